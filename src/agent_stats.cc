@@ -0,0 +1,88 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/agent_stats.h"
+
+#include <sstream>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Names of the counters, in the order of AgentStats::Counter. The times
+// are reported in microseconds.
+const char *const kCounterNames[] = {
+    "signals",          "handler_usec",  "table_additions",
+    "table_probes",     "dropped",       "harvest_usec",
+    "symbolize_usec",   "profiles",      "serialize_usec",
+    "serialized_bytes", "uploads",       "upload_failures",
+    "upload_usec",      "rejected_attributes",
+};
+
+static_assert(sizeof(kCounterNames) / sizeof(kCounterNames[0]) ==
+                  AgentStats::kNumCounters,
+              "missing counter names");
+
+bool IsNanos(AgentStats::Counter counter) {
+  switch (counter) {
+    case AgentStats::kHandlerNanos:
+    case AgentStats::kHarvestNanos:
+    case AgentStats::kSymbolizeNanos:
+    case AgentStats::kSerializeNanos:
+    case AgentStats::kUploadNanos:
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+std::atomic<int64_t> AgentStats::counters_[AgentStats::kNumCounters];
+std::atomic<int64_t>
+    AgentStats::call_trace_errors_[AgentStats::kNumCallTraceErrors];
+
+void AgentStats::AddCallTraceErrors(int error, int64_t count) {
+  int index = -error;
+  if (index < 0) {
+    return;
+  }
+  if (index >= kNumCallTraceErrors) {
+    index = kNumCallTraceErrors - 1;
+  }
+  call_trace_errors_[index].fetch_add(count, std::memory_order_relaxed);
+}
+
+string AgentStats::ToString() {
+  std::ostringstream out;
+  for (int i = 0; i < kNumCounters; i++) {
+    Counter counter = static_cast<Counter>(i);
+    int64_t value = Get(counter);
+    if (i > 0) {
+      out << " ";
+    }
+    out << kCounterNames[i] << "=" << (IsNanos(counter) ? value / 1000 : value);
+  }
+  for (int i = 0; i < kNumCallTraceErrors; i++) {
+    int64_t value = call_trace_errors_[i].load(std::memory_order_relaxed);
+    if (value != 0) {
+      out << " asgct_error_" << -i << "=" << value;
+    }
+  }
+  return out.str();
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_AGENT_STATS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_AGENT_STATS_H_
+
+#include <atomic>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// AgentStats counts the work done by the agent itself since it started, to
+// show its overhead. The counters are updated with relaxed atomics, mostly
+// once per profile rather than per sample, and can be read at any time.
+class AgentStats {
+ public:
+  enum Counter {
+    // Estimated number of profiling signals handled, and time spent
+    // handling them.
+    kSignals,
+    kHandlerNanos,
+    // Traces added to the internal table, and entries examined to add
+    // them.
+    kTableAdditions,
+    kTableProbes,
+    // Samples which could not be recorded, reported as [Unknown].
+    kDroppedSamples,
+    // Time spent moving the samples out of the internal table.
+    kHarvestNanos,
+    // Time spent resolving the Java methods and native symbols.
+    kSymbolizeNanos,
+    // Profiles serialized, and the time and bytes it took.
+    kProfiles,
+    kSerializeNanos,
+    kSerializedBytes,
+    // Profile uploads attempted, failed, and the time they took.
+    kUploads,
+    kUploadFailures,
+    kUploadNanos,
+    // Attributes the application could not register, as the table of the
+    // attributes was full.
+    kRejectedAttributes,
+    kNumCounters
+  };
+
+  static void Add(Counter counter, int64_t value) {
+    counters_[counter].fetch_add(value, std::memory_order_relaxed);
+  }
+
+  static int64_t Get(Counter counter) {
+    return counters_[counter].load(std::memory_order_relaxed);
+  }
+
+  // Counts samples for which AsyncGetCallTrace failed with the given error,
+  // one of the google::javaprofiler::CallTraceErrors.
+  static void AddCallTraceErrors(int error, int64_t count);
+
+  // Returns a one-line text rendering of the counters, as in
+  // "signals=1000 handler_usec=2000 ... asgct_error_-10=5", only listing
+  // the errors which happened.
+  static string ToString();
+
+ private:
+  // Error codes go from 0 down to -(kNumCallTraceErrors - 1), the lower
+  // ones are counted with the last.
+  static const int kNumCallTraceErrors = 16;
+
+  static std::atomic<int64_t> counters_[kNumCounters];
+  static std::atomic<int64_t> call_trace_errors_[kNumCallTraceErrors];
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(AgentStats);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_AGENT_STATS_H_
@@ -0,0 +1,204 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/cgroup_cpu.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+DEFINE_bool(cprof_cgroup_aware, true,
+            "Scale the sampling budgets down to the CPU quota of the cgroup "
+            "of the process when it is under one CPU, and report the time "
+            "the cgroup was throttled in the wall profiles.");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char kCgroupMount[] = "/sys/fs/cgroup";
+
+// Returns the contents of a small file, empty if it cannot be read.
+string ReadFile(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  string contents;
+  char buf[4096];
+  ssize_t size;
+  while ((size = read(fd, buf, sizeof(buf))) > 0) {
+    contents.append(buf, size);
+  }
+  close(fd);
+  return contents;
+}
+
+bool Readable(const string &path) { return access(path.c_str(), R_OK) == 0; }
+
+// Whether the comma separated list of v1 controllers has the cpu one.
+bool HasCpuController(const string &controllers) {
+  std::istringstream in(controllers);
+  string controller;
+  while (std::getline(in, controller, ',')) {
+    if (controller == "cpu") {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the path of the cgroup of the process in the v2 hierarchy, or in
+// the v1 hierarchy of the cpu controller, empty if there is none.
+string CgroupPath(bool v2) {
+  std::istringstream in(ReadFile("/proc/self/cgroup"));
+  string line;
+  while (std::getline(in, line)) {
+    // The lines read "hierarchy-id:controllers:path", the v2 hierarchy has
+    // id 0 and no controllers.
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if (first == string::npos || second == string::npos) {
+      continue;
+    }
+    string controllers = line.substr(first + 1, second - first - 1);
+    bool match = v2 ? line.compare(0, first, "0") == 0 && controllers.empty()
+                    : HasCpuController(controllers);
+    if (match) {
+      return line.substr(second + 1);
+    }
+  }
+  return "";
+}
+
+// Returns the CPUs granted by the quota of a cgroup, 0 when it has none.
+double ReadQuota(const string &dir, bool v2) {
+  long long quota, period;  // NOLINT
+  if (v2) {
+    // Reads "max 100000" without a quota, else as "50000 100000".
+    string max = ReadFile(dir + "/cpu.max");
+    if (sscanf(max.c_str(), "%lld %lld", &quota, &period) != 2) {
+      return 0;
+    }
+  } else {
+    // The quota is -1 when there is none.
+    string quota_us = ReadFile(dir + "/cpu.cfs_quota_us");
+    string period_us = ReadFile(dir + "/cpu.cfs_period_us");
+    if (sscanf(quota_us.c_str(), "%lld", &quota) != 1 ||
+        sscanf(period_us.c_str(), "%lld", &period) != 1) {
+      return 0;
+    }
+  }
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return static_cast<double>(quota) / period;
+}
+
+// Returns the value of a key of a cpu.stat file, -1 if it is missing.
+int64_t StatValue(const string &stat, const string &key) {
+  std::istringstream in(stat);
+  string name;
+  int64_t value;
+  while (in >> name >> value) {
+    if (name == key) {
+      return value;
+    }
+  }
+  return -1;
+}
+
+}  // namespace
+
+string CgroupCpu::dir_;
+string CgroupCpu::root_;
+bool CgroupCpu::v2_;
+std::atomic<double> CgroupCpu::allowance_(1.0);
+
+void CgroupCpu::Init() {
+  if (!FLAGS_cprof_cgroup_aware) {
+    return;
+  }
+  string root = kCgroupMount;
+  v2_ = Readable(root + "/cgroup.controllers");
+  if (!v2_) {
+    // The v1 controller is mounted on its own, along with cpuacct or not.
+    root += Readable(root + "/cpu,cpuacct") ? "/cpu,cpuacct" : "/cpu";
+  }
+  string path = CgroupPath(v2_);
+  string dir = path.empty() || path == "/" ? root : root + path;
+  if (!Readable(dir + "/cpu.stat")) {
+    // Without a cgroup namespace the path is the one in the hierarchy of
+    // the host, of which a container only has its own cgroup mounted.
+    dir = root;
+  }
+  if (!Readable(dir + "/cpu.stat")) {
+    LOG(INFO) << "No cgroup CPU controller found";
+    return;
+  }
+  root_ = root;
+  dir_ = dir;
+  Update();
+  LOG(INFO) << "Found cgroup " << (v2_ ? "v2" : "v1") << " CPU controller "
+            << "at " << dir_ << ", CPU allowance of " << Allowance();
+}
+
+void CgroupCpu::Update() {
+  if (dir_.empty()) {
+    return;
+  }
+  // The quotas of the ancestors apply too, the lowest one holds.
+  double cpus = 0;
+  string dir = dir_;
+  while (true) {
+    double quota = ReadQuota(dir, v2_);
+    if (quota > 0 && (cpus == 0 || quota < cpus)) {
+      cpus = quota;
+    }
+    if (dir.size() <= root_.size()) {
+      break;
+    }
+    dir.resize(dir.rfind('/'));
+  }
+  double allowance = cpus > 0 ? std::min(cpus, 1.0) : 1.0;
+  if (allowance != Allowance()) {
+    LOG(INFO) << "The cgroup CPU allowance changed from " << Allowance()
+              << " to " << allowance;
+    allowance_.store(allowance, std::memory_order_relaxed);
+  }
+}
+
+bool CgroupCpu::ReadThrottling(int64_t *num_periods, int64_t *nanos) {
+  if (dir_.empty()) {
+    return false;
+  }
+  string stat = ReadFile(dir_ + "/cpu.stat");
+  *num_periods = StatValue(stat, "nr_throttled");
+  if (v2_) {
+    *nanos = StatValue(stat, "throttled_usec");
+    if (*nanos >= 0) {
+      *nanos *= 1000;
+    }
+  } else {
+    *nanos = StatValue(stat, "throttled_time");
+  }
+  return *num_periods >= 0 && *nanos >= 0;
+}
+
+}  // namespace profiler
+}  // namespace cloud
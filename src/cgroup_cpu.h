@@ -0,0 +1,72 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CGROUP_CPU_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CGROUP_CPU_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// CgroupCpu reads the CPU controller of the cgroup of the process, v2 or
+// v1, to fit the profiling to the CPU quota of a container. The sampling
+// budgets are meant for a whole CPU, so they are scaled down by the
+// allowance when the quota grants less than one; a quota of several CPUs
+// leaves them unchanged.
+//
+// The time the cgroup was throttled for exceeding its quota is read too,
+// so that the profiles can show it.
+class CgroupCpu {
+ public:
+  // Finds the CPU controller and reads the quota. Does nothing if the
+  // cgroup awareness is disabled, or there is no controller. Called once,
+  // before the profiling starts.
+  static void Init();
+
+  // Re-reads the quota, which can be changed while the process runs.
+  // Called before each profile.
+  static void Update();
+
+  // CPUs granted by the quota, at most 1; 1 when there is no quota.
+  static double Allowance() {
+    return allowance_.load(std::memory_order_relaxed);
+  }
+
+  // Reads the number of enforcement periods in which the cgroup was
+  // throttled, and the total time it was, since it was created. Returns
+  // false if they are unknown.
+  static bool ReadThrottling(int64_t *num_periods, int64_t *nanos);
+
+ private:
+  // Directory of the cgroup, empty when there is no controller.
+  static string dir_;
+  // Mount point of the controller, that dir_ is under.
+  static string root_;
+  static bool v2_;
+  static std::atomic<double> allowance_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(CgroupCpu);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CGROUP_CPU_H_
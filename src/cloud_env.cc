@@ -14,10 +14,12 @@
 
 #include "src/cloud_env.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <sstream>
 #include <string>
 
+#include "src/clock.h"
 #include "src/http.h"
 #include "src/string.h"
 
@@ -44,6 +46,10 @@ const char kZoneNamePath[] = "/computeMetadata/v1/instance/zone";
 
 const char kNoData[] = "";
 
+// Access tokens are refreshed this long before they expire, so that they
+// do not expire while in use.
+const int64_t kAccessTokenExpiryMarginSec = 60;
+
 namespace {
 
 string GceMetadataRequest(HTTPRequest* req, const string& path) {
@@ -76,7 +82,7 @@ const char* Getenv(const string& var) {
 
 }  // namespace
 
-CloudEnv::CloudEnv() {
+CloudEnv::CloudEnv() : access_token_expiry_() {
   if (!FLAGS_cprof_service.empty()) {
     service_ = FLAGS_cprof_service;
   } else if (!FLAGS_cprof_target.empty()) {
@@ -160,6 +166,9 @@ string CloudEnv::ZoneName(HTTPRequest* req) {
 }
 
 string CloudEnv::Oauth2AccessToken() {
+  if (AccessTokenValid()) {
+    return access_token_;
+  }
   HTTPRequest req;
   return Oauth2AccessToken(&req);
 }
@@ -170,13 +179,18 @@ string CloudEnv::Oauth2AccessToken(HTTPRequest* req) {
     return FLAGS_cprof_access_token_test_only;
   }
 
-  // TODO: Cache the access token as it's valid for ~1 hour.
+  if (AccessTokenValid()) {
+    return access_token_;
+  }
+
   string resp = GceMetadataRequest(req, kTokenPath);
   if (resp == kNoData) {
     LOG(ERROR) << "Failed to acquire an access token";
     return resp;
   }
 
+  string access_token;
+  int64_t expires_in_sec = 0;
   std::vector<string> lines = Split(resp, '\n');
   for (const string& line : lines) {
     std::vector<string> pair = Split(line, ' ');
@@ -186,11 +200,28 @@ string CloudEnv::Oauth2AccessToken(HTTPRequest* req) {
       continue;
     }
     if (pair[0] == "access_token") {
-      return pair[1];
+      access_token = pair[1];
+    } else if (pair[0] == "expires_in") {
+      expires_in_sec = strtoll(pair[1].c_str(), nullptr, 10);
     }
   }
-  LOG(ERROR) << "Could not parse access token out of '" << resp << "'";
-  return kNoData;
+  if (access_token.empty()) {
+    LOG(ERROR) << "Could not parse access token out of '" << resp << "'";
+    return kNoData;
+  }
+
+  // Without a known lifetime, the token is fetched again the next time.
+  access_token_ = access_token;
+  int64_t lifetime_sec =
+      std::max<int64_t>(expires_in_sec - kAccessTokenExpiryMarginSec, 0);
+  access_token_expiry_ = TimeAdd(
+      DefaultClock()->Now(), NanosToTimeSpec(lifetime_sec * kNanosPerSecond));
+  return access_token_;
+}
+
+bool CloudEnv::AccessTokenValid() const {
+  return !access_token_.empty() &&
+         TimeLessThan(DefaultClock()->Now(), access_token_expiry_);
 }
 
 string CloudEnv::Service() { return service_; }
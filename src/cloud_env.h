@@ -17,6 +17,8 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_CLOUD_ENV_H_
 #define CLOUD_PROFILER_AGENT_JAVA_CLOUD_ENV_H_
 
+#include <time.h>
+
 #include "src/globals.h"
 
 namespace cloud {
@@ -42,7 +44,8 @@ class CloudEnv {
   // service account assigned or an error occurred while trying to fetch the
   // access token. The token may carry limited set of OAuth2 scopes, so the
   // later use of the token for a specific operation may fail with an
-  // authorization error.
+  // authorization error. The token is cached until shortly before it
+  // expires.
   virtual string Oauth2AccessToken();
 
   // Returns the profiled service name for the current environment.
@@ -64,8 +67,13 @@ class CloudEnv {
   string Oauth2AccessToken(HTTPRequest* req);
 
  private:
+  // Whether access_token_ can still be used.
+  bool AccessTokenValid() const;
+
   string project_id_;
   string zone_name_;
+  string access_token_;
+  struct timespec access_token_expiry_;
   string service_;
   string service_version_;
   DISALLOW_COPY_AND_ASSIGN(CloudEnv);
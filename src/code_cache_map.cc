@@ -0,0 +1,213 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/code_cache_map.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace cloud {
+namespace profiler {
+
+std::atomic<bool> CodeCacheMap::enabled_;
+std::atomic<uint64_t> CodeCacheMap::low_(
+    std::numeric_limits<uint64_t>::max());
+std::atomic<uint64_t> CodeCacheMap::high_;
+std::mutex *CodeCacheMap::log_mutex_ = new std::mutex();
+std::vector<CodeCacheMap::Change> *CodeCacheMap::log_ =
+    new std::vector<CodeCacheMap::Change>();
+std::vector<CodeCacheMap::Change> *CodeCacheMap::unloaded_ =
+    new std::vector<CodeCacheMap::Change>();
+std::map<uint64_t, CodeCacheMap::Code> *CodeCacheMap::index_ =
+    new std::map<uint64_t, CodeCacheMap::Code>();
+
+bool CodeCacheMap::AddCapabilities(jvmtiEnv *jvmti) {
+  jvmtiCapabilities all_caps;
+  JVMTI_ERROR_1((jvmti->GetPotentialCapabilities(&all_caps)), false);
+  if (!all_caps.can_generate_compiled_method_load_events) {
+    LOG(WARNING) << "The JVM does not support compiled method events, "
+                 << "JIT frames not resolved";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_compiled_method_load_events = 1;
+  JVMTI_ERROR_1((jvmti->AddCapabilities(&caps)), false);
+  return true;
+}
+
+void CodeCacheMap::AddCallbacks(jvmtiEventCallbacks *callbacks,
+                                std::vector<jvmtiEvent> *events) {
+  callbacks->CompiledMethodLoad = &OnCompiledMethodLoad;
+  callbacks->CompiledMethodUnload = &OnCompiledMethodUnload;
+  callbacks->DynamicCodeGenerated = &OnDynamicCodeGenerated;
+  if (std::find(events->begin(), events->end(),
+                JVMTI_EVENT_COMPILED_METHOD_LOAD) == events->end()) {
+    events->push_back(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+  }
+  events->push_back(JVMTI_EVENT_COMPILED_METHOD_UNLOAD);
+  events->push_back(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
+  enabled_ = true;
+}
+
+void CodeCacheMap::Update() {
+  std::vector<Change> changes;
+  {
+    std::lock_guard<std::mutex> lock(*log_mutex_);
+    changes.swap(*log_);
+  }
+
+  // The code unloaded during the previous profile was kept to resolve its
+  // samples, unless new code was loaded over it since.
+  for (const Change &change : *unloaded_) {
+    auto it = index_->find(change.start);
+    if (it != index_->end() && it->second.method_id == change.code.method_id) {
+      index_->erase(it);
+    }
+  }
+  unloaded_->clear();
+
+  for (Change &change : changes) {
+    if (!change.loaded) {
+      unloaded_->push_back(std::move(change));
+      continue;
+    }
+    // Drop whatever the new code replaces, the JVM does not always report
+    // the code it frees.
+    auto it = index_->lower_bound(change.start);
+    if (it != index_->begin() && std::prev(it)->second.limit > change.start) {
+      --it;
+    }
+    while (it != index_->end() && it->first < change.code.limit) {
+      it = index_->erase(it);
+    }
+    index_->emplace(change.start, std::move(change.code));
+  }
+}
+
+bool CodeCacheMap::Lookup(uint64_t address, JVMPI_CallFrame *frame,
+                          string *name) {
+  auto it = index_->upper_bound(address);
+  if (it == index_->begin()) {
+    return false;
+  }
+  --it;
+  const Code &code = it->second;
+  if (address >= code.limit) {
+    return false;
+  }
+  if (code.method_id == nullptr) {
+    *name = code.name;
+    return false;
+  }
+
+  // The closest offset at or before the address, -1 when unknown.
+  uint32_t offset = static_cast<uint32_t>(address - it->first);
+  auto bci = std::upper_bound(
+      code.bcis.begin(), code.bcis.end(), offset,
+      [](uint32_t o, const std::pair<uint32_t, jint> &b) {
+        return o < b.first;
+      });
+  frame->method_id = code.method_id;
+  frame->lineno = bci == code.bcis.begin() ? -1 : std::prev(bci)->second;
+  return true;
+}
+
+void CodeCacheMap::Log(Change change) {
+  uint64_t low = low_.load(std::memory_order_relaxed);
+  while (change.start < low &&
+         !low_.compare_exchange_weak(low, change.start,
+                                     std::memory_order_relaxed)) {
+  }
+  uint64_t high = high_.load(std::memory_order_relaxed);
+  while (change.code.limit > high &&
+         !high_.compare_exchange_weak(high, change.code.limit,
+                                      std::memory_order_relaxed)) {
+  }
+
+  std::lock_guard<std::mutex> lock(*log_mutex_);
+  log_->push_back(std::move(change));
+}
+
+void JNICALL CodeCacheMap::OnCompiledMethodLoad(
+    jvmtiEnv *jvmti, jmethodID method, jint code_size, const void *code_addr,
+    jint map_length, const jvmtiAddrLocationMap *map,
+    const void *compile_info) {
+  // Like the callback of entry.cc, this also enables DebugNonSafepoints,
+  // which makes the map precise between the safepoints.
+  IMPLICITLY_USE(jvmti);
+  IMPLICITLY_USE(compile_info);
+  if (code_size <= 0) {
+    return;
+  }
+  Change change;
+  change.start = reinterpret_cast<uint64_t>(code_addr);
+  change.loaded = true;
+  change.code.limit = change.start + code_size;
+  change.code.method_id = method;
+  if (map != nullptr) {
+    change.code.bcis.reserve(map_length);
+    for (jint i = 0; i < map_length; i++) {
+      uint64_t address = reinterpret_cast<uint64_t>(map[i].start_address);
+      if (address < change.start || address >= change.code.limit) {
+        continue;
+      }
+      change.code.bcis.emplace_back(static_cast<uint32_t>(address -
+                                                          change.start),
+                                    static_cast<jint>(map[i].location));
+    }
+    std::stable_sort(change.code.bcis.begin(), change.code.bcis.end(),
+                     [](const std::pair<uint32_t, jint> &a,
+                        const std::pair<uint32_t, jint> &b) {
+                       return a.first < b.first;
+                     });
+  }
+  Log(std::move(change));
+}
+
+void JNICALL CodeCacheMap::OnCompiledMethodUnload(jvmtiEnv *jvmti,
+                                                  jmethodID method,
+                                                  const void *code_addr) {
+  IMPLICITLY_USE(jvmti);
+  Change change;
+  change.start = reinterpret_cast<uint64_t>(code_addr);
+  change.loaded = false;
+  change.code.limit = change.start;
+  change.code.method_id = method;
+  std::lock_guard<std::mutex> lock(*log_mutex_);
+  log_->push_back(std::move(change));
+}
+
+void JNICALL CodeCacheMap::OnDynamicCodeGenerated(jvmtiEnv *jvmti,
+                                                  const char *name,
+                                                  const void *address,
+                                                  jint length) {
+  IMPLICITLY_USE(jvmti);
+  if (length <= 0) {
+    return;
+  }
+  Change change;
+  change.start = reinterpret_cast<uint64_t>(address);
+  change.loaded = true;
+  change.code.limit = change.start + length;
+  change.code.method_id = nullptr;
+  change.code.name = name != nullptr ? name : "generated code";
+  Log(std::move(change));
+}
+
+}  // namespace profiler
+}  // namespace cloud
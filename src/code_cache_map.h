@@ -0,0 +1,129 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CODE_CACHE_MAP_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CODE_CACHE_MAP_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// CodeCacheMap maps the addresses of the code generated by the JVM to the
+// Java methods compiled there, or to the name of the generated code such
+// as the interpreter or a stub, from the JVMTI CompiledMethodLoad,
+// CompiledMethodUnload and DynamicCodeGenerated events. It resolves the
+// frames sampled as raw program counters, which are often in compiled
+// Java code that AsyncGetCallTrace could not walk.
+//
+// The callbacks only append the changes to a log, under a short lock. The
+// sorted index of the code ranges is owned by the serialization, which
+// applies the log in Update() and looks the addresses up without locks.
+// The signal handler only reads the bounds of the code, see MayContain().
+//
+// The JVMTI callbacks are static, so is the state of the map.
+class CodeCacheMap {
+ public:
+  // Adds the JVMTI capability needed for the compiled method events. Must
+  // be called during the OnLoad phase. Returns false if the JVM does not
+  // support them.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the JVMTI callbacks, and appends the events to enable for them.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks,
+                           std::vector<jvmtiEvent> *events);
+
+  // Whether the generated code is tracked.
+  static bool Enabled() { return enabled_; }
+
+  // Whether address may be in the generated code. This is async signal
+  // safe.
+  static bool MayContain(uint64_t address) {
+    return address >= low_.load(std::memory_order_relaxed) &&
+           address < high_.load(std::memory_order_relaxed);
+  }
+
+  // Applies the code loaded and unloaded since the previous call to the
+  // index. The unloaded code is only dropped by the next call, so that the
+  // samples taken while it ran still resolve. Must not be called
+  // concurrently with itself or Lookup().
+  static void Update();
+
+  // Sets the frame of the Java method compiled at address, with the bci of
+  // the address as its lineno, and returns true. Otherwise sets name to
+  // the name of the generated code holding address, or returns false if
+  // none does.
+  static bool Lookup(uint64_t address, JVMPI_CallFrame *frame, string *name);
+
+ private:
+  struct Code {
+    uint64_t limit;
+    // The compiled method, nullptr for the other generated code.
+    jmethodID method_id;
+    string name;
+    // Offsets of the code from its start and their bci, sorted.
+    std::vector<std::pair<uint32_t, jint>> bcis;
+  };
+
+  struct Change {
+    uint64_t start;
+    // Unloaded when false.
+    bool loaded;
+    Code code;
+  };
+
+  static void JNICALL OnCompiledMethodLoad(jvmtiEnv *jvmti, jmethodID method,
+                                           jint code_size,
+                                           const void *code_addr,
+                                           jint map_length,
+                                           const jvmtiAddrLocationMap *map,
+                                           const void *compile_info);
+  static void JNICALL OnCompiledMethodUnload(jvmtiEnv *jvmti,
+                                             jmethodID method,
+                                             const void *code_addr);
+  static void JNICALL OnDynamicCodeGenerated(jvmtiEnv *jvmti,
+                                             const char *name,
+                                             const void *address,
+                                             jint length);
+
+  // Appends a change for the next Update(), and widens the bounds.
+  static void Log(Change change);
+
+  static std::atomic<bool> enabled_;
+  // Bounds of all the code seen so far.
+  static std::atomic<uint64_t> low_;
+  static std::atomic<uint64_t> high_;
+
+  static std::mutex *log_mutex_;
+  static std::vector<Change> *log_;
+  // Unloaded by the previous Update(), removed from the index by the next.
+  static std::vector<Change> *unloaded_;
+  // Keyed on the start address of the code.
+  static std::map<uint64_t, Code> *index_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(CodeCacheMap);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CODE_CACHE_MAP_H_
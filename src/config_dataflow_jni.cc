@@ -14,6 +14,8 @@
 
 #include <jni.h>
 
+#include "src/agent_stats.h"
+#include "src/thread_labels.h"
 #include "src/worker.h"
 #include "third_party/javaprofiler/stacktraces.h"
 
@@ -31,11 +33,20 @@ Java_com_google_cloud_dataflow_worker_profiler_Profiler_disable(
   cloud::profiler::Worker::DisableProfiling();
 }
 
+// Returns the attribute for value, to be set with setAttribute(). The
+// attributes are never unregistered, and only up to
+// AttributeTable::kMaxStrings of them along with the thread labels: past
+// that, 0 is returned, which is no attribute, and the rejection counted in
+// the rejected_attributes stat.
 extern "C" AGENTEXPORT jint JNICALL
 Java_com_google_cloud_dataflow_worker_profiler_Profiler_registerAttribute(
     JNIEnv *env, jclass, jstring value) {
   const char *value_utf = env->GetStringUTFChars(value, nullptr);
   int ret = google::javaprofiler::AttributeTable::RegisterString(value_utf);
+  if (ret == 0 && value_utf != nullptr && value_utf[0] != '\0') {
+    cloud::profiler::AgentStats::Add(
+        cloud::profiler::AgentStats::kRejectedAttributes, 1);
+  }
   env->ReleaseStringUTFChars(value, value_utf);
   return static_cast<jint>(ret);
 }
@@ -44,7 +55,8 @@ extern "C" AGENTEXPORT jint JNICALL
 Java_com_google_cloud_dataflow_worker_profiler_Profiler_setAttribute(
     JNIEnv *env, jclass, jint attr) {
   int64_t ret = google::javaprofiler::Accessors::GetAttribute();
-  google::javaprofiler::Accessors::SetAttribute(static_cast<int64_t>(attr));
+  google::javaprofiler::Accessors::SetAttribute(
+      cloud::profiler::ThreadLabels::KeepLabel(ret, attr));
   return static_cast<jint>(ret);
 }
 
@@ -54,3 +66,52 @@ Java_com_google_cloud_dataflow_worker_profiler_Profiler_getAttribute(
   int64_t ret = google::javaprofiler::Accessors::GetAttribute();
   return static_cast<jint>(ret);
 }
+
+extern "C" AGENTEXPORT jint JNICALL
+Java_com_google_cloud_dataflow_worker_profiler_Profiler_registerAttributeKey(
+    JNIEnv *env, jclass, jstring name) {
+  const char *name_utf = env->GetStringUTFChars(name, nullptr);
+  int ret = google::javaprofiler::AttributeTable::RegisterKey(name_utf);
+  env->ReleaseStringUTFChars(name, name_utf);
+  return static_cast<jint>(ret);
+}
+
+// Sets the value of a key of the attribute of the current thread, keeping
+// the other keys. Returns the previous attribute, to be restored with
+// setAttribute().
+extern "C" AGENTEXPORT jint JNICALL
+Java_com_google_cloud_dataflow_worker_profiler_Profiler_setAttributeValue(
+    JNIEnv *env, jclass, jint key, jint value) {
+  int64_t ret = google::javaprofiler::Accessors::GetAttribute();
+  google::javaprofiler::Accessors::SetAttribute(
+      google::javaprofiler::AttributeTable::SetValue(ret, key, value));
+  return static_cast<jint>(ret);
+}
+
+// Returns the counters of the agent's own work, see AgentStats::ToString().
+extern "C" AGENTEXPORT jstring JNICALL
+Java_com_google_cloud_dataflow_worker_profiler_Profiler_getStats(
+    JNIEnv *env, jclass) {
+  return env->NewStringUTF(cloud::profiler::AgentStats::ToString().c_str());
+}
+
+// Asks for a burst profile of the given type ("cpu", "wall" or a perf event
+// type) over durationMs, collected right away at a higher sampling rate, as
+// when the application detects a latency regression. Returns false if the
+// request is rejected, see Worker::RequestBurst().
+extern "C" AGENTEXPORT jboolean JNICALL
+Java_com_google_cloud_dataflow_worker_profiler_Profiler_captureBurst(
+    JNIEnv *env, jclass, jint duration_ms, jstring type) {
+  if (type == nullptr) {
+    return JNI_FALSE;
+  }
+  const char *type_utf = env->GetStringUTFChars(type, nullptr);
+  if (type_utf == nullptr) {
+    return JNI_FALSE;
+  }
+  string profile_type(type_utf);
+  env->ReleaseStringUTFChars(type, type_utf);
+  bool accepted = cloud::profiler::Worker::RequestBurst(
+      profile_type, static_cast<int64_t>(duration_ms) * 1000 * 1000);
+  return accepted ? JNI_TRUE : JNI_FALSE;
+}
@@ -0,0 +1,279 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/contention_monitor.h"
+
+#include <string.h>
+
+#include <vector>
+
+#include "perftools/profiles/proto/builder.h"
+#include "src/clock.h"
+#include "src/profiler.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Time at which the current thread started waiting on a contended monitor,
+// 0 if it is not waiting.
+__thread int64_t contended_enter_nanos;
+
+// State of the random number generator of the current thread.
+__thread uint64_t random_state;
+
+int64_t NowNanos() { return TimeSpecToNanos(DefaultClock()->Now()); }
+
+// Returns a pseudo random number (xorshift64*), good enough to decide which
+// contentions to sample.
+uint64_t NextRandom() {
+  uint64_t x = random_state;
+  if (x == 0) {
+    x = static_cast<uint64_t>(NowNanos()) | 1;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  random_state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+}  // namespace
+
+std::atomic<bool> ContentionMonitor::enabled_;
+int64_t ContentionMonitor::sampling_interval_nanos_;
+std::atomic<bool> ContentionMonitor::recording_;
+std::atomic<int> ContentionMonitor::active_callbacks_;
+std::atomic<int64_t> ContentionMonitor::dropped_;
+google::javaprofiler::AsyncSafeTraceMultiset *ContentionMonitor::traces_;
+
+bool ContentionMonitor::AddCapabilities(jvmtiEnv *jvmti) {
+  jvmtiCapabilities all_caps;
+  JVMTI_ERROR_1((jvmti->GetPotentialCapabilities(&all_caps)), false);
+  if (!all_caps.can_generate_monitor_events) {
+    LOG(WARNING) << "The JVM does not support monitor events, "
+                 << "contention profiling disabled";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_monitor_events = 1;
+  JVMTI_ERROR_1((jvmti->AddCapabilities(&caps)), false);
+  return true;
+}
+
+void ContentionMonitor::AddCallbacks(jvmtiEventCallbacks *callbacks) {
+  callbacks->MonitorContendedEnter = &OnMonitorContendedEnter;
+  callbacks->MonitorContendedEntered = &OnMonitorContendedEntered;
+}
+
+void ContentionMonitor::Enable(int64_t sampling_interval_usec) {
+  sampling_interval_nanos_ =
+      (sampling_interval_usec > 0 ? sampling_interval_usec : 1) * 1000;
+  traces_ = new google::javaprofiler::AsyncSafeTraceMultiset();
+  enabled_ = true;
+}
+
+void JNICALL ContentionMonitor::OnMonitorContendedEnter(jvmtiEnv *jvmti,
+                                                        JNIEnv *jni,
+                                                        jthread thread,
+                                                        jobject object) {
+  IMPLICITLY_USE(jvmti);
+  IMPLICITLY_USE(jni);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+  contended_enter_nanos = NowNanos();
+}
+
+void JNICALL ContentionMonitor::OnMonitorContendedEntered(jvmtiEnv *jvmti,
+                                                          JNIEnv *jni,
+                                                          jthread thread,
+                                                          jobject object) {
+  IMPLICITLY_USE(jni);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+  int64_t enter_nanos = contended_enter_nanos;
+  if (enter_nanos == 0) {
+    // The events were enabled while the thread was waiting.
+    return;
+  }
+  contended_enter_nanos = 0;
+
+  active_callbacks_++;
+  if (recording_) {
+    Record(jvmti, NowNanos() - enter_nanos);
+  }
+  active_callbacks_--;
+}
+
+void ContentionMonitor::Record(jvmtiEnv *jvmti, int64_t delay_nanos) {
+  int64_t count = 1;
+  if (delay_nanos < sampling_interval_nanos_) {
+    // Sample with a probability of delay / interval, each sample standing
+    // for interval / delay contentions of interval in total. The ratio is
+    // rounded up or down at random, so that the counts add up on average.
+    if (delay_nanos <= 0 ||
+        static_cast<int64_t>(NextRandom() % sampling_interval_nanos_) >=
+            delay_nanos) {
+      return;
+    }
+    count = sampling_interval_nanos_ / delay_nanos;
+    if (static_cast<int64_t>(NextRandom() % delay_nanos) <
+        sampling_interval_nanos_ % delay_nanos) {
+      count++;
+    }
+    delay_nanos = sampling_interval_nanos_;
+  }
+
+  int max_frames = Profiler::MaxStackDepth();
+  std::vector<jvmtiFrameInfo> frame_info(max_frames);
+  jint num_frames = 0;
+  if (jvmti->GetStackTrace(nullptr, 0, max_frames, frame_info.data(),
+                           &num_frames) != JVMTI_ERROR_NONE) {
+    dropped_++;
+    return;
+  }
+  // Room for the [truncated] root frame.
+  std::vector<JVMPI_CallFrame> frames(num_frames + 1);
+  for (int i = 0; i < num_frames; i++) {
+    frames[i].lineno = static_cast<jint>(frame_info[i].location);
+    frames[i].method_id = frame_info[i].method;
+  }
+  if (num_frames == max_frames) {
+    frames[num_frames++] = JVMPI_CallFrame{kTruncatedFrameLineNum, nullptr};
+  }
+  JVMPI_CallTrace trace = {nullptr, num_frames, frames.data()};
+
+  uint32_t node;
+  if (!traces_->Add(kContentionsAttr, &trace, &node) ||
+      (count > 1 && !traces_->AddNode(kContentionsAttr, node, count - 1)) ||
+      !traces_->AddNode(kDelayAttr, node, delay_nanos / 1000)) {
+    dropped_++;
+  }
+}
+
+bool ContentionMonitor::SetEvents(jvmtiEnv *jvmti, jvmtiEventMode mode) {
+  JVMTI_ERROR_1((jvmti->SetEventNotificationMode(
+                    mode, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr)),
+                false);
+  JVMTI_ERROR_1((jvmti->SetEventNotificationMode(
+                    mode, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr)),
+                false);
+  return true;
+}
+
+string ContentionMonitor::Collect(jvmtiEnv *jvmti, int64_t duration_nanos) {
+  // No callback is recording at this point, see below.
+  traces_->Reset();
+  dropped_ = 0;
+
+  google::javaprofiler::TraceMultiset traces;
+  Clock *clock = DefaultClock();
+  // Flush the async table every 100 ms
+  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
+  struct timespec finish_line =
+      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos));
+
+  recording_ = true;
+  bool started = SetEvents(jvmti, JVMTI_ENABLE);
+  if (started) {
+    while (TimeLessThan(TimeAdd(clock->Now(), flush_interval), finish_line)) {
+      clock->SleepFor(flush_interval);
+      HarvestSamples(traces_, &traces, Profiler::MaxStackDepth() + 1);
+    }
+    clock->SleepUntil(finish_line);
+  }
+  SetEvents(jvmti, JVMTI_DISABLE);
+  recording_ = false;
+
+  // Wait for the callbacks which started before recording_ was cleared, the
+  // ones starting later do not touch the traces.
+  struct timespec drain_interval = {0, 1000 * 1000};  // 1 millisec
+  while (active_callbacks_ > 0) {
+    clock->SleepFor(drain_interval);
+  }
+  if (!started) {
+    LOG(ERROR) << "Failed to enable the monitor events";
+    return "";
+  }
+  HarvestSamples(traces_, &traces, Profiler::MaxStackDepth() + 1);
+
+  if (dropped_ > 0) {
+    LOG(WARNING) << "Dropped " << dropped_ << " sampled contentions";
+  }
+  return Serialize(jvmti, traces, duration_nanos);
+}
+
+string ContentionMonitor::Serialize(
+    jvmtiEnv *jvmti, const google::javaprofiler::TraceMultiset &traces,
+    int64_t duration_nanos) {
+  size_t num_traces = 0;
+  size_t num_frames = 0;
+  for (const auto &entry : traces) {
+    num_traces++;
+    num_frames += entry.first.num_frames;
+  }
+  // The builder takes the frames of each trace contiguous.
+  std::vector<JVMPI_CallFrame> frames(num_frames);
+  std::vector<JVMPI_CallTrace> call_traces;
+  std::vector<google::javaprofiler::ProfileStackTrace> stack_traces;
+  std::vector<int64_t> counts;
+  // Reserved so that the stack traces can point to the call traces.
+  call_traces.reserve(num_traces);
+  stack_traces.reserve(num_traces);
+  counts.reserve(num_traces);
+
+  // The builder merges the samples of identical stacks, adding up the
+  // contentions of one entry with the delay of the other.
+  size_t next_frame = 0;
+  for (const auto &entry : traces) {
+    const google::javaprofiler::TraceMultiset::CallTrace &trace = entry.first;
+    JVMPI_CallFrame *trace_frames = frames.data() + next_frame;
+    traces.Frames(trace, trace_frames);
+    next_frame += trace.num_frames;
+    call_traces.push_back({nullptr, trace.num_frames, trace_frames});
+    if (trace.attr == kDelayAttr) {
+      stack_traces.push_back({&call_traces.back(),
+                              static_cast<int64_t>(entry.second)});
+      counts.push_back(0);
+    } else {
+      stack_traces.push_back({&call_traces.back(), 0});
+      counts.push_back(entry.second);
+    }
+  }
+
+  google::javaprofiler::JavaFrameCache cache;
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      google::javaprofiler::ProfileProtoBuilder::ForContention(
+          jvmti, sampling_interval_nanos_ / 1000, &cache);
+  builder->AddTraces(stack_traces.data(), counts.data(), stack_traces.size());
+
+  std::unique_ptr<perftools::profiles::Profile> profile =
+      builder->CreateProto();
+  profile->set_duration_nanos(duration_nanos);
+  LOG(INFO) << "Collected a contention profile: " << num_traces << " entries";
+
+  string out;
+  if (!perftools::profiles::Builder::Marshal(*profile, &out)) {
+    LOG(ERROR) << "Failed to serialize the contention profile";
+    return "";
+  }
+  return out;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CONTENTION_MONITOR_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CONTENTION_MONITOR_H_
+
+#include <atomic>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// ContentionMonitor samples the threads blocked on contended Java monitors
+// through the JVMTI MonitorContendedEnter and MonitorContendedEntered
+// events, which are only enabled while a contention profile is collected.
+//
+// The sampling is weighted by time: a contention lasting at least the
+// sampling interval is always recorded, a shorter one with a probability
+// proportional to its delay. The recorded counts and delays are scaled
+// accordingly, so that the profile estimates the actual number of
+// contentions and the total delay.
+//
+// The samples are aggregated in an AsyncSafeTraceMultiset, so that the
+// contended threads do not serialize on a lock of the profiler.
+class ContentionMonitor {
+ public:
+  // Adds the JVMTI capabilities needed for the monitor events. Must be
+  // called during the OnLoad phase. Returns false if the JVM does not
+  // support them.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the JVMTI callbacks of the monitor events, which remain disabled
+  // until Collect() is called.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks);
+
+  // Allows the collection of contention profiles, sampling one contention
+  // per sampling_interval_usec of delay on average.
+  static void Enable(int64_t sampling_interval_usec);
+
+  // Whether contention profiles can be collected.
+  static bool Enabled() { return enabled_; }
+
+  // Records the contentions for duration_nanos, and returns their
+  // compressed serialized profile.proto. Must not be called concurrently.
+  static string Collect(jvmtiEnv *jvmti, int64_t duration_nanos);
+
+ private:
+  static void JNICALL OnMonitorContendedEnter(jvmtiEnv *jvmti, JNIEnv *jni,
+                                              jthread thread, jobject object);
+  static void JNICALL OnMonitorContendedEntered(jvmtiEnv *jvmti, JNIEnv *jni,
+                                                jthread thread,
+                                                jobject object);
+
+  // Records a contention of the current thread which lasted delay_nanos.
+  static void Record(jvmtiEnv *jvmti, int64_t delay_nanos);
+
+  static bool SetEvents(jvmtiEnv *jvmti, jvmtiEventMode mode);
+
+  static string Serialize(jvmtiEnv *jvmti,
+                          const google::javaprofiler::TraceMultiset &traces,
+                          int64_t duration_nanos);
+
+  // Trace attributes, to keep the counts and delays of a trace apart.
+  static const int kContentionsAttr = 0;
+  static const int kDelayAttr = 1;
+
+  static std::atomic<bool> enabled_;
+  static int64_t sampling_interval_nanos_;
+
+  // Whether the events are being recorded.
+  static std::atomic<bool> recording_;
+  // Number of event callbacks in progress, drained before the traces are
+  // reset or harvested for the last time.
+  static std::atomic<int> active_callbacks_;
+  // Number of sampled contentions that could not be recorded.
+  static std::atomic<int64_t> dropped_;
+
+  // Allocated by Enable(), and never released as the callbacks may still be
+  // running.
+  static google::javaprofiler::AsyncSafeTraceMultiset *traces_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(ContentionMonitor);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CONTENTION_MONITOR_H_
@@ -14,9 +14,21 @@
 
 #include <limits.h>
 
+#include <algorithm>
+#include <memory>
 #include <string>
-
+#include <vector>
+
+#include "src/clock.h"
+#include "src/code_cache_map.h"
+#include "src/contention_monitor.h"
+#include "src/gc_monitor.h"
+#include "src/heap_monitor.h"
+#include "src/method_cache.h"
+#include "src/profiler.h"
 #include "src/string.h"
+#include "src/thread_labels.h"
+#include "src/unwinder.h"
 #include "src/worker.h"
 #include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/stacktraces.h"
@@ -28,6 +40,40 @@ DEFINE_bool(cprof_force_debug_non_safepoints, true,
             "when true, force DebugNonSafepoints flag by subscribing to the"
             "code generation events. This improves the accuracy of profiles,"
             "but may incur a bit of overhead.");
+DEFINE_bool(cprof_resolve_jit_frames, false,
+            "when true, track the code compiled and generated by the JVM "
+            "to resolve the sampled program counters in it to Java "
+            "methods, for the samples AsyncGetCallTrace cannot walk");
+DEFINE_bool(cprof_enable_heap_sampling, false,
+            "when true, sample the Java heap allocations to collect heap "
+            "profiles; requires JDK 11 or later");
+DEFINE_int32(cprof_heap_sampling_interval, 512 * 1024,
+             "average number of bytes allocated between two sampled "
+             "allocations, for the heap profiles");
+DEFINE_bool(cprof_enable_contention_profiling, false,
+            "when true, collect profiles of the threads blocked on "
+            "contended Java monitors");
+DEFINE_int32(cprof_contention_sampling_interval_usec, 1000,
+             "contentions are sampled with a probability of their delay "
+             "over this interval, in microseconds");
+DEFINE_bool(cprof_wall_gc_aware, false,
+            "when true, do not signal the threads for the wall profiles "
+            "during the stop-the-world garbage collections, and charge "
+            "each of them as a single [GC pause] sample instead");
+DEFINE_int32(cprof_method_id_threads, 0,
+             "when positive, create the method IDs of the classes loaded "
+             "before the VM init on this many background threads rather "
+             "than during the VM init; their frames sampled meanwhile are "
+             "reported as [No class load event]");
+DEFINE_bool(cprof_refresh_redefined_methods, false,
+            "when true, resolve the names and lines of the Java methods "
+            "again after a class is redefined or retransformed; this "
+            "enables the class file load hook, which may slow down class "
+            "loading");
+DEFINE_bool(cprof_skip_bootstrap_method_ids, false,
+            "when true, do not create the method IDs of the classes of the "
+            "bootstrap class loader ahead of time, their frames are then "
+            "reported as [No class load event]");
 
 namespace cloud {
 namespace profiler {
@@ -41,10 +87,10 @@ static ThreadTable *threads;
 
 static void JNICALL OnThreadStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
                                   jthread thread) {
-  IMPLICITLY_USE(jvmti_env);
-  IMPLICITLY_USE(thread);
   google::javaprofiler::Accessors::SetCurrentJniEnv(jni_env);
+  RegisterThreadStack();
   threads->RegisterCurrent();
+  ThreadLabels::SetCurrent(jvmti_env, jni_env, thread);
 }
 
 static void JNICALL OnThreadEnd(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
@@ -81,6 +127,22 @@ static void JNICALL OnCompiledMethodLoad(jvmtiEnv *jvmti_env, jmethodID method,
   IMPLICITLY_USE(compile_info);
 }
 
+// Whether the jmethodIDs of a class are to be created ahead of time.
+bool WantJMethodIDsForClass(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass) {
+  if (!FLAGS_cprof_skip_bootstrap_method_ids) {
+    return true;
+  }
+  jobject loader = nullptr;
+  if (jvmti->GetClassLoader(klass, &loader) != JVMTI_ERROR_NONE) {
+    return true;
+  }
+  if (loader == nullptr) {
+    return false;
+  }
+  jni->DeleteLocalRef(loader);
+  return true;
+}
+
 // Calls GetClassMethods on a given class to force the creation of
 // jmethodIDs of it.
 void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass) {
@@ -97,6 +159,41 @@ void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass) {
   }
 }
 
+// Body of the background threads creating the jmethodIDs of a batch of
+// classes, a std::vector<jclass> of global references taken over.
+void JNICALL CreateJMethodIDsForBatch(jvmtiEnv *jvmti, JNIEnv *jni,
+                                      void *arg) {
+  std::unique_ptr<std::vector<jclass>> batch(
+      static_cast<std::vector<jclass> *>(arg));
+  struct timespec start = DefaultClock()->Now();
+  for (jclass klass : *batch) {
+    CreateJMethodIDsForClass(jvmti, klass);
+    jni->DeleteGlobalRef(klass);
+  }
+  LOG(INFO) << "Created the method IDs of " << batch->size()
+            << " classes in "
+            << (TimeSpecToNanos(DefaultClock()->Now()) -
+                TimeSpecToNanos(start)) / kNanosPerMilli
+            << "ms";
+}
+
+// Runs CreateJMethodIDsForBatch() on a new agent thread. Returns false if
+// the thread could not be started, in which case the batch is left to the
+// caller.
+bool StartJMethodIDsBatch(jvmtiEnv *jvmti, JNIEnv *jni,
+                          std::vector<jclass> *batch) {
+  jclass cls = jni->FindClass("java/lang/Thread");
+  jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+  jobject thread = jni->NewObject(cls, constructor);
+  if (thread == nullptr) {
+    return false;
+  }
+  jvmtiError err = jvmti->RunAgentThread(thread, CreateJMethodIDsForBatch,
+                                         batch, JVMTI_THREAD_NORM_PRIORITY);
+  jni->DeleteLocalRef(thread);
+  return err == JVMTI_ERROR_NONE;
+}
+
 void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
   IMPLICITLY_USE(thread);
   LOG(INFO) << "On VM init";
@@ -107,22 +204,80 @@ void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
   google::javaprofiler::JvmtiScopedPtr<jclass> classes(jvmti);
   JVMTI_ERROR((jvmti->GetLoadedClasses(&class_count, classes.GetRef())));
   jclass *class_list = classes.Get();
+  std::vector<jclass> wanted;
   for (int i = 0; i < class_count; ++i) {
     jclass klass = class_list[i];
-    CreateJMethodIDsForClass(jvmti, klass);
+    if (WantJMethodIDsForClass(jvmti, jni_env, klass)) {
+      wanted.push_back(klass);
+    }
+  }
+  LOG(INFO) << "Creating the method IDs of " << wanted.size() << " of "
+            << class_count << " loaded classes";
+
+  // The classes are split in contiguous batches, one per thread.
+  size_t num_batches =
+      std::max(0, std::min<int>(FLAGS_cprof_method_id_threads, wanted.size()));
+  size_t start = 0;
+  for (size_t i = 0; i < num_batches; i++) {
+    size_t end = wanted.size() * (i + 1) / num_batches;
+    std::vector<jclass> *batch = new std::vector<jclass>();
+    for (size_t j = start; j < end; j++) {
+      batch->push_back(static_cast<jclass>(jni_env->NewGlobalRef(wanted[j])));
+    }
+    if (StartJMethodIDsBatch(jvmti, jni_env, batch)) {
+      start = end;
+      continue;
+    }
+    LOG(WARNING) << "Failed to start a method ID creation thread";
+    for (jclass klass : *batch) {
+      jni_env->DeleteGlobalRef(klass);
+    }
+    delete batch;
+    break;
+  }
+  // Whatever was not handed out to a thread.
+  for (size_t i = start; i < wanted.size(); ++i) {
+    CreateJMethodIDsForClass(jvmti, wanted[i]);
   }
   worker->Start(jni_env);
 }
 
 void JNICALL OnClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
                             jthread thread, jclass klass) {
-  IMPLICITLY_USE(jni_env);
   IMPLICITLY_USE(thread);
   // We need to do this to "prime the pump", as it were -- make sure
   // that all of the methodIDs have been initialized internally, for
   // AsyncGetCallTrace.  I imagine it slows down class loading a mite,
   // but honestly, how fast does class loading have to be?
-  CreateJMethodIDsForClass(jvmti_env, klass);
+  if (WantJMethodIDsForClass(jvmti_env, jni_env, klass)) {
+    CreateJMethodIDsForClass(jvmti_env, klass);
+  }
+}
+
+void JNICALL OnClassFileLoadHook(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
+                                 jclass class_being_redefined,
+                                 jobject loader, const char *name,
+                                 jobject protection_domain,
+                                 jint class_data_len,
+                                 const unsigned char *class_data,
+                                 jint *new_class_data_len,
+                                 unsigned char **new_class_data) {
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(jni_env);
+  IMPLICITLY_USE(loader);
+  IMPLICITLY_USE(name);
+  IMPLICITLY_USE(protection_domain);
+  IMPLICITLY_USE(class_data_len);
+  IMPLICITLY_USE(class_data);
+  IMPLICITLY_USE(new_class_data_len);
+  IMPLICITLY_USE(new_class_data);
+  // The class is left as is, only its redefinition matters: its methods
+  // keep their jmethodIDs but may get new names and lines. The methods of
+  // newly loaded classes, even with the name of an unloaded one, get new
+  // jmethodIDs.
+  if (class_being_redefined != nullptr) {
+    MethodCache::ClassRedefined(name);
+  }
 }
 
 void JNICALL OnVMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
@@ -178,7 +333,9 @@ static bool PrepareJvmti(jvmtiEnv *jvmti) {
   return true;
 }
 
-static bool RegisterJvmti(jvmtiEnv *jvmti) {
+static bool RegisterJvmti(jvmtiEnv *jvmti, bool heap_sampling,
+                          bool contention_profiling, bool gc_tracking,
+                          bool code_tracking) {
   // Create the list of callbacks to be called on given events.
   jvmtiEventCallbacks *callbacks = new jvmtiEventCallbacks();
   memset(callbacks, 0, sizeof(jvmtiEventCallbacks));
@@ -201,6 +358,30 @@ static bool RegisterJvmti(jvmtiEnv *jvmti) {
     events.push_back(JVMTI_EVENT_COMPILED_METHOD_LOAD);
   }
 
+  if (code_tracking) {
+    // Takes over the compiled method load callback above, if any.
+    CodeCacheMap::AddCallbacks(callbacks, &events);
+  }
+
+  if (FLAGS_cprof_refresh_redefined_methods) {
+    callbacks->ClassFileLoadHook = &OnClassFileLoadHook;
+    events.push_back(JVMTI_EVENT_CLASS_FILE_LOAD_HOOK);
+  }
+
+  if (heap_sampling) {
+    HeapMonitor::AddCallbacks(callbacks, &events);
+  }
+
+  if (gc_tracking) {
+    // After the heap monitor, whose collection events it takes over.
+    GcMonitor::AddCallbacks(callbacks, &events);
+  }
+
+  if (contention_profiling) {
+    // The monitor events are only enabled while collecting a profile.
+    ContentionMonitor::AddCallbacks(callbacks);
+  }
+
   JVMTI_ERROR_1(
       (jvmti->SetEventCallbacks(callbacks, sizeof(jvmtiEventCallbacks))),
       false);
@@ -250,6 +431,7 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
 
   google::javaprofiler::Accessors::Init();
   google::javaprofiler::AttributeTable::Init();
+  ThreadLabels::Init();
 
   if ((err = (vm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION))) !=
       JNI_OK) {
@@ -262,12 +444,27 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     return 0;
   }
 
+  bool heap_sampling =
+      FLAGS_cprof_enable_heap_sampling && HeapMonitor::AddCapabilities(jvmti);
+  bool contention_profiling = FLAGS_cprof_enable_contention_profiling &&
+                              ContentionMonitor::AddCapabilities(jvmti);
+  bool gc_tracking =
+      FLAGS_cprof_wall_gc_aware && GcMonitor::AddCapabilities(jvmti);
+  bool code_tracking =
+      FLAGS_cprof_resolve_jit_frames && CodeCacheMap::AddCapabilities(jvmti);
+
   // The process exit will free the memory. See comments to the variable on why.
   // Initialize before registering the JVMTI callbacks to avoid the unlikely
   // race of getting thread events before the thread table is born.
-  threads = new ThreadTable(FLAGS_cprof_cpu_use_per_thread_timers);
-
-  if (!RegisterJvmti(jvmti)) {
+  // Traces deeper than what fits on the stack of the signal handler are
+  // captured in per-thread buffers.
+  int max_stack_depth = Profiler::MaxStackDepth();
+  threads = new ThreadTable(
+      FLAGS_cprof_cpu_use_per_thread_timers,
+      max_stack_depth > kMaxFramesToCapture ? max_stack_depth + 1 : 0);
+
+  if (!RegisterJvmti(jvmti, heap_sampling, contention_profiling, gc_tracking,
+                     code_tracking)) {
     LOG(ERROR) << "Failed to enable JVMTI events.  Continuing...";
     // We fail hard here because we may have failed in the middle of
     // registering callbacks, which will leave the system in an
@@ -275,6 +472,14 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     return 1;
   }
 
+  if (heap_sampling &&
+      !HeapMonitor::Enable(jvmti, FLAGS_cprof_heap_sampling_interval)) {
+    LOG(ERROR) << "Failed to enable heap sampling.  Continuing...";
+  }
+  if (contention_profiling) {
+    ContentionMonitor::Enable(FLAGS_cprof_contention_sampling_interval_usec);
+  }
+
   google::javaprofiler::Asgct::SetAsgct(
       google::javaprofiler::Accessors::GetJvmFunction<
       google::javaprofiler::ASGCTType>("AsyncGetCallTrace"));
@@ -0,0 +1,88 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/gc_monitor.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "src/clock.h"
+#include "src/heap_monitor.h"
+
+namespace cloud {
+namespace profiler {
+
+std::atomic<bool> GcMonitor::enabled_;
+std::atomic<bool> GcMonitor::collecting_;
+std::atomic<int64_t> GcMonitor::start_nanos_;
+std::atomic<int64_t> GcMonitor::num_collections_;
+std::atomic<int64_t> GcMonitor::collection_nanos_;
+
+bool GcMonitor::AddCapabilities(jvmtiEnv *jvmti) {
+  jvmtiCapabilities all_caps;
+  JVMTI_ERROR_1((jvmti->GetPotentialCapabilities(&all_caps)), false);
+  if (!all_caps.can_generate_garbage_collection_events) {
+    LOG(WARNING) << "The JVM does not support garbage collection events, "
+                 << "garbage collections not tracked";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_garbage_collection_events = 1;
+  JVMTI_ERROR_1((jvmti->AddCapabilities(&caps)), false);
+  return true;
+}
+
+void GcMonitor::AddCallbacks(jvmtiEventCallbacks *callbacks,
+                             std::vector<jvmtiEvent> *events) {
+  callbacks->GarbageCollectionStart = &OnGarbageCollectionStart;
+  callbacks->GarbageCollectionFinish = &OnGarbageCollectionFinish;
+  events->push_back(JVMTI_EVENT_GARBAGE_COLLECTION_START);
+  if (std::find(events->begin(), events->end(),
+                JVMTI_EVENT_GARBAGE_COLLECTION_FINISH) == events->end()) {
+    events->push_back(JVMTI_EVENT_GARBAGE_COLLECTION_FINISH);
+  }
+  enabled_ = true;
+}
+
+void GcMonitor::Totals(int64_t *num_collections, int64_t *collection_nanos) {
+  *num_collections = num_collections_.load(std::memory_order_acquire);
+  *collection_nanos = collection_nanos_.load(std::memory_order_acquire);
+}
+
+void JNICALL GcMonitor::OnGarbageCollectionStart(jvmtiEnv *jvmti) {
+  IMPLICITLY_USE(jvmti);
+  // Called while the Java threads are stopped, where JNI and most of JVMTI
+  // cannot be used.
+  start_nanos_.store(TimeSpecToNanos(DefaultClock()->Now()),
+                     std::memory_order_relaxed);
+  collecting_.store(true, std::memory_order_release);
+}
+
+void JNICALL GcMonitor::OnGarbageCollectionFinish(jvmtiEnv *jvmti) {
+  int64_t start_nanos = start_nanos_.load(std::memory_order_relaxed);
+  if (collecting_.exchange(false, std::memory_order_acq_rel) &&
+      start_nanos != 0) {
+    collection_nanos_.fetch_add(
+        TimeSpecToNanos(DefaultClock()->Now()) - start_nanos,
+        std::memory_order_relaxed);
+    num_collections_.fetch_add(1, std::memory_order_release);
+  }
+  HeapMonitor::OnGarbageCollectionFinish(jvmti);
+}
+
+}  // namespace profiler
+}  // namespace cloud
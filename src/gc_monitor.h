@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_GC_MONITOR_H_
+#define CLOUD_PROFILER_AGENT_JAVA_GC_MONITOR_H_
+
+#include <atomic>
+#include <vector>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// GcMonitor tracks the stop-the-world garbage collections through the
+// JVMTI GarbageCollectionStart and GarbageCollectionFinish events, so that
+// the wall profiler does not signal the threads parked for a collection,
+// and charges each pause as a whole instead. The events say nothing of the
+// collector or of its phases, only when the Java threads are stopped.
+//
+// The JVMTI callbacks are static, so is the state of the monitor.
+class GcMonitor {
+ public:
+  // Adds the JVMTI capability needed for the garbage collection events.
+  // Must be called during the OnLoad phase. Returns false if the JVM does
+  // not support them.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the JVMTI callbacks, and appends the events to enable for them.
+  // Takes over the garbage collection events of the HeapMonitor, which
+  // must have added its callbacks before.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks,
+                           std::vector<jvmtiEvent> *events);
+
+  // Whether the garbage collections are tracked.
+  static bool Enabled() { return enabled_; }
+
+  // Whether a garbage collection is in progress. This is async signal
+  // safe.
+  static bool InCollection() {
+    return collecting_.load(std::memory_order_acquire);
+  }
+
+  // Sets the number of garbage collections which completed since the agent
+  // started, and the nanoseconds they took in total.
+  static void Totals(int64_t *num_collections, int64_t *collection_nanos);
+
+ private:
+  static void JNICALL OnGarbageCollectionStart(jvmtiEnv *jvmti);
+  static void JNICALL OnGarbageCollectionFinish(jvmtiEnv *jvmti);
+
+  static std::atomic<bool> enabled_;
+  static std::atomic<bool> collecting_;
+  // Start of the collection in progress.
+  static std::atomic<int64_t> start_nanos_;
+  static std::atomic<int64_t> num_collections_;
+  static std::atomic<int64_t> collection_nanos_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(GcMonitor);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_GC_MONITOR_H_
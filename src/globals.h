@@ -63,8 +63,10 @@ using google::javaprofiler::kSafepoint;
 
 using google::javaprofiler::kCallTraceErrorLineNum;
 using google::javaprofiler::kMaxFramesToCapture;
+using google::javaprofiler::kMaxStackDepthLimit;
 using google::javaprofiler::kNativeFrameLineNum;
 using google::javaprofiler::kNumCallTraceErrors;
+using google::javaprofiler::kTruncatedFrameLineNum;
 
 using google::javaprofiler::JVMPI_CallFrame;
 using google::javaprofiler::JVMPI_CallTrace;
@@ -0,0 +1,223 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/heap_monitor.h"
+
+#include <string.h>
+
+#include <iterator>
+
+#include "perftools/profiles/proto/builder.h"
+#include "src/clock.h"
+#include "src/profiler.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+
+namespace cloud {
+namespace profiler {
+
+std::atomic<bool> HeapMonitor::enabled_;
+int HeapMonitor::sampling_interval_;
+std::atomic<bool> HeapMonitor::collected_;
+std::mutex HeapMonitor::mutex_;
+std::vector<HeapMonitor::Sample> HeapMonitor::live_;
+std::vector<HeapMonitor::Sample> HeapMonitor::allocated_;
+bool HeapMonitor::recording_allocations_;
+
+bool HeapMonitor::AddCapabilities(jvmtiEnv *jvmti) {
+#ifdef HAVE_JVMTI_SAMPLED_OBJECT_ALLOC
+  jvmtiCapabilities all_caps;
+  JVMTI_ERROR_1((jvmti->GetPotentialCapabilities(&all_caps)), false);
+  if (!all_caps.can_generate_sampled_object_alloc_events ||
+      !all_caps.can_generate_garbage_collection_events) {
+    LOG(WARNING) << "The JVM does not support sampling the allocations, "
+                 << "heap profiling disabled";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_sampled_object_alloc_events = 1;
+  caps.can_generate_garbage_collection_events = 1;
+  JVMTI_ERROR_1((jvmti->AddCapabilities(&caps)), false);
+  return true;
+#else
+  LOG(WARNING) << "The agent was built without support for sampling the "
+               << "allocations, heap profiling disabled";
+  return false;
+#endif
+}
+
+void HeapMonitor::AddCallbacks(jvmtiEventCallbacks *callbacks,
+                               std::vector<jvmtiEvent> *events) {
+#ifdef HAVE_JVMTI_SAMPLED_OBJECT_ALLOC
+  callbacks->SampledObjectAlloc = &OnSampledObjectAlloc;
+  callbacks->GarbageCollectionFinish = &OnGarbageCollectionFinish;
+  events->push_back(JVMTI_EVENT_SAMPLED_OBJECT_ALLOC);
+  events->push_back(JVMTI_EVENT_GARBAGE_COLLECTION_FINISH);
+#endif
+}
+
+bool HeapMonitor::Enable(jvmtiEnv *jvmti, int sampling_interval) {
+#ifdef HAVE_JVMTI_SAMPLED_OBJECT_ALLOC
+  JVMTI_ERROR_1((jvmti->SetHeapSamplingInterval(sampling_interval)), false);
+  sampling_interval_ = sampling_interval;
+  enabled_ = true;
+  LOG(INFO) << "Sampling an allocation every " << sampling_interval
+            << " bytes on average";
+  return true;
+#else
+  return false;
+#endif
+}
+
+void JNICALL HeapMonitor::OnSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni,
+                                               jthread thread, jobject object,
+                                               jclass klass, jlong size) {
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(klass);
+  int max_frames = Profiler::MaxStackDepth();
+  std::vector<jvmtiFrameInfo> frames(max_frames);
+  jint num_frames = 0;
+  if (jvmti->GetStackTrace(nullptr, 0, max_frames, frames.data(),
+                           &num_frames) != JVMTI_ERROR_NONE) {
+    return;
+  }
+
+  Sample sample;
+  sample.frames.resize(num_frames);
+  for (int i = 0; i < num_frames; i++) {
+    sample.frames[i].lineno = static_cast<jint>(frames[i].location);
+    sample.frames[i].method_id = frames[i].method;
+  }
+  if (num_frames == max_frames) {
+    sample.frames.push_back(JVMPI_CallFrame{kTruncatedFrameLineNum, nullptr});
+  }
+  sample.size = size;
+  sample.object = jni->NewWeakGlobalRef(object);
+  if (sample.object == nullptr) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (recording_allocations_) {
+    allocated_.push_back({sample.frames, sample.size, nullptr});
+  }
+  live_.push_back(std::move(sample));
+}
+
+void JNICALL HeapMonitor::OnGarbageCollectionFinish(jvmtiEnv *jvmti) {
+  IMPLICITLY_USE(jvmti);
+  collected_ = true;
+}
+
+void HeapMonitor::RemoveCollected(JNIEnv *jni) {
+  if (!collected_.exchange(false)) {
+    // No object can have been collected since the last call.
+    return;
+  }
+  // Swept without the lock, so that the allocations sampled meanwhile do
+  // not wait for it. They are appended to live_, and kept.
+  std::vector<Sample> live;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    live.swap(live_);
+  }
+  size_t num_live = 0;
+  for (size_t i = 0; i < live.size(); i++) {
+    if (jni->IsSameObject(live[i].object, nullptr)) {
+      jni->DeleteWeakGlobalRef(live[i].object);
+      continue;
+    }
+    if (num_live != i) {
+      live[num_live] = std::move(live[i]);
+    }
+    num_live++;
+  }
+  live.resize(num_live);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  live.insert(live.end(), std::make_move_iterator(live_.begin()),
+              std::make_move_iterator(live_.end()));
+  live_.swap(live);
+}
+
+string HeapMonitor::SerializeLiveHeap(jvmtiEnv *jvmti, JNIEnv *jni) {
+  RemoveCollected(jni);
+  std::vector<Sample> samples;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples.reserve(live_.size());
+    for (const Sample &sample : live_) {
+      samples.push_back({sample.frames, sample.size, nullptr});
+    }
+  }
+  return Serialize(jvmti, false, samples, 0);
+}
+
+string HeapMonitor::CollectAllocations(jvmtiEnv *jvmti,
+                                       int64_t duration_nanos) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    allocated_.clear();
+    recording_allocations_ = true;
+  }
+  DefaultClock()->SleepFor(NanosToTimeSpec(duration_nanos));
+
+  std::vector<Sample> samples;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    recording_allocations_ = false;
+    samples.swap(allocated_);
+  }
+  return Serialize(jvmti, true, samples, duration_nanos);
+}
+
+string HeapMonitor::Serialize(jvmtiEnv *jvmti, bool allocations,
+                              const std::vector<Sample> &samples,
+                              int64_t duration_nanos) {
+  google::javaprofiler::JavaFrameCache cache;
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      allocations ? google::javaprofiler::ProfileProtoBuilder::ForAllocations(
+                        jvmti, sampling_interval_, &cache)
+                  : google::javaprofiler::ProfileProtoBuilder::ForHeap(
+                        jvmti, sampling_interval_, &cache);
+
+  std::vector<JVMPI_CallTrace> traces(samples.size());
+  std::vector<google::javaprofiler::ProfileStackTrace> stack_traces(
+      samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    traces[i].env_id = nullptr;
+    traces[i].num_frames = samples[i].frames.size();
+    traces[i].frames = const_cast<JVMPI_CallFrame *>(samples[i].frames.data());
+    stack_traces[i] = {&traces[i], samples[i].size};
+  }
+  builder->AddTraces(stack_traces.data(), stack_traces.size());
+
+  std::unique_ptr<perftools::profiles::Profile> profile =
+      builder->CreateProto();
+  profile->set_period(sampling_interval_);
+  profile->set_duration_nanos(duration_nanos);
+  LOG(INFO) << "Collected a " << (allocations ? "heap allocation" : "heap")
+            << " profile: " << samples.size() << " samples";
+
+  string out;
+  if (!perftools::profiles::Builder::Marshal(*profile, &out)) {
+    LOG(ERROR) << "Failed to serialize the heap profile";
+    return "";
+  }
+  return out;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_HEAP_MONITOR_H_
+#define CLOUD_PROFILER_AGENT_JAVA_HEAP_MONITOR_H_
+
+#include <atomic>
+#include <mutex>  // NOLINT
+#include <vector>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// HeapMonitor samples the Java object allocations through the JVMTI
+// SampledObjectAlloc event, available from JDK 11. About one allocation out
+// of every sampling interval bytes is recorded along with its stack trace.
+//
+// The sampled objects are tracked with weak references until they are
+// garbage collected, which produces the heap profile of the objects in use.
+// While an allocation profile is being collected, all the sampled
+// allocations are recorded as well regardless of their liveness.
+//
+// The JVMTI callbacks are static, so is the state of the monitor.
+class HeapMonitor {
+ public:
+  // Adds the JVMTI capabilities needed to sample the allocations, if the
+  // JVM supports them. Must be called during the OnLoad phase. Returns
+  // false if the allocations cannot be sampled.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the JVMTI callbacks, and appends the events to enable for them.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks,
+                           std::vector<jvmtiEvent> *events);
+
+  // Starts sampling an allocation every sampling_interval bytes on
+  // average. AddCapabilities() and AddCallbacks() must have succeeded.
+  static bool Enable(jvmtiEnv *jvmti, int sampling_interval);
+
+  // Whether allocations are being sampled.
+  static bool Enabled() { return enabled_; }
+
+  // Returns the compressed serialized profile.proto of the sampled objects
+  // which are still alive.
+  static string SerializeLiveHeap(jvmtiEnv *jvmti, JNIEnv *jni);
+
+  // Records the sampled allocations for duration_nanos, and returns their
+  // compressed serialized profile.proto.
+  static string CollectAllocations(jvmtiEnv *jvmti, int64_t duration_nanos);
+
+  // Drops the live samples whose object has been garbage collected since
+  // the last call. Called from the profiling thread before each profile,
+  // rather than from the application threads.
+  static void RemoveCollected(JNIEnv *jni);
+
+  // JVMTI GarbageCollectionFinish callback, also called by the GcMonitor
+  // when it takes over the event.
+  static void JNICALL OnGarbageCollectionFinish(jvmtiEnv *jvmti);
+
+ private:
+  struct Sample {
+    std::vector<JVMPI_CallFrame> frames;
+    int64_t size;
+    // Weak reference to the sampled object, only set for the live samples.
+    jweak object;
+  };
+
+  static void JNICALL OnSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni,
+                                           jthread thread, jobject object,
+                                           jclass klass, jlong size);
+
+  static string Serialize(jvmtiEnv *jvmti, bool allocations,
+                          const std::vector<Sample> &samples,
+                          int64_t duration_nanos);
+
+  static std::atomic<bool> enabled_;
+  static int sampling_interval_;
+
+  // Set by the garbage collection events, where JNI cannot be used, to
+  // defer the cleanup of the live samples to RemoveCollected().
+  static std::atomic<bool> collected_;
+
+  static std::mutex mutex_;
+  static std::vector<Sample> live_;
+  // Samples allocated while an allocation profile is collected.
+  static std::vector<Sample> allocated_;
+  static bool recording_allocations_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(HeapMonitor);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_HEAP_MONITOR_H_
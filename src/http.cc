@@ -14,6 +14,8 @@
 
 #include "src/http.h"
 
+#include <mutex>
+
 #include "curl/curl.h"
 
 namespace cloud {
@@ -21,11 +23,60 @@ namespace profiler {
 
 typedef long curl_long_t;  // NOLINT 'long'
 
+namespace {
+
+// Guards the data shared by the requests, one lock per kind of data.
+std::mutex share_mutexes[CURL_LOCK_DATA_LAST];
+
+void LockShare(CURL *handle, curl_lock_data data, curl_lock_access access,
+               void *userptr) {
+  share_mutexes[data].lock();
+}
+
+void UnlockShare(CURL *handle, curl_lock_data data, void *userptr) {
+  share_mutexes[data].unlock();
+}
+
+CURLSH *NewShare() {
+  CURLSH *share = curl_share_init();
+  if (share == nullptr) {
+    LOG(ERROR) << "Failed to initialize the curl share";
+    return nullptr;
+  }
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, LockShare);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900  // 7.57.0
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  return share;
+}
+
+// Shared by all the requests, so that they reuse the connections, DNS
+// lookups and TLS sessions of the previous ones rather than doing a new
+// handshake every time. Never released, as requests may run until exit.
+CURLSH *Share() {
+  static CURLSH *share = NewShare();
+  return share;
+}
+
+}  // namespace
+
 HTTPRequest::HTTPRequest() : headers_(nullptr) {
   curl_ = curl_easy_init();
   if (!curl_) {
     LOG(ERROR) << "Failed to initialize curl";
+    return;
+  }
+  CURLSH *share = Share();
+  if (share != nullptr) {
+    curl_easy_setopt(curl_, CURLOPT_SHARE, share);
   }
+  curl_easy_setopt(curl_, CURLOPT_TCP_KEEPALIVE, 1L);
+  // Falls back to HTTP/1.1 when the server or libcurl does not support it.
+  curl_easy_setopt(curl_, CURLOPT_HTTP_VERSION,
+                   (curl_long_t)CURL_HTTP_VERSION_2TLS);
 }
 
 HTTPRequest::~HTTPRequest() {
@@ -0,0 +1,205 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/method_cache.h"
+
+#include <algorithm>
+
+#include "third_party/javaprofiler/display.h"
+#include "third_party/javaprofiler/stacktrace_fixer.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Names filled in by GetStackFrameElements() when the JVMTI calls fail,
+// see display.cc. An unloaded method gets another name, and is not
+// resolved again.
+const char kClassUnknown[] = "UnknownClass";
+const char kMethodUnknown[] = "UnknownMethod";
+
+// Reads the line number table of a method, sorted by bci as the JVMTI does
+// not guarantee any order.
+void GetSortedLines(jvmtiEnv *jvmti, jmethodID method_id,
+                    std::vector<std::pair<jint, jint>> *lines) {
+  lines->clear();
+  if (jvmti == nullptr) {
+    return;
+  }
+  jint entry_count;
+  JvmtiScopedPtr<jvmtiLineNumberEntry> table(jvmti);
+  if (jvmti->GetLineNumberTable(method_id, &entry_count, table.GetRef()) !=
+      JVMTI_ERROR_NONE) {
+    table.AbandonBecauseOfError();
+    return;
+  }
+  lines->reserve(entry_count);
+  for (jint i = 0; i < entry_count; i++) {
+    lines->push_back(std::make_pair(
+        static_cast<jint>(table.Get()[i].start_location),
+        table.Get()[i].line_number));
+  }
+  std::sort(lines->begin(), lines->end());
+}
+
+}  // namespace
+
+std::atomic<uint32_t> MethodCache::epochs_[MethodCache::kNumEpochSlots];
+std::atomic<uint32_t> MethodCache::redefinitions_;
+
+int MethodCache::Method::LineNumber(jlocation bci) const {
+  // Native methods have no bci.
+  if (bci < 0 || lines.empty()) {
+    return -1;
+  }
+  if (lines.size() == 1) {
+    return lines[0].second;
+  }
+  // Last line starting at or before bci.
+  auto it = std::upper_bound(
+      lines.begin(), lines.end(), bci,
+      [](jlocation b, const std::pair<jint, jint> &l) { return b < l.first; });
+  if (it == lines.begin()) {
+    return -1;
+  }
+  return (it - 1)->second;
+}
+
+const MethodCache::Method &MethodCache::Lookup(jvmtiEnv *jvmti,
+                                               jmethodID method_id) {
+  auto it = methods_.find(method_id);
+  if (it != methods_.end()) {
+    it->second.used = true;
+    return it->second.method;
+  }
+
+  Method method;
+  Resolve(jvmti, method_id, &method);
+  return Add(method_id, std::move(method));
+}
+
+const MethodCache::Method &MethodCache::Add(jmethodID method_id,
+                                            Method method) {
+  Entry &entry = methods_[method_id];
+  entry.used = true;
+  entry.method = std::move(method);
+  return entry.method;
+}
+
+void MethodCache::Resolve(jvmtiEnv *jvmti, jmethodID method_id,
+                          Method *method) {
+  uint32_t redefinitions = redefinitions_.load(std::memory_order_acquire);
+  string method_name, class_name, file_name, signature;
+  // The line number depends on the location within the method, it is not
+  // part of the cached names.
+  JVMPI_CallFrame frame = {0, method_id};
+  google::javaprofiler::GetStackFrameElements(jvmti, frame, &file_name,
+                                              &class_name, &method_name,
+                                              &signature, nullptr);
+  google::javaprofiler::FixMethodParameters(&signature);
+  method->failed =
+      class_name == kClassUnknown || method_name == kMethodUnknown;
+
+  method->name.clear();
+  if (!class_name.empty()) {
+    method->name = class_name + ".";
+  }
+  method->name += method_name;
+  method->name += signature;
+  method->simplified_name =
+      google::javaprofiler::SimplifyFunctionName(method->name);
+  method->file_name = std::move(file_name);
+  GetSortedLines(jvmti, method_id, &method->lines);
+
+  method->epoch_slot = EpochSlot(class_name);
+  method->epoch =
+      epochs_[method->epoch_slot].load(std::memory_order_acquire);
+  if (redefinitions_.load(std::memory_order_acquire) != redefinitions) {
+    // A class was redefined while resolving, maybe this one after its
+    // epoch was read. Tagged as stale, so that it is resolved again.
+    method->epoch--;
+  }
+}
+
+int MethodCache::EpochSlot(const string &class_name) {
+  // FNV-1a, with the package separators of both forms hashed the same.
+  uint32_t h = 2166136261u;
+  for (char c : class_name) {
+    h = (h ^ static_cast<unsigned char>(c == '/' ? '.' : c)) * 16777619u;
+  }
+  return h % kNumEpochSlots;
+}
+
+void MethodCache::ClassRedefined(const char *name) {
+  epochs_[EpochSlot(name != nullptr ? name : "")].fetch_add(
+      1, std::memory_order_acq_rel);
+  redefinitions_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+bool MethodCache::EvictRedefined() {
+  uint32_t redefinitions = redefinitions_.load(std::memory_order_acquire);
+  if (redefinitions == seen_redefinitions_ && settling_slots_.empty()) {
+    return false;
+  }
+  seen_redefinitions_ = redefinitions;
+  if (seen_epochs_.empty()) {
+    seen_epochs_.resize(kNumEpochSlots, 0);
+  }
+  // The epoch is bumped before the class is swapped, so the methods
+  // resolved meanwhile have the new epoch but may have the old names and
+  // lines. All the methods of the slots changed by the previous call are
+  // evicted, so that they are resolved again once the redefinition is done.
+  std::vector<bool> evict_slot(kNumEpochSlots, false);
+  for (int slot : settling_slots_) {
+    evict_slot[slot] = true;
+  }
+  settling_slots_.clear();
+  for (int slot = 0; slot < kNumEpochSlots; slot++) {
+    uint32_t epoch = epochs_[slot].load(std::memory_order_acquire);
+    if (epoch != seen_epochs_[slot]) {
+      seen_epochs_[slot] = epoch;
+      settling_slots_.push_back(slot);
+    }
+  }
+  int64_t evicted = 0;
+  for (auto it = methods_.begin(); it != methods_.end();) {
+    const Method &method = it->second.method;
+    if (evict_slot[method.epoch_slot] ||
+        epochs_[method.epoch_slot].load(std::memory_order_acquire) !=
+            method.epoch) {
+      it = methods_.erase(it);
+      evicted++;
+    } else {
+      ++it;
+    }
+  }
+  LOG(INFO) << "Evicted " << evicted << " methods of redefined classes";
+  return true;
+}
+
+void MethodCache::EndProfile() {
+  bool evict = Size() > max_methods_;
+  for (auto it = methods_.begin(); it != methods_.end();) {
+    if (it->second.method.failed || (evict && !it->second.used)) {
+      it = methods_.erase(it);
+    } else {
+      it->second.used = false;
+      ++it;
+    }
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
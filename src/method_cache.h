@@ -0,0 +1,146 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
+#define CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
+
+#include <atomic>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// MethodCache keeps the names of the Java methods found in profiles, so that
+// each method is only resolved through the JVMTI once rather than in every
+// profile. It is bounded: once it holds more than max_methods methods, the
+// ones not used by the last profile are evicted. It is not thread safe, and
+// is meant to be used by the profiling thread only.
+//
+// The methods are keyed on their jmethodID. The JVM does not reuse the IDs
+// of methods of unloaded classes, so their entries are just never used again
+// and eventually evicted. A redefined method keeps its ID though: each
+// method is tagged with the epoch of its class when resolved, and the
+// methods whose class epoch changed since are evicted by EvictRedefined().
+// The epochs are kept in a fixed table indexed by a hash of the class name,
+// so that a redefinition is recorded without allocating and only costs the
+// other classes of its slot a new resolution. As the epoch is bumped before
+// the redefinition takes effect, the methods of a changed slot are evicted
+// again by the following call to EvictRedefined().
+//
+// The line number table of each method is kept along with its names,
+// sorted, so that the line of each bci is found without going through the
+// JVMTI again.
+//
+// The methods which could not be resolved are only kept until the end of
+// the profile, and resolved again in the next one.
+class MethodCache {
+ public:
+  struct Method {
+    // Name of the method, as in "com.example.Foo.bar(int)".
+    string name;
+    // Same as name, with the parameters and generics removed.
+    string simplified_name;
+    string file_name;
+    // Line number table of the method, as (start bci, line number) pairs
+    // sorted by bci.
+    std::vector<std::pair<jint, jint>> lines;
+
+    // Epoch slot of the class of the method, and its epoch when the method
+    // was resolved.
+    int epoch_slot = 0;
+    uint32_t epoch = 0;
+
+    // Whether the JVMTI failed to give the names, which may only be
+    // transient, as when the class is still being prepared.
+    bool failed = false;
+
+    // Returns the line number of the bci, -1 if unknown.
+    int LineNumber(jlocation bci) const;
+  };
+
+  explicit MethodCache(int64_t max_methods) : max_methods_(max_methods) {}
+
+  // Returns the names of the method, resolving them on a miss. The
+  // returned reference remains valid until the next call to EndProfile()
+  // or Clear().
+  const Method &Lookup(jvmtiEnv *jvmti, jmethodID method_id);
+
+  // Whether the method is in the cache.
+  bool Contains(jmethodID method_id) const {
+    return methods_.count(method_id) != 0;
+  }
+
+  // Adds the names of a method resolved by Resolve(), and returns them as
+  // Lookup() does.
+  const Method &Add(jmethodID method_id, Method method);
+
+  // Resolves the names of a method through the JVMTI, without the cache.
+  // Unlike the other methods, it can be called from any thread.
+  static void Resolve(jvmtiEnv *jvmti, jmethodID method_id, Method *method);
+
+  // Marks the end of a profile, evicting the methods which failed to
+  // resolve, and the methods it did not use if the cache holds too many.
+  void EndProfile();
+
+  // Evicts all the methods.
+  void Clear() { methods_.clear(); }
+
+  // Marks the methods of a class as stale, when it is redefined or
+  // retransformed. name is in the internal form, as in "java/lang/String".
+  // Can be called from any thread.
+  static void ClassRedefined(const char *name);
+
+  // Evicts the methods of the classes redefined since the last call, and of
+  // those redefined just before it, and returns whether any was.
+  bool EvictRedefined();
+
+  int64_t Size() const { return methods_.size(); }
+
+ private:
+  struct Entry {
+    Method method;
+    // Whether the method has been looked up since the last EndProfile().
+    bool used;
+  };
+
+  const int64_t max_methods_;
+  std::unordered_map<jmethodID, Entry> methods_;
+
+  // Returns the epoch slot of a class, named with either '.' or '/' as the
+  // package separator.
+  static int EpochSlot(const string &class_name);
+
+  static const int kNumEpochSlots = 4096;
+  static std::atomic<uint32_t> epochs_[kNumEpochSlots];
+  // Number of redefinitions, and the number seen by EvictRedefined().
+  static std::atomic<uint32_t> redefinitions_;
+  uint32_t seen_redefinitions_ = 0;
+  // Epochs of the slots as of the last EvictRedefined(), allocated on its
+  // first pass, and the slots whose epoch it found changed.
+  std::vector<uint32_t> seen_epochs_;
+  std::vector<int> settling_slots_;
+
+  DISALLOW_COPY_AND_ASSIGN(MethodCache);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
@@ -0,0 +1,240 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/native_symbolizer.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace cloud {
+namespace profiler {
+
+NativeSymbolizer::ObjectFile::ObjectFile(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image != MAP_FAILED) {
+      Index(static_cast<const char *>(image), st.st_size);
+      munmap(image, st.st_size);
+    }
+  }
+  close(fd);
+  if (symbols_.empty()) {
+    LOG(INFO) << "No symbols found in " << path;
+  }
+}
+
+void NativeSymbolizer::ObjectFile::Index(const char *image, size_t size) {
+  if (size < sizeof(Elf64_Ehdr) || memcmp(image, ELFMAG, SELFMAG) != 0 ||
+      image[EI_CLASS] != ELFCLASS64) {
+    return;
+  }
+  const Elf64_Ehdr *header = reinterpret_cast<const Elf64_Ehdr *>(image);
+
+  if (header->e_phentsize == sizeof(Elf64_Phdr) &&
+      header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr) <= size) {
+    const Elf64_Phdr *phdrs =
+        reinterpret_cast<const Elf64_Phdr *>(image + header->e_phoff);
+    for (int i = 0; i < header->e_phnum; i++) {
+      if (phdrs[i].p_type == PT_LOAD) {
+        segments_.push_back(
+            {phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+      }
+    }
+  }
+
+  if (header->e_shentsize != sizeof(Elf64_Shdr) ||
+      header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > size) {
+    return;
+  }
+  const Elf64_Shdr *shdrs =
+      reinterpret_cast<const Elf64_Shdr *>(image + header->e_shoff);
+  // Prefer the full symbol table, only stripped files are left with the
+  // dynamic one.
+  const Elf64_Shdr *symtab = nullptr;
+  for (int i = 0; i < header->e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB ||
+        (shdrs[i].sh_type == SHT_DYNSYM && symtab == nullptr)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (symtab == nullptr || symtab->sh_link >= header->e_shnum ||
+      symtab->sh_offset + symtab->sh_size > size) {
+    return;
+  }
+  const Elf64_Shdr *strtab = &shdrs[symtab->sh_link];
+  if (strtab->sh_offset + strtab->sh_size > size) {
+    return;
+  }
+  const char *strings = image + strtab->sh_offset;
+
+  const Elf64_Sym *syms =
+      reinterpret_cast<const Elf64_Sym *>(image + symtab->sh_offset);
+  size_t num_syms = symtab->sh_size / sizeof(Elf64_Sym);
+  for (size_t i = 0; i < num_syms; i++) {
+    const Elf64_Sym &sym = syms[i];
+    if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC ||
+        sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+        sym.st_name >= strtab->sh_size) {
+      continue;
+    }
+    const char *name = strings + sym.st_name;
+    size_t name_len = strnlen(name, strtab->sh_size - sym.st_name);
+    if (name_len == 0) {
+      continue;
+    }
+    symbols_.push_back({sym.st_value, sym.st_size,
+                        static_cast<uint32_t>(names_.size())});
+    names_.insert(names_.end(), name, name + name_len);
+    names_.push_back('\0');
+  }
+
+  // Aliases share an address, keep a single one of them.
+  std::sort(symbols_.begin(), symbols_.end(),
+            [](const Symbol &a, const Symbol &b) { return a.start < b.start; });
+  symbols_.erase(std::unique(symbols_.begin(), symbols_.end(),
+                             [](const Symbol &a, const Symbol &b) {
+                               return a.start == b.start;
+                             }),
+                 symbols_.end());
+  symbols_.shrink_to_fit();
+  names_.shrink_to_fit();
+}
+
+const char *NativeSymbolizer::ObjectFile::Lookup(uint64_t address) const {
+  auto it = std::upper_bound(
+      symbols_.begin(), symbols_.end(), address,
+      [](uint64_t address, const Symbol &s) { return address < s.start; });
+  if (it == symbols_.begin()) {
+    return nullptr;
+  }
+  --it;
+  // Symbols without a size extend up to the next one.
+  if (it->size != 0 && address >= it->start + it->size) {
+    return nullptr;
+  }
+  return &names_[it->name];
+}
+
+bool NativeSymbolizer::ObjectFile::SegmentBias(uint64_t offset,
+                                               int64_t *bias) const {
+  for (const Segment &segment : segments_) {
+    if (offset >= segment.offset &&
+        offset < segment.offset + segment.file_size) {
+      *bias = segment.address - segment.offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+void NativeSymbolizer::Update(
+    const google::javaprofiler::NativeProcessInfo &native_info) {
+  std::map<uint64_t, Mapping> mappings;
+  // Files indexed so far, shared by all their mappings.
+  std::map<string, std::shared_ptr<const ObjectFile>> objects;
+  for (const auto &it : mappings_) {
+    objects[it.second.name] = it.second.object;
+  }
+
+  for (const auto &mapping : native_info.Mappings()) {
+    if (mapping.name.empty() || mapping.name[0] != '/') {
+      // Not a file, such as [vdso].
+      continue;
+    }
+    auto old = mappings_.find(mapping.start);
+    if (old != mappings_.end() && old->second.limit == mapping.limit &&
+        old->second.offset == mapping.offset &&
+        old->second.name == mapping.name) {
+      mappings.insert(*old);
+      continue;
+    }
+
+    std::shared_ptr<const ObjectFile> &object = objects[mapping.name];
+    if (!object) {
+      object = std::make_shared<ObjectFile>(mapping.name);
+    }
+    int64_t segment_bias;
+    if (!object->SegmentBias(mapping.offset, &segment_bias)) {
+      continue;
+    }
+    int64_t bias = mapping.start - mapping.offset - segment_bias;
+    mappings[mapping.start] =
+        Mapping{mapping.limit, mapping.offset, bias, mapping.name, object};
+  }
+
+  // Releases the files which are no longer mapped.
+  mappings_.swap(mappings);
+}
+
+bool NativeSymbolizer::Symbolize(uint64_t address, string *function_name,
+                                 string *file_name) const {
+  auto it = mappings_.upper_bound(address);
+  if (it == mappings_.begin()) {
+    return false;
+  }
+  --it;
+  const Mapping &mapping = it->second;
+  if (address >= mapping.limit) {
+    return false;
+  }
+  const char *name = mapping.object->Lookup(address - mapping.bias);
+  if (name == nullptr) {
+    return false;
+  }
+
+  int status;
+  char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (status == 0 && demangled != nullptr) {
+    *function_name = demangled;
+  } else {
+    *function_name = name;
+  }
+  free(demangled);
+  *file_name = mapping.name;
+  return true;
+}
+
+perftools::profiles::Location *NativeFrameCache::GetLocation(
+    const JVMPI_CallFrame &jvm_frame,
+    google::javaprofiler::LocationBuilder *location_builder) {
+  string function_name, file_name;
+  if (!symbolizer_->Symbolize(reinterpret_cast<uint64_t>(jvm_frame.method_id),
+                              &function_name, &file_name)) {
+    function_name = "[Unknown native]";
+  }
+  return location_builder->LocationFor("", function_name, file_name, 0);
+}
+
+string NativeFrameCache::GetFunctionName(const JVMPI_CallFrame &jvm_frame) {
+  string function_name, file_name;
+  symbolizer_->Symbolize(reinterpret_cast<uint64_t>(jvm_frame.method_id),
+                         &function_name, &file_name);
+  return function_name;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLIZER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLIZER_H_
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "src/globals.h"
+#include "third_party/javaprofiler/native.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+
+namespace cloud {
+namespace profiler {
+
+// NativeSymbolizer resolves the addresses of native frames to the function
+// symbols of the ELF files mapped in the process, from their .symtab or,
+// for stripped files, .dynsym sections.
+//
+// Each file is read once, its function symbols kept in an array sorted by
+// address, and shared by all its mappings. Update() only reads the files of
+// new mappings, so the index is meant to be kept across profiles. It is not
+// thread safe.
+class NativeSymbolizer {
+ public:
+  NativeSymbolizer() {}
+
+  // Indexes the files of the mappings not seen by the previous call, and
+  // forgets the ones which are no longer mapped.
+  void Update(const google::javaprofiler::NativeProcessInfo &native_info);
+
+  // Returns the demangled name of the function holding address and sets
+  // file_name to the file it comes from, or returns false if the address is
+  // not covered by a known symbol.
+  bool Symbolize(uint64_t address, string *function_name,
+                 string *file_name) const;
+
+ private:
+  // Function symbols of an ELF file.
+  class ObjectFile {
+   public:
+    // Reads the symbols of the file at path. Leaves the index empty if the
+    // file cannot be read or parsed.
+    explicit ObjectFile(const string &path);
+
+    // Returns the name of the symbol covering the link-time address, or
+    // nullptr.
+    const char *Lookup(uint64_t address) const;
+
+    // Returns the difference between the link-time addresses and the file
+    // offsets of the loadable segment holding offset, or false if there is
+    // none.
+    bool SegmentBias(uint64_t offset, int64_t *bias) const;
+
+   private:
+    struct Symbol {
+      uint64_t start;
+      uint64_t size;
+      // Offset of the name in names_.
+      uint32_t name;
+    };
+
+    struct Segment {
+      uint64_t offset;
+      uint64_t file_size;
+      uint64_t address;
+    };
+
+    // Reads the symbols of the ELF image of the given size.
+    void Index(const char *image, size_t size);
+
+    std::vector<Symbol> symbols_;
+    std::vector<Segment> segments_;
+    // Concatenated zero-terminated names of the symbols.
+    std::vector<char> names_;
+
+    DISALLOW_COPY_AND_ASSIGN(ObjectFile);
+  };
+
+  struct Mapping {
+    uint64_t limit;
+    uint64_t offset;
+    // Subtracted from addresses to get the link-time address in the file.
+    int64_t bias;
+    string name;
+    std::shared_ptr<const ObjectFile> object;
+  };
+
+  // Keyed on the start address of the mappings.
+  std::map<uint64_t, Mapping> mappings_;
+
+  DISALLOW_COPY_AND_ASSIGN(NativeSymbolizer);
+};
+
+// Frame cache resolving native frames through a NativeSymbolizer, for the
+// builders in profile_proto_builder.h.
+class NativeFrameCache : public google::javaprofiler::ProfileFrameCache {
+ public:
+  explicit NativeFrameCache(const NativeSymbolizer *symbolizer)
+      : symbolizer_(symbolizer) {}
+
+  void ProcessTraces(const google::javaprofiler::ProfileStackTrace *traces,
+                     int num_traces) override {}
+
+  perftools::profiles::Location *GetLocation(
+      const JVMPI_CallFrame &jvm_frame,
+      google::javaprofiler::LocationBuilder *location_builder) override;
+
+  string GetFunctionName(const JVMPI_CallFrame &jvm_frame) override;
+
+ private:
+  const NativeSymbolizer *symbolizer_;
+
+  DISALLOW_COPY_AND_ASSIGN(NativeFrameCache);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLIZER_H_
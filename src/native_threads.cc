@@ -0,0 +1,432 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/native_threads.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "src/thread_labels.h"
+
+DEFINE_bool(cprof_profile_native_threads, false,
+            "when true, also sample the threads of the JVM which are not "
+            "Java threads, such as the garbage collection and JIT compiler "
+            "threads, in the CPU and wall profiles");
+DEFINE_int32(cprof_native_threads_scan_interval_msec, 1000,
+             "interval between two scans for the native threads, in "
+             "milliseconds");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Attribute entry of a thread which exited, skipped by the lookups and
+// reused by the next threads. No thread has the ID 0.
+const uint64_t kDeletedAttribute = 1;
+
+// Returns the sorted IDs of the threads of the process, empty if they
+// cannot be listed.
+std::vector<pid_t> ListThreads() {
+  std::vector<pid_t> tids;
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return tids;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    pid_t tid = atoi(entry->d_name);
+    if (tid > 0) {
+      tids.push_back(tid);
+    }
+  }
+  closedir(dir);
+  std::sort(tids.begin(), tids.end());
+  return tids;
+}
+
+// Returns the name of a thread of the process, empty if it is gone.
+string ThreadName(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  char buf[64];
+  ssize_t size = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (size <= 0) {
+    return "";
+  }
+  string name(buf, size);
+  if (name.back() == '\n') {
+    name.pop_back();
+  }
+  return name;
+}
+
+// Returns the stack pointer of a thread of the process, 0 if unknown, as
+// when the thread is running. It is the next to last field of the syscall
+// file of a blocked thread, see proc(5).
+uintptr_t ThreadStackPointer(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/syscall", tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  char buf[256];
+  ssize_t size = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (size <= 0) {
+    return 0;
+  }
+  buf[size] = '\0';
+  std::vector<uintptr_t> fields;
+  char *end = buf;
+  while (true) {
+    char *start = end;
+    uintptr_t field = strtoull(start, &end, 0);
+    if (end == start) {
+      break;
+    }
+    fields.push_back(field);
+  }
+  // "running", or only the system call number.
+  if (fields.size() < 3) {
+    return 0;
+  }
+  return fields[fields.size() - 2];
+}
+
+// Returns the sorted address ranges of the mappings of the process.
+std::vector<std::pair<uintptr_t, uintptr_t>> ReadMappings() {
+  std::vector<std::pair<uintptr_t, uintptr_t>> mappings;
+  FILE *maps = fopen("/proc/self/maps", "re");
+  if (maps == nullptr) {
+    return mappings;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), maps) != nullptr) {
+    unsigned long start, end;  // NOLINT(runtime/int)
+    if (sscanf(line, "%lx-%lx", &start, &end) == 2) {
+      mappings.push_back({start, end});
+    }
+    // Skip the rest of the long lines.
+    while (strchr(line, '\n') == nullptr &&
+           fgets(line, sizeof(line), maps) != nullptr) {
+    }
+  }
+  fclose(maps);
+  std::sort(mappings.begin(), mappings.end());
+  return mappings;
+}
+
+}  // namespace
+
+std::atomic<uint64_t>
+    NativeThreads::attributes_[NativeThreads::kAttributeEntries];
+std::atomic<uintptr_t>
+    NativeThreads::stack_low_[NativeThreads::kAttributeEntries];
+std::atomic<uintptr_t>
+    NativeThreads::stack_high_[NativeThreads::kAttributeEntries];
+int NativeThreads::used_attributes_;
+int NativeThreads::deleted_attributes_;
+std::atomic<bool> NativeThreads::enabled_;
+std::mutex NativeThreads::mutex_;
+std::condition_variable NativeThreads::stop_cv_;
+bool NativeThreads::stopping_;
+
+void NativeThreads::Start(jvmtiEnv *jvmti, JNIEnv *jni,
+                          ThreadTable *threads) {
+  if (!FLAGS_cprof_profile_native_threads) {
+    return;
+  }
+  jclass cls = jni->FindClass("java/lang/Thread");
+  jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+  jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
+  if (thread == nullptr) {
+    LOG(ERROR) << "Failed to construct the native threads scanner thread";
+    return;
+  }
+  // Enabled first, the profiles started from now on expect native threads.
+  enabled_ = true;
+  jvmtiError err =
+      jvmti->RunAgentThread(thread, Run, threads, JVMTI_THREAD_MIN_PRIORITY);
+  if (err != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to start the native threads scanner thread";
+    enabled_ = false;
+  }
+}
+
+void NativeThreads::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = true;
+  stop_cv_.notify_all();
+}
+
+int NativeThreads::Attribute(pid_t tid) {
+  int index = AttributeIndex(tid);
+  for (int i = 0; i < kAttributeEntries; i++) {
+    uint64_t entry = attributes_[(index + i) % kAttributeEntries].load(
+        std::memory_order_acquire);
+    if (entry == 0) {
+      return 0;
+    }
+    if (static_cast<pid_t>(entry >> 32) == tid) {
+      return static_cast<int>(static_cast<uint32_t>(entry));
+    }
+  }
+  return 0;
+}
+
+bool NativeThreads::Stack(pid_t tid, uintptr_t *low, uintptr_t *high) {
+  int index = AttributeIndex(tid);
+  for (int i = 0; i < kAttributeEntries; i++) {
+    int slot = (index + i) % kAttributeEntries;
+    uint64_t entry = attributes_[slot].load(std::memory_order_acquire);
+    if (entry == 0) {
+      return false;
+    }
+    if (static_cast<pid_t>(entry >> 32) == tid) {
+      *high = stack_high_[slot].load(std::memory_order_acquire);
+      *low = stack_low_[slot].load(std::memory_order_relaxed);
+      // The bounds are those of tid unless the entry was reused meanwhile.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return *high != 0 &&
+             attributes_[slot].load(std::memory_order_relaxed) == entry;
+    }
+  }
+  return false;
+}
+
+int NativeThreads::AttributeIndex(pid_t tid) {
+  return (static_cast<uint32_t>(tid) * 2654435761u) % kAttributeEntries;
+}
+
+int NativeThreads::FindEntry(pid_t tid) {
+  int index = AttributeIndex(tid);
+  for (int i = 0; i < kAttributeEntries; i++) {
+    int slot = (index + i) % kAttributeEntries;
+    uint64_t current = attributes_[slot].load(std::memory_order_relaxed);
+    if (current == 0) {
+      return -1;
+    }
+    if (static_cast<pid_t>(current >> 32) == tid) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void NativeThreads::SetAttribute(pid_t tid, int attr) {
+  uint64_t value = static_cast<uint64_t>(static_cast<uint32_t>(tid)) << 32 |
+                   static_cast<uint32_t>(attr);
+  // The stack bounds of the previous thread of an entry are cleared before
+  // it is reused. The fence orders the deletion of the entry before, so
+  // that a handler reading the cleared bounds sees the entry changed.
+  auto reuse = [value](int slot) {
+    std::atomic_thread_fence(std::memory_order_release);
+    stack_high_[slot].store(0, std::memory_order_relaxed);
+    stack_low_[slot].store(0, std::memory_order_relaxed);
+    attributes_[slot].store(value, std::memory_order_release);
+  };
+  int index = AttributeIndex(tid);
+  for (int i = 0; i < kAttributeEntries; i++) {
+    int slot = (index + i) % kAttributeEntries;
+    uint64_t current = attributes_[slot].load(std::memory_order_relaxed);
+    if (current == kDeletedAttribute) {
+      deleted_attributes_--;
+      reuse(slot);
+      return;
+    }
+    if (current == 0) {
+      // Keep the table at most half full, so that the lookups are short.
+      if (2 * used_attributes_ >= kAttributeEntries &&
+          deleted_attributes_ > 0) {
+        RemoveDeleted();
+        SetAttribute(tid, attr);
+        return;
+      }
+      if (2 * used_attributes_ >= kAttributeEntries) {
+        static bool logged = false;
+        if (!logged) {
+          LOG(WARNING) << "Too many native threads, not labelling nor "
+                       << "unwinding the samples of the next ones";
+          logged = true;
+        }
+        return;
+      }
+      used_attributes_++;
+      reuse(slot);
+      return;
+    }
+  }
+}
+
+void NativeThreads::ClearAttribute(pid_t tid) {
+  int slot = FindEntry(tid);
+  if (slot < 0) {
+    return;
+  }
+  attributes_[slot].store(kDeletedAttribute, std::memory_order_release);
+  deleted_attributes_++;
+  // No probe sequence goes past a deleted entry followed by an empty one,
+  // so it can be emptied, and so on for the deleted ones before it. The
+  // table is never full, so this stops at a live or empty entry.
+  while (attributes_[slot].load(std::memory_order_relaxed) ==
+             kDeletedAttribute &&
+         attributes_[(slot + 1) % kAttributeEntries].load(
+             std::memory_order_relaxed) == 0) {
+    attributes_[slot].store(0, std::memory_order_release);
+    used_attributes_--;
+    deleted_attributes_--;
+    slot = (slot + kAttributeEntries - 1) % kAttributeEntries;
+  }
+}
+
+void NativeThreads::RemoveDeleted() {
+  struct Entry {
+    uint64_t value;
+    uintptr_t stack_low;
+    uintptr_t stack_high;
+  };
+  std::vector<Entry> entries;
+  for (int slot = 0; slot < kAttributeEntries; slot++) {
+    uint64_t value = attributes_[slot].load(std::memory_order_relaxed);
+    if (value != 0 && value != kDeletedAttribute) {
+      entries.push_back({value,
+                         stack_low_[slot].load(std::memory_order_relaxed),
+                         stack_high_[slot].load(std::memory_order_relaxed)});
+    }
+    attributes_[slot].store(0, std::memory_order_release);
+  }
+  used_attributes_ = 0;
+  deleted_attributes_ = 0;
+  for (const Entry &entry : entries) {
+    pid_t tid = static_cast<pid_t>(entry.value >> 32);
+    SetAttribute(tid, static_cast<int>(static_cast<uint32_t>(entry.value)));
+    if (entry.stack_high != 0) {
+      SetStack(tid, entry.stack_low, entry.stack_high);
+    }
+  }
+}
+
+void NativeThreads::SetStack(pid_t tid, uintptr_t low, uintptr_t high) {
+  int slot = FindEntry(tid);
+  if (slot >= 0) {
+    // Low first, so that a handler seeing high sees low too.
+    stack_low_[slot].store(low, std::memory_order_relaxed);
+    stack_high_[slot].store(high, std::memory_order_release);
+  }
+}
+
+void JNICALL NativeThreads::Run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  IMPLICITLY_USE(jvmti);
+  IMPLICITLY_USE(jni);
+  ThreadTable *threads = static_cast<ThreadTable *>(arg);
+  std::map<pid_t, NativeThread> natives;
+  std::chrono::milliseconds interval(
+      std::max(FLAGS_cprof_native_threads_scan_interval_msec, 1));
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    lock.unlock();
+    Scan(threads, &natives);
+    lock.lock();
+    stop_cv_.wait_for(lock, interval, []() { return stopping_; });
+  }
+}
+
+void NativeThreads::Scan(ThreadTable *threads,
+                         std::map<pid_t, NativeThread> *natives) {
+  std::vector<pid_t> tids = ListThreads();
+  if (tids.empty()) {
+    return;
+  }
+  // Registered threads, the native ones included. A native thread listed
+  // twice has registered as a Java thread since, as when it had only just
+  // started at the previous scan, or its ID was reused.
+  std::vector<pid_t> registered = threads->Threads();
+  std::sort(registered.begin(), registered.end());
+  auto num_registered = [&registered](pid_t tid) {
+    auto range = std::equal_range(registered.begin(), registered.end(), tid);
+    return range.second - range.first;
+  };
+
+  // The threads of the agent are not sampled, those which started as the
+  // previous scan ran were registered before they could tell.
+  for (auto it = natives->begin(); it != natives->end();) {
+    if (!std::binary_search(tids.begin(), tids.end(), it->first) ||
+        num_registered(it->first) > 1 ||
+        ScopedAgentThread::Contains(it->first)) {
+      threads->UnregisterOther(it->second.index);
+      ClearAttribute(it->first);
+      it = natives->erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (pid_t tid : tids) {
+    if (num_registered(tid) > 0 || ScopedAgentThread::Contains(tid)) {
+      continue;
+    }
+    string name = ThreadName(tid);
+    if (name.empty()) {
+      // Gone already.
+      continue;
+    }
+    int64_t index = threads->RegisterOther(tid);
+    if (index < 0) {
+      break;
+    }
+    (*natives)[tid] = NativeThread{index, false};
+    SetAttribute(tid, ThreadLabels::LabelAttribute(0, name.c_str()));
+  }
+
+  // The stack of a thread is the mapping holding its stack pointer.
+  std::vector<std::pair<uintptr_t, uintptr_t>> mappings;
+  for (auto &native : *natives) {
+    if (native.second.has_stack) {
+      continue;
+    }
+    uintptr_t sp = ThreadStackPointer(native.first);
+    if (sp == 0) {
+      continue;
+    }
+    if (mappings.empty()) {
+      mappings = ReadMappings();
+    }
+    auto it = std::upper_bound(
+        mappings.begin(), mappings.end(),
+        std::make_pair(sp, std::numeric_limits<uintptr_t>::max()));
+    if (it != mappings.begin() && sp < (it - 1)->second) {
+      SetStack(native.first, (it - 1)->first, (it - 1)->second);
+      native.second.has_stack = true;
+    }
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
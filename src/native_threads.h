@@ -0,0 +1,134 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_NATIVE_THREADS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_NATIVE_THREADS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <map>
+#include <mutex>  // NOLINT
+
+#include "src/globals.h"
+#include "src/threads.h"
+
+namespace cloud {
+namespace profiler {
+
+// NativeThreads finds the threads of the process which the JVMTI does not
+// report, such as the garbage collection workers, the JIT compiler threads
+// and the VM thread, and registers them in the thread table, so that the
+// CPU timers and the wall profiles cover them too. Their samples have no
+// Java frames, only their native stack.
+//
+// The threads are found by listing /proc/self/task periodically from an
+// agent thread, and diffing the list against the threads registered, leaving
+// out the threads the agent starts itself, see ScopedAgentThread. The
+// samples of each native thread are labelled with its name, as the Java
+// threads are by ThreadLabels, through a small table the signal handler
+// reads without locks.
+//
+// The same table holds the bounds of the stack of each native thread, for
+// the signal handler to walk it: the scanner finds the mapping holding the
+// stack pointer of the thread, which the kernel only reports while the
+// thread is blocked, so it retries on each scan until it gets it.
+class NativeThreads {
+ public:
+  // Starts the scanner thread registering the native threads into
+  // threads, when enabled by the flags. Must be called from a thread
+  // attached to the JVM, before the profiling starts.
+  static void Start(jvmtiEnv *jvmti, JNIEnv *jni, ThreadTable *threads);
+
+  // Tells the scanner thread to exit, it is not waited for.
+  static void Stop();
+
+  // Whether the native threads are tracked.
+  static bool Enabled() { return enabled_; }
+
+  // Returns the attribute labelling the samples of the native thread tid,
+  // 0 if none. Async signal safe.
+  static int Attribute(pid_t tid);
+
+  // Sets low and high to the bounds of the stack of the native thread tid,
+  // and returns whether they are known. Async signal safe.
+  static bool Stack(pid_t tid, uintptr_t *low, uintptr_t *high);
+
+ private:
+  // A native thread registered by the scanner.
+  struct NativeThread {
+    // Slot of the thread in the thread table.
+    int64_t index;
+    // Whether the bounds of its stack were found.
+    bool has_stack;
+  };
+
+  static void JNICALL Run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+  // Registers the native threads started since the previous scan, and
+  // unregisters those gone. natives holds the native threads registered.
+  static void Scan(ThreadTable *threads,
+                   std::map<pid_t, NativeThread> *natives);
+
+  // Adds or removes the entry of a native thread, with its attribute and
+  // no stack bounds, from the scanner.
+  static void SetAttribute(pid_t tid, int attr);
+  static void ClearAttribute(pid_t tid);
+
+  // Inserts the entries left again into an empty table, to get rid of the
+  // deleted ones. The handler meanwhile finds no label nor stack for the
+  // threads being moved. From the scanner.
+  static void RemoveDeleted();
+
+  // Sets the stack bounds of the entry of a native thread, from the
+  // scanner.
+  static void SetStack(pid_t tid, uintptr_t low, uintptr_t high);
+
+  // Returns the first entry of the probe sequence of tid.
+  static int AttributeIndex(pid_t tid);
+
+  // Returns the entry of tid, -1 if none. Only for the scanner thread.
+  static int FindEntry(pid_t tid);
+
+  // Entries of an open-addressed table of the native threads, holding the
+  // thread ID in the high 32 bits and the attribute in the low ones. Only
+  // written by the scanner thread.
+  static const int kAttributeEntries = 4096;
+  static std::atomic<uint64_t> attributes_[kAttributeEntries];
+  // Stack bounds of the thread of each entry, high being 0 while unknown.
+  // Cleared before an entry is reused, and read by the signal handler as
+  // a sequence lock whose sequence is the entry.
+  static std::atomic<uintptr_t> stack_low_[kAttributeEntries];
+  static std::atomic<uintptr_t> stack_high_[kAttributeEntries];
+  // Number of entries used, including the deleted ones, and number of
+  // those deleted.
+  static int used_attributes_;
+  static int deleted_attributes_;
+
+  static std::atomic<bool> enabled_;
+  static std::mutex mutex_;
+  static std::condition_variable stop_cv_;
+  static bool stopping_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(NativeThreads);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_NATIVE_THREADS_H_
@@ -0,0 +1,80 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/overhead_controller.h"
+
+#include <algorithm>
+
+#include "src/clock.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// The period grows up to this many times the configured one...
+const int64_t kMaxPeriodScale = 16;
+// ... and no further than this, as the timers take periods under a second.
+const int64_t kMaxPeriodNanos = 500 * kNanosPerMilli;
+
+// Bounds of the change of the period after a profile, so that a single
+// unusual profile does not swing it.
+const double kMinScale = 0.5;
+const double kMaxScale = 2.0;
+
+// The period is doubled when more than this fraction of the samples are
+// dropped, as the internal table cannot keep up.
+const double kMaxDroppedRatio = 0.01;
+
+}  // namespace
+
+OverheadController::OverheadController(const char *profile_type,
+                                       int64_t min_period_nanos, double budget)
+    : profile_type_(profile_type),
+      min_period_nanos_(min_period_nanos),
+      max_period_nanos_(std::max(
+          min_period_nanos,
+          std::min(min_period_nanos * kMaxPeriodScale, kMaxPeriodNanos))),
+      budget_(budget),
+      allowance_(1.0),
+      period_nanos_(min_period_nanos) {}
+
+void OverheadController::Update(int64_t duration_nanos, int64_t cost_nanos,
+                                int64_t num_samples, int64_t num_dropped) {
+  if (budget_ <= 0 || duration_nanos <= 0) {
+    return;
+  }
+
+  double overhead = static_cast<double>(cost_nanos) / duration_nanos;
+  double scale = overhead / (budget_ * allowance_);
+  if (num_samples > 0 && num_dropped > kMaxDroppedRatio * num_samples) {
+    scale = std::max(scale, kMaxScale);
+  }
+  scale = std::min(std::max(scale, kMinScale), kMaxScale);
+
+  int64_t period_nanos = std::min(
+      std::max(static_cast<int64_t>(period_nanos_ * scale), min_period_nanos_),
+      max_period_nanos_);
+  if (period_nanos != period_nanos_) {
+    LOG(INFO) << "Measured " << profile_type_ << " profiling overhead of "
+              << overhead * 100 << "%, " << num_dropped << " of "
+              << num_samples << " samples dropped, sampling period changed "
+              << "from " << period_nanos_ / 1000 << " to "
+              << period_nanos / 1000 << " usec";
+  }
+  period_nanos_ = period_nanos;
+}
+
+}  // namespace profiler
+}  // namespace cloud
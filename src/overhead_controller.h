@@ -0,0 +1,69 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_CONTROLLER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_CONTROLLER_H_
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// OverheadController tunes the sampling period of a profile type from
+// profile to profile, so that the measured cost of collecting the profiles
+// stays under a budget. The cost is the time spent handling the sampling
+// signals plus the CPU time of the profiling thread and of the helper
+// threads sending the signals, relative to the duration of the profile.
+//
+// The period is scaled by the ratio of the cost to the budget, by at most a
+// factor of two per profile, and is kept between the configured period and
+// a multiple of it. It is also lengthened when too many samples could not
+// be recorded.
+class OverheadController {
+ public:
+  // Starts with min_period_nanos, which is never gone below. A budget of 0
+  // disables the controller, the period then never changes.
+  OverheadController(const char *profile_type, int64_t min_period_nanos,
+                     double budget);
+
+  // Sampling period to use for the next profile.
+  int64_t PeriodNanos() const { return period_nanos_; }
+
+  // Scales the budget by the share of a CPU the process is allowed, as the
+  // budget is meant for a whole one.
+  void SetAllowance(double allowance) { allowance_ = allowance; }
+
+  // Updates the period from the cost of a profile collected with the
+  // current one: cost_nanos spent over duration_nanos, to take num_samples
+  // samples of which num_dropped could not be recorded.
+  void Update(int64_t duration_nanos, int64_t cost_nanos, int64_t num_samples,
+              int64_t num_dropped);
+
+ private:
+  const char *profile_type_;
+  const int64_t min_period_nanos_;
+  const int64_t max_period_nanos_;
+  const double budget_;
+  double allowance_;
+  int64_t period_nanos_;
+
+  DISALLOW_COPY_AND_ASSIGN(OverheadController);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_CONTROLLER_H_
@@ -0,0 +1,153 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/perf_events.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "src/throttler.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const PerfEvent kPerfEvents[] = {
+    {kTypeCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false,
+     10 * 1000 * 1000},
+    {kTypeInstructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false,
+     10 * 1000 * 1000},
+    // The generic cache misses are the last level ones on most CPUs.
+    {kTypeLLCMisses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false,
+     10 * 1000},
+    // Threads are switched out in the kernel, these cannot be sampled in
+    // user mode only.
+    {kTypeContextSwitches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+     true, 10},
+};
+
+// Set once the kernel refused to count the kernel mode events of a thread,
+// so that the next counters only ask for the user mode ones.
+std::atomic<bool> user_mode_only(false);
+
+int PerfEventOpen(const PerfEvent &event, pid_t tid, int64_t period,
+                  bool user_only) {
+  struct perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.sample_period = period;
+  attr.wakeup_events = 1;
+  // Enabled once the signal is set up.
+  attr.disabled = 1;
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, tid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+// Returns the perf_event_paranoid setting, or -2 if it cannot be read.
+int PerfEventParanoid() {
+  int paranoid = -2;
+  FILE *file = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+  if (file != nullptr) {
+    if (fscanf(file, "%d", &paranoid) != 1) {
+      paranoid = -2;
+    }
+    fclose(file);
+  }
+  return paranoid;
+}
+
+}  // namespace
+
+const PerfEvent *FindPerfEvent(const string &profile_type) {
+  for (const PerfEvent &event : kPerfEvents) {
+    if (profile_type == event.profile_type) {
+      return &event;
+    }
+  }
+  return nullptr;
+}
+
+int OpenPerfEvent(const PerfEvent &event, pid_t tid, int64_t period) {
+  bool user_only = !event.kernel_events && user_mode_only.load();
+  int fd = PerfEventOpen(event, tid, period, user_only);
+  if (fd < 0 && !user_only && !event.kernel_events &&
+      (errno == EACCES || errno == EPERM)) {
+    fd = PerfEventOpen(event, tid, period, true);
+    if (fd >= 0) {
+      user_mode_only.store(true);
+    }
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = tid;
+  if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGPROF) != 0 ||
+      fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+void ClosePerfEvent(int fd) {
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  close(fd);
+}
+
+void LogPerfEventError(const PerfEvent &event, int err) {
+  switch (err) {
+    case EACCES:
+    case EPERM:
+      LOG(WARNING) << "Not permitted to sample " << event.profile_type
+                   << " with perf_event_open, perf_event_paranoid is "
+                   << PerfEventParanoid() << " and the container may filter "
+                   << "the system call; skipping the profile";
+      break;
+    case ENOENT:
+    case ENODEV:
+    case EOPNOTSUPP:
+      LOG(WARNING) << "The " << event.profile_type << " event is not "
+                   << "supported on this machine, skipping the profile";
+      break;
+    case ENOSYS:
+      LOG(WARNING) << "perf_event_open is not available, skipping the "
+                   << event.profile_type << " profile";
+      break;
+    default:
+      LOG(WARNING) << "Failed to open a " << event.profile_type
+                   << " counter: " << strerror(err)
+                   << ", skipping the profile";
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
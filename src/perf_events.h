@@ -0,0 +1,62 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
+
+#include <sys/types.h>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// A hardware or software event sampled with perf_event_open, and the
+// profile type its samples are uploaded as.
+struct PerfEvent {
+  const char *profile_type;
+  // PERF_TYPE_* and PERF_COUNT_* of the event.
+  uint32_t type;
+  uint64_t config;
+  // Whether the events only occur in kernel mode. The others are sampled
+  // in user mode only when perf_event_paranoid does not allow more.
+  bool kernel_events;
+  // Number of events between samples when none is configured.
+  int64_t default_period;
+};
+
+// Returns the event sampled for a profile type, or nullptr if the type is
+// not one of the perf event ones.
+const PerfEvent *FindPerfEvent(const string &profile_type);
+
+// Opens a counter of the event on a thread of this process, which sends
+// SIGPROF to the thread each time it counts period more events, with
+// si_code set to POLL_IN. The thread does not need to be the current one.
+// Returns the file descriptor of the counter, or -1 with errno set if it
+// could not be opened, e.g. as perf_event_open is restricted.
+int OpenPerfEvent(const PerfEvent &event, pid_t tid, int64_t period);
+
+// Stops and closes a counter returned by OpenPerfEvent().
+void ClosePerfEvent(int fd);
+
+// Logs why a counter of the event could not be opened, given the errno of
+// OpenPerfEvent().
+void LogPerfEventError(const PerfEvent &event, int err);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
@@ -0,0 +1,190 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/profile_dictionary.h"
+
+#include <algorithm>
+
+#include "third_party/javaprofiler/stacktraces.h"
+
+namespace cloud {
+namespace profiler {
+
+void ProfileDictionary::StartProfile(ProfileWriter *writer) {
+  writer_ = writer;
+  std::fill(profile_strings_.begin(), profile_strings_.end(), 0);
+  std::fill(profile_functions_.begin(), profile_functions_.end(), 0);
+  std::fill(profile_locations_.begin(), profile_locations_.end(), 0);
+  // The empty string is always first.
+  writer_->AddString("");
+}
+
+void ProfileDictionary::EndProfile() {
+  writer_ = nullptr;
+  if (NumLocations() > max_locations_) {
+    LOG(INFO) << "Dropping the profile dictionary: " << NumLocations()
+              << " locations";
+    Clear();
+  }
+}
+
+void ProfileDictionary::Clear() {
+  strings_.clear();
+  string_index_.clear();
+  functions_.clear();
+  function_index_.clear();
+  locations_.clear();
+  line_index_.clear();
+  frame_index_.clear();
+  attribute_strings_.clear();
+  profile_strings_.clear();
+  profile_functions_.clear();
+  profile_locations_.clear();
+  InternString("");
+}
+
+int64_t ProfileDictionary::StringId(const string &str) {
+  return ProfileString(InternString(str));
+}
+
+int64_t ProfileDictionary::AttributeStringId(int id) {
+  if (id <= 0) {
+    return 0;
+  }
+  if (static_cast<size_t>(id) >= attribute_strings_.size()) {
+    attribute_strings_.resize(
+        google::javaprofiler::AttributeTable::NumStrings(), -1);
+    if (static_cast<size_t>(id) >= attribute_strings_.size()) {
+      return 0;
+    }
+  }
+  if (attribute_strings_[id] < 0) {
+    const string *str = google::javaprofiler::AttributeTable::GetString(id);
+    if (str == nullptr) {
+      return 0;
+    }
+    attribute_strings_[id] = InternString(*str);
+  }
+  return ProfileString(attribute_strings_[id]);
+}
+
+uint64_t ProfileDictionary::FunctionId(const string &name,
+                                       const string &system_name,
+                                       const string &file_name) {
+  return ProfileFunction(InternFunction(name, system_name, file_name));
+}
+
+uint64_t ProfileDictionary::LocationId(const string &name,
+                                       const string &system_name,
+                                       const string &file_name,
+                                       int64_t line_number) {
+  return ProfileLocation(InternLocation(
+      InternFunction(name, system_name, file_name), line_number));
+}
+
+uint64_t ProfileDictionary::FrameLocationId(jmethodID method_id, int bci) {
+  auto it =
+      frame_index_.find(LineKey(reinterpret_cast<uint64_t>(method_id), bci));
+  if (it == frame_index_.end()) {
+    return 0;
+  }
+  return ProfileLocation(it->second);
+}
+
+uint64_t ProfileDictionary::AddFrameLocation(jmethodID method_id, int bci,
+                                             const string &name,
+                                             const string &system_name,
+                                             const string &file_name,
+                                             int64_t line_number) {
+  uint64_t location = InternLocation(
+      InternFunction(name, system_name, file_name), line_number);
+  frame_index_[LineKey(reinterpret_cast<uint64_t>(method_id), bci)] =
+      location;
+  return ProfileLocation(location);
+}
+
+int64_t ProfileDictionary::InternString(const string &str) {
+  auto inserted = string_index_.insert(std::make_pair(str, strings_.size()));
+  if (inserted.second) {
+    strings_.push_back(str);
+    profile_strings_.push_back(0);
+  }
+  return inserted.first->second;
+}
+
+uint64_t ProfileDictionary::InternFunction(const string &name,
+                                           const string &system_name,
+                                           const string &file_name) {
+  Function function = {InternString(name), InternString(system_name),
+                       InternString(file_name)};
+  auto inserted = function_index_.insert(std::make_pair(
+      FunctionKey(function.name, function.system_name, function.file_name),
+      functions_.size()));
+  if (inserted.second) {
+    functions_.push_back(function);
+    profile_functions_.push_back(0);
+  }
+  return inserted.first->second;
+}
+
+uint64_t ProfileDictionary::InternLocation(uint64_t function,
+                                           int64_t line_number) {
+  auto inserted = line_index_.insert(
+      std::make_pair(LineKey(function, line_number), locations_.size()));
+  if (inserted.second) {
+    locations_.push_back({function, line_number});
+    profile_locations_.push_back(0);
+  }
+  return inserted.first->second;
+}
+
+int64_t ProfileDictionary::ProfileString(int64_t index) {
+  if (index == 0) {
+    return 0;
+  }
+  int64_t &id = profile_strings_[index];
+  if (id == 0) {
+    id = writer_->AddString(strings_[index]);
+  }
+  return id;
+}
+
+uint64_t ProfileDictionary::ProfileFunction(uint64_t function) {
+  uint64_t &id = profile_functions_[function];
+  if (id == 0) {
+    const Function &f = functions_[function];
+    perftools::profiles::Function func;
+    func.set_name(ProfileString(f.name));
+    func.set_system_name(ProfileString(f.system_name));
+    func.set_filename(ProfileString(f.file_name));
+    id = writer_->AddFunction(&func);
+  }
+  return id;
+}
+
+uint64_t ProfileDictionary::ProfileLocation(uint64_t location) {
+  uint64_t &id = profile_locations_[location];
+  if (id == 0) {
+    const Location &l = locations_[location];
+    perftools::profiles::Location loc;
+    perftools::profiles::Line *line = loc.add_line();
+    line->set_function_id(ProfileFunction(l.function));
+    line->set_line(l.line_number);
+    id = writer_->AddLocation(&loc);
+  }
+  return id;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_PROFILE_DICTIONARY_H_
+#define CLOUD_PROFILER_AGENT_JAVA_PROFILE_DICTIONARY_H_
+
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "src/globals.h"
+#include "src/profile_writer.h"
+
+namespace cloud {
+namespace profiler {
+
+// ProfileDictionary keeps the strings, functions and locations of the CPU
+// profiles across collections, so that the frames seen in earlier profiles
+// are neither resolved nor interned again.
+//
+// Each profile still is a self-contained profile.proto: the dictionary
+// entries get an id in a profile the first time the profile references
+// them, and are only then written to it. It is bounded: once it holds more
+// than max_locations locations, the whole dictionary is dropped at the end
+// of a profile. It is not thread safe, and is meant to be used by the
+// profiling thread only.
+//
+// The Java frames are keyed on their jmethodID and bci, which the JVM does
+// not reuse, as for MethodCache.
+class ProfileDictionary {
+ public:
+  explicit ProfileDictionary(int64_t max_locations)
+      : max_locations_(max_locations), writer_(nullptr) {
+    Clear();
+  }
+
+  // Starts writing a new profile. The ids returned until EndProfile() are
+  // the ones of the entries in the profile written by writer.
+  void StartProfile(ProfileWriter *writer);
+
+  // Marks the end of the profile, dropping the dictionary if it holds too
+  // many locations.
+  void EndProfile();
+
+  // Returns the index of str in the string table of the profile.
+  int64_t StringId(const string &str);
+
+  // Returns the index of the string registered in the AttributeTable as
+  // id, 0 if there is none.
+  int64_t AttributeStringId(int id);
+
+  // Returns the id of a function with these names.
+  uint64_t FunctionId(const string &name, const string &system_name,
+                      const string &file_name);
+
+  // Returns the id of the location of a line of a function with these
+  // names.
+  uint64_t LocationId(const string &name, const string &system_name,
+                      const string &file_name, int64_t line_number);
+
+  // Returns the id of the location of the Java frame at bci in method_id,
+  // or 0 if the frame has not been added yet.
+  uint64_t FrameLocationId(jmethodID method_id, int bci);
+
+  // Whether the Java frame at bci in method_id has been added, without
+  // referencing it from the profile.
+  bool HasFrameLocation(jmethodID method_id, int bci) const {
+    return frame_index_.count(
+               LineKey(reinterpret_cast<uint64_t>(method_id), bci)) != 0;
+  }
+
+  // Adds the Java frame at bci in method_id, at the location of a line of
+  // a function with these names, and returns its id.
+  uint64_t AddFrameLocation(jmethodID method_id, int bci, const string &name,
+                            const string &system_name,
+                            const string &file_name, int64_t line_number);
+
+  int64_t NumLocations() const { return locations_.size(); }
+
+  // Forgets the locations of the Java frames of the methods for which
+  // drop(method_id) is true, so that they are added again with their
+  // current names and lines. Must be called between profiles.
+  template <typename Predicate>
+  void DropFrameLocations(Predicate drop) {
+    for (auto it = frame_index_.begin(); it != frame_index_.end();) {
+      if (drop(reinterpret_cast<jmethodID>(std::get<0>(it->first)))) {
+        it = frame_index_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+ private:
+  // Entries of the dictionary, which reference each other by their index
+  // in the dictionary.
+  struct Function {
+    int64_t name;
+    int64_t system_name;
+    int64_t file_name;
+  };
+  struct Location {
+    uint64_t function;
+    int64_t line_number;
+  };
+
+  typedef std::tuple<int64_t, int64_t, int64_t> FunctionKey;
+  class FunctionHasher {
+   public:
+    size_t operator()(const FunctionKey &f) const {
+      int64_t hash = std::get<0>(f);
+      hash = hash + ((hash << 8) ^ std::get<1>(f));
+      hash = hash + ((hash << 8) ^ std::get<2>(f));
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  typedef std::tuple<uint64_t, int64_t> LineKey;
+  class LineHasher {
+   public:
+    size_t operator()(const LineKey &l) const {
+      uint64_t hash = std::get<0>(l);
+      hash = hash + ((hash << 8) ^ std::get<1>(l));
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  // Drops all the entries.
+  void Clear();
+
+  // Return the index of an entry in the dictionary, adding it if needed.
+  int64_t InternString(const string &str);
+  uint64_t InternFunction(const string &name, const string &system_name,
+                          const string &file_name);
+  uint64_t InternLocation(uint64_t function, int64_t line_number);
+
+  // Return the id in the profile of an entry of the dictionary, writing it
+  // to the profile if needed.
+  int64_t ProfileString(int64_t index);
+  uint64_t ProfileFunction(uint64_t function);
+  uint64_t ProfileLocation(uint64_t location);
+
+  const int64_t max_locations_;
+
+  std::vector<string> strings_;
+  std::unordered_map<string, int64_t> string_index_;
+  std::vector<Function> functions_;
+  std::unordered_map<FunctionKey, uint64_t, FunctionHasher> function_index_;
+  std::vector<Location> locations_;
+  // Keyed on (function, line number).
+  std::unordered_map<LineKey, uint64_t, LineHasher> line_index_;
+  // Keyed on (method ID, bci).
+  std::unordered_map<LineKey, uint64_t, LineHasher> frame_index_;
+  // Strings of the AttributeTable, indexed by their id there, -1 for the
+  // ones not looked up yet.
+  std::vector<int64_t> attribute_strings_;
+
+  // Profile being written, and the ids in it of the entries of the
+  // dictionary, 0 for the ones it does not reference yet.
+  ProfileWriter *writer_;
+  std::vector<int64_t> profile_strings_;
+  std::vector<uint64_t> profile_functions_;
+  std::vector<uint64_t> profile_locations_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfileDictionary);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_PROFILE_DICTIONARY_H_
@@ -0,0 +1,189 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Merges profile.proto files, for instance the profiles of a fleet saved by
+// the agents, into a single profile, or into the difference with the merge
+// of base profiles:
+//
+//   profile_merge --output=merged.pb.gz [--base=@base.txt] file... @list...
+//
+// An argument starting with '@' names a file listing one profile path per
+// line. A path starting with 'spool:' names a profile spool written by the
+// agent, whose profiles of type --spool_type are merged, oldest first. Pass
+// --logtostderr to get the log on the standard error.
+
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "src/profile_merger.h"
+#include "src/string.h"
+#include "src/uploader_spool.h"
+
+DEFINE_string(output, "", "path of the merged profile");
+DEFINE_string(base, "",
+              "comma-separated list of the profiles to subtract from the "
+              "merged ones, for a differential profile");
+DEFINE_bool(normalize, false,
+            "scale the base by the ratio of the number of profiles to the "
+            "number of base profiles");
+DEFINE_bool(keep_labels, false,
+            "keep the samples with different string labels apart");
+DEFINE_int64(max_stacks, 1 << 20,
+             "maximum # of distinct stacks kept, the samples of the others "
+             "are merged into an [other] stack");
+DEFINE_int32(threads, 0,
+             "# of threads reading and parsing the profiles; 0 for one per "
+             "CPU");
+DEFINE_string(spool_type, "cpu",
+              "type of the profiles merged from the spool: inputs");
+
+namespace {
+
+const char kSpoolPrefix[] = "spool:";
+
+struct Input {
+  string path;
+  bool base;
+  // Whether path is a profile spool rather than a profile.
+  bool spool;
+};
+
+bool ReadFile(const string &path, string *data) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  *data = contents.str();
+  return !in.bad();
+}
+
+void AddInput(const string &path, bool base, std::vector<Input> *inputs) {
+  size_t prefix_size = sizeof(kSpoolPrefix) - 1;
+  if (path.compare(0, prefix_size, kSpoolPrefix) == 0) {
+    inputs->push_back({path.substr(prefix_size), base, true});
+  } else {
+    inputs->push_back({path, base, false});
+  }
+}
+
+// Appends the profile path in arg, or the paths listed in the file named
+// after a leading '@'.
+bool AddInputs(const string &arg, bool base, std::vector<Input> *inputs) {
+  if (arg.empty() || arg[0] != '@') {
+    AddInput(arg, base, inputs);
+    return true;
+  }
+  std::ifstream list(arg.substr(1));
+  if (!list) {
+    LOG(ERROR) << "Failed to read the list of profiles " << arg.substr(1);
+    return false;
+  }
+  string path;
+  while (std::getline(list, path)) {
+    if (!path.empty()) {
+      AddInput(path, base, inputs);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_output.empty()) {
+    LOG(ERROR) << "--output is required";
+    return 2;
+  }
+
+  std::vector<Input> inputs;
+  for (int i = 1; i < argc; i++) {
+    if (!AddInputs(argv[i], false, &inputs)) {
+      return 1;
+    }
+  }
+  for (const string &arg : cloud::profiler::Split(FLAGS_base, ',')) {
+    if (!AddInputs(arg, true, &inputs)) {
+      return 1;
+    }
+  }
+  if (inputs.empty()) {
+    LOG(ERROR) << "No profiles to merge";
+    return 2;
+  }
+
+  cloud::profiler::ProfileMerger merger(FLAGS_max_stacks, FLAGS_keep_labels);
+  std::atomic<size_t> next(0);
+  std::atomic<int64_t> failed(0);
+  auto merge = [&] {
+    string data;
+    for (size_t i = next++; i < inputs.size(); i = next++) {
+      if (inputs[i].spool) {
+        bool base = inputs[i].base;
+        const string &path = inputs[i].path;
+        auto visit = [&](const string &profile_type, int64_t time_nanos,
+                         const string &profile) {
+          if (profile_type == FLAGS_spool_type &&
+              !merger.Add(profile, base)) {
+            LOG(ERROR) << "Failed to merge a profile of " << path;
+            failed++;
+          }
+        };
+        if (!cloud::profiler::SpoolUploader::Read(path, visit)) {
+          LOG(ERROR) << "Failed to read the profile spool " << path;
+          failed++;
+        }
+      } else if (!ReadFile(inputs[i].path, &data)) {
+        LOG(ERROR) << "Failed to read " << inputs[i].path;
+        failed++;
+      } else if (!merger.Add(data, inputs[i].base)) {
+        LOG(ERROR) << "Failed to merge " << inputs[i].path;
+        failed++;
+      }
+    }
+  };
+  int num_threads = FLAGS_threads > 0 ? FLAGS_threads
+                                      : std::thread::hardware_concurrency();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.emplace_back(merge);
+  }
+  merge();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  string output;
+  if (!merger.Emit(FLAGS_normalize, &output)) {
+    LOG(ERROR) << "Failed to encode the merged profile";
+    return 1;
+  }
+  std::ofstream out(FLAGS_output, std::ios::binary);
+  out.write(output.data(), output.size());
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Failed to write " << FLAGS_output;
+    return 1;
+  }
+  LOG(INFO) << "Merged " << merger.NumProfiles() << " profiles and "
+            << merger.NumBaseProfiles() << " base profiles into "
+            << FLAGS_output << ", " << failed << " skipped";
+  return 0;
+}
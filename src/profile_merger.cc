@@ -0,0 +1,277 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/profile_merger.h"
+
+#include <cmath>
+#include <cstdio>
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "perftools/profiles/proto/builder.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char kOtherFrame[] = "[other]";
+
+bool IsGzip(const string &data) {
+  return data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+         static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+bool Parse(const string &data, perftools::profiles::Profile *profile) {
+  if (!IsGzip(data)) {
+    return profile->ParseFromString(data);
+  }
+  google::protobuf::io::ArrayInputStream stream(data.data(), data.size());
+  google::protobuf::io::GzipInputStream gzip(
+      &stream, google::protobuf::io::GzipInputStream::GZIP);
+  return profile->ParseFromZeroCopyStream(&gzip);
+}
+
+string ValueTypeString(const perftools::profiles::Profile &profile,
+                       const perftools::profiles::ValueType &value_type) {
+  return profile.string_table(value_type.type()) + "/" +
+         profile.string_table(value_type.unit());
+}
+
+// Returns the string at index in the string table of the profile, or the
+// empty string if the index is not valid.
+const string &ProfileString(const perftools::profiles::Profile &profile,
+                            int64_t index) {
+  static const string *empty = new string();
+  if (index < 0 || index >= profile.string_table_size()) {
+    return *empty;
+  }
+  return profile.string_table(index);
+}
+
+}  // namespace
+
+size_t ProfileMerger::KeyHash::operator()(
+    const std::vector<uint32_t> &key) const {
+  uint64_t h = 14695981039346656037ULL;
+  for (uint32_t id : key) {
+    h = (h ^ id) * 1099511628211ULL;
+  }
+  return static_cast<size_t>(h);
+}
+
+ProfileMerger::ProfileMerger(int64_t max_stacks, bool keep_labels)
+    : max_stacks_(max_stacks),
+      keep_labels_(keep_labels),
+      period_(0),
+      duration_nanos_(0),
+      num_profiles_{0, 0} {}
+
+uint32_t ProfileMerger::FrameId(const string &function, const string &file,
+                                int64_t line) {
+  string key = function;
+  key.push_back('\0');
+  key += file;
+  key.push_back('\0');
+  key += std::to_string(line);
+  auto inserted = frame_ids_.emplace(key, frames_.size());
+  if (inserted.second) {
+    frames_.push_back({function, file, line});
+  }
+  return inserted.first->second;
+}
+
+uint32_t ProfileMerger::StringId(const string &str) {
+  auto inserted = string_ids_.emplace(str, strings_.size());
+  if (inserted.second) {
+    strings_.push_back(str);
+  }
+  return inserted.first->second;
+}
+
+bool ProfileMerger::Add(const string &data, bool base) {
+  perftools::profiles::Profile profile;
+  if (!Parse(data, &profile)) {
+    LOG(ERROR) << "Failed to parse the profile";
+    return false;
+  }
+  std::vector<string> sample_types;
+  for (const auto &sample_type : profile.sample_type()) {
+    sample_types.push_back(ValueTypeString(profile, sample_type));
+  }
+
+  // Indexes of the functions and locations of the profile by their ids.
+  std::unordered_map<uint64_t, const perftools::profiles::Function *>
+      functions;
+  for (const auto &function : profile.function()) {
+    functions[function.id()] = &function;
+  }
+  std::unordered_map<uint64_t, const perftools::profiles::Mapping *> mappings;
+  for (const auto &mapping : profile.mapping()) {
+    mappings[mapping.id()] = &mapping;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (num_profiles_[0] + num_profiles_[1] == 0) {
+    sample_types_ = sample_types;
+    period_type_ = ValueTypeString(profile, profile.period_type());
+    period_ = profile.period();
+  } else if (sample_types != sample_types_) {
+    LOG(ERROR) << "Skipping a profile of different sample types";
+    return false;
+  }
+  num_profiles_[base ? 1 : 0]++;
+  if (!base) {
+    duration_nanos_ += profile.duration_nanos();
+  }
+
+  // Frames of each location, leaf first.
+  std::unordered_map<uint64_t, std::vector<uint32_t>> locations;
+  for (const auto &location : profile.location()) {
+    std::vector<uint32_t> &frames = locations[location.id()];
+    for (const auto &line : location.line()) {
+      auto function = functions.find(line.function_id());
+      if (function == functions.end()) {
+        continue;
+      }
+      frames.push_back(
+          FrameId(ProfileString(profile, function->second->name()),
+                  ProfileString(profile, function->second->filename()),
+                  line.line()));
+    }
+    if (frames.empty()) {
+      // Not symbolized, keep the address within the mapping file.
+      char address[32];
+      snprintf(address, sizeof(address), "0x%llx",
+               static_cast<unsigned long long>(location.address()));
+      auto mapping = mappings.find(location.mapping_id());
+      frames.push_back(FrameId(
+          address,
+          mapping == mappings.end()
+              ? ""
+              : ProfileString(profile, mapping->second->filename()),
+          0));
+    }
+  }
+
+  int num_values = sample_types_.size();
+  int offset = base ? num_values : 0;
+  std::vector<uint32_t> key;
+  for (const auto &sample : profile.sample()) {
+    key.clear();
+    key.push_back(0);
+    if (keep_labels_) {
+      for (const auto &label : sample.label()) {
+        if (label.str() == 0) {
+          continue;
+        }
+        key[0]++;
+        key.push_back(StringId(ProfileString(profile, label.key())));
+        key.push_back(StringId(ProfileString(profile, label.str())));
+      }
+    }
+    for (uint64_t location_id : sample.location_id()) {
+      const std::vector<uint32_t> &frames = locations[location_id];
+      key.insert(key.end(), frames.begin(), frames.end());
+    }
+    auto stack = stacks_.find(key);
+    if (stack == stacks_.end()) {
+      if (static_cast<int64_t>(stacks_.size()) >= max_stacks_) {
+        key.assign(1, 0);
+        key.push_back(FrameId(kOtherFrame, "", 0));
+      }
+      stack = stacks_.emplace(key, std::vector<int64_t>(2 * num_values))
+                  .first;
+    }
+    for (int i = 0; i < num_values && i < sample.value_size(); i++) {
+      stack->second[offset + i] += sample.value(i);
+    }
+  }
+  return true;
+}
+
+bool ProfileMerger::Emit(bool normalize, string *output) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  double base_scale = 1;
+  if (normalize && num_profiles_[1] > 0) {
+    base_scale = static_cast<double>(num_profiles_[0]) / num_profiles_[1];
+  }
+
+  perftools::profiles::Builder builder;
+  perftools::profiles::Profile *profile = builder.mutable_profile();
+  auto value_type = [&builder](const string &type_unit,
+                               perftools::profiles::ValueType *value_type) {
+    size_t slash = type_unit.rfind('/');
+    value_type->set_type(builder.StringId(type_unit.substr(0, slash).c_str()));
+    value_type->set_unit(
+        builder.StringId(type_unit.substr(slash + 1).c_str()));
+  };
+  for (const string &sample_type : sample_types_) {
+    value_type(sample_type, profile->add_sample_type());
+  }
+  if (!period_type_.empty()) {
+    value_type(period_type_, profile->mutable_period_type());
+  }
+  profile->set_period(period_);
+  profile->set_duration_nanos(duration_nanos_);
+
+  // Location i + 1 is frame i.
+  std::vector<bool> used(frames_.size());
+  size_t num_values = sample_types_.size();
+  for (const auto &stack : stacks_) {
+    const std::vector<uint32_t> &key = stack.first;
+    perftools::profiles::Sample *sample = profile->add_sample();
+    bool nonzero = false;
+    for (size_t i = 0; i < num_values; i++) {
+      int64_t value =
+          stack.second[i] -
+          static_cast<int64_t>(std::llround(stack.second[num_values + i] *
+                                            base_scale));
+      sample->add_value(value);
+      nonzero |= value != 0;
+    }
+    if (!nonzero) {
+      profile->mutable_sample()->RemoveLast();
+      continue;
+    }
+    size_t frames_start = 1 + 2 * key[0];
+    for (size_t i = 1; i < frames_start; i += 2) {
+      perftools::profiles::Label *label = sample->add_label();
+      label->set_key(builder.StringId(strings_[key[i]].c_str()));
+      label->set_str(builder.StringId(strings_[key[i + 1]].c_str()));
+    }
+    for (size_t i = frames_start; i < key.size(); i++) {
+      sample->add_location_id(key[i] + 1);
+      used[key[i]] = true;
+    }
+  }
+
+  for (size_t i = 0; i < frames_.size(); i++) {
+    if (!used[i]) {
+      continue;
+    }
+    const Frame &frame = frames_[i];
+    perftools::profiles::Location *location = profile->add_location();
+    location->set_id(i + 1);
+    perftools::profiles::Line *line = location->add_line();
+    line->set_function_id(builder.FunctionId(
+        frame.function.c_str(), frame.function.c_str(), frame.file.c_str(),
+        0));
+    line->set_line(frame.line);
+  }
+  return builder.Emit(output);
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_PROFILE_MERGER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_PROFILE_MERGER_H_
+
+#include <mutex>  // NOLINT
+#include <unordered_map>
+#include <vector>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// ProfileMerger adds up the samples of profile.proto profiles of the same
+// type by symbolized stack: the function name, file name and line of each
+// frame, and optionally the string labels of the sample. Only the distinct
+// frames and stacks are kept, not the profiles, so that any number of
+// profiles can be merged in an amount of memory bounded by max_stacks.
+//
+// Profiles can also be added as part of a base, which is subtracted from
+// the others to get a differential profile.
+//
+// Add() can be called concurrently: the profiles are decompressed and
+// parsed in parallel, and only their aggregation is serialized.
+class ProfileMerger {
+ public:
+  // Keeps up to max_stacks distinct stacks, the samples of the further ones
+  // are merged into a single "[other]" stack.
+  ProfileMerger(int64_t max_stacks, bool keep_labels);
+
+  // Adds the samples of a serialized profile.proto, gzip compressed or not,
+  // to the merged ones or to the base. Returns false if it cannot be parsed
+  // or if its sample types differ from those of the first profile added.
+  bool Add(const string &data, bool base);
+
+  // Serializes the merged profile, gzip compressed. With a base, the
+  // values of the base are subtracted, scaled by the ratio of the number
+  // of profiles to the number of base profiles when normalize is true.
+  bool Emit(bool normalize, string *output);
+
+  int64_t NumProfiles() const { return num_profiles_[0]; }
+  int64_t NumBaseProfiles() const { return num_profiles_[1]; }
+
+ private:
+  struct Frame {
+    string function;
+    string file;
+    int64_t line;
+  };
+
+  struct KeyHash {
+    size_t operator()(const std::vector<uint32_t> &key) const;
+  };
+
+  // Returns the id of a frame, adding it if needed. Must be called with
+  // mutex_ held.
+  uint32_t FrameId(const string &function, const string &file, int64_t line);
+  // Same for a label string.
+  uint32_t StringId(const string &str);
+
+  const int64_t max_stacks_;
+  const bool keep_labels_;
+
+  std::mutex mutex_;
+  std::vector<string> sample_types_;
+  string period_type_;
+  int64_t period_;
+  int64_t duration_nanos_;
+  int64_t num_profiles_[2];
+
+  std::vector<Frame> frames_;
+  std::unordered_map<string, uint32_t> frame_ids_;
+  std::vector<string> strings_;
+  std::unordered_map<string, uint32_t> string_ids_;
+  // Values of each stack: those of the profiles, then those of the base.
+  // A key is the number of labels, their key and value string ids, then
+  // the frame ids, leaf first.
+  std::unordered_map<std::vector<uint32_t>, std::vector<int64_t>, KeyHash>
+      stacks_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfileMerger);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_PROFILE_MERGER_H_
@@ -0,0 +1,108 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/profile_writer.h"
+
+#include "google/protobuf/wire_format_lite.h"
+
+namespace cloud {
+namespace profiler {
+
+using google::protobuf::internal::WireFormatLite;
+using perftools::profiles::Profile;
+
+ProfileWriter::ProfileWriter(string *output)
+    : stream_(output),
+      gzip_(&stream_),
+      coded_(new google::protobuf::io::CodedOutputStream(&gzip_)) {}
+
+int64_t ProfileWriter::AddString(const string &str) {
+  coded_->WriteTag(WireFormatLite::MakeTag(
+      Profile::kStringTableFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  coded_->WriteVarint32(str.size());
+  coded_->WriteString(str);
+  return num_strings_++;
+}
+
+uint64_t ProfileWriter::AddFunction(perftools::profiles::Function *function) {
+  function->set_id(++num_functions_);
+  WriteMessage(Profile::kFunctionFieldNumber, *function);
+  return num_functions_;
+}
+
+uint64_t ProfileWriter::AddLocation(perftools::profiles::Location *location) {
+  location->set_id(++num_locations_);
+  WriteMessage(Profile::kLocationFieldNumber, *location);
+  return num_locations_;
+}
+
+uint64_t ProfileWriter::AddMapping(perftools::profiles::Mapping *mapping) {
+  mapping->set_id(++num_mappings_);
+  WriteMessage(Profile::kMappingFieldNumber, *mapping);
+  return num_mappings_;
+}
+
+void ProfileWriter::AddSampleType(
+    const perftools::profiles::ValueType &sample_type) {
+  WriteMessage(Profile::kSampleTypeFieldNumber, sample_type);
+}
+
+void ProfileWriter::AddSample(const perftools::profiles::Sample &sample) {
+  WriteMessage(Profile::kSampleFieldNumber, sample);
+}
+
+void ProfileWriter::SetPeriodType(
+    const perftools::profiles::ValueType &period_type) {
+  WriteMessage(Profile::kPeriodTypeFieldNumber, period_type);
+}
+
+void ProfileWriter::SetPeriod(int64_t period) {
+  WriteInt64(Profile::kPeriodFieldNumber, period);
+}
+
+void ProfileWriter::SetDurationNanos(int64_t duration_nanos) {
+  WriteInt64(Profile::kDurationNanosFieldNumber, duration_nanos);
+}
+
+void ProfileWriter::AddComment(int64_t comment) {
+  WriteInt64(Profile::kCommentFieldNumber, comment);
+}
+
+bool ProfileWriter::Close() {
+  if (!coded_) {
+    return false;
+  }
+  bool ok = !coded_->HadError();
+  // Flushes the buffered bytes to gzip_.
+  coded_.reset();
+  return gzip_.Close() && ok;
+}
+
+void ProfileWriter::WriteMessage(
+    int field, const google::protobuf::MessageLite &message) {
+  coded_->WriteTag(WireFormatLite::MakeTag(
+      field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  coded_->WriteVarint32(message.ByteSizeLong());
+  message.SerializeWithCachedSizes(coded_.get());
+}
+
+void ProfileWriter::WriteInt64(int field, int64_t value) {
+  coded_->WriteTag(
+      WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_VARINT));
+  coded_->WriteVarint64(static_cast<uint64_t>(value));
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_PROFILE_WRITER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_PROFILE_WRITER_H_
+
+#include <memory>
+
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "perftools/profiles/proto/builder.h"
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// ProfileWriter encodes a profile.proto field by field into a gzip
+// compressed string, so that the profile is never held in memory as a whole
+// message nor uncompressed. The elements of the repeated fields are written
+// as they are added, and get consecutive ids or indices in that order.
+class ProfileWriter {
+ public:
+  // Writes the compressed profile to output, which must outlive the writer.
+  explicit ProfileWriter(string *output);
+
+  // Appends str to the string table, and returns its index. The first
+  // string must be the empty one.
+  int64_t AddString(const string &str);
+
+  // Set the id of the element to the next one, append it to the profile
+  // and return its id.
+  uint64_t AddFunction(perftools::profiles::Function *function);
+  uint64_t AddLocation(perftools::profiles::Location *location);
+  uint64_t AddMapping(perftools::profiles::Mapping *mapping);
+
+  void AddSampleType(const perftools::profiles::ValueType &sample_type);
+  void AddSample(const perftools::profiles::Sample &sample);
+  void SetPeriodType(const perftools::profiles::ValueType &period_type);
+  void SetPeriod(int64_t period);
+  void SetDurationNanos(int64_t duration_nanos);
+  // Adds a comment, given as an index in the string table.
+  void AddComment(int64_t comment);
+
+  int64_t NumStrings() const { return num_strings_; }
+  int64_t NumLocations() const { return num_locations_; }
+
+  // Completes the compressed profile. Returns false if it could not be
+  // encoded, in which case the output is not valid. Nothing can be added
+  // afterwards.
+  bool Close();
+
+ private:
+  void WriteMessage(int field, const google::protobuf::MessageLite &message);
+  void WriteInt64(int field, int64_t value);
+
+  google::protobuf::io::StringOutputStream stream_;
+  google::protobuf::io::GzipOutputStream gzip_;
+  // Buffers on top of gzip_, released by Close().
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_;
+
+  int64_t num_strings_ = 0;
+  uint64_t num_functions_ = 0;
+  uint64_t num_locations_ = 0;
+  uint64_t num_mappings_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfileWriter);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_PROFILE_WRITER_H_
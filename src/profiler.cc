@@ -17,19 +17,58 @@
 #include <errno.h>
 #include <execinfo.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/ucontext.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
+#include "src/agent_stats.h"
+#include "src/cgroup_cpu.h"
 #include "src/clock.h"
+#include "src/code_cache_map.h"
+#include "src/gc_monitor.h"
 #include "src/globals.h"
+#include "src/native_threads.h"
 #include "src/proto.h"
+#include "src/throttler.h"
+#include "src/unwinder.h"
 
 DEFINE_int32(cprof_wall_num_threads_cutoff, 4096,
              "Do not take wall profiles if more than this # of threads exist.");
 DEFINE_int32(cprof_wall_max_threads_per_sec, 160,
              "Max total # of threads to wake up per second in wall profiling.");
+DEFINE_int32(cprof_wall_signal_threads, 0,
+             "# of helper threads, each pinned to a CPU, which share the "
+             "sending of the wall profiling signals; 0 for none.");
+DEFINE_int32(cprof_max_stack_traces,
+             google::javaprofiler::AsyncSafeTraceMultiset::kDefaultMaxEntries,
+             "Maximum # of distinct stack traces held between two flushes; "
+             "samples which do not fit are reported as [Unknown].");
+DEFINE_int32(cprof_max_stack_frames,
+             google::javaprofiler::AsyncSafeTraceMultiset::kDefaultMaxFrames,
+             "Maximum # of distinct stack frames held between two flushes, "
+             "counting the callers shared by multiple traces once.");
+DEFINE_int32(cprof_stack_trace_shards, 1,
+             "# of per-CPU tables the stack traces are split into, each "
+             "holding at least 256 traces; 0 uses one table per online "
+             "CPU, which is not sensible on large hosts, as a stack seen "
+             "on many CPUs takes an entry in each of their tables.");
+DEFINE_int32(cprof_cpu_max_thread_timers, 0,
+             "When using per-thread timers and more than this # of threads "
+             "exist, use a single process CPU timer instead; 0 for no limit.");
+DEFINE_bool(cprof_wall_skip_idle_threads, false,
+            "Do not interrupt threads which have not run since their last "
+            "wall sample, reuse their last stack trace instead.");
+DEFINE_int32(cprof_max_stack_depth, google::javaprofiler::kMaxFramesToCapture,
+             "Maximum # of frames kept from each stack trace, up to 4096; "
+             "deeper traces are rooted at a [truncated] frame.");
 // Off by default since it may cause rare crashes, b/27615794.
 DEFINE_bool(cprof_record_native_stack, false,
             "Whether to unwind native stack and put atop of the Java one.");
@@ -37,11 +76,132 @@ DEFINE_bool(cprof_record_native_stack, false,
 namespace cloud {
 namespace profiler {
 
-google::javaprofiler::AsyncSafeTraceMultiset *Profiler::fixed_traces_ = nullptr;
-std::atomic<int> Profiler::unknown_stack_count_;
+google::javaprofiler::AsyncSafeTraceMultiset
+    *Profiler::fixed_traces_[Profiler::kNumSampleKinds];
+std::atomic<int> Profiler::unknown_stack_count_[Profiler::kNumSampleKinds];
+std::atomic<int> Profiler::mode_;
+std::atomic<int> Profiler::active_handlers_[Profiler::kNumSampleKinds];
+std::atomic<int64_t> Profiler::handler_cycles_;
+std::atomic<int64_t> Profiler::handler_signals_;
+uint64_t Profiler::handler_cost_cycles_;
+int64_t Profiler::handler_cost_nanos_;
 
 namespace {
 
+// Interval at which the samples are flushed from the internal table.
+const int64_t kFlushIntervalNanos = 100 * kNanosPerMilli;
+
+// Threads which consumed less CPU time than this since their last wall
+// sample are considered idle. This accounts for the CPU time spent
+// returning from the signal handler that took the sample.
+const int64_t kIdleThreadCpuNanos = 100 * 1000;
+
+// Packs the attribute and frames node of a trace into a value for
+// ThreadTable::RecordCurrentSample(). Traces without a node are 0.
+uint64_t PackTrace(int attr, uint32_t node) {
+  if (node == google::javaprofiler::AsyncSafeFrameTrie::kNoNode) {
+    return 0;
+  }
+  return static_cast<uint64_t>(static_cast<uint32_t>(attr)) << 32 | node;
+}
+
+// Only one call to the signal handler out of this many is timed on each
+// thread, to keep the cost of the measurement and the contention on its
+// counters low.
+const int kHandlerTimingInterval = 16;
+
+// Number of calls to the signal handler on the current thread.
+__thread int handler_calls;
+
+// Returns the time stamp counter, or the monotonic clock where there is
+// none. Async-signal-safe.
+uint64_t CycleCount() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return TimeSpecToNanos(now);
+#endif
+}
+
+int64_t MonotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return TimeSpecToNanos(now);
+}
+
+// The signals of a wall profiling period are spread over up to this many
+// slots of the period, of at least kMinSignalSlotNanos, rather than sent to
+// all the threads at once.
+const int64_t kMaxSignalSlots = 8;
+const int64_t kMinSignalSlotNanos = kNanosPerMilli;
+
+// Fewer threads than this are signalled without the helper threads, as
+// waking them up would cost more than it saves.
+const size_t kMinPooledSignals = 64;
+
+// TickTimer wakes up at regular deadlines of the monotonic clock. The
+// deadlines are absolute, so that late wakeups do not delay the next ones.
+// It uses a timerfd, or sleeps when none can be created.
+class TickTimer {
+ public:
+  TickTimer(const struct timespec &start, int64_t interval_nanos)
+      : next_(start), interval_(NanosToTimeSpec(interval_nanos)) {
+    fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd_ < 0) {
+      LOG(WARNING) << "Could not create a timerfd, errno " << errno;
+      return;
+    }
+    struct itimerspec spec;
+    spec.it_value = start;
+    spec.it_interval = interval_;
+    if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+      LOG(WARNING) << "Could not arm the timerfd, errno " << errno;
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  ~TickTimer() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Waits for the next deadline. Returns the number of deadlines which
+  // passed since the previous call, more than one if it woke up late.
+  int64_t Wait() {
+    if (fd_ >= 0) {
+      uint64_t expirations;
+      ssize_t size;
+      do {
+        size = read(fd_, &expirations, sizeof(expirations));
+      } while (size < 0 && errno == EINTR);
+      if (size == sizeof(expirations)) {
+        for (uint64_t i = 0; i < expirations; i++) {
+          next_ = TimeAdd(next_, interval_);
+        }
+        return expirations;
+      }
+      LOG(WARNING) << "Could not read the timerfd, errno " << errno;
+      close(fd_);
+      fd_ = -1;
+    }
+    DefaultClock()->SleepUntil(next_);
+    next_ = TimeAdd(next_, interval_);
+    return 1;
+  }
+
+ private:
+  int fd_;
+  // Next deadline.
+  struct timespec next_;
+  const struct timespec interval_;
+
+  DISALLOW_COPY_AND_ASSIGN(TickTimer);
+};
+
 // Helper class to store and reset errno when in a signal handler.
 class ErrnoRaii {
  public:
@@ -56,66 +216,230 @@ class ErrnoRaii {
 
 }  // namespace
 
+void Profiler::Record(SampleKind kind, int attr, JVMPI_CallTrace *trace) {
+  uint32_t node;
+  if (!fixed_traces_[kind]->Add(attr, trace, &node)) {
+    unknown_stack_count_[kind]++;
+  }
+  if (kind == kWallSamples) {
+    // For the idle threads and the runqueue profiles.
+    ThreadTable::RecordCurrentSample(PackTrace(attr, node));
+  }
+}
+
+bool Profiler::RecordCached(uint64_t trace) {
+  int attr = static_cast<int>(trace >> 32);
+  uint32_t node = static_cast<uint32_t>(trace);
+  if (!fixed_traces_[kWallSamples]->HasNode(node)) {
+    return false;
+  }
+  if (!fixed_traces_[kWallSamples]->AddNode(attr, node, 1)) {
+    unknown_stack_count_[kWallSamples]++;
+  }
+  return true;
+}
+
+int Profiler::CachedFrames(uint64_t trace, int *attr, int max_frames,
+                           JVMPI_CallFrame *frames) {
+  *attr = static_cast<int>(trace >> 32);
+  if (trace == 0) {
+    return 0;
+  }
+  return fixed_traces_[kWallSamples]->NodeFrames(static_cast<uint32_t>(trace),
+                                                 max_frames, frames);
+}
+
+template <int kFeatures>
 void Profiler::Handle(int signum, siginfo_t *info, void *context) {
   IMPLICITLY_USE(signum);
-  IMPLICITLY_USE(info);
+  SampleKind kind = kCpuSamples;
+  if (info != nullptr && info->si_code == SI_TKILL) {
+    kind = kWallSamples;
+  } else if (info != nullptr && info->si_code == POLL_IN) {
+    kind = kPerfSamples;
+  }
+  // Counted before checking the mode, so that StopSampling() sees either
+  // the mode cleared or the handler in progress.
+  active_handlers_[kind].fetch_add(1, std::memory_order_seq_cst);
+  if ((mode_.load(std::memory_order_seq_cst) & (1 << kind)) != 0) {
+    if (++handler_calls % kHandlerTimingInterval != 0) {
+      HandleSample<kFeatures>(kind, context);
+    } else {
+      uint64_t start = CycleCount();
+      HandleSample<kFeatures>(kind, context);
+      handler_cycles_ += CycleCount() - start;
+      handler_signals_ += kHandlerTimingInterval;
+    }
+  }
+  active_handlers_[kind].fetch_sub(1, std::memory_order_release);
+}
+
+void Profiler::TakeHandlerCost(int64_t *handler_nanos, int64_t *num_signals) {
+  static std::mutex *mutex = new std::mutex();
+  std::lock_guard<std::mutex> lock(*mutex);
+  int64_t cycles = handler_cycles_.exchange(0);
+  *num_signals = handler_signals_.exchange(0);
+
+  // Calibrates the counter against the clock over the interval since the
+  // previous call.
+  uint64_t now_cycles = CycleCount();
+  int64_t now_nanos = MonotonicNanos();
+  double nanos_per_cycle = 0;
+  if (handler_cost_cycles_ != 0 && now_cycles > handler_cost_cycles_) {
+    nanos_per_cycle = static_cast<double>(now_nanos - handler_cost_nanos_) /
+                      (now_cycles - handler_cost_cycles_);
+  }
+  handler_cost_cycles_ = now_cycles;
+  handler_cost_nanos_ = now_nanos;
+  *handler_nanos = static_cast<int64_t>(cycles * nanos_per_cycle);
+
+  AgentStats::Add(AgentStats::kSignals, *num_signals);
+  AgentStats::Add(AgentStats::kHandlerNanos, *handler_nanos);
+}
+
+int Profiler::MaxStackDepth() {
+  return std::min(std::max(FLAGS_cprof_max_stack_depth, 1),
+                  kMaxStackDepthLimit);
+}
+
+int Profiler::FlushTo(google::javaprofiler::TraceMultiset *traces) {
+  int64_t start = MonotonicNanos();
+  // Room for the [truncated] frame.
+  int num_traces =
+      HarvestSamples(fixed_traces_[kind_], traces, MaxStackDepth() + 1);
+  AgentStats::Add(AgentStats::kHarvestNanos, MonotonicNanos() - start);
+  return num_traces;
+}
+
+int Profiler::HandlerFeatures() {
+  int features = 0;
+  if (FLAGS_cprof_record_native_stack) {
+    features |= kNativeStacks;
+  }
+  // The thread table only has buffers for the traces deeper than this.
+  if (MaxStackDepth() > kMaxFramesToCapture) {
+    features |= kDeepStacks;
+  }
+  if (CodeCacheMap::Enabled()) {
+    features |= kJitPcs;
+  }
+  if (NativeThreads::Enabled()) {
+    features |= kNativeThreads;
+  }
+  return features;
+}
+
+template <int kFeatures>
+void Profiler::HandleSample(SampleKind kind, void *context) {
   ErrnoRaii err_storage;  // stores and resets errno
 
   JVMPI_CallTrace trace;
-  JVMPI_CallFrame frames[kMaxFramesToCapture];
+  // Deeper traces are captured in the buffer of the thread; the extra frame
+  // is for the [truncated] root.
+  JVMPI_CallFrame stack_frames[kMaxFramesToCapture + 1];
+  int max_frames = MaxStackDepth();
+  JVMPI_CallFrame *frames =
+      (kFeatures & kDeepStacks) != 0 ? ThreadTable::CurrentFrames() : nullptr;
+  if (frames == nullptr) {
+    frames = stack_frames;
+    max_frames = std::min(max_frames, kMaxFramesToCapture);
+  }
 
   JNIEnv *env = google::javaprofiler::Accessors::CurrentJniEnv();
   trace.frames = frames;
   trace.env_id = env;
   trace.num_frames = 0;
   int attr = google::javaprofiler::Accessors::GetAttribute();
+  bool native_thread = (kFeatures & kNativeThreads) != 0 && env == nullptr;
+  pid_t native_tid = 0;
+  if (native_thread) {
+    native_tid = GetTid();
+    int native_attr = NativeThreads::Attribute(native_tid);
+    if (native_attr != 0) {
+      attr = native_attr;
+    }
+  }
 
   if (env != nullptr) {
     // This is a java thread.
     google::javaprofiler::ASGCTType asgct =
         google::javaprofiler::Asgct::GetAsgct();
-    (*asgct)(&trace, kMaxFramesToCapture, context);
+    (*asgct)(&trace, max_frames, context);
 
     if (trace.num_frames < 0) {
-      // Did not get a valid java trace.
-      trace.frames[0] =
-          JVMPI_CallFrame{kCallTraceErrorLineNum,
-                          reinterpret_cast<jmethodID>(trace.num_frames)};
-      trace.num_frames = 1;
-      if (!fixed_traces_->Add(attr, &trace)) {
-        unknown_stack_count_++;
+      // Did not get a valid java trace. Keep the program counter as the
+      // leaf when it may be in compiled code, which the serialization can
+      // resolve to its Java method.
+      JVMPI_CallFrame error_frame{
+          kCallTraceErrorLineNum,
+          reinterpret_cast<jmethodID>(trace.num_frames)};
+      trace.num_frames = 0;
+      if ((kFeatures & kJitPcs) != 0 && max_frames > 1) {
+        uint64_t pc =
+            static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
+        if (CodeCacheMap::MayContain(pc)) {
+          trace.frames[trace.num_frames++] = JVMPI_CallFrame{
+              kNativeFrameLineNum, reinterpret_cast<jmethodID>(pc)};
+        }
       }
+      trace.frames[trace.num_frames++] = error_frame;
+      Record(kind, attr, &trace);
       return;
     }
 
+    if (trace.num_frames == max_frames) {
+      // The trace is likely missing its roots.
+      trace.frames[trace.num_frames++] =
+          JVMPI_CallFrame{kTruncatedFrameLineNum, nullptr};
+    }
+
     if (frames[0].lineno >= 0) {
       // Leaf is a java frame, return java trace.
-      if (!fixed_traces_->Add(attr, &trace)) {
-        unknown_stack_count_++;
-      }
+      Record(kind, attr, &trace);
       return;
     }
   }
 
   // Collect native trace on top of java trace.
-  // Skip top two frames, which include this function and the signal
-  // handler.
-  const int kFramesToSkip = 2;
-  if (FLAGS_cprof_record_native_stack &&
-      (kMaxFramesToCapture + kFramesToSkip - trace.num_frames > 0)) {
+  int max_native_frames =
+      std::min(max_frames - trace.num_frames, kMaxFramesToCapture);
+  if (((kFeatures & kNativeStacks) != 0 || native_thread) &&
+      max_native_frames > 0) {
+    // Skip top two frames of backtrace(), which include this function and
+    // the signal handler.
+    const int kFramesToSkip = 2;
     void *raw_callstack[kMaxFramesToCapture + kFramesToSkip];
-    int stack_len =
-        backtrace(&raw_callstack[0],
-                  kMaxFramesToCapture + kFramesToSkip - trace.num_frames);
-    if (stack_len > kFramesToSkip) {
-      stack_len -= kFramesToSkip;
+    void **callstack = &raw_callstack[0];
+    int stack_len;
+    uintptr_t stack_low, stack_high;
+    if (!native_thread) {
+      stack_len = UnwindNativeStack(static_cast<ucontext_t *>(context),
+                                    max_native_frames, callstack);
+    } else if (NativeThreads::Stack(native_tid, &stack_low, &stack_high)) {
+      stack_len =
+          UnwindNativeStack(static_cast<ucontext_t *>(context), stack_low,
+                            stack_high, max_native_frames, callstack);
+    } else {
+      // The stack was not found yet, only the program counter is recorded
+      // below: backtrace() is slow and takes locks, and the native threads
+      // are sampled in every profile.
+      stack_len = 0;
+    }
+    if (stack_len < 0 && !native_thread) {
+      // The stack of this thread is unknown, fall back to the slower
+      // backtrace().
+      stack_len = backtrace(&raw_callstack[0],
+                            max_native_frames + kFramesToSkip) -
+                  kFramesToSkip;
+      callstack = &raw_callstack[kFramesToSkip];
+    }
+    if (stack_len > 0) {
       // Shift java frames to make room for native frames.
       if (trace.num_frames > 0) {
         for (int i = trace.num_frames; i > 0; i--) {
           trace.frames[stack_len + i - 1] = trace.frames[i - 1];
         }
       }
-      void **callstack = &raw_callstack[kFramesToSkip];
       for (int i = 0; i < stack_len; i++) {
         trace.frames[i] = JVMPI_CallFrame{kNativeFrameLineNum,
                                           static_cast<jmethodID>(callstack[i])};
@@ -138,9 +462,7 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context) {
     ++trace.num_frames;
   }
 
-  if (!fixed_traces_->Add(attr, &trace)) {
-    unknown_stack_count_++;
-  }
+  Record(kind, attr, &trace);
 }
 
 // This method schedules the SIGPROF timer to go off every specified interval.
@@ -177,31 +499,91 @@ struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
 }
 
 void Profiler::Reset() {
-  if (fixed_traces_ == nullptr) {
-    fixed_traces_ = new google::javaprofiler::AsyncSafeTraceMultiset();
-  } else {
-    fixed_traces_->Reset();
+  // Serializes the profilers of different kinds, which may be reset from
+  // different threads.
+  static std::mutex *reset_mutex = new std::mutex();
+  std::lock_guard<std::mutex> lock(*reset_mutex);
+
+  google::javaprofiler::AsyncSafeTraceMultiset *&traces = fixed_traces_[kind_];
+  if (traces == nullptr) {
+    int num_shards = FLAGS_cprof_stack_trace_shards;
+    if (num_shards <= 0) {
+      num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    traces = new google::javaprofiler::AsyncSafeTraceMultiset(
+        FLAGS_cprof_max_stack_traces, num_shards,
+        FLAGS_cprof_max_stack_frames);
+    LOG(INFO) << "Stack trace table: " << traces->MaxEntries()
+              << " entries in " << traces->NumShards() << " shards, "
+              << traces->MaxFrames() << " frames";
   }
-  unknown_stack_count_ = 0;
+  unknown_stack_count_[kind_] = 0;
 
   if (FLAGS_cprof_record_native_stack) {
     // When native stack collection requested, gather a single backtrace before
     // setting up the signal handler, to avoid running internal initialization
-    // within backtrace from the signal handler.
+    // within backtrace from the signal handler. It is only used by the Java
+    // threads whose stack was not registered.
     void *raw_callstack[1];
     backtrace(&raw_callstack[0], 1);
   }
 
-  // old_action_ is stored, but never used.  This is in case of future
-  // refactorings that need it.
-  old_action_ = handler_.SetAction(&Profiler::Handle);
+  InstallHandler();
+}
+
+void Profiler::InstallHandler() {
+  static void (*const handlers[])(int, siginfo_t *, void *) = {
+      &Handle<0>,  &Handle<1>,  &Handle<2>,  &Handle<3>,
+      &Handle<4>,  &Handle<5>,  &Handle<6>,  &Handle<7>,
+      &Handle<8>,  &Handle<9>,  &Handle<10>, &Handle<11>,
+      &Handle<12>, &Handle<13>, &Handle<14>, &Handle<15>,
+  };
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == kNumHandlerVariants,
+                "missing signal handler variants");
+  static bool installed = false;
+  if (!installed) {
+    int features = HandlerFeatures();
+    LOG(INFO) << "Installing the signal handler with features " << features;
+    handler_.SetAction(handlers[features]);
+    installed = true;
+  }
+}
+
+void Profiler::StartSampling() {
+  mode_.fetch_or(1 << kind_, std::memory_order_seq_cst);
+}
+
+void Profiler::StopSampling() {
+  mode_.fetch_and(~(1 << kind_), std::memory_order_seq_cst);
+  struct timespec drain_interval = {0, 100 * 1000};  // 100 usec
+  while (active_handlers_[kind_].load(std::memory_order_acquire) != 0) {
+    DefaultClock()->SleepFor(drain_interval);
+  }
 }
 
 string Profiler::SerializeProfile(
     const google::javaprofiler::NativeProcessInfo &native_info) {
+  int64_t additions, probes;
+  fixed_traces_[kind_]->TakeProbeStats(&additions, &probes);
+  AgentStats::Add(AgentStats::kTableAdditions, additions);
+  AgentStats::Add(AgentStats::kTableProbes, probes);
+  AgentStats::Add(AgentStats::kDroppedSamples, UnknownStackCount());
+  std::vector<ArtificialSample> artificial_samples;
+  if (num_gc_pauses_ > 0) {
+    artificial_samples.push_back(
+        {"[GC pause]", num_gc_pauses_, gc_pause_nanos_});
+  }
+  num_gc_pauses_ = 0;
+  gc_pause_nanos_ = 0;
+  if (throttled_nanos_ > 0) {
+    artificial_samples.push_back(
+        {"[CPU throttled]", num_throttled_, throttled_nanos_});
+  }
+  num_throttled_ = 0;
+  throttled_nanos_ = 0;
   return SerializeAndClearJavaCpuTraces(
       jvmti_, native_info, ProfileType(), duration_nanos_, period_nanos_,
-      &aggregated_traces_, unknown_stack_count_);
+      &aggregated_traces_, UnknownStackCount(), artificial_samples);
 }
 
 bool AlmostThere(const struct timespec &finish, const struct timespec &lap) {
@@ -245,30 +627,256 @@ bool CPUProfiler::Collect() {
 
 bool CPUProfiler::Start() {
   int period_usec = period_nanos_ / 1000;
-  if (threads_->UseTimers()) {
+  thread_timers_ = threads_->UseTimers();
+  if (thread_timers_ && FLAGS_cprof_cpu_max_thread_timers > 0 &&
+      threads_->Size() > FLAGS_cprof_cpu_max_thread_timers) {
+    // Setting up that many timers costs more than it is worth, let the
+    // kernel pick the running threads to signal. This profiles non-Java
+    // threads as well.
+    thread_timers_ = false;
+  }
+  StartSampling();
+  if (thread_timers_) {
     threads_->StartTimers(period_usec);
     return true;
-  } else {
-    return handler_.SetSigprofInterval(period_usec);
   }
+  if (!handler_.SetSigprofInterval(period_usec)) {
+    StopSampling();
+    return false;
+  }
+  return true;
 }
 
 void CPUProfiler::Stop() {
-  if (threads_->UseTimers()) {
+  if (thread_timers_) {
     threads_->StopTimers();
   } else {
     handler_.SetSigprofInterval(0);
   }
-  // Breaks encapsulation, but whatever.
-  signal(SIGPROF, SIG_IGN);
+  StopSampling();
+}
+
+bool PerfEventProfiler::Start() {
+  StartSampling();
+  if (!threads_->StartPerfEvents(event_, period_nanos_)) {
+    StopSampling();
+    return false;
+  }
+  return true;
+}
+
+void PerfEventProfiler::Stop() {
+  threads_->StopPerfEvents();
+  StopSampling();
 }
 
+ContinuousCPUProfiler::ContinuousCPUProfiler(jvmtiEnv *jvmti,
+                                             ThreadTable *threads,
+                                             int64_t period_nanos,
+                                             int64_t window_nanos,
+                                             int num_windows)
+    : CPUProfiler(jvmti, threads, window_nanos, period_nanos),
+      window_nanos_(window_nanos),
+      num_windows_(num_windows > 0 ? num_windows : 1),
+      profile_duration_nanos_(window_nanos),
+      profile_unknown_count_(0),
+      current_(new Window()),
+      last_flush_(),
+      collecting_(false),
+      paused_(false),
+      stopping_(false) {}
+
+ContinuousCPUProfiler::~ContinuousCPUProfiler() { StopCollection(); }
+
+bool ContinuousCPUProfiler::StartCollection() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (collecting_) {
+    return true;
+  }
+  if (!Start()) {
+    return false;
+  }
+  collecting_ = true;
+  last_flush_ = DefaultClock()->Now();
+  stopping_ = false;
+  collector_ = std::thread(&ContinuousCPUProfiler::CollectorLoop, this);
+  return true;
+}
+
+void ContinuousCPUProfiler::StopCollection() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!collecting_) {
+      return;
+    }
+    collecting_ = false;
+    if (!paused_) {
+      Stop();
+    }
+  }
+  stopping_.store(true, std::memory_order_release);
+  collector_.join();
+}
+
+void ContinuousCPUProfiler::SetProfileDuration(int64_t duration_nanos) {
+  // The ring cannot hold profiles longer than that.
+  int64_t max_duration_nanos =
+      static_cast<int64_t>(num_windows_) * window_nanos_;
+  profile_duration_nanos_ = std::min(duration_nanos, max_duration_nanos);
+}
+
+bool ContinuousCPUProfiler::Collect() {
+  Clock *clock = DefaultClock();
+  struct timespec flush_interval = NanosToTimeSpec(kFlushIntervalNanos);
+
+  std::vector<std::unique_ptr<Window>> profile_windows;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    int64_t collected_nanos = 0;
+    while (true) {
+      if (!collecting_) {
+        return false;
+      }
+      collected_nanos = 0;
+      for (const auto &window : windows_) {
+        collected_nanos += window->collected_nanos;
+      }
+      if (collected_nanos >= profile_duration_nanos_) {
+        break;
+      }
+      lock.unlock();
+      clock->SleepFor(flush_interval);
+      lock.lock();
+    }
+    // Take the most recent windows, the older ones would make the
+    // profile longer than requested.
+    collected_nanos = 0;
+    while (collected_nanos < profile_duration_nanos_) {
+      collected_nanos += windows_.back()->collected_nanos;
+      profile_windows.push_back(std::move(windows_.back()));
+      windows_.pop_back();
+    }
+    windows_.clear();
+  }
+
+  // Aggregate without holding the lock, to not delay the collector.
+  google::javaprofiler::TraceMultiset *traces = aggregated_traces();
+  duration_nanos_ = 0;
+  profile_unknown_count_ = 0;
+  std::vector<JVMPI_CallFrame> frames;
+  for (const auto &window : profile_windows) {
+    for (const auto &trace : window->traces) {
+      const auto &call_trace = trace.first;
+      if (frames.size() < static_cast<size_t>(call_trace.num_frames)) {
+        frames.resize(call_trace.num_frames);
+      }
+      window->traces.Frames(call_trace, frames.data());
+      traces->Add(call_trace.attr, call_trace.num_frames, frames.data(),
+                  trace.second, call_trace.hash);
+    }
+    duration_nanos_ += window->collected_nanos;
+    profile_unknown_count_ += window->unknown_count;
+  }
+  return true;
+}
+
+void ContinuousCPUProfiler::Pause() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!collecting_ || paused_) {
+    return;
+  }
+  Stop();
+  // Delay to allow last signals to be processed.
+  DefaultClock()->SleepFor(NanosToTimeSpec(kFlushIntervalNanos));
+  FlushWindow();
+  paused_ = true;
+}
+
+void ContinuousCPUProfiler::Resume() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!collecting_ || !paused_) {
+    return;
+  }
+  // Whoever used the internal table while paused has flushed it, but it
+  // may have left its own signal disposition behind.
+  Reset();
+  if (!Start()) {
+    LOG(ERROR) << "Failed to resume continuous cpu profiling";
+    return;
+  }
+  last_flush_ = DefaultClock()->Now();
+  paused_ = false;
+}
+
+void ContinuousCPUProfiler::CollectorLoop() {
+  ScopedAgentThread agent_thread;
+  Clock *clock = DefaultClock();
+  struct timespec flush_interval = NanosToTimeSpec(kFlushIntervalNanos);
+  while (!stopping_.load(std::memory_order_acquire)) {
+    clock->SleepFor(flush_interval);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!collecting_ || paused_) {
+      continue;
+    }
+    FlushWindow();
+  }
+}
+
+void ContinuousCPUProfiler::FlushWindow() {
+  struct timespec now = DefaultClock()->Now();
+  FlushTo(&current_->traces);
+  current_->unknown_count += TakeUnknownStackCount();
+  current_->collected_nanos +=
+      TimeSpecToNanos(now) - TimeSpecToNanos(last_flush_);
+  last_flush_ = now;
+  if (current_->collected_nanos >= window_nanos_) {
+    CloseWindow();
+  }
+}
+
+void ContinuousCPUProfiler::CloseWindow() {
+  windows_.push_back(std::move(current_));
+  if (windows_.size() > num_windows_) {
+    windows_.pop_front();
+  }
+  current_.reset(new Window());
+}
+
+int64_t WallProfiler::signalled_threads_ = 0;
+
 WallProfiler::WallProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
-                           int64_t duration_nanos, int64_t period_nanos)
+                           int64_t duration_nanos, int64_t period_nanos,
+                           bool runqueue)
     : Profiler(jvmti, threads, duration_nanos,
-               EffectivePeriodNanos(period_nanos, threads->Size(),
-                                    FLAGS_cprof_wall_max_threads_per_sec,
-                                    duration_nanos)) {}
+               EffectivePeriodNanos(period_nanos, ThreadsToSignal(threads),
+                                    MaxThreadsPerSecond(), duration_nanos),
+               kWallSamples),
+      helper_cpu_nanos_(0),
+      runqueue_(runqueue) {}
+
+int64_t WallProfiler::ThreadsToSignal(ThreadTable *threads) {
+  if (FLAGS_cprof_wall_skip_idle_threads && signalled_threads_ > 0) {
+    // Only the threads which run get signals, assume as many will as
+    // during the previous profile.
+    return signalled_threads_;
+  }
+  return threads->Size();
+}
+
+bool WallProfiler::IsIdle(const ThreadTable::ThreadSample &thread) {
+  if (thread.trace == 0) {
+    return false;
+  }
+  int64_t cpu_nanos = ThreadCpuNanos(thread.tid);
+  return cpu_nanos >= 0 && cpu_nanos - thread.cpu_nanos < kIdleThreadCpuNanos;
+}
+
+int64_t WallProfiler::MaxThreadsPerSecond() {
+  // Signalling the threads costs CPU time, of which a quota of less than a
+  // CPU allows as much less.
+  return std::max<int64_t>(
+      1, FLAGS_cprof_wall_max_threads_per_sec * CgroupCpu::Allowance());
+}
 
 int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
                                            int64_t num_threads,
@@ -292,50 +900,198 @@ int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
   return period_nanos;
 }
 
-bool WallProfiler::Collect() {
+bool WallProfiler::Collect() { return Collect(GetTid()); }
+
+bool WallProfiler::Collect(pid_t skip_tid) {
   Reset();
-  pid_t my_tid = GetTid();
+  // The samples recorded before refer to frames which are gone.
+  threads_->ClearSamples();
+  int64_t start_gc_pauses, start_gc_pause_nanos;
+  GcMonitor::Totals(&start_gc_pauses, &start_gc_pause_nanos);
+  int64_t start_throttled, start_throttled_nanos;
+  bool throttling =
+      CgroupCpu::ReadThrottling(&start_throttled, &start_throttled_nanos);
+  StartSampling();
 
   Clock *clock = DefaultClock();
-  struct timespec profile_period = {0, period_nanos_};
   struct timespec finish_line =
       TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
 
-  // Send signals to all threads to wakeup and report themselves. Stop
-  // after we reach the finish line.
-  struct timespec next = clock->Now();
-
-  int64_t count = 0;
-  const int kFlushPeriod = 128;  // Flush table every 128 samples
-  while (TimeLessThan(next, finish_line)) {
-    if (count > kFlushPeriod) {
-      count = 0;
-      // Periodically flush the internal tables.
-      Flush();
-    }
-    clock->SleepUntil(next);
-    std::vector<pid_t> threads = threads_->Threads();
-    if (threads.size() > FLAGS_cprof_wall_num_threads_cutoff) {
-      LOG(WARNING) << "Aborting wall profiling due to too many threads. "
-                   << "Got " << threads.size() << " threads. "
-                   << "Want up to " << FLAGS_cprof_wall_num_threads_cutoff;
-      return false;  // Too many threads, abort
+  // The signals are sent from a dedicated thread, so that flushing the
+  // internal tables from this one does not delay them.
+  std::atomic<bool> sampling(true);
+  bool sampled = false;
+  helper_cpu_nanos_ = 0;
+  std::thread sampler([&] {
+    ScopedAgentThread agent_thread;
+    pid_t sampler_tid = GetTid();
+    int64_t start_cpu_nanos = ThreadCpuNanos(sampler_tid);
+    sampled = SampleThreads(skip_tid, finish_line);
+    helper_cpu_nanos_ += ThreadCpuNanos(sampler_tid) - start_cpu_nanos;
+    sampling.store(false, std::memory_order_release);
+  });
+  struct timespec flush_interval = NanosToTimeSpec(kFlushIntervalNanos);
+  while (sampling.load(std::memory_order_acquire) &&
+         !AlmostThere(finish_line, flush_interval)) {
+    clock->SleepFor(flush_interval);
+    Flush();
+  }
+  sampler.join();
+  if (GcMonitor::Enabled()) {
+    // The pauses were not sampled, see SampleThreads().
+    GcMonitor::Totals(&num_gc_pauses_, &gc_pause_nanos_);
+    num_gc_pauses_ -= start_gc_pauses;
+    gc_pause_nanos_ -= start_gc_pause_nanos;
+  }
+  if (throttling &&
+      CgroupCpu::ReadThrottling(&num_throttled_, &throttled_nanos_)) {
+    num_throttled_ -= start_throttled;
+    throttled_nanos_ -= start_throttled_nanos;
+  } else {
+    num_throttled_ = 0;
+    throttled_nanos_ = 0;
+  }
+  if (!sampled) {
+    // Leave the table empty for the next profile.
+    StopSampling();
+    Flush();
+    return false;
+  }
+  // Delay to allow last signals to be processed.
+  clock->SleepFor(NanosToTimeSpec(period_nanos_));
+  StopSampling();
+  Flush();
+  return true;
+}
+
+bool WallProfiler::SampleThreads(pid_t skip_tid,
+                                 const struct timespec &finish_line) {
+  int64_t num_slots = std::max<int64_t>(
+      1, std::min(kMaxSignalSlots, period_nanos_ / kMinSignalSlotNanos));
+  Clock *clock = DefaultClock();
+  struct timespec start = clock->Now();
+  TickTimer timer(start, period_nanos_ / num_slots);
+  std::unique_ptr<SignalPool> pool;
+  if (FLAGS_cprof_wall_signal_threads > 0) {
+    pool.reset(new SignalPool(FLAGS_cprof_wall_signal_threads));
+  }
+
+  // Each slot signals the threads of its index modulo num_slots, the list
+  // of threads is updated at the start of each period.
+  std::vector<ThreadTable::ThreadSample> threads;
+  std::vector<pid_t> to_signal;
+  // Last run delay read for each thread.
+  std::unordered_map<pid_t, int64_t> run_delays;
+  run_delay_nanos_.clear();
+  int64_t num_expired = 0, next_slot = 0;
+  int64_t ticks = 0, signalled = 0;
+  struct timespec now;
+  while (true) {
+    num_expired += timer.Wait();
+    now = clock->Now();
+    if (!TimeLessThan(now, finish_line)) {
+      break;
     }
-    count += threads.size();
-    for (pid_t tid : threads) {
-      if (tid != my_tid) {
-        // Skip profiler worker thread.
-        TgKill(tid, SIGPROF);
+    // Catch up with the slots missed by a late wakeup, up to a period:
+    // the threads are then sampled late rather than not at all.
+    for (int64_t slot = std::max(next_slot, num_expired - num_slots);
+         slot < num_expired; slot++) {
+      if (slot % num_slots == 0) {
+        threads = threads_->Samples();
+        if (threads.size() > FLAGS_cprof_wall_num_threads_cutoff) {
+          LOG(WARNING) << "Aborting wall profiling due to too many threads. "
+                       << "Got " << threads.size() << " threads. "
+                       << "Want up to " << FLAGS_cprof_wall_num_threads_cutoff;
+          if (pool) {
+            helper_cpu_nanos_ += pool->CpuNanos();
+          }
+          return false;
+        }
+        ticks++;
+      }
+      if (GcMonitor::InCollection()) {
+        // The Java threads are all stopped for the collection, which is
+        // charged as a whole instead.
+        continue;
+      }
+      to_signal.clear();
+      for (size_t i = slot % num_slots; i < threads.size(); i += num_slots) {
+        const ThreadTable::ThreadSample &thread = threads[i];
+        if (thread.tid == skip_tid) {
+          // Skip profiler worker thread.
+          continue;
+        }
+        if (runqueue_) {
+          int64_t run_delay = ThreadRunDelayNanos(thread.tid);
+          if (run_delay >= 0) {
+            auto last = run_delays.emplace(thread.tid, run_delay);
+            if (!last.second) {
+              if (run_delay > last.first->second) {
+                run_delay_nanos_[thread.trace] +=
+                    run_delay - last.first->second;
+              }
+              last.first->second = run_delay;
+            }
+          }
+        }
+        if (FLAGS_cprof_wall_skip_idle_threads && IsIdle(thread) &&
+            RecordCached(thread.trace)) {
+          // Its stack cannot have changed since it has not run.
+          continue;
+        }
+        to_signal.push_back(thread.tid);
+      }
+      if (pool && to_signal.size() >= kMinPooledSignals) {
+        signalled += pool->Signal(to_signal, SIGPROF);
+        continue;
+      }
+      for (pid_t tid : to_signal) {
+        if (TgKill(tid, SIGPROF)) {
+          signalled++;
+        }
       }
     }
-    next = TimeAdd(next, profile_period);
+    next_slot = num_expired;
+  }
+  if (pool) {
+    helper_cpu_nanos_ += pool->CpuNanos();
+  }
+  if (ticks > 0) {
+    signalled_threads_ = signalled / ticks;
+    // Periods skipped by late wakeups are accounted for in the weight of
+    // the samples taken.
+    period_nanos_ = (TimeSpecToNanos(now) - TimeSpecToNanos(start)) / ticks;
   }
-  // Delay to allow last signals to be processed.
-  clock->SleepUntil(TimeAdd(next, profile_period));
-  signal(SIGPROF, SIG_IGN);
-  Flush();
   return true;
 }
 
+string WallProfiler::SerializeRunqueueProfile(
+    const google::javaprofiler::NativeProcessInfo &native_info) {
+  if (!runqueue_) {
+    return "";
+  }
+  // The delays are counted in microseconds, so that the number of samples
+  // is meaningful.
+  const int64_t kRunqueuePeriodNanos = 1000;
+  google::javaprofiler::TraceMultiset traces;
+  std::vector<JVMPI_CallFrame> frames(MaxStackDepth() + 1);
+  int64_t unknown_usec = 0;
+  for (const auto &entry : run_delay_nanos_) {
+    int64_t usec = entry.second / kRunqueuePeriodNanos;
+    int attr;
+    int num_frames =
+        CachedFrames(entry.first, &attr, frames.size(), frames.data());
+    if (num_frames == 0) {
+      unknown_usec += usec;
+    } else if (usec > 0) {
+      traces.Add(attr, num_frames, frames.data(), usec);
+    }
+  }
+  run_delay_nanos_.clear();
+  return SerializeAndClearJavaCpuTraces(jvmti(), native_info, kTypeRunqueue,
+                                        duration_nanos_, kRunqueuePeriodNanos,
+                                        &traces, unknown_usec);
+}
+
 }  // namespace profiler
 }  // namespace cloud
@@ -20,7 +20,13 @@
 #include <signal.h>
 
 #include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
+#include <unordered_map>
 
+#include "src/perf_events.h"
 #include "src/threads.h"
 #include "third_party/javaprofiler/stacktraces.h"
 
@@ -39,13 +45,33 @@ class SignalHandler {
   DISALLOW_COPY_AND_ASSIGN(SignalHandler);
 };
 
+// The signal handler is installed once and stays installed. Each kind of
+// samples is recorded into its own internal table while its bit is set in
+// a mode word, so that switching profiles only flips bits, and CPU and wall
+// profiles can be collected at the same time.
 class Profiler {
  public:
+  // The signal handler tells the kinds of samples apart by the origin of
+  // the signal: the wall profiler signals the threads itself, the CPU
+  // timers are the kernel's, and so are the perf event counters, which
+  // signal the file descriptor activity.
+  enum SampleKind {
+    kCpuSamples,
+    kWallSamples,
+    kPerfSamples,
+    kNumSampleKinds
+  };
+
   Profiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
-           int64_t period_nanos)
+           int64_t period_nanos, SampleKind kind)
       : threads_(threads),
         duration_nanos_(duration_nanos),
         period_nanos_(period_nanos),
+        kind_(kind),
+        num_gc_pauses_(0),
+        gc_pause_nanos_(0),
+        num_throttled_(0),
+        throttled_nanos_(0),
         jvmti_(jvmti) {
     Reset();
   }
@@ -59,41 +85,146 @@ class Profiler {
   string SerializeProfile(
       const google::javaprofiler::NativeProcessInfo &native_info);
 
+  // Optional steps of the signal handler, set by the configuration of the
+  // process, which does not change once sampling starts.
+  enum HandlerFeature {
+    // Unwinds the native frames above the Java ones.
+    kNativeStacks = 1 << 0,
+    // Captures the traces deeper than the stack buffer of the handler into
+    // the buffers of the threads.
+    kDeepStacks = 1 << 1,
+    // Keeps the program counter of the failed traces in generated code.
+    kJitPcs = 1 << 2,
+    // Unwinds the native stacks of the threads which are not Java threads
+    // and labels their samples, see NativeThreads.
+    kNativeThreads = 1 << 3,
+    kNumHandlerVariants = 1 << 4
+  };
+
   // Signal handler, which records the current stack trace into the profile.
+  // Instantiated for each combination of the HandlerFeatures, so that the
+  // installed one only goes through the steps it needs.
+  template <int kFeatures>
   static void Handle(int signum, siginfo_t *info, void *context);
 
-  // Reset internal state to support data collection.
+  // The HandlerFeatures of the current configuration.
+  static int HandlerFeatures();
+
+  // Sets handler_nanos to the estimated time spent in Handle() since the
+  // previous call, and num_signals to the estimated number of signals it
+  // handled, and resets them. Also adds them to the AgentStats.
+  static void TakeHandlerCost(int64_t *handler_nanos, int64_t *num_signals);
+
+  // Maximum number of frames captured from each stack trace, as configured.
+  static int MaxStackDepth();
+
+  // CPU time spent during the last Collect() by the agent threads it ran,
+  // other than the calling one.
+  virtual int64_t HelperCpuNanos() { return 0; }
+
+  // Number of samples reported as unknown in the serialized profile.
+  virtual int64_t UnknownStackCount() { return unknown_stack_count_[kind_]; }
+
+  // Reset internal state to support data collection. Must not be called
+  // while sampling.
   void Reset();
 
   // Migrate data from fixed internal table into growable data structure.
   // Returns number of entries extracted.
-  int Flush() { return HarvestSamples(fixed_traces_, &aggregated_traces_); }
+  int Flush() { return FlushTo(&aggregated_traces_); }
 
   // String description of the profile type
   virtual const char *ProfileType() = 0;
 
  protected:
+  // Record a trace sampled, from the signal handler.
+  static void Record(SampleKind kind, int attr, JVMPI_CallTrace *trace);
+
+  // Record another occurrence of a wall trace recorded before, as saved by
+  // ThreadTable::RecordCurrentSample(). Returns false if its frames have
+  // been reclaimed since, in which case the thread needs to be sampled
+  // again.
+  static bool RecordCached(uint64_t trace);
+
+  // Copies up to max_frames frames of such a wall trace, and sets attr to
+  // its attribute. Returns the number of frames written, 0 for a trace
+  // without frames or whose frames have been reclaimed since.
+  static int CachedFrames(uint64_t trace, int *attr, int max_frames,
+                          JVMPI_CallFrame *frames);
+
+  // Start recording the samples of this kind delivered to the handler.
+  void StartSampling();
+
+  // Stop recording the samples of this kind, and wait for the handlers
+  // recording them to return. The signals received afterwards are ignored.
+  void StopSampling();
+
+  // Migrate data from the fixed internal table into the given multiset.
+  int FlushTo(google::javaprofiler::TraceMultiset *traces);
+
+  // Returns the number of samples where the stack aggregation failed since
+  // the previous call, and resets it.
+  int TakeUnknownStackCount() {
+    return unknown_stack_count_[kind_].exchange(0);
+  }
+
+  google::javaprofiler::TraceMultiset *aggregated_traces() {
+    return &aggregated_traces_;
+  }
+
+  jvmtiEnv *jvmti() { return jvmti_; }
+
   ThreadTable *threads_;
   SignalHandler handler_;
   int64_t duration_nanos_;
   int64_t period_nanos_;
+  const SampleKind kind_;
+  // Garbage collections during which no samples were taken, and their
+  // total duration, charged to a single [GC pause] sample.
+  int64_t num_gc_pauses_;
+  int64_t gc_pause_nanos_;
+  // Periods in which the cgroup of the process was throttled for exceeding
+  // its CPU quota, and the time it was, charged to a [CPU throttled]
+  // sample.
+  int64_t num_throttled_;
+  int64_t throttled_nanos_;
 
  private:
-  // Points to a fixed multiset of traces used during collection. This
-  // is allocated on the first call to Reset(). Will be reused by
-  // subsequent allocations. Cannot be deallocated as it could be in
-  // use by other threads, triggered from a signal handler.
-  static google::javaprofiler::AsyncSafeTraceMultiset *fixed_traces_;
+  // Points to the fixed multisets of traces used during collection, one
+  // per kind of samples. They are allocated on the first call to Reset().
+  // Will be reused by subsequent allocations. Cannot be deallocated as they
+  // could be in use by other threads, triggered from a signal handler.
+  static google::javaprofiler::AsyncSafeTraceMultiset
+      *fixed_traces_[kNumSampleKinds];
 
   // Aggregated profile data, populated using data extracted from
   // fixed_traces.
   google::javaprofiler::TraceMultiset aggregated_traces_;
   jvmtiEnv *jvmti_;
 
-  struct sigaction old_action_;
+  // Installs the signal handler, on the first call.
+  void InstallHandler();
+
+  // Records the current stack trace, on behalf of Handle().
+  template <int kFeatures>
+  static void HandleSample(SampleKind kind, void *context);
 
   // Number of samples where the stack aggregation failed.
-  static std::atomic<int> unknown_stack_count_;
+  static std::atomic<int> unknown_stack_count_[kNumSampleKinds];
+
+  // Bit (1 << kind) is set while the samples of kind are recorded.
+  static std::atomic<int> mode_;
+  // Number of signal handlers in progress for each kind of samples.
+  static std::atomic<int> active_handlers_[kNumSampleKinds];
+
+  // Time stamp counter cycles spent in the timed calls to Handle(), and
+  // number of calls they stand for.
+  static std::atomic<int64_t> handler_cycles_;
+  static std::atomic<int64_t> handler_signals_;
+  // Time stamp counter and clock at the previous TakeHandlerCost(), to
+  // convert the cycles into nanoseconds.
+  static uint64_t handler_cost_cycles_;
+  static int64_t handler_cost_nanos_;
 
   DISALLOW_COPY_AND_ASSIGN(Profiler);
 };
@@ -102,33 +233,167 @@ class Profiler {
 // collecting a sample each time it is triggered (via SIGPROF).
 class CPUProfiler : public Profiler {
  public:
-  using Profiler::Profiler;
+  CPUProfiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
+              int64_t period_nanos)
+      : CPUProfiler(jvmti, threads, duration_nanos, period_nanos,
+                    kCpuSamples) {}
 
   // Collect profiling data.
   bool Collect() override;
 
   const char *ProfileType() override { return "cpu"; }
 
- private:
+ protected:
+  CPUProfiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
+              int64_t period_nanos, SampleKind kind)
+      : Profiler(jvmti, threads, duration_nanos, period_nanos, kind),
+        thread_timers_(false) {}
+
   // Initiate data collection at a fixed interval
-  bool Start();
+  virtual bool Start();
 
   // Stop data collection
-  void Stop();
+  virtual void Stop();
+
+ private:
+  // Whether the current collection uses the per-thread timers.
+  bool thread_timers_;
 
   DISALLOW_COPY_AND_ASSIGN(CPUProfiler);
 };
 
+// PerfEventProfiler collects profiles of a hardware or kernel event, such
+// as the CPU cycles or the last level cache misses, from per-thread
+// perf_event_open counters signalling their thread (via SIGPROF) every
+// period events. Only the registered threads are sampled, and the period
+// of the profile is a number of events rather than nanoseconds.
+class PerfEventProfiler : public CPUProfiler {
+ public:
+  PerfEventProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
+                    const PerfEvent &event, int64_t duration_nanos,
+                    int64_t period)
+      : CPUProfiler(jvmti, threads, duration_nanos, period, kPerfSamples),
+        event_(event) {}
+
+  const char *ProfileType() override { return event_.profile_type; }
+
+ protected:
+  // Fails if no counter can be opened, as when perf_event_open is
+  // restricted.
+  bool Start() override;
+  void Stop() override;
+
+ private:
+  const PerfEvent &event_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfEventProfiler);
+};
+
+// ContinuousCPUProfiler keeps collecting cpu samples across profiles. The
+// timer and the signal handler are set up once, a collector thread flushes
+// the internal table into a ring of fixed length windows, and each profile
+// is cut from the windows collected since the previous one.
+class ContinuousCPUProfiler : public CPUProfiler {
+ public:
+  // Keeps up to num_windows windows of window_nanos each.
+  ContinuousCPUProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
+                        int64_t period_nanos, int64_t window_nanos,
+                        int num_windows);
+  ~ContinuousCPUProfiler() override;
+
+  // Start collecting samples and flushing them into windows.
+  bool StartCollection();
+
+  // Stop collecting samples, and wait for the collector thread to exit.
+  void StopCollection();
+
+  // Set the duration of the profiles returned by Collect(). This is
+  // rounded up to a multiple of the window duration.
+  void SetProfileDuration(int64_t duration_nanos);
+
+  // Wait until the windows collected since the previous call cover the
+  // profile duration, and aggregate the most recent of them into the
+  // profile. Windows older than that are discarded.
+  bool Collect() override;
+
+  // Suspend the collection, flushing the samples collected so far.
+  void Pause();
+
+  // Resume the collection after Pause().
+  void Resume();
+
+ protected:
+  int64_t UnknownStackCount() override { return profile_unknown_count_; }
+
+ private:
+  struct Window {
+    google::javaprofiler::TraceMultiset traces;
+    // Time during which samples were collected into this window.
+    int64_t collected_nanos = 0;
+    int64_t unknown_count = 0;
+  };
+
+  // Body of the collector thread.
+  void CollectorLoop();
+
+  // Flush the internal table into the current window, rotating it into
+  // the ring once complete. Must be called with mutex_ held.
+  void FlushWindow();
+
+  // Move the current window into the ring, dropping the oldest window
+  // if full. Must be called with mutex_ held.
+  void CloseWindow();
+
+  const int64_t window_nanos_;
+  const size_t num_windows_;
+  int64_t profile_duration_nanos_;
+  int64_t profile_unknown_count_;
+
+  // Protects the windows and the collection state below.
+  std::mutex mutex_;
+  std::unique_ptr<Window> current_;
+  // Complete windows not yet part of a profile, oldest first.
+  std::deque<std::unique_ptr<Window>> windows_;
+  // Time of the last flush into the current window.
+  struct timespec last_flush_;
+  bool collecting_;
+  bool paused_;
+
+  std::atomic<bool> stopping_;
+  std::thread collector_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContinuousCPUProfiler);
+};
+
 // WallProfiler collects wallclock profiles by explicitly sending
 // SIGPROF to each thread in the thread table.
+//
+// It can also collect a runqueue profile of the time the threads spent
+// runnable but waiting for a CPU, as told by their schedstat at each tick.
+// That time is attributed to the stack of the last wall sample of the
+// thread, so that CPU-starved threads can be told apart from the blocked
+// ones.
 class WallProfiler : public Profiler {
  public:
   WallProfiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
-               int64_t period_nanos);
+               int64_t period_nanos, bool runqueue = false);
 
   // Collect profiling data.
   bool Collect() override;
 
+  // Same as above, but not sampling the thread skip_tid rather than the
+  // calling one, for a collection run on behalf of skip_tid.
+  bool Collect(pid_t skip_tid);
+
+  // The signals are sent from helper threads.
+  int64_t HelperCpuNanos() override { return helper_cpu_nanos_; }
+
+  // Returns the runqueue profile collected along with the last wall
+  // profile, which must have been serialized before, or an empty string
+  // unless enabled at construction.
+  string SerializeRunqueueProfile(
+      const google::javaprofiler::NativeProcessInfo &native_info);
+
   // Compute effective period based on desired overhead parameters.
   static int64_t EffectivePeriodNanos(int64_t num_threads,
                                       int64_t max_threads_per_second,
@@ -138,6 +403,33 @@ class WallProfiler : public Profiler {
   const char *ProfileType() override { return "wall"; }
 
  private:
+  // Returns the number of threads expected to be signalled at each tick.
+  static int64_t ThreadsToSignal(ThreadTable *threads);
+
+  // Returns the most threads to signal per second, scaled to the cgroup
+  // CPU allowance.
+  static int64_t MaxThreadsPerSecond();
+
+  // Whether the thread has not run since its last recorded sample.
+  static bool IsIdle(const ThreadTable::ThreadSample &thread);
+
+  // Signals the threads of the table but skip_tid once per period until
+  // finish_line, from a dedicated thread. Returns false if it gave up as
+  // there were too many threads. Sets the period to the measured average
+  // interval between the samples of a thread.
+  bool SampleThreads(pid_t skip_tid, const struct timespec &finish_line);
+
+  // Average number of threads signalled per tick by the last profile.
+  static int64_t signalled_threads_;
+
+  // CPU time of the threads which sent the signals of the last profile.
+  int64_t helper_cpu_nanos_;
+  // Whether to collect a runqueue profile.
+  const bool runqueue_;
+  // Time the threads spent waiting for a CPU, by the packed trace of their
+  // last wall sample, 0 for the threads which had none.
+  std::unordered_map<uint64_t, int64_t> run_delay_nanos_;
+
   DISALLOW_COPY_AND_ASSIGN(WallProfiler);
 };
 
@@ -0,0 +1,438 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Microbenchmarks of the sampling and serialization paths of the agent, on
+// synthetic traces and a fake JVMTI, with no JVM:
+//
+//   profiler_bench [--benchmark_filter=regex] [--cprof_...]
+//
+// The traces of a benchmark share their roots and differ by their leaf
+// frames, as the stacks of a Java program do. The benchmarks take the depth
+// of the traces and the number of distinct ones, and the ones adding
+// samples concurrently run with several threads. The agent flags, such as
+// --cprof_stack_trace_shards, apply to the Profiler benchmarks.
+
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/clock.h"
+#include "src/profiler.h"
+#include "src/proto.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+DECLARE_int32(cprof_max_stack_traces);
+DECLARE_int32(cprof_max_stack_frames);
+
+namespace {
+
+using google::javaprofiler::AsyncSafeTraceMultiset;
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::JVMPI_CallTrace;
+using google::javaprofiler::TraceMultiset;
+
+// Number of leaf frames which differ between the traces of a benchmark.
+const int kDistinctFrames = 4;
+
+// Number of classes the synthetic methods are spread over.
+const int kNumClasses = 64;
+
+// Samples of the serialized profile, spread over its distinct traces.
+const int64_t kSerializedSamples = 10000;
+
+const int64_t kPeriodNanos = 10 * 1000 * 1000;
+
+// Frames of num_traces distinct traces of depth frames each, frames[0]
+// being the leaf. The methods of the shared root frames are 1 to depth,
+// the ones of the leaf frames are numbered past them.
+std::vector<std::vector<JVMPI_CallFrame>> MakeTraces(int depth,
+                                                     int num_traces) {
+  std::vector<std::vector<JVMPI_CallFrame>> traces(num_traces);
+  int distinct = std::min(depth, kDistinctFrames);
+  for (int i = 0; i < num_traces; i++) {
+    traces[i].resize(depth);
+    for (int j = 0; j < depth; j++) {
+      intptr_t method = j < distinct ? depth + 1 + i * distinct + j : j + 1;
+      traces[i][j] = JVMPI_CallFrame{j % 16,
+                                     reinterpret_cast<jmethodID>(method)};
+    }
+  }
+  return traces;
+}
+
+JVMPI_CallTrace CallTrace(std::vector<JVMPI_CallFrame> *frames) {
+  JVMPI_CallTrace trace;
+  trace.env_id = nullptr;
+  trace.num_frames = frames->size();
+  trace.frames = frames->data();
+  return trace;
+}
+
+// The fake JVMTI names the synthetic methods after their id, and the class
+// of method id is the id modulo kNumClasses, plus one.
+jvmtiError JNICALL Allocate(jvmtiEnv *jvmti, jlong size,
+                            unsigned char **mem_ptr) {
+  *mem_ptr = static_cast<unsigned char *>(malloc(size));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL Deallocate(jvmtiEnv *jvmti, unsigned char *mem) {
+  free(mem);
+  return JVMTI_ERROR_NONE;
+}
+
+char *JvmtiString(const char *format, intptr_t id) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), format, static_cast<long>(id));
+  return strdup(buffer);
+}
+
+jvmtiError JNICALL GetMethodName(jvmtiEnv *jvmti, jmethodID method_id,
+                                 char **name_ptr, char **signature_ptr,
+                                 char **generic_ptr) {
+  intptr_t id = reinterpret_cast<intptr_t>(method_id);
+  if (name_ptr != nullptr) {
+    *name_ptr = JvmtiString("method%ld", id);
+  }
+  if (signature_ptr != nullptr) {
+    *signature_ptr = strdup("()V");
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetMethodDeclaringClass(jvmtiEnv *jvmti,
+                                           jmethodID method_id,
+                                           jclass *declaring_class) {
+  intptr_t id = reinterpret_cast<intptr_t>(method_id);
+  *declaring_class = reinterpret_cast<jclass>(id % kNumClasses + 1);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetClassSignature(jvmtiEnv *jvmti, jclass klass,
+                                     char **signature_ptr,
+                                     char **generic_ptr) {
+  if (signature_ptr != nullptr) {
+    *signature_ptr = JvmtiString("Lcom/example/Class%ld;",
+                                 reinterpret_cast<intptr_t>(klass));
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetSourceFileName(jvmtiEnv *jvmti, jclass klass,
+                                     char **source_name_ptr) {
+  *source_name_ptr =
+      JvmtiString("Class%ld.java", reinterpret_cast<intptr_t>(klass));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetLineNumberTable(jvmtiEnv *jvmti, jmethodID method_id,
+                                      jint *entry_count_ptr,
+                                      jvmtiLineNumberEntry **table_ptr) {
+  intptr_t id = reinterpret_cast<intptr_t>(method_id);
+  const int kNumLines = 4;
+  *entry_count_ptr = kNumLines;
+  *table_ptr = static_cast<jvmtiLineNumberEntry *>(
+      malloc(kNumLines * sizeof(jvmtiLineNumberEntry)));
+  for (int i = 0; i < kNumLines; i++) {
+    (*table_ptr)[i].start_location = i * 4;
+    (*table_ptr)[i].line_number = id % 1000 + i;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiEnv *FakeJvmti() {
+  static struct jvmtiInterface_1_ functions;
+  static jvmtiEnv jvmti;
+  if (jvmti.functions == nullptr) {
+    memset(&functions, 0, sizeof(functions));
+    functions.Allocate = &Allocate;
+    functions.Deallocate = &Deallocate;
+    functions.GetMethodName = &GetMethodName;
+    functions.GetMethodDeclaringClass = &GetMethodDeclaringClass;
+    functions.GetClassSignature = &GetClassSignature;
+    functions.GetSourceFileName = &GetSourceFileName;
+    functions.GetLineNumberTable = &GetLineNumberTable;
+    jvmti.functions = &functions;
+  }
+  return &jvmti;
+}
+
+// Trace returned by the fake AsyncGetCallTrace to the current thread.
+__thread std::vector<JVMPI_CallFrame> *asgct_frames;
+
+void FakeAsgct(JVMPI_CallTrace *trace, jint depth, void *ucontext) {
+  int num_frames = std::min<int>(depth, asgct_frames->size());
+  memcpy(trace->frames, asgct_frames->data(),
+         num_frames * sizeof(JVMPI_CallFrame));
+  trace->num_frames = num_frames;
+}
+
+// Exposes the sampling of a CPU profiler, with no timer, so that its
+// signal handler can be called directly.
+class BenchProfiler : public cloud::profiler::CPUProfiler {
+ public:
+  BenchProfiler()
+      : CPUProfiler(nullptr, nullptr, 0, kPeriodNanos) {
+    StartSampling();
+  }
+
+  // The table of the CPU samples is shared by all the profilers.
+  static BenchProfiler *Get() {
+    static BenchProfiler *profiler = new BenchProfiler();
+    return profiler;
+  }
+};
+
+// Shared by the threads of the concurrent benchmarks, large enough to hold
+// the traces of all of them.
+AsyncSafeTraceMultiset *SharedTraces() {
+  static AsyncSafeTraceMultiset *traces = new AsyncSafeTraceMultiset(
+      1 << 16, sysconf(_SC_NPROCESSORS_ONLN), 1 << 20);
+  return traces;
+}
+
+void BM_CalculateHash(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(google::javaprofiler::CalculateHash(
+        0, traces[0].size(), traces[0].data()));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CalculateHash)->ArgName("depth")->Arg(8)->Arg(32)->Arg(128)
+    ->Arg(1024);
+
+void BM_Equal(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), 1);
+  std::vector<JVMPI_CallFrame> copy = traces[0];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(google::javaprofiler::Equal(
+        copy.size(), traces[0].data(), copy.data()));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Equal)->ArgName("depth")->Arg(8)->Arg(32)->Arg(128)->Arg(1024);
+
+// Adds samples of distinct traces from concurrent threads, as the signal
+// handler does.
+void BM_AsyncSafeTraceMultisetAdd(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), state.range(1));
+  AsyncSafeTraceMultiset *multiset = SharedTraces();
+  size_t i = 0;
+  for (auto _ : state) {
+    JVMPI_CallTrace trace = CallTrace(&traces[i++ % traces.size()]);
+    benchmark::DoNotOptimize(multiset->Add(0, &trace));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AsyncSafeTraceMultisetAdd)
+    ->ArgNames({"depth", "traces"})
+    ->Args({8, 1})
+    ->Args({32, 64})
+    ->Args({128, 64})
+    ->Args({128, 1024})
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Adds samples of new traces to a multiset whose entries are all taken, so
+// that each one probes its home shard and a spill shard before failing.
+void BM_AsyncSafeTraceMultisetAddFull(benchmark::State &state) {
+  const int kShards = 4;
+  AsyncSafeTraceMultiset multiset(0, kShards, 1 << 20);
+  int64_t entries = multiset.MaxEntries();
+  auto traces = MakeTraces(state.range(0), 2 * entries);
+  int added = 0;
+  for (int64_t i = 0; i < entries; i++) {
+    JVMPI_CallTrace trace = CallTrace(&traces[i]);
+    added += multiset.Add(0, &trace);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    JVMPI_CallTrace trace = CallTrace(&traces[entries + i++ % entries]);
+    benchmark::DoNotOptimize(multiset.Add(0, &trace));
+  }
+  state.counters["filled"] = added;
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AsyncSafeTraceMultisetAddFull)->ArgName("depth")->Arg(8)
+    ->Arg(128);
+
+// Extracts the traces of a multiset one entry at a time.
+void BM_AsyncSafeTraceMultisetExtract(benchmark::State &state) {
+  int depth = state.range(0);
+  auto traces = MakeTraces(depth, state.range(1));
+  AsyncSafeTraceMultiset multiset(2 * traces.size(), 1, 1 << 20);
+  std::vector<JVMPI_CallFrame> extracted(depth);
+  for (auto _ : state) {
+    state.PauseTiming();
+    multiset.Reset();
+    for (auto &frames : traces) {
+      JVMPI_CallTrace trace = CallTrace(&frames);
+      multiset.Add(0, &trace);
+    }
+    state.ResumeTiming();
+    for (int64_t location = multiset.NextOccupied(0);
+         location < multiset.MaxEntries();
+         location = multiset.NextOccupied(location + 1)) {
+      int64_t attr, count;
+      benchmark::DoNotOptimize(multiset.Extract(location, &attr, depth,
+                                                extracted.data(), &count));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * traces.size());
+}
+BENCHMARK(BM_AsyncSafeTraceMultisetExtract)
+    ->ArgNames({"depth", "traces"})
+    ->Args({8, 64})
+    ->Args({32, 1024})
+    ->Args({128, 1024});
+
+// Moves the traces of a multiset into the aggregated traces of a profile.
+void BM_HarvestSamples(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), state.range(1));
+  AsyncSafeTraceMultiset multiset(2 * traces.size(), 1, 1 << 20);
+  TraceMultiset aggregated;
+  for (auto _ : state) {
+    state.PauseTiming();
+    multiset.Reset();
+    for (auto &frames : traces) {
+      JVMPI_CallTrace trace = CallTrace(&frames);
+      multiset.Add(0, &trace);
+    }
+    aggregated.Clear();
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        google::javaprofiler::HarvestSamples(&multiset, &aggregated));
+  }
+  state.SetItemsProcessed(state.iterations() * traces.size());
+}
+BENCHMARK(BM_HarvestSamples)
+    ->ArgNames({"depth", "traces"})
+    ->Args({8, 64})
+    ->Args({32, 1024})
+    ->Args({128, 1024});
+
+// Calls the signal handler of the CPU profiles from concurrent threads,
+// with a fake AsyncGetCallTrace returning the synthetic traces.
+void BM_ProfilerHandle(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), state.range(1));
+  BenchProfiler::Get();
+  JNIEnv env;
+  google::javaprofiler::Accessors::SetCurrentJniEnv(&env);
+  ucontext_t context;
+  getcontext(&context);
+  size_t i = 0;
+  for (auto _ : state) {
+    asgct_frames = &traces[i++ % traces.size()];
+    cloud::profiler::Profiler::Handle<0>(SIGPROF, nullptr, &context);
+  }
+  google::javaprofiler::Accessors::SetCurrentJniEnv(nullptr);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ProfilerHandle)
+    ->ArgNames({"depth", "traces"})
+    ->Args({8, 1})
+    ->Args({32, 64})
+    ->Args({128, 1024})
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Populates a CPU profile proto from the traces, symbolized through the
+// fake JVMTI.
+void BM_ProfileProtoBuilderPopulate(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), state.range(1));
+  std::vector<JVMPI_CallTrace> call_traces;
+  std::vector<google::javaprofiler::ProfileStackTrace> stack_traces;
+  std::vector<int64_t> counts(traces.size(), 1);
+  for (auto &frames : traces) {
+    call_traces.push_back(CallTrace(&frames));
+  }
+  for (auto &trace : call_traces) {
+    stack_traces.push_back({&trace, kPeriodNanos});
+  }
+  google::javaprofiler::JavaFrameCache cache;
+  for (auto _ : state) {
+    auto builder = google::javaprofiler::ProfileProtoBuilder::ForCpu(
+        FakeJvmti(), kPeriodNanos, &cache);
+    builder->AddTraces(stack_traces.data(), counts.data(),
+                       stack_traces.size());
+    benchmark::DoNotOptimize(builder->CreateProto());
+  }
+  state.SetItemsProcessed(state.iterations() * traces.size());
+}
+BENCHMARK(BM_ProfileProtoBuilderPopulate)
+    ->ArgNames({"depth", "traces"})
+    ->Args({8, 64})
+    ->Args({32, 1024})
+    ->Args({128, 1024});
+
+// Serializes a CPU profile of kSerializedSamples samples into its
+// compressed bytes, as uploaded. The caches the agent keeps across
+// profiles are warm after the first iteration, as in a long running JVM.
+void BM_SerializeProfile(benchmark::State &state) {
+  auto traces = MakeTraces(state.range(0), state.range(1));
+  int64_t count = kSerializedSamples / traces.size();
+  google::javaprofiler::NativeProcessInfo native_info("/dev/null");
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    TraceMultiset aggregated;
+    for (auto &frames : traces) {
+      aggregated.Add(0, frames.size(), frames.data(), count);
+    }
+    state.ResumeTiming();
+    string profile = cloud::profiler::SerializeAndClearJavaCpuTraces(
+        FakeJvmti(), native_info, "cpu", 10 * cloud::profiler::kNanosPerSecond,
+        kPeriodNanos, &aggregated, 0);
+    bytes = profile.size();
+  }
+  state.counters["profile_bytes"] = bytes;
+  state.SetItemsProcessed(state.iterations() * kSerializedSamples);
+}
+BENCHMARK(BM_SerializeProfile)
+    ->ArgNames({"depth", "traces"})
+    ->Args({32, 100})
+    ->Args({32, 1000})
+    ->Args({32, 10000})
+    ->Args({128, 1000})
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  // Room for the traces of all the Profiler benchmarks, unless overridden.
+  FLAGS_cprof_max_stack_traces = 1 << 16;
+  FLAGS_cprof_max_stack_frames = 1 << 20;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  google::javaprofiler::AttributeTable::Init();
+  google::javaprofiler::Asgct::SetAsgct(&FakeAsgct);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
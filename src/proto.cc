@@ -17,29 +17,77 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <algorithm>
+#include <fstream>
 #include <map>
+#include <set>
 #include <string>
+#include <unordered_set>
 
 #include "perftools/profiles/proto/builder.h"
+#include "src/agent_stats.h"
+#include "src/clock.h"
+#include "src/code_cache_map.h"
+#include "src/method_cache.h"
+#include "src/native_symbolizer.h"
+#include "src/perf_events.h"
+#include "src/profile_dictionary.h"
+#include "src/profile_writer.h"
+#include "src/symbolizer_pool.h"
+#include "src/trace_record.h"
+#include "src/uploader.h"
 #include "third_party/javaprofiler/display.h"
 #include "third_party/javaprofiler/stacktrace_fixer.h"
 
+DEFINE_int32(cprof_method_cache_size, 65536,
+             "Max # of Java methods whose names are kept across profiles.");
+DEFINE_bool(cprof_symbolize_native, true,
+            "when true, resolve the native frames to the function symbols "
+            "of the mapped ELF files");
+DEFINE_int64(cprof_profile_dictionary_size, 262144,
+             "Max # of locations of the CPU profiles kept across profiles.");
+DEFINE_string(cprof_record_traces, "",
+              "when set to a path prefix, also save the traces of each CPU "
+              "and wall profile with their methods to a file, to replay "
+              "their serialization offline with trace_replay");
+DEFINE_int32(cprof_max_profile_stacks, 0,
+             "when positive, keep this many distinct stacks with the "
+             "largest weights in each CPU, wall or perf profile, and fold "
+             "the others into an [other] frame under the deepest frame they "
+             "share with the kept stacks, to bound the size of the profiles");
+DEFINE_bool(cprof_stats_in_profile, false,
+            "when set, add the agent's own counters to the CPU and wall "
+            "profiles as a comment");
+
 namespace cloud {
 namespace profiler {
 
 // Encodes a set of java stack traces into a CPU profile, symbolized using
-// the jvmti.
+// the jvmti, and the native symbolizer if not null. The strings, functions
+// and locations come from the dictionary, which must not be used by another
+// builder until EndProfile() is called.
+//
+// The profile is compressed as it is populated, so that its uncompressed
+// form is never held in memory.
 class ProfileProtoBuilder {
  public:
   ProfileProtoBuilder(
       jvmtiEnv *jvmti,
-      const google::javaprofiler::NativeProcessInfo &native_info)
-      : jvmti_(jvmti), native_info_(native_info) {
-    for (const auto &it : google::javaprofiler::AttributeTable::GetStrings()) {
-      builder_.StringId(it.c_str());
-    }
+      const google::javaprofiler::NativeProcessInfo &native_info,
+      MethodCache *method_cache, const NativeSymbolizer *native_symbolizer,
+      ProfileDictionary *dictionary)
+      : jvmti_(jvmti),
+        method_cache_(method_cache),
+        native_symbolizer_(native_symbolizer),
+        dictionary_(dictionary),
+        writer_(&out_),
+        native_info_(native_info) {
+    dictionary_->StartProfile(&writer_);
   }
 
+  // Releases the dictionary, once the profile is complete.
+  void EndProfile() { dictionary_->EndProfile(); }
+
   // Populate the profile with a set of traces
   void Populate(const char *profile_type,
                 const google::javaprofiler::TraceMultiset &traces,
@@ -47,43 +95,66 @@ class ProfileProtoBuilder {
   void AddArtificialSample(const string &name, int64_t count, int64_t weight);
   int64_t TotalCount() const;
   int64_t TotalWeight() const;
+  // Time spent resolving the frames.
+  int64_t SymbolizeNanos() const { return symbolize_nanos_; }
 
-  string Emit() {
-    string out;
-    builder_.Emit(&out);
-    return out;
+  // Adds a comment to the profile. It does not go through the dictionary,
+  // as it is usually different for each profile.
+  void AddComment(const string &comment) {
+    writer_.AddComment(writer_.AddString(comment));
   }
-  void Encode(perftools::profiles::Profile *p) {
-    p->Swap(builder_.mutable_profile());
+
+  // Returns the compressed profile, nothing can be added afterwards.
+  string Emit() {
+    if (!writer_.Close()) {
+      LOG(ERROR) << "Failed to encode the profile";
+      return "";
+    }
+    return std::move(out_);
   }
 
  private:
+  // Resolves the Java frames of the traces not in the dictionary yet on
+  // the SymbolizerPool, and adds them to the dictionary.
+  void ResolveNewFrames(const google::javaprofiler::TraceMultiset &traces);
+  // Adds the pruned traces as samples of an [other] frame, under the
+  // longest prefix from the root they share with one of the kept traces.
+  void AddFoldedSamples(
+      const google::javaprofiler::TraceMultiset &traces,
+      const std::vector<google::javaprofiler::TraceMultiset::const_iterator>
+          &kept,
+      const std::vector<google::javaprofiler::TraceMultiset::const_iterator>
+          &pruned,
+      int64_t period_ns);
   void AddSample(const std::vector<uint64_t> &locations, int64_t count,
                  int64_t weight, int64_t attr);
   uint64_t LocationID(const google::javaprofiler::JVMPI_CallFrame &frame);
   uint64_t LocationID(uint64_t address);
   uint64_t LocationID(const string &name);
-  uint64_t LocationID(const string &class_name, const string &method_name,
-                      const string &signature, const string &file_name,
-                      int line_number);
+  uint64_t LocationID(const string &name, const string &simplified_name,
+                      const string &file_name, int line_number);
+  uint64_t MappingID(
+      const google::javaprofiler::NativeProcessInfo::Mapping &mapping);
 
   jvmtiEnv *jvmti_;
+  MethodCache *method_cache_;
+  const NativeSymbolizer *native_symbolizer_;
+  ProfileDictionary *dictionary_;
   int64_t total_count_ = 0;
   int64_t total_weight_ = 0;
-  perftools::profiles::Builder builder_;
-
-  typedef std::tuple<uint64_t, int> Line;
-  class LineHasher {
-   public:
-    size_t operator()(const Line &f) const {
-      size_t hash = std::get<0>(f);
-      hash = hash + ((hash << 8) ^ std::get<1>(f));
-      return static_cast<size_t>(hash);
-    }
-  };
-
-  std::unordered_map<Line, uint64_t, LineHasher> line_map_;
+  int64_t symbolize_nanos_ = 0;
+  string out_;
+  ProfileWriter writer_;
+  // Reused by all the samples.
+  perftools::profiles::Sample sample_;
+
+  // Locations of the native frames, which are not kept in the dictionary
+  // as the mappings change across profiles.
   std::unordered_map<uint64_t, uint64_t> address_location_;
+  // Only the mappings holding native frames are written to the profile.
+  std::unordered_map<const google::javaprofiler::NativeProcessInfo::Mapping *,
+                     uint64_t>
+      mapping_ids_;
 
   const google::javaprofiler::NativeProcessInfo &native_info_;
   DISALLOW_COPY_AND_ASSIGN(ProfileProtoBuilder);
@@ -118,6 +189,33 @@ string CallTraceErrorToName(int64_t err) {
   }
 }
 
+// Returns the hash of the prefix of a trace from its root made of the
+// prefix of hash h and frame.
+uint64_t PrefixHash(uint64_t h, const JVMPI_CallFrame &frame) {
+  h ^= reinterpret_cast<uint64_t>(frame.method_id) + 0x9e3779b97f4a7c15ULL +
+       (h << 6) + (h >> 2);
+  h ^= static_cast<uint64_t>(static_cast<uint32_t>(frame.lineno)) *
+       0xff51afd7ed558ccdULL;
+  return h * 0xc4ceb9fe1a85ec53ULL;
+}
+
+// Saves the traces for trace_replay, under the --cprof_record_traces prefix.
+void RecordTraces(jvmtiEnv *jvmti, const char *profile_type,
+                  int64_t duration_ns, int64_t period_ns,
+                  const google::javaprofiler::TraceMultiset &traces,
+                  int64_t unknown_count) {
+  string path =
+      ProfilePath(FLAGS_cprof_record_traces, profile_type, ".traces");
+  string record = EncodeTraceRecord(jvmti, profile_type, duration_ns,
+                                    period_ns, traces, unknown_count);
+  std::ofstream out(path, std::ios::binary);
+  out.write(record.data(), record.size());
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Failed to record the traces to " << path;
+  }
+}
+
 }  // namespace
 
 void ProfileProtoBuilder::AddArtificialSample(const string &name, int64_t count,
@@ -132,7 +230,16 @@ int64_t ProfileProtoBuilder::TotalWeight() const { return total_weight_; }
 uint64_t ProfileProtoBuilder::LocationID(
     const google::javaprofiler::JVMPI_CallFrame &frame) {
   if (frame.lineno == google::javaprofiler::kNativeFrameLineNum) {
-    return LocationID(reinterpret_cast<uint64_t>(frame.method_id));
+    uint64_t address = reinterpret_cast<uint64_t>(frame.method_id);
+    JVMPI_CallFrame java_frame;
+    string code_name;
+    if (CodeCacheMap::Lookup(address, &java_frame, &code_name)) {
+      return LocationID(java_frame);
+    }
+    if (!code_name.empty()) {
+      return LocationID("[" + code_name + "]");
+    }
+    return LocationID(address);
   }
 
   if (frame.lineno == google::javaprofiler::kCallTraceErrorLineNum) {
@@ -140,14 +247,78 @@ uint64_t ProfileProtoBuilder::LocationID(
         CallTraceErrorToName(reinterpret_cast<size_t>(frame.method_id)));
   }
 
-  string method_name, class_name, file_name, signature;
-  int line_number = 0;
-  google::javaprofiler::GetStackFrameElements(jvmti_, frame, &file_name,
-                                              &class_name, &method_name,
-                                              &signature, &line_number);
-  google::javaprofiler::FixMethodParameters(&signature);
+  if (frame.lineno == google::javaprofiler::kTruncatedFrameLineNum) {
+    return LocationID("[truncated]");
+  }
 
-  return LocationID(class_name, method_name, signature, file_name, line_number);
+  // The same frames show up in many traces and profiles, only resolve them
+  // once.
+  uint64_t location_id =
+      dictionary_->FrameLocationId(frame.method_id, frame.lineno);
+  if (location_id != 0) {
+    return location_id;
+  }
+
+  int64_t start = TimeSpecToNanos(DefaultClock()->Now());
+  const MethodCache::Method &method =
+      method_cache_->Lookup(jvmti_, frame.method_id);
+  // frame.lineno is actually a bci for Java frames.
+  int line_number = method.LineNumber(frame.lineno);
+  symbolize_nanos_ += TimeSpecToNanos(DefaultClock()->Now()) - start;
+  if (method.failed) {
+    // Not keyed on the frame, so that it is resolved again in the next
+    // profile.
+    return LocationID(method.name, method.simplified_name, method.file_name,
+                      line_number);
+  }
+  return dictionary_->AddFrameLocation(frame.method_id, frame.lineno,
+                                       method.simplified_name, method.name,
+                                       method.file_name, line_number);
+}
+
+void ProfileProtoBuilder::ResolveNewFrames(
+    const google::javaprofiler::TraceMultiset &traces) {
+  int64_t start = TimeSpecToNanos(DefaultClock()->Now());
+  std::vector<SymbolizerPool::Frame> frames;
+  std::set<std::pair<jmethodID, int>> seen_frames;
+  std::unordered_set<jmethodID> seen_methods;
+  for (const auto &trace : traces) {
+    traces.ForEachFrame(trace.first, [&](const JVMPI_CallFrame &frame) {
+      if (frame.lineno == google::javaprofiler::kNativeFrameLineNum ||
+          frame.lineno == google::javaprofiler::kCallTraceErrorLineNum ||
+          frame.lineno == google::javaprofiler::kTruncatedFrameLineNum ||
+          dictionary_->HasFrameLocation(frame.method_id, frame.lineno)) {
+        return;
+      }
+      if (!seen_frames.insert(std::make_pair(frame.method_id, frame.lineno))
+               .second) {
+        return;
+      }
+      SymbolizerPool::Frame f;
+      f.method_id = frame.method_id;
+      f.bci = frame.lineno;
+      f.resolve_method = !method_cache_->Contains(frame.method_id) &&
+                         seen_methods.insert(frame.method_id).second;
+      frames.push_back(std::move(f));
+    });
+  }
+  SymbolizerPool::Resolve(jvmti_, &frames);
+
+  // In the order of the frames, a method resolved by a frame is in the
+  // cache for the next ones.
+  for (auto &f : frames) {
+    const MethodCache::Method &method =
+        f.resolve_method ? method_cache_->Add(f.method_id, std::move(f.method))
+                         : method_cache_->Lookup(jvmti_, f.method_id);
+    if (method.failed) {
+      // Left to LocationID(), see there.
+      continue;
+    }
+    dictionary_->AddFrameLocation(f.method_id, f.bci, method.simplified_name,
+                                  method.name, method.file_name,
+                                  method.LineNumber(f.bci));
+  }
+  symbolize_nanos_ += TimeSpecToNanos(DefaultClock()->Now()) - start;
 }
 
 uint64_t ProfileProtoBuilder::LocationID(uint64_t address) {
@@ -156,104 +327,200 @@ uint64_t ProfileProtoBuilder::LocationID(uint64_t address) {
     return location_id;
   }
 
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-  location_id = profile->location_size() + 1;
+  string function_name, file_name;
+  uint64_t function_id = 0;
+  int64_t start = TimeSpecToNanos(DefaultClock()->Now());
+  if (native_symbolizer_ != nullptr &&
+      native_symbolizer_->Symbolize(address, &function_name, &file_name)) {
+    function_id =
+        dictionary_->FunctionId(function_name, function_name, file_name);
+  }
+  symbolize_nanos_ += TimeSpecToNanos(DefaultClock()->Now()) - start;
+
+  perftools::profiles::Location loc;
+  loc.set_address(address);
+  const google::javaprofiler::NativeProcessInfo::Mapping *mapping =
+      native_info_.Find(address);
+  if (mapping != nullptr) {
+    loc.set_mapping_id(MappingID(*mapping));
+  }
+  if (function_id != 0) {
+    loc.add_line()->set_function_id(function_id);
+  }
+
+  location_id = writer_.AddLocation(&loc);
   address_location_[address] = location_id;
+  return location_id;
+}
 
-  perftools::profiles::Location *loc = profile->add_location();
-  loc->set_id(location_id);
-  loc->set_address(address);
+uint64_t ProfileProtoBuilder::MappingID(
+    const google::javaprofiler::NativeProcessInfo::Mapping &mapping) {
+  uint64_t &mapping_id = mapping_ids_[&mapping];
+  if (mapping_id != 0) {
+    return mapping_id;
+  }
 
-  return location_id;
+  perftools::profiles::Mapping m;
+  m.set_memory_start(mapping.start);
+  m.set_memory_limit(mapping.limit);
+  m.set_file_offset(mapping.offset);
+  m.set_filename(dictionary_->StringId(mapping.name));
+  mapping_id = writer_.AddMapping(&m);
+  return mapping_id;
 }
 
 uint64_t ProfileProtoBuilder::LocationID(const string &name) {
-  return LocationID("", name, "", "", 0);
+  return LocationID(name, ::google::javaprofiler::SimplifyFunctionName(name),
+                    "", 0);
 }
 
-uint64_t ProfileProtoBuilder::LocationID(const string &class_name,
-                                         const string &method_name,
-                                         const string &signature,
+uint64_t ProfileProtoBuilder::LocationID(const string &name,
+                                         const string &simplified_name,
                                          const string &file_name,
                                          int line_number) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-
-  string frame_name;
-  if (!class_name.empty()) {
-    frame_name = class_name + ".";
-  }
-  frame_name += method_name;
-
-  if (!signature.empty()) {
-    frame_name += signature;
-  }
-
-  const string simplified_name =
-      ::google::javaprofiler::SimplifyFunctionName(frame_name);
-
-  uint64_t function_id = builder_.FunctionId(
-      simplified_name.c_str(), frame_name.c_str(), file_name.c_str(), 0);
-
-  uint64_t location_id = profile->location_size() + 1;
-  Line function_line(function_id, line_number);
-  auto inserted = line_map_.insert(std::make_pair(function_line, location_id));
-  if (!inserted.second) {
-    return inserted.first->second;
-  }
-
-  perftools::profiles::Location *loc = profile->add_location();
-  loc->set_id(location_id);
-  perftools::profiles::Line *line = loc->add_line();
-  line->set_function_id(function_id);
-  line->set_line(line_number);
-
-  return location_id;
+  return dictionary_->LocationId(simplified_name, name, file_name,
+                                 line_number);
 }
 
 void ProfileProtoBuilder::Populate(
     const char *profile_type, const google::javaprofiler::TraceMultiset &traces,
     int64_t duration_ns, int64_t period_ns) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
+  // The perf event profiles count events rather than time.
+  const char *unit =
+      FindPerfEvent(profile_type) != nullptr ? "count" : "nanoseconds";
+  perftools::profiles::ValueType value_type;
+  value_type.set_type(dictionary_->StringId(profile_type));
+  value_type.set_unit(dictionary_->StringId(unit));
+  writer_.SetPeriodType(value_type);
+  writer_.SetPeriod(period_ns);
+
+  value_type.set_type(dictionary_->StringId("sample"));
+  value_type.set_unit(dictionary_->StringId("count"));
+  writer_.AddSampleType(value_type);
+
+  value_type.set_type(dictionary_->StringId(profile_type));
+  value_type.set_unit(dictionary_->StringId(unit));
+  writer_.AddSampleType(value_type);
+
+  writer_.SetDurationNanos(duration_ns);
+
+  if (SymbolizerPool::NumThreads() > 0) {
+    ResolveNewFrames(traces);
+  }
 
-  profile->mutable_period_type()->set_type(builder_.StringId(profile_type));
-  profile->mutable_period_type()->set_unit(builder_.StringId("nanoseconds"));
-  profile->set_period(period_ns);
-  perftools::profiles::ValueType *sample_type = profile->add_sample_type();
-  sample_type->set_type(builder_.StringId("sample"));
-  sample_type->set_unit(builder_.StringId("count"));
+  std::vector<google::javaprofiler::TraceMultiset::const_iterator> kept,
+      pruned;
+  for (auto it = traces.begin(); it != traces.end(); ++it) {
+    if (it->second != 0) {
+      kept.push_back(it);
+    }
+  }
+  size_t max_stacks = FLAGS_cprof_max_profile_stacks;
+  if (max_stacks > 0 && kept.size() > max_stacks) {
+    std::nth_element(
+        kept.begin(), kept.begin() + max_stacks, kept.end(),
+        [](const google::javaprofiler::TraceMultiset::const_iterator &a,
+           const google::javaprofiler::TraceMultiset::const_iterator &b) {
+          return a->second > b->second;
+        });
+    pruned.assign(kept.begin() + max_stacks, kept.end());
+    kept.resize(max_stacks);
+    LOG(INFO) << "Folding " << pruned.size() << " of "
+              << kept.size() + pruned.size() << " stacks of the "
+              << profile_type << " profile into [other]";
+  }
 
-  sample_type = profile->add_sample_type();
-  sample_type->set_type(builder_.StringId(profile_type));
-  sample_type->set_unit(builder_.StringId("nanoseconds"));
+  std::vector<uint64_t> locations;
+  for (const auto &it : kept) {
+    int64_t count = it->second;
+    const auto &call_trace = it->first;
+    locations.clear();
+    traces.ForEachFrame(call_trace, [&](const JVMPI_CallFrame &frame) {
+      // The error is the root, under the program counter if any.
+      if (frame.lineno == google::javaprofiler::kCallTraceErrorLineNum) {
+        AgentStats::AddCallTraceErrors(
+            static_cast<int>(reinterpret_cast<intptr_t>(frame.method_id)),
+            count);
+      }
+      locations.push_back(LocationID(frame));
+    });
+    AddSample(locations, count, count * period_ns, call_trace.attr);
+  }
+  if (!pruned.empty()) {
+    AddFoldedSamples(traces, kept, pruned, period_ns);
+  }
+}
 
-  profile->set_duration_nanos(duration_ns);
+void ProfileProtoBuilder::AddFoldedSamples(
+    const google::javaprofiler::TraceMultiset &traces,
+    const std::vector<google::javaprofiler::TraceMultiset::const_iterator>
+        &kept,
+    const std::vector<google::javaprofiler::TraceMultiset::const_iterator>
+        &pruned,
+    int64_t period_ns) {
+  // Hashes of all the prefixes of the kept traces, from their root.
+  std::unordered_set<uint64_t> prefixes;
+  std::vector<JVMPI_CallFrame> frames;
+  for (const auto &it : kept) {
+    frames.resize(it->first.num_frames);
+    traces.Frames(it->first, frames.data());
+    uint64_t h = 0;
+    for (int i = it->first.num_frames - 1; i >= 0; i--) {
+      h = PrefixHash(h, frames[i]);
+      prefixes.insert(h);
+    }
+  }
 
-  for (const auto &trace : traces) {
-    int64_t count = trace.second;
-    if (count != 0) {
-      std::vector<uint64_t> locations;
-      for (const auto &frame : trace.first.frames) {
-        locations.push_back(LocationID(frame));
+  struct Folded {
+    std::vector<uint64_t> locations;
+    int64_t count = 0;
+  };
+  // Keyed on the attribute and the hash of the shared prefix.
+  std::map<std::pair<int64_t, uint64_t>, Folded> folded;
+  for (const auto &it : pruned) {
+    int num_frames = it->first.num_frames;
+    frames.resize(num_frames);
+    traces.Frames(it->first, frames.data());
+    if (num_frames > 0 &&
+        frames[num_frames - 1].lineno ==
+            google::javaprofiler::kCallTraceErrorLineNum) {
+      AgentStats::AddCallTraceErrors(
+          static_cast<int>(reinterpret_cast<intptr_t>(
+              frames[num_frames - 1].method_id)),
+          it->second);
+    }
+    // The prefixes of the kept traces include all their own prefixes, so
+    // the longest shared one ends at the first frame missing.
+    uint64_t h = 0;
+    int shared = 0;
+    while (shared < num_frames) {
+      uint64_t next = PrefixHash(h, frames[num_frames - 1 - shared]);
+      if (prefixes.count(next) == 0) {
+        break;
+      }
+      h = next;
+      shared++;
+    }
+    Folded &f = folded[std::make_pair(it->first.attr, h)];
+    if (f.locations.empty()) {
+      f.locations.push_back(LocationID("[other]"));
+      for (int i = num_frames - shared; i < num_frames; i++) {
+        f.locations.push_back(LocationID(frames[i]));
       }
-      AddSample(locations, count, count * period_ns, trace.first.attr);
     }
+    f.count += it->second;
   }
-
-  for (const auto &mapping : native_info_.Mappings()) {
-    perftools::profiles::Mapping *m = profile->add_mapping();
-    m->set_id(profile->mapping_size());
-    m->set_memory_start(mapping.start);
-    m->set_memory_limit(mapping.limit);
-    m->set_filename(builder_.StringId(mapping.name.c_str()));
+  for (const auto &f : folded) {
+    AddSample(f.second.locations, f.second.count,
+              f.second.count * period_ns, f.first.first);
   }
 }
 
 void ProfileProtoBuilder::AddSample(const std::vector<uint64_t> &locations,
                                     int64_t count, int64_t weight,
                                     int64_t attr) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-
-  perftools::profiles::Sample *sample = profile->add_sample();
+  perftools::profiles::Sample *sample = &sample_;
+  sample->Clear();
   sample->add_value(count);
   total_count_ += count;
   sample->add_value(weight);
@@ -264,23 +531,76 @@ void ProfileProtoBuilder::AddSample(const std::vector<uint64_t> &locations,
   }
 
   if (attr != 0) {
-    perftools::profiles::Label *label = sample->add_label();
-    label->set_key(builder_.StringId("attr"));
-    label->set_str(attr);
+    int values[google::javaprofiler::AttributeTable::kMaxKeys];
+    google::javaprofiler::AttributeTable::GetValues(attr, values);
+    for (int key = 0; key < google::javaprofiler::AttributeTable::kMaxKeys;
+         key++) {
+      int64_t str = dictionary_->AttributeStringId(values[key]);
+      if (str == 0) {
+        continue;
+      }
+      perftools::profiles::Label *label = sample->add_label();
+      label->set_key(key == 0 ? dictionary_->StringId("attr")
+                              : dictionary_->AttributeStringId(
+                                    google::javaprofiler::AttributeTable::
+                                        KeyString(key)));
+      label->set_str(str);
+    }
   }
+  writer_.AddSample(*sample);
 }
 
 string SerializeAndClearJavaCpuTraces(
     jvmtiEnv *jvmti, const google::javaprofiler::NativeProcessInfo &native_info,
     const char *profile_type, int64_t duration_ns, int64_t period_ns,
-    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count) {
-  ProfileProtoBuilder b(jvmti, native_info);
+    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count,
+    const std::vector<ArtificialSample> &artificial_samples) {
+  // Shared by all profiles, as the same methods show up again and again.
+  static MethodCache *method_cache =
+      new MethodCache(FLAGS_cprof_method_cache_size);
+  // Same for the native symbols, only the new mappings are indexed.
+  static NativeSymbolizer *native_symbolizer =
+      FLAGS_cprof_symbolize_native ? new NativeSymbolizer() : nullptr;
+  int64_t start = TimeSpecToNanos(DefaultClock()->Now());
+  if (native_symbolizer != nullptr) {
+    native_symbolizer->Update(native_info);
+  }
+  CodeCacheMap::Update();
+  AgentStats::Add(AgentStats::kSymbolizeNanos,
+                  TimeSpecToNanos(DefaultClock()->Now()) - start);
+  // Same for the strings, functions and locations of the profiles.
+  static ProfileDictionary *dictionary =
+      new ProfileDictionary(FLAGS_cprof_profile_dictionary_size);
+  if (method_cache->EvictRedefined()) {
+    // The frames of the evicted methods, and of those evicted earlier whose
+    // class is not known anymore, may have stale names and lines.
+    dictionary->DropFrameLocations([](jmethodID method_id) {
+      return !method_cache->Contains(method_id);
+    });
+  }
+
+  if (!FLAGS_cprof_record_traces.empty()) {
+    RecordTraces(jvmti, profile_type, duration_ns, period_ns, *traces,
+                 unknown_count);
+  }
+
+  ProfileProtoBuilder b(jvmti, native_info, method_cache, native_symbolizer,
+                        dictionary);
   b.Populate(profile_type, *traces, duration_ns, period_ns);
+  method_cache->EndProfile();
   b.AddArtificialSample("[Unknown]", unknown_count, unknown_count * period_ns);
+  for (const ArtificialSample &sample : artificial_samples) {
+    b.AddArtificialSample(sample.name, sample.count, sample.weight);
+  }
+  if (FLAGS_cprof_stats_in_profile) {
+    b.AddComment(AgentStats::ToString());
+  }
+  b.EndProfile();
+  AgentStats::Add(AgentStats::kSymbolizeNanos, b.SymbolizeNanos());
   LOG(INFO) << "Collected a profile: total count=" << b.TotalCount()
             << ", weight=" << b.TotalWeight();
 
-  traces->Clear();  // Release traces before binary encoding to reuse memory
+  traces->Clear();
   return b.Emit();
 }
 
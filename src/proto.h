@@ -17,19 +17,32 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 #define CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 
+#include <vector>
+
 #include "src/profiler.h"
 #include "perftools/profiles/proto/builder.h"
 
 namespace cloud {
 namespace profiler {
 
+// A sample of a single frame which is not part of a stack trace, such as
+// "[GC pause]".
+struct ArtificialSample {
+  string name;
+  int64_t count;
+  int64_t weight;
+};
+
 // Generates a CPU profile in a compressed serialized profile.proto
 // from a collection of java stack traces, symbolized using the jvmti.
-// Data in traces will be cleared.
+// Data in traces will be cleared. The artificial samples are added along
+// with the [Unknown] one of the unknown_count failed traces.
 string SerializeAndClearJavaCpuTraces(
     jvmtiEnv *jvmti, const google::javaprofiler::NativeProcessInfo &native_info,
     const char *profile_type, int64_t duration_nanos, int64_t period_nanos,
-    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count);
+    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count,
+    const std::vector<ArtificialSample> &artificial_samples =
+        std::vector<ArtificialSample>());
 
 }  // namespace profiler
 }  // namespace cloud
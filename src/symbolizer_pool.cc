@@ -0,0 +1,135 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "src/symbolizer_pool.h"
+
+#include <algorithm>
+
+DEFINE_int32(cprof_symbolizer_threads, 0,
+             "number of threads resolving the Java frames of the profiles "
+             "along with the profiling thread, 0 to resolve them on the "
+             "profiling thread alone");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Number of frames taken at once by a thread, to keep the shared index off
+// the hot path of the JVMTI calls.
+const size_t kFramesPerBatch = 32;
+
+}  // namespace
+
+int SymbolizerPool::num_threads_;
+std::mutex SymbolizerPool::mutex_;
+std::condition_variable SymbolizerPool::work_cv_;
+std::condition_variable SymbolizerPool::done_cv_;
+std::vector<SymbolizerPool::Frame> *SymbolizerPool::frames_;
+std::atomic<size_t> SymbolizerPool::next_frame_;
+int64_t SymbolizerPool::generation_;
+int SymbolizerPool::busy_;
+bool SymbolizerPool::stopping_;
+
+void SymbolizerPool::Start(jvmtiEnv *jvmti, JNIEnv *jni) {
+  jclass cls = jni->FindClass("java/lang/Thread");
+  jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+  for (int i = 0; i < FLAGS_cprof_symbolizer_threads; i++) {
+    jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
+    if (thread == nullptr) {
+      LOG(ERROR) << "Failed to construct a symbolizer thread";
+      break;
+    }
+    // Counted before starting, the thread may look for work right away.
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_threads_++;
+    }
+    jvmtiError err =
+        jvmti->RunAgentThread(thread, Run, nullptr, JVMTI_THREAD_MIN_PRIORITY);
+    if (err != JVMTI_ERROR_NONE) {
+      LOG(ERROR) << "Failed to start a symbolizer thread";
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_threads_--;
+      break;
+    }
+  }
+  if (num_threads_ > 0) {
+    LOG(INFO) << "Started " << num_threads_ << " symbolizer threads";
+  }
+}
+
+void SymbolizerPool::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = true;
+  work_cv_.notify_all();
+}
+
+void SymbolizerPool::Resolve(jvmtiEnv *jvmti, std::vector<Frame> *frames) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frames_ = frames;
+    next_frame_.store(0, std::memory_order_relaxed);
+    generation_++;
+    busy_ = num_threads_;
+    work_cv_.notify_all();
+  }
+  ResolveFrames(jvmti);
+  // The frames must outlive the threads still resolving the last ones.
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, []() { return busy_ == 0; });
+  frames_ = nullptr;
+}
+
+void JNICALL SymbolizerPool::Run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  IMPLICITLY_USE(jni);
+  IMPLICITLY_USE(arg);
+  int64_t done = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [&]() { return generation_ != done || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    done = generation_;
+    lock.unlock();
+    ResolveFrames(jvmti);
+    lock.lock();
+    if (--busy_ == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+void SymbolizerPool::ResolveFrames(jvmtiEnv *jvmti) {
+  std::vector<Frame> &frames = *frames_;
+  while (true) {
+    size_t start =
+        next_frame_.fetch_add(kFramesPerBatch, std::memory_order_relaxed);
+    if (start >= frames.size()) {
+      return;
+    }
+    size_t end = std::min(start + kFramesPerBatch, frames.size());
+    for (size_t i = start; i < end; i++) {
+      Frame &frame = frames[i];
+      if (frame.resolve_method) {
+        MethodCache::Resolve(jvmti, frame.method_id, &frame.method);
+      }
+    }
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_SYMBOLIZER_POOL_H_
+#define CLOUD_PROFILER_AGENT_JAVA_SYMBOLIZER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <mutex>               // NOLINT
+#include <vector>
+
+#include "src/globals.h"
+#include "src/method_cache.h"
+
+namespace cloud {
+namespace profiler {
+
+// SymbolizerPool resolves the Java methods of a profile on a few agent
+// threads, as the JVMTI calls it takes for each new method can be called
+// concurrently. The profiling thread hands out the frames it has not seen
+// yet, and takes part in the work until all are resolved. The results are
+// then added to the caches and the profile by the profiling thread alone,
+// in the order of the frames, so the profile does not depend on the
+// threads.
+class SymbolizerPool {
+ public:
+  // A Java frame to resolve.
+  struct Frame {
+    jmethodID method_id;
+    int bci;
+    // Whether the names of the method are to be resolved, they are
+    // otherwise in the method cache already.
+    bool resolve_method;
+    MethodCache::Method method;
+  };
+
+  // Starts the threads of the pool, when enabled by the flags. Must be
+  // called from a thread attached to the JVM.
+  static void Start(jvmtiEnv *jvmti, JNIEnv *jni);
+
+  // Tells the threads to exit, they are not waited for.
+  static void Stop();
+
+  // Returns the number of threads of the pool, 0 if not started.
+  static int NumThreads() { return num_threads_; }
+
+  // Resolves the frames, on the pool threads and the calling one. Can only
+  // be called from one thread at a time.
+  static void Resolve(jvmtiEnv *jvmti, std::vector<Frame> *frames);
+
+ private:
+  static void JNICALL Run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+  // Resolves frames of frames_ until there are none left.
+  static void ResolveFrames(jvmtiEnv *jvmti);
+
+  static int num_threads_;
+  static std::mutex mutex_;
+  static std::condition_variable work_cv_;
+  static std::condition_variable done_cv_;
+  // The frames being resolved, and the index of the next ones to take.
+  static std::vector<Frame> *frames_;
+  static std::atomic<size_t> next_frame_;
+  // Incremented for each call to Resolve(), so that the threads only work
+  // once on each.
+  static int64_t generation_;
+  // Number of threads still working on the current generation.
+  static int busy_;
+  static bool stopping_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(SymbolizerPool);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_SYMBOLIZER_POOL_H_
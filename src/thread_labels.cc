@@ -0,0 +1,133 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/thread_labels.h"
+
+#include <ctype.h>
+
+#include <mutex>  // NOLINT
+#include <unordered_set>
+
+#include "third_party/javaprofiler/stacktraces.h"
+
+DEFINE_string(cprof_thread_label, "",
+              "Label the CPU and wall samples with their thread: 'name' for "
+              "the thread name, 'pool' for the name with its digits "
+              "stripped, empty for no label. The labels are never released: "
+              "with 'name', the threads past the first "
+              "cprof_thread_label_max_names distinct names get the 'pool' "
+              "label.");
+DEFINE_int32(cprof_thread_label_max_names, 1024,
+             "Most distinct thread names used as labels with "
+             "--cprof_thread_label=name, so that the threads churned by a "
+             "service do not fill the attribute table shared with the "
+             "application");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Name of the label key in the profiles.
+const char kThreadLabelKey[] = "thread";
+
+}  // namespace
+
+int ThreadLabels::key_ = 0;
+
+void ThreadLabels::Init() {
+  if (FLAGS_cprof_thread_label.empty()) {
+    return;
+  }
+  if (FLAGS_cprof_thread_label != "name" &&
+      FLAGS_cprof_thread_label != "pool") {
+    LOG(ERROR) << "Unknown thread label '" << FLAGS_cprof_thread_label
+               << "', the samples are not labelled with their thread";
+    return;
+  }
+  key_ = google::javaprofiler::AttributeTable::RegisterKey(kThreadLabelKey);
+  if (key_ == 0) {
+    LOG(ERROR) << "No room for the thread label key";
+  }
+}
+
+void ThreadLabels::SetCurrent(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread) {
+  if (key_ == 0) {
+    return;
+  }
+  jvmtiThreadInfo info;
+  JVMTI_ERROR(jvmti->GetThreadInfo(thread, &info));
+  JvmtiScopedPtr<char> name(jvmti, info.name);
+  jni->DeleteLocalRef(info.thread_group);
+  jni->DeleteLocalRef(info.context_class_loader);
+  int attr = google::javaprofiler::Accessors::GetAttribute();
+  google::javaprofiler::Accessors::SetAttribute(
+      LabelAttribute(attr, info.name));
+}
+
+int ThreadLabels::LabelAttribute(int attr, const char *name) {
+  if (key_ == 0) {
+    return attr;
+  }
+  bool pool = FLAGS_cprof_thread_label == "pool";
+  if (!pool) {
+    // Thread names registered as labels so far.
+    static std::mutex *mutex = new std::mutex();
+    static std::unordered_set<string> *names = new std::unordered_set<string>();
+    std::lock_guard<std::mutex> lock(*mutex);
+    string label = Label(name, false);
+    if (names->count(label) == 0) {
+      if (names->size() < FLAGS_cprof_thread_label_max_names) {
+        names->insert(label);
+      } else {
+        pool = true;
+      }
+    }
+  }
+  int value = google::javaprofiler::AttributeTable::RegisterString(
+      Label(name, pool).c_str());
+  if (value == 0) {
+    return attr;
+  }
+  return google::javaprofiler::AttributeTable::SetValue(attr, key_, value);
+}
+
+int ThreadLabels::KeepLabel(int current, int attr) {
+  if (key_ == 0) {
+    return attr;
+  }
+  int values[google::javaprofiler::AttributeTable::kMaxKeys];
+  google::javaprofiler::AttributeTable::GetValues(current, values);
+  if (values[key_] == 0) {
+    return attr;
+  }
+  return google::javaprofiler::AttributeTable::SetValue(attr, key_,
+                                                        values[key_]);
+}
+
+string ThreadLabels::Label(const char *name, bool pool) {
+  if (name == nullptr) {
+    return "";
+  }
+  string label;
+  for (const char *c = name; *c != '\0'; c++) {
+    if (!pool || !isdigit(static_cast<unsigned char>(*c))) {
+      label.push_back(*c);
+    }
+  }
+  return label;
+}
+
+}  // namespace profiler
+}  // namespace cloud
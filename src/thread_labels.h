@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_THREAD_LABELS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_THREAD_LABELS_H_
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// ThreadLabels labels the samples of each thread with its name, or the
+// name of its pool. The label is a key of the AttributeTable set in the
+// attribute of the thread when it starts, so the samples only carry the
+// attribute id as before and the signal handler does no string work.
+class ThreadLabels {
+ public:
+  // Registers the label key, when enabled by the flags. Must be called
+  // after AttributeTable::Init().
+  static void Init();
+
+  // Sets the label of the current thread from the name of thread, which
+  // must be the current one. Does nothing unless enabled.
+  static void SetCurrent(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread);
+
+  // Returns attr with the label for a thread of the given name, or attr as
+  // is unless enabled. The names past the first
+  // --cprof_thread_label_max_names get the pool label instead.
+  static int LabelAttribute(int attr, const char *name);
+
+  // Returns attr with the thread label of the current attribute, so that
+  // replacing the attribute of a thread keeps its label.
+  static int KeepLabel(int current, int attr);
+
+  // Returns the label for a thread name: the name itself, or the name with
+  // its digits stripped when pool is true, for instance "pool--thread-"
+  // for "pool-1-thread-12".
+  static string Label(const char *name, bool pool);
+
+ private:
+  // Key of the label, 0 when disabled.
+  static int key_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(ThreadLabels);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_THREAD_LABELS_H_
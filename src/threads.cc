@@ -14,11 +14,20 @@
 
 #include "src/threads.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
 #include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <unordered_set>
+
+#include "src/clock.h"
+
 namespace cloud {
 namespace profiler {
 
@@ -26,13 +35,22 @@ namespace {
 
 const timer_t kInvalidTimer = reinterpret_cast<timer_t>(-1LL);
 
+// Returns the ID of the clock measuring the CPU time of a thread of this
+// process, as encoded by the kernel (and used by pthread_getcpuclockid).
+// Unlike CLOCK_THREAD_CPUTIME_ID, it can be used from any thread.
+clockid_t ThreadCpuClock(pid_t tid) {
+  const clockid_t kCpuClockPerThreadSched = 6;
+  return (~static_cast<clockid_t>(tid) << 3) | kCpuClockPerThreadSched;
+}
+
 timer_t CreateTimer(pid_t tid) {
   struct sigevent sevp = {};
   sevp.sigev_notify = SIGEV_THREAD_ID;
   sevp._sigev_un._tid = tid;
   sevp.sigev_signo = SIGPROF;
   timer_t timer = kInvalidTimer;
-  int err = timer_create(CLOCK_THREAD_CPUTIME_ID, &sevp, &timer);
+  // The timer may be created from another thread than the one it samples.
+  int err = timer_create(ThreadCpuClock(tid), &sevp, &timer);
   if (err) {
     LOG(ERROR) << "Failed to create timer: " << err;
     return kInvalidTimer;
@@ -60,64 +78,532 @@ void DeleteTimer(timer_t timer) {
   }
 }
 
+// Slot of the current thread in the thread table, -1 if not registered.
+__thread int64_t current_slot = -1;
+
+const uint64_t kFreeIndexMask = 0xffffffff;
+
+int64_t ClockNanos(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) {
+    return -1;
+  }
+  return TimeSpecToNanos(ts);
+}
+
 }  // namespace
 
+__thread ThreadTable::Slot *ThreadTable::current_;
+
+ThreadTable::ThreadTable(bool use_timers, int frame_buffer_size)
+    : num_slots_(0), free_head_(0), size_(0), use_timers_(use_timers),
+      frame_buffer_size_(frame_buffer_size), period_usec_(0),
+      perf_event_(nullptr), perf_period_(0) {
+  for (int i = 0; i < kMaxSegments; i++) {
+    segments_[i] = nullptr;
+  }
+}
+
+ThreadTable::~ThreadTable() {
+  for (int i = 0; i < kMaxSegments; i++) {
+    Slot *segment = segments_[i].load();
+    if (segment == nullptr) {
+      continue;
+    }
+    for (int j = 0; j < kSegmentSlots; j++) {
+      delete[] segment[j].frames;
+    }
+    delete[] segment;
+  }
+}
+
+ThreadTable::Slot *ThreadTable::SlotAt(uint32_t index) const {
+  Slot *segment = segments_[index / kSegmentSlots].load(
+      std::memory_order_acquire);
+  return segment == nullptr ? nullptr : &segment[index % kSegmentSlots];
+}
+
+uint32_t ThreadTable::NumSlots() const {
+  uint32_t num_slots = num_slots_.load(std::memory_order_acquire);
+  uint32_t max_slots = kMaxSegments * kSegmentSlots;
+  return num_slots < max_slots ? num_slots : max_slots;
+}
+
+int64_t ThreadTable::AllocateSlot() {
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  while ((head & kFreeIndexMask) != 0) {
+    uint32_t index = (head & kFreeIndexMask) - 1;
+    uint64_t next = SlotAt(index)->next_free.load(std::memory_order_relaxed);
+    uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+    if (free_head_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acquire)) {
+      return index;
+    }
+  }
+
+  uint32_t index = num_slots_.fetch_add(1, std::memory_order_relaxed);
+  if (index >= static_cast<uint32_t>(kMaxSegments * kSegmentSlots)) {
+    return -1;
+  }
+  std::atomic<Slot *> &segment = segments_[index / kSegmentSlots];
+  if (segment.load(std::memory_order_acquire) == nullptr) {
+    Slot *slots = new Slot[kSegmentSlots]();
+    for (int i = 0; i < kSegmentSlots; i++) {
+      slots[i].timer = kInvalidTimer;
+      slots[i].perf_fd = -1;
+    }
+    Slot *expected = nullptr;
+    if (!segment.compare_exchange_strong(expected, slots,
+                                         std::memory_order_acq_rel)) {
+      // Another thread allocated the segment first.
+      delete[] slots;
+    }
+  }
+  return index;
+}
+
+void ThreadTable::FreeSlot(uint32_t index) {
+  Slot *slot = SlotAt(index);
+  uint64_t head = free_head_.load(std::memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    slot->next_free.store(head & kFreeIndexMask, std::memory_order_relaxed);
+    new_head = (((head >> 32) + 1) << 32) | (index + 1);
+  } while (!free_head_.compare_exchange_weak(head, new_head,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+}
+
 void ThreadTable::RegisterCurrent() {
   pid_t tid = GetTid();
-  timer_t timer = kInvalidTimer;
-  if (use_timers_) {
-    timer = CreateTimer(tid);
+  int64_t index = AllocateSlot();
+  if (index < 0) {
+    LOG(ERROR) << "Too many threads, not tracking thread " << tid;
+    return;
+  }
+  current_slot = index;
+  Slot *slot = SlotAt(index);
+  if (frame_buffer_size_ > 0 && slot->frames == nullptr) {
+    slot->frames = new JVMPI_CallFrame[frame_buffer_size_];
   }
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  threads_.push_back({tid, timer});
-  if (timer != kInvalidTimer && period_usec_ > 0) {
-    SetTimer(timer, period_usec_);
+  current_ = slot;
+  AddThread(slot, tid);
+}
+
+int64_t ThreadTable::RegisterOther(pid_t tid) {
+  int64_t index = AllocateSlot();
+  if (index < 0) {
+    LOG(ERROR) << "Too many threads, not tracking thread " << tid;
+    return -1;
+  }
+  AddThread(SlotAt(index), tid);
+  return index;
+}
+
+void ThreadTable::AddThread(Slot *slot, pid_t tid) {
+  slot->trace.store(0, std::memory_order_relaxed);
+  slot->cpu_nanos.store(0, std::memory_order_relaxed);
+  slot->tid.store(tid, std::memory_order_release);
+  size_.fetch_add(1, std::memory_order_relaxed);
+
+  // Pairs with the fence in StartTimers(): either this thread sees the
+  // period, or StartTimers() sees the ID, so that the timer is not missed
+  // by both. A release store alone may be reordered with the loads below.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (use_timers_ && period_usec_.load() > 0) {
+    // A CPU profile is in progress, the timer of this thread is needed now.
+    ArmTimer(slot);
+  }
+  if (perf_period_.load() > 0) {
+    ArmPerfEvent(slot);
   }
 }
 
 void ThreadTable::UnregisterCurrent() {
-  pid_t tid = GetTid();
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  for (auto i = threads_.begin(); i != threads_.end(); ++i) {
-    if (i->first == tid) {
-      if (i->second != kInvalidTimer) {
-        DeleteTimer(i->second);
-      }
-      threads_.erase(i);
-      return;
+  int64_t index = current_slot;
+  if (index < 0) {
+    return;
+  }
+  current_slot = -1;
+  current_ = nullptr;
+  // Keep the signal handlers of this thread from using the slot once freed.
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  RemoveThread(index);
+}
+
+void ThreadTable::UnregisterOther(int64_t index) {
+  if (index >= 0) {
+    RemoveThread(index);
+  }
+}
+
+void ThreadTable::RemoveThread(uint32_t index) {
+  Slot *slot = SlotAt(index);
+  {
+    std::lock_guard<std::mutex> lock(slot->timer_mutex);
+    if (slot->timer != kInvalidTimer) {
+      DeleteTimer(slot->timer);
+      slot->timer = kInvalidTimer;
     }
+    if (slot->perf_fd >= 0) {
+      ClosePerfEvent(slot->perf_fd);
+      slot->perf_fd = -1;
+    }
+    // Cleared under the lock, so that StartTimers() and StartPerfEvents()
+    // do not create the timer or the counter again for this thread.
+    slot->tid.store(0, std::memory_order_release);
   }
+  size_.fetch_sub(1, std::memory_order_relaxed);
+  FreeSlot(index);
 }
 
 int64_t ThreadTable::Size() const {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  return threads_.size();
+  return size_.load(std::memory_order_relaxed);
 }
 
 std::vector<pid_t> ThreadTable::Threads() const {
   std::vector<pid_t> tids;
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  for (const auto& t : threads_) {
-    tids.push_back(t.first);
+  tids.reserve(Size());
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot == nullptr) {
+      // The segment is being allocated, there is no thread in it yet.
+      continue;
+    }
+    pid_t tid = slot->tid.load(std::memory_order_acquire);
+    if (tid != 0) {
+      tids.push_back(tid);
+    }
   }
   return tids;
 }
 
+void ThreadTable::RecordCurrentSample(uint64_t trace) {
+  Slot *slot = current_;
+  if (slot == nullptr) {
+    return;
+  }
+  int64_t cpu_nanos = ClockNanos(CLOCK_THREAD_CPUTIME_ID);
+  // Publish the trace along with the CPU time, so that readers seeing the
+  // new CPU time also see the new trace.
+  slot->trace.store(trace, std::memory_order_relaxed);
+  slot->cpu_nanos.store(cpu_nanos, std::memory_order_release);
+}
+
+JVMPI_CallFrame *ThreadTable::CurrentFrames() {
+  Slot *slot = current_;
+  return slot == nullptr ? nullptr : slot->frames;
+}
+
+std::vector<ThreadTable::ThreadSample> ThreadTable::Samples() const {
+  std::vector<ThreadSample> samples;
+  samples.reserve(Size());
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot == nullptr) {
+      continue;
+    }
+    pid_t tid = slot->tid.load(std::memory_order_acquire);
+    if (tid != 0) {
+      int64_t cpu_nanos = slot->cpu_nanos.load(std::memory_order_acquire);
+      uint64_t trace = slot->trace.load(std::memory_order_relaxed);
+      samples.push_back({tid, trace, cpu_nanos});
+    }
+  }
+  return samples;
+}
+
+void ThreadTable::ClearSamples() {
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot != nullptr) {
+      slot->trace.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void ThreadTable::ArmTimer(Slot *slot) {
+  std::lock_guard<std::mutex> lock(slot->timer_mutex);
+  // Check again under the lock, in case the timers have been stopped or the
+  // thread has exited since.
+  int64_t period_usec = period_usec_.load();
+  pid_t tid = slot->tid.load(std::memory_order_acquire);
+  if (period_usec <= 0 || tid == 0) {
+    return;
+  }
+  if (slot->timer == kInvalidTimer) {
+    slot->timer = CreateTimer(tid);
+  }
+  if (slot->timer != kInvalidTimer) {
+    SetTimer(slot->timer, period_usec);
+  }
+}
+
+void ThreadTable::DisarmTimer(Slot *slot) {
+  std::lock_guard<std::mutex> lock(slot->timer_mutex);
+  if (slot->timer != kInvalidTimer) {
+    DeleteTimer(slot->timer);
+    slot->timer = kInvalidTimer;
+  }
+}
+
 void ThreadTable::StartTimers(int64_t period_usec) {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  period_usec_ = period_usec;
-  for (const auto& t : threads_) {
-    SetTimer(t.second, period_usec);
+  std::lock_guard<std::mutex> lock(timers_mutex_);
+  period_usec_.store(period_usec);
+  // See AddThread().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot != nullptr && slot->tid.load(std::memory_order_acquire) != 0) {
+      ArmTimer(slot);
+    }
+  }
+}
+
+void ThreadTable::StopTimers() {
+  std::lock_guard<std::mutex> lock(timers_mutex_);
+  period_usec_.store(0);
+  // Visit all the slots, the timers of threads registering concurrently may
+  // have been created before their ID is visible.
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot != nullptr) {
+      DisarmTimer(slot);
+    }
+  }
+}
+
+int ThreadTable::ArmPerfEvent(Slot *slot) {
+  std::lock_guard<std::mutex> lock(slot->timer_mutex);
+  int64_t period = perf_period_.load();
+  pid_t tid = slot->tid.load(std::memory_order_acquire);
+  if (period <= 0 || tid == 0 || slot->perf_fd >= 0) {
+    return 0;
+  }
+  slot->perf_fd = OpenPerfEvent(*perf_event_, tid, period);
+  return slot->perf_fd < 0 ? errno : 0;
+}
+
+void ThreadTable::DisarmPerfEvent(Slot *slot) {
+  std::lock_guard<std::mutex> lock(slot->timer_mutex);
+  if (slot->perf_fd >= 0) {
+    ClosePerfEvent(slot->perf_fd);
+    slot->perf_fd = -1;
+  }
+}
+
+bool ThreadTable::StartPerfEvents(const PerfEvent &event, int64_t period) {
+  std::unique_lock<std::mutex> lock(timers_mutex_);
+  perf_event_ = &event;
+  perf_period_.store(period);
+  // See AddThread().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t opened = 0;
+  int err = 0;
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot == nullptr || slot->tid.load(std::memory_order_acquire) == 0) {
+      continue;
+    }
+    int slot_err = ArmPerfEvent(slot);
+    if (slot_err == 0) {
+      opened++;
+    } else if (slot_err != ESRCH) {
+      // Threads exiting meanwhile are not a reason to give up.
+      err = slot_err;
+    }
+  }
+  if (opened == 0 && err != 0) {
+    LogPerfEventError(event, err);
+    lock.unlock();
+    // Also closes the counters of the threads registered meanwhile.
+    StopPerfEvents();
+    return false;
   }
+  return true;
 }
 
-void ThreadTable::StopTimers() { StartTimers(0); }
+void ThreadTable::StopPerfEvents() {
+  std::lock_guard<std::mutex> lock(timers_mutex_);
+  perf_period_.store(0);
+  uint32_t num_slots = NumSlots();
+  for (uint32_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot != nullptr) {
+      DisarmPerfEvent(slot);
+    }
+  }
+}
 
 pid_t GetTid() { return syscall(__NR_gettid); }
 
+int64_t ThreadCpuNanos(pid_t tid) {
+  // This avoids parsing files under /proc/self/task for threads only known
+  // by their ID.
+  return ClockNanos(ThreadCpuClock(tid));
+}
+
+int64_t ThreadRunDelayNanos(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  char buf[128];
+  ssize_t size = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (size <= 0) {
+    return -1;
+  }
+  buf[size] = '\0';
+  // The time spent on a CPU, then waiting for one, then the number of
+  // time slices run.
+  unsigned long long running, waiting;  // NOLINT(runtime/int)
+  if (sscanf(buf, "%llu %llu", &running, &waiting) != 2) {
+    return -1;
+  }
+  return waiting;
+}
+
 bool TgKill(pid_t tid, int signum) {
   return syscall(__NR_tgkill, getpid(), tid, signum) == 0;
 }
 
+namespace {
+
+// Threads of the agent, see ScopedAgentThread.
+std::mutex agent_threads_mutex;
+std::unordered_set<pid_t> *agent_threads = new std::unordered_set<pid_t>();
+
+}  // namespace
+
+ScopedAgentThread::ScopedAgentThread() : tid_(GetTid()) {
+  std::lock_guard<std::mutex> lock(agent_threads_mutex);
+  agent_threads->insert(tid_);
+}
+
+ScopedAgentThread::~ScopedAgentThread() {
+  std::lock_guard<std::mutex> lock(agent_threads_mutex);
+  agent_threads->erase(tid_);
+}
+
+bool ScopedAgentThread::Contains(pid_t tid) {
+  std::lock_guard<std::mutex> lock(agent_threads_mutex);
+  return agent_threads->count(tid) != 0;
+}
+
+SignalPool::SignalPool(int num_helpers)
+    : tids_(nullptr),
+      signum_(0),
+      batch_(0),
+      pending_(0),
+      signalled_(0),
+      stopping_(false) {
+  cpu_set_t allowed;
+  std::vector<int> cpus;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  for (int i = 0; i < num_helpers; i++) {
+    helpers_.emplace_back(&SignalPool::Run, this, i + 1);
+    if (cpus.size() > 1) {
+      // The caller keeps its own CPU, the helpers take the next ones.
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpus[(i + 1) % cpus.size()], &cpu);
+      pthread_setaffinity_np(helpers_.back().native_handle(), sizeof(cpu),
+                             &cpu);
+    }
+  }
+}
+
+SignalPool::~SignalPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_.notify_all();
+  for (auto &helper : helpers_) {
+    helper.join();
+  }
+}
+
+int64_t SignalPool::Signal(const std::vector<pid_t> &tids, int signum) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tids_ = &tids;
+    signum_ = signum;
+    batch_++;
+    pending_ = helpers_.size();
+    signalled_ = 0;
+  }
+  start_.notify_all();
+  int64_t signalled = SignalChunk(0);
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return pending_ == 0; });
+  tids_ = nullptr;
+  return signalled + signalled_;
+}
+
+int64_t SignalPool::CpuNanos() {
+  int64_t cpu_nanos = 0;
+  for (auto &helper : helpers_) {
+    clockid_t clock;
+    if (pthread_getcpuclockid(helper.native_handle(), &clock) != 0) {
+      continue;
+    }
+    int64_t nanos = ClockNanos(clock);
+    if (nanos > 0) {
+      cpu_nanos += nanos;
+    }
+  }
+  return cpu_nanos;
+}
+
+int64_t SignalPool::SignalChunk(int index) {
+  size_t num_chunks = helpers_.size() + 1;
+  size_t begin = tids_->size() * index / num_chunks;
+  size_t end = tids_->size() * (index + 1) / num_chunks;
+  int64_t signalled = 0;
+  for (size_t i = begin; i < end; i++) {
+    if (TgKill((*tids_)[i], signum_)) {
+      signalled++;
+    }
+  }
+  return signalled;
+}
+
+void SignalPool::Run(int index) {
+  ScopedAgentThread agent_thread;
+  uint64_t done_batch = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    start_.wait(lock, [&] { return stopping_ || batch_ != done_batch; });
+    if (stopping_) {
+      return;
+    }
+    done_batch = batch_;
+    // The batch does not change until all the helpers are done with it.
+    lock.unlock();
+    int64_t signalled = SignalChunk(index);
+    lock.lock();
+    signalled_ += signalled;
+    if (--pending_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
 }  // namespace profiler
 }  // namespace cloud
@@ -18,31 +18,57 @@
 #define CLOUD_PROFILER_AGENT_JAVA_THREADS_H_
 
 #include <time.h>
+#include <atomic>
+#include <condition_variable>  // NOLINT(build/c++11)
 #include <mutex>  // NOLINT(build/c++11)
-#include <utility>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 #include "src/globals.h"
+#include "src/perf_events.h"
 
 namespace cloud {
 namespace profiler {
 
 // ThreadTable keeps track of the thread IDs of the known active threads.
-// It is meant to be updated from the OnThreadStart and OnThreadEnd callbacks.
+// It is meant to be updated from the OnThreadStart and OnThreadEnd callbacks,
+// and can also track threads the JVMTI does not report, by their ID.
 // When configured to do so, it manages per thread CPU time timers and allows
 // starting and stopping them to generate SIGPROF signal when certain amount of
-// the CPU time expires.
+// the CPU time expires. The timers only exist while started: they are created
+// by StartTimers(), or when a thread registers while started, and deleted by
+// StopTimers(). The perf event counters, which signal the threads after a
+// number of hardware or kernel events, are managed the same way.
+//
+// The threads are kept in slots which are never deallocated, so that they can
+// be listed without locks while threads come and go. Each registered thread
+// remembers its slot, and released slots are reused through a lock free list,
+// so registering and unregistering a thread takes constant time. A thread can
+// only be registered in a single table.
+//
+// When frame_buffer_size is positive, each registered thread also gets a
+// buffer of that many frames, for its signal handlers to capture stack
+// traces too deep for their own stack.
 class ThreadTable {
  public:
-  explicit ThreadTable(bool use_timers)
-      : use_timers_(use_timers), period_usec_() {}
+  explicit ThreadTable(bool use_timers, int frame_buffer_size = 0);
+  ~ThreadTable();
 
   // Registers the current thread.
   void RegisterCurrent();
   // Unregisters the current thread.
   void UnregisterCurrent();
+  // Registers a thread other than the current one, such as a thread of the
+  // JVM which is not a Java thread. It gets the timers and counters of the
+  // registered threads, but no frame buffer nor recorded samples. Returns
+  // the slot of the thread, or -1 if the table is full.
+  int64_t RegisterOther(pid_t tid);
+  // Unregisters a thread registered by RegisterOther(), given its slot.
+  void UnregisterOther(int64_t index);
   // Returns the number of registered threads.
   int64_t Size() const;
-  // Returns the IDs of all registered threads.
+  // Returns the IDs of all registered threads. Threads registered or
+  // unregistered concurrently may or may not be included.
   std::vector<pid_t> Threads() const;
   // Starts per-thread timers.
   void StartTimers(int64_t period_usec);
@@ -50,16 +76,109 @@ class ThreadTable {
   void StopTimers();
   // Whether CPU time sampling is configured to use per-thread timers.
   bool UseTimers() const { return use_timers_; }
+  // Starts per-thread counters of the event, which signal their thread
+  // every period events. Returns false if no counter could be opened, as
+  // when perf_event_open is restricted, in which case it logs why and none
+  // is started.
+  bool StartPerfEvents(const PerfEvent &event, int64_t period);
+  // Stops per-thread perf event counters.
+  void StopPerfEvents();
+
+  // The last sample recorded by a thread, see RecordCurrentSample().
+  struct ThreadSample {
+    pid_t tid;
+    // Trace recorded, 0 if none.
+    uint64_t trace;
+    // CPU time consumed by the thread when the trace was recorded.
+    int64_t cpu_nanos;
+  };
+
+  // Records a trace sampled on the current thread, along with the CPU time it
+  // has consumed so far. This is async signal safe.
+  static void RecordCurrentSample(uint64_t trace);
+  // Returns the frame buffer of the current thread, nullptr if it is not
+  // registered or the table has no frame buffers. This is async signal safe.
+  static JVMPI_CallFrame *CurrentFrames();
+
+  // Returns the IDs of all registered threads with their last recorded
+  // samples.
+  std::vector<ThreadSample> Samples() const;
+  // Forgets the samples recorded by all threads.
+  void ClearSamples();
 
  private:
-  mutable std::mutex thread_mutex_;
-  // List of threads and associated timers. The timer ID is kInvalidTimer when
-  // the timer usage is off or the timer creation failed for the thread.
-  std::vector<std::pair<pid_t, timer_t>> threads_;
+  struct Slot {
+    // ID of the thread, 0 when the slot is free.
+    std::atomic<pid_t> tid;
+    // Last sample recorded by the thread.
+    std::atomic<uint64_t> trace;
+    std::atomic<int64_t> cpu_nanos;
+    // One-based index of the next slot in the free list.
+    std::atomic<uint32_t> next_free;
+    // Frame buffer, allocated when a thread first registers in the slot and
+    // kept for the next ones.
+    JVMPI_CallFrame *frames;
+    // Serializes the creation, deletion and setting of the timer and of
+    // the perf event counter.
+    std::mutex timer_mutex;
+    // The timer of the thread, kInvalidTimer when the timers are stopped,
+    // their usage is off or the timer creation failed.
+    timer_t timer;
+    // The perf event counter of the thread, -1 when the counters are
+    // stopped or its creation failed.
+    int perf_fd;
+  };
+
+  // Slots are allocated in segments of kSegmentSlots slots, on demand.
+  static const int kSegmentSlots = 1024;
+  static const int kMaxSegments = 256;
+
+  // Returns the number of slots which may be in use.
+  uint32_t NumSlots() const;
+  // Returns the slot at index, or nullptr if not allocated yet.
+  Slot *SlotAt(uint32_t index) const;
+  // Returns the index of a free slot, or -1 if the table is full.
+  int64_t AllocateSlot();
+  // Returns a slot to the free list.
+  void FreeSlot(uint32_t index);
+  // Sets up the slot for the thread tid, and starts its timer and counter
+  // if they are started.
+  void AddThread(Slot *slot, pid_t tid);
+  // Deletes the timer and the counter of the slot thread, and frees the
+  // slot.
+  void RemoveThread(uint32_t index);
+  // Creates the timer of the slot thread if needed, and sets it to the
+  // current period. Does nothing if the timers are stopped.
+  void ArmTimer(Slot *slot);
+  // Deletes the timer of the slot thread, if any.
+  void DisarmTimer(Slot *slot);
+  // Opens the perf event counter of the slot thread if needed. Returns 0,
+  // or the errno of the failed perf_event_open. Does nothing if the
+  // counters are stopped.
+  int ArmPerfEvent(Slot *slot);
+  // Closes the perf event counter of the slot thread, if any.
+  void DisarmPerfEvent(Slot *slot);
+
+  std::atomic<Slot *> segments_[kMaxSegments];
+  // Number of slots handed out so far, including the ones now free.
+  std::atomic<uint32_t> num_slots_;
+  // One-based index of the first free slot in the low 32 bits, and a
+  // counter in the high bits to detect concurrent updates (ABA).
+  std::atomic<uint64_t> free_head_;
+  std::atomic<int64_t> size_;
+  // Serializes StartTimers() and StopTimers().
+  std::mutex timers_mutex_;
   // True when the timer usage is requested.
   bool use_timers_;
+  const int frame_buffer_size_;
   // Non-zero when the thread timers have been started.
-  int64_t period_usec_;
+  std::atomic<int64_t> period_usec_;
+  // Event counted, and non-zero period when the counters have been started.
+  const PerfEvent *perf_event_;
+  std::atomic<int64_t> perf_period_;
+
+  // Slot of the current thread, nullptr if not registered.
+  static __thread Slot *current_;
 
   DISALLOW_COPY_AND_ASSIGN(ThreadTable);
 };
@@ -67,9 +186,72 @@ class ThreadTable {
 // Returns the thread ID of the current thread.
 pid_t GetTid();
 
+// Returns the CPU time consumed by a thread of this process, or -1 if the
+// thread does not exist anymore.
+int64_t ThreadCpuNanos(pid_t tid);
+
+// Returns the time a thread of this process spent runnable but waiting
+// for a CPU, from its schedstat, or -1 if it is not available.
+int64_t ThreadRunDelayNanos(pid_t tid);
+
 // Sends a signal to the specified thread.
 bool TgKill(pid_t tid, int signum);
 
+// ScopedAgentThread marks the current thread as a thread of the agent while
+// in scope, so that it is not sampled as one of the native threads of the
+// JVM, see NativeThreads. Meant to be the first thing the threads the agent
+// starts itself, rather than through the JVMTI, do.
+class ScopedAgentThread {
+ public:
+  ScopedAgentThread();
+  ~ScopedAgentThread();
+
+  // Whether the thread tid is marked as a thread of the agent.
+  static bool Contains(pid_t tid);
+
+ private:
+  const pid_t tid_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedAgentThread);
+};
+
+// SignalPool sends a signal to a list of threads split in chunks, one per
+// helper thread plus one for the caller, so that long lists are signalled
+// in a fraction of the time a single thread takes. The helpers are pinned
+// to different CPUs when the affinity mask allows it.
+class SignalPool {
+ public:
+  explicit SignalPool(int num_helpers);
+  ~SignalPool();
+
+  // Sends signum to the threads, and returns once all were sent. Returns
+  // the number of threads successfully signalled.
+  int64_t Signal(const std::vector<pid_t> &tids, int signum);
+
+  // Returns the CPU time spent by the helpers so far.
+  int64_t CpuNanos();
+
+ private:
+  // Signals the chunk of the current batch for the given index.
+  int64_t SignalChunk(int index);
+  void Run(int index);
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  // Current batch, and its number to tell helpers the batches apart.
+  const std::vector<pid_t> *tids_;
+  int signum_;
+  uint64_t batch_;
+  // Helpers still busy with the current batch, and threads they signalled.
+  int pending_;
+  int64_t signalled_;
+  bool stopping_;
+  std::vector<std::thread> helpers_;
+
+  DISALLOW_COPY_AND_ASSIGN(SignalPool);
+};
+
 }  // namespace profiler
 }  // namespace cloud
 
@@ -17,6 +17,7 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_THROTTLER_H_
 #define CLOUD_PROFILER_AGENT_JAVA_THROTTLER_H_
 
+#include <functional>
 #include <memory>
 
 #include "src/globals.h"
@@ -27,6 +28,24 @@ namespace profiler {
 // Supported profile types.
 constexpr char kTypeCPU[] = "cpu";
 constexpr char kTypeWall[] = "wall";
+// Objects in use on the Java heap.
+constexpr char kTypeHeap[] = "heap";
+// Objects allocated on the Java heap over the profile duration.
+constexpr char kTypeHeapAlloc[] = "heap_alloc";
+// Threads blocked on contended Java monitors.
+constexpr char kTypeContention[] = "contention";
+// Time threads spent runnable but waiting for a CPU, collected along with
+// the wall profiles and uploaded with DeferUploadAs().
+constexpr char kTypeRunqueue[] = "runqueue";
+// CPU and wall profiles over the same window, uploaded as two profiles of
+// types kTypeCPU and kTypeWall with DeferUploadAs().
+constexpr char kTypeCPUWall[] = "cpu+wall";
+// Hardware and kernel events sampled with perf_event_open, see
+// perf_events.h. The API has no such types.
+constexpr char kTypeCycles[] = "cycles";
+constexpr char kTypeInstructions[] = "instructions";
+constexpr char kTypeLLCMisses[] = "llc_misses";
+constexpr char kTypeContextSwitches[] = "context_switches";
 
 // Iterator-like abstraction used to guide a profiling loop comprising of
 // waiting for when the next profile may be collected and saving its data once
@@ -58,8 +77,33 @@ class Throttler {
   // by a successful call to WaitNext().
   virtual int64_t DurationNanos() = 0;
 
-  // Upload the compressed profile proto bytes. Returns false on error.
+  // Upload the compressed profile proto bytes. Returns false on error. The
+  // bytes are taken over by the throttler, callers should move them in so
+  // that they are never copied on their way to the backend.
   virtual bool Upload(string profile) = 0;
+
+  // Returns a function uploading the compressed profile proto bytes of the
+  // current iteration, which returns false on error. Unlike Upload(), the
+  // function can be called later on from another thread, while the next
+  // iterations are in progress, as long as the throttler is alive.
+  virtual std::function<bool()> DeferUpload(string profile) = 0;
+
+  // Same as DeferUpload(), for a profile of the given type collected at
+  // this iteration. The type only differs from ProfileType() for the
+  // profiles of a kTypeCPUWall iteration, which only the throttlers asking
+  // for such iterations need to handle.
+  virtual std::function<bool()> DeferUploadAs(const string &profile_type,
+                                              string profile) {
+    return DeferUpload(std::move(profile));
+  }
+
+  // Same as DeferUploadAs(), for a burst profile of the given type
+  // collected on demand before this iteration, which the throttlers mark
+  // as such where they can.
+  virtual std::function<bool()> DeferUploadBurst(const string &profile_type,
+                                                 string profile) {
+    return DeferUploadAs(profile_type, std::move(profile));
+  }
 };
 
 }  // namespace profiler
@@ -19,8 +19,11 @@
 
 #include "src/clock.h"
 #include "src/cloud_env.h"
+#include "src/contention_monitor.h"
+#include "src/heap_monitor.h"
 #include "src/pem_roots.h"
 #include "src/string.h"
+#include "src/uploader_spool.h"
 
 #include "google/devtools/cloudprofiler/v2/profiler.grpc.pb.h"
 #include "google/protobuf/duration.pb.h"  // NOLINT
@@ -44,6 +47,13 @@ DEFINE_string(cprof_profile_labels, "",
               "names must be in dns-label-like-format");
 DEFINE_bool(cprof_use_insecure_creds_for_testing, false,
             "use insecure channel creds, for testing only");
+DEFINE_string(cprof_spool_failed_uploads, "",
+              "path of a profile spool where the profiles are saved when "
+              "their upload fails, rather than only discarded");
+DEFINE_bool(cprof_prefetch_profiles, false,
+            "when true, ask the server for the next profile as soon as one "
+            "is created, so that the long poll overlaps with the collection "
+            "and upload of the current profile");
 
 namespace cloud {
 namespace profiler {
@@ -66,6 +76,8 @@ const char kZoneNameLabel[] = "zone";
 const char kLanguageLabel[] = "language";
 // Standard service version label key.
 const char kServiceVersionLabel[] = "version";
+// Profile label of the burst profiles, collected on demand.
+const char kBurstLabel[] = "burst";
 // Range of random number
 const int64_t kRandomRange = 65536;
 
@@ -224,10 +236,21 @@ APIThrottler::APIThrottler(
   grpc_init();
   gpr_set_log_function(GRPCLog);
 
+  if (HeapMonitor::Enabled()) {
+    types_.push_back(api::HEAP);
+  }
+  if (ContentionMonitor::Enabled()) {
+    types_.push_back(api::CONTENTION);
+  }
+
   // Create a random number generator.
   gen_ = std::default_random_engine(clock_->Now().tv_nsec / 1000);
   dist_ = std::uniform_int_distribution<int64_t>(0, kRandomRange);
 
+  if (!FLAGS_cprof_spool_failed_uploads.empty()) {
+    spool_ = SpoolUploader::Open(FLAGS_cprof_spool_failed_uploads);
+  }
+
   if (!stub_) {  // Set in tests
     LOG(INFO) << "Will use profiler service " << FLAGS_cprof_api_address
               << " to create and upload profiles";
@@ -235,6 +258,20 @@ APIThrottler::APIThrottler(
   }
 }
 
+APIThrottler::~APIThrottler() {
+  if (creation_queue_ == nullptr) {
+    return;
+  }
+  if (pending_ != nullptr) {
+    pending_->ctx.TryCancel();
+  }
+  creation_queue_->Shutdown();
+  void* tag;
+  bool ok;
+  while (creation_queue_->Next(&tag, &ok)) {
+  }
+}
+
 void APIThrottler::SetProfileTypes(const std::vector<api::ProfileType>& types) {
   types_ = types;
 }
@@ -255,22 +292,81 @@ bool APIThrottler::WaitNext() {
     return false;
   }
 
-  while (true) {
-    LOG(INFO) << "Creating a new profile via profiler service";
+  if (FLAGS_cprof_prefetch_profiles) {
+    while (true) {
+      if (pending_ == nullptr) {
+        StartCreation(req);
+      }
+      if (FinishCreation(req)) {
+        break;
+      }
+    }
+    // Long polls for the next profile while this one is collected.
+    StartCreation(req);
+    return true;
+  }
 
-    grpc::ClientContext ctx;
+  while (!CreateProfile(req)) {
+  }
+  return true;
+}
+
+bool APIThrottler::CreateProfile(const api::CreateProfileRequest& req) {
+  LOG(INFO) << "Creating a new profile via profiler service";
+
+  grpc::ClientContext ctx;
+  profile_.Clear();
+  grpc::Status st = stub_->CreateProfile(&ctx, req, &profile_);
+  if (!st.ok()) {
     profile_.Clear();
-    grpc::Status st = stub_->CreateProfile(&ctx, req, &profile_);
-    if (st.ok()) {
-      LOG(INFO) << "Profile created: " << ProfileType() << " "
-                << profile_.name();
-      // Reset the backoff envelope to the base on success.
-      creation_backoff_envelope_ns_ = kBackoffNanos;
-      break;
-    }
     OnCreationError(ctx, st);
+    return false;
   }
+  LOG(INFO) << "Profile created: " << ProfileType() << " " << profile_.name();
+  // Reset the backoff envelope to the base on success.
+  creation_backoff_envelope_ns_ = kBackoffNanos;
+  return true;
+}
+
+void APIThrottler::StartCreation(const api::CreateProfileRequest& req) {
+  if (creation_queue_ == nullptr) {
+    creation_queue_.reset(new grpc::CompletionQueue());
+  }
+  LOG(INFO) << "Creating a new profile via profiler service";
+  pending_.reset(new PendingCreation());
+  pending_->rpc = stub_->AsyncCreateProfile(&pending_->ctx, req,
+                                            creation_queue_.get());
+  pending_->rpc->Finish(&pending_->profile, &pending_->status,
+                        pending_.get());
+}
 
+bool APIThrottler::FinishCreation(const api::CreateProfileRequest& req) {
+  void* tag;
+  bool ok;
+  // The only call in flight is pending_, its completion is always reported.
+  if (!creation_queue_->Next(&tag, &ok) || tag != pending_.get()) {
+    LOG(ERROR) << "Unexpected completion of the profile creation, "
+               << "creating the profile again";
+    // The call may still be in flight, wait for it to be cancelled before
+    // releasing it along with the queue.
+    pending_->ctx.TryCancel();
+    creation_queue_->Shutdown();
+    while (creation_queue_->Next(&tag, &ok)) {
+    }
+    creation_queue_.reset();
+    pending_.reset();
+    return CreateProfile(req);
+  }
+  std::unique_ptr<PendingCreation> done = std::move(pending_);
+  if (!done->status.ok()) {
+    profile_.Clear();
+    OnCreationError(done->ctx, done->status);
+    return false;
+  }
+  profile_.Swap(&done->profile);
+  LOG(INFO) << "Profile created: " << ProfileType() << " " << profile_.name();
+  // Reset the backoff envelope to the base on success.
+  creation_backoff_envelope_ns_ = kBackoffNanos;
   return true;
 }
 
@@ -281,6 +377,10 @@ string APIThrottler::ProfileType() {
       return kTypeCPU;
     case api::WALL:
       return kTypeWall;
+    case api::HEAP:
+      return kTypeHeap;
+    case api::CONTENTION:
+      return kTypeContention;
     default:
       const string& pt_name = api::ProfileType_Name(pt);
       LOG(ERROR) << "Unsupported profile type " << pt_name;
@@ -294,29 +394,50 @@ int64_t APIThrottler::DurationNanos() {
 }
 
 bool APIThrottler::Upload(string profile) {
+  return DeferUpload(std::move(profile))();
+}
+
+std::function<bool()> APIThrottler::DeferUpload(string profile) {
   LOG(INFO) << "Uploading " << profile.size() << " bytes of '" << ProfileType()
             << "' profile data";
 
-  grpc::ClientContext ctx;
-
   if (!AddProfileLabels(&profile_, FLAGS_cprof_profile_labels)) {
     LOG(ERROR) << "Failed to add profile labels, won't upload the profile";
-    return false;
+    return []() { return false; };
   }
 
-  api::UpdateProfileRequest req;
-  *req.mutable_profile() = profile_;
-
-  req.mutable_profile()->set_profile_bytes(std::move(profile));
-  grpc::Status st = stub_->UpdateProfile(&ctx, req, &profile_);
-
-  if (!st.ok()) {
-    // TODO: Recognize and retry transient errors.
-    LOG(ERROR) << "Profile bytes upload failed: " << DebugString(st);
-    return false;
-  }
+  // Copy the profile, profile_ is overwritten by the next WaitNext().
+  std::shared_ptr<api::UpdateProfileRequest> req(
+      new api::UpdateProfileRequest());
+  *req->mutable_profile() = profile_;
+  req->mutable_profile()->set_profile_bytes(std::move(profile));
+
+  // Spooled on the first failure, so that the profile is kept even if the
+  // agent exits before the retries, if any, are done.
+  ProfileUploader *spool = spool_.get();
+  string profile_type = ProfileType();
+  std::shared_ptr<bool> spooled(new bool(false));
+  return [this, req, spool, profile_type, spooled]() {
+    grpc::ClientContext ctx;
+    api::Profile resp;
+    grpc::Status st = stub_->UpdateProfile(&ctx, *req, &resp);
+    if (!st.ok()) {
+      LOG(ERROR) << "Profile bytes upload failed: " << DebugString(st);
+      if (spool != nullptr && !*spooled) {
+        *spooled = spool->Upload(profile_type, req->profile().profile_bytes());
+      }
+      return false;
+    }
+    return true;
+  };
+}
 
-  return true;
+std::function<bool()> APIThrottler::DeferUploadBurst(
+    const string& profile_type, string profile) {
+  // The label only applies to the profile of this iteration, profile_ is
+  // overwritten by the next WaitNext().
+  (*profile_.mutable_labels())[kBurstLabel] = "true";
+  return DeferUpload(std::move(profile));
 }
 
 void APIThrottler::OnCreationError(const grpc::ClientContext& ctx,
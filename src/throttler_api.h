@@ -24,9 +24,12 @@
 #include "src/clock.h"
 #include "src/cloud_env.h"
 #include "src/throttler.h"
+#include "src/uploader.h"
 #include "google/devtools/cloudprofiler/v2/profiler.grpc.pb.h"
 
 #include "grpcpp/client_context.h"
+#include "grpcpp/completion_queue.h"
+#include "grpcpp/support/async_unary_call.h"
 #include "grpcpp/support/status.h"
 
 namespace cloud {
@@ -41,6 +44,7 @@ class APIThrottler : public Throttler {
                std::unique_ptr<google::devtools::cloudprofiler::v2::grpc::
                                    ProfilerService::StubInterface>
                    stub);
+  ~APIThrottler() override;
 
   // Set the list of supported profile types. The list is used in the profile
   // creation call to the server to specify the supported types.
@@ -52,6 +56,10 @@ class APIThrottler : public Throttler {
   string ProfileType() override;
   int64_t DurationNanos() override;
   bool Upload(string profile) override;
+  std::function<bool()> DeferUpload(string profile) override;
+  // Labels the profile as a burst.
+  std::function<bool()> DeferUploadBurst(const string& profile_type,
+                                         string profile) override;
 
  private:
   // Takes a backoff on profile creation error. The backoff duration
@@ -59,6 +67,31 @@ class APIThrottler : public Throttler {
   // exponentially increasing value, bounded by kMaxBackoffNanos.
   void OnCreationError(const grpc::ClientContext& ctx, const grpc::Status& st);
 
+  // A CreateProfile call in flight on creation_queue_.
+  struct PendingCreation {
+    grpc::ClientContext ctx;
+    google::devtools::cloudprofiler::v2::Profile profile;
+    grpc::Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReaderInterface<
+        google::devtools::cloudprofiler::v2::Profile>>
+        rpc;
+  };
+
+  // Makes a CreateProfile call into profile_ and waits for its result.
+  // Returns false if it failed, profile_ is then cleared and the error
+  // handled.
+  bool CreateProfile(
+      const google::devtools::cloudprofiler::v2::CreateProfileRequest& req);
+  // Issues the next CreateProfile call without waiting for its result.
+  void StartCreation(
+      const google::devtools::cloudprofiler::v2::CreateProfileRequest& req);
+  // Waits for the result of the call started by StartCreation() with req
+  // into profile_, as CreateProfile() does. If the completion queue does
+  // not report the call, it is abandoned and a synchronous call made
+  // instead.
+  bool FinishCreation(
+      const google::devtools::cloudprofiler::v2::CreateProfileRequest& req);
+
  private:
   CloudEnv* env_;
   Clock* clock_;
@@ -67,6 +100,13 @@ class APIThrottler : public Throttler {
       stub_;
   google::devtools::cloudprofiler::v2::Profile profile_;
   std::vector<google::devtools::cloudprofiler::v2::ProfileType> types_;
+  // Keeps the profiles whose upload failed, if any.
+  std::unique_ptr<ProfileUploader> spool_;
+
+  // With --cprof_prefetch_profiles, the next profile is asked for while the
+  // current one is collected and uploaded.
+  std::unique_ptr<grpc::CompletionQueue> creation_queue_;
+  std::unique_ptr<PendingCreation> pending_;
 
   // Profile creation error handling.
   int64_t creation_backoff_envelope_ns_;
@@ -16,14 +16,27 @@
 
 #include <algorithm>
 
+#include "src/contention_monitor.h"
+#include "src/heap_monitor.h"
+#include "src/perf_events.h"
+#include "src/string.h"
 #include "src/uploader_file.h"
 #include "src/uploader_gcs.h"
+#include "src/uploader_spool.h"
 
 DEFINE_int32(cprof_interval_sec, cloud::profiler::kProfileWaitSeconds, "");
 DEFINE_int32(cprof_duration_sec, cloud::profiler::kProfileDurationSeconds, "");
 DEFINE_int32(cprof_delay_sec, 0, "");
 DEFINE_int32(cprof_max_count, cloud::profiler::kProfileMaxCount, "");
 DEFINE_string(cprof_force, "", "");
+DEFINE_bool(cprof_concurrent_cpu_wall, false,
+            "when set, collect the CPU and wall profiles over the same "
+            "window instead of one after the other");
+DEFINE_string(cprof_perf_profiles, "",
+              "comma separated perf event profile types to also collect in "
+              "each interval, among cycles, instructions, llc_misses and "
+              "context_switches; skipped where perf_event_open is "
+              "restricted");
 
 namespace cloud {
 namespace profiler {
@@ -33,18 +46,50 @@ namespace {
 const int64_t kRandomRange = 65536;
 
 // Gets the sampling configuration from the flags.
-int64_t GetConfiguration(int64_t *duration_cpu_ns, int64_t *duration_wall_ns) {
+int64_t GetConfiguration(int64_t *duration_cpu_ns, int64_t *duration_wall_ns,
+                         int64_t *duration_alloc_ns,
+                         int64_t *duration_contention_ns, bool *heap,
+                         std::vector<string> *perf_types) {
   int64_t duration_ns = FLAGS_cprof_duration_sec * kNanosPerSecond;
 
   *duration_cpu_ns = 0;
   *duration_wall_ns = 0;
+  *duration_alloc_ns = 0;
+  *duration_contention_ns = 0;
+  *heap = false;
+  perf_types->clear();
   if (FLAGS_cprof_force == "") {
     *duration_cpu_ns = duration_ns;
     *duration_wall_ns = duration_ns;
+    if (HeapMonitor::Enabled()) {
+      *duration_alloc_ns = duration_ns;
+      *heap = true;
+    }
+    if (ContentionMonitor::Enabled()) {
+      *duration_contention_ns = duration_ns;
+    }
+    if (!FLAGS_cprof_perf_profiles.empty()) {
+      for (const string& type : Split(FLAGS_cprof_perf_profiles, ',')) {
+        if (FindPerfEvent(type) != nullptr) {
+          perf_types->push_back(type);
+        } else {
+          LOG(ERROR) << "Unrecognized perf event profile type '" << type
+                     << "', ignored";
+        }
+      }
+    }
   } else if (FLAGS_cprof_force == kTypeCPU) {
     *duration_cpu_ns = duration_ns;
   } else if (FLAGS_cprof_force == kTypeWall) {
     *duration_wall_ns = duration_ns;
+  } else if (FLAGS_cprof_force == kTypeHeap) {
+    *heap = true;
+  } else if (FLAGS_cprof_force == kTypeHeapAlloc) {
+    *duration_alloc_ns = duration_ns;
+  } else if (FLAGS_cprof_force == kTypeContention) {
+    *duration_contention_ns = duration_ns;
+  } else if (FindPerfEvent(FLAGS_cprof_force) != nullptr) {
+    perf_types->push_back(FLAGS_cprof_force);
   } else {
     LOG(ERROR) << "Unrecognized option cprof_force=" << FLAGS_cprof_force
                << ", profiling disabled";
@@ -71,6 +116,10 @@ std::unique_ptr<ProfileUploader> UploaderFromFlags(const string& path) {
     LOG(INFO) << "Will upload profiles to Google Cloud Storage";
     return std::unique_ptr<ProfileUploader>(
         new GcsUploader(DefaultCloudEnv(), filename));
+  }
+  filename = TryStripPrefix(path, "spool:");
+  if (filename != path) {
+    return SpoolUploader::Open(filename);
   } else {
     LOG(INFO) << "Will save profiles to the local filesystem";
     return std::unique_ptr<ProfileUploader>(new FileUploader(filename));
@@ -85,9 +134,19 @@ TimedThrottler::TimedThrottler(const string& path)
 TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
                                Clock* clock, bool fixed_seed)
     : clock_(clock), profile_count_(), uploader_(std::move(uploader)) {
-  interval_ns_ = GetConfiguration(&duration_cpu_ns_, &duration_wall_ns_);
+  interval_ns_ = GetConfiguration(&duration_cpu_ns_, &duration_wall_ns_,
+                                  &duration_alloc_ns_,
+                                  &duration_contention_ns_, &heap_,
+                                  &perf_types_);
   LOG(INFO) << "sampling duration: cpu=" << duration_cpu_ns_ / kNanosPerSecond
-            << "s, wall=" << duration_wall_ns_ / kNanosPerSecond << "s";
+            << "s, wall=" << duration_wall_ns_ / kNanosPerSecond
+            << "s, heap_alloc=" << duration_alloc_ns_ / kNanosPerSecond
+            << "s, contention=" << duration_contention_ns_ / kNanosPerSecond
+            << "s";
+  for (const string& type : perf_types_) {
+    LOG(INFO) << "sampling duration: " << type << "="
+              << FLAGS_cprof_duration_sec << "s";
+  }
   LOG(INFO) << "sampling interval: " << interval_ns_ / kNanosPerSecond << "s";
   LOG(INFO) << "sampling delay: " << FLAGS_cprof_delay_sec << "s";
 
@@ -111,8 +170,10 @@ TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
 }
 
 bool TimedThrottler::WaitNext() {
-  if (!uploader_ || (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0)) {
-    // Refuse profiling if both CPU and wall are disabled or no uploader.
+  if (!uploader_ || (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0 &&
+                     duration_alloc_ns_ == 0 && duration_contention_ns_ == 0 &&
+                     !heap_ && perf_types_.empty())) {
+    // Refuse profiling if all the profile types are disabled or no uploader.
     LOG(WARNING) << "Profiling disabled";
     return false;
   }
@@ -130,8 +191,18 @@ bool TimedThrottler::WaitNext() {
     }
     profile_count_++;
 
+    bool cpu_wall = FLAGS_cprof_concurrent_cpu_wall && duration_cpu_ns_ > 0 &&
+                    duration_wall_ns_ > 0;
+    int64_t duration_cpu_wall_ns =
+        cpu_wall ? std::max(duration_cpu_ns_, duration_wall_ns_)
+                 : duration_cpu_ns_ + duration_wall_ns_;
+
     int64_t random_value = dist_(gen_);
-    int64_t wait_range_ns = interval_ns_ - duration_cpu_ns_ - duration_wall_ns_;
+    int64_t duration_perf_ns =
+        perf_types_.size() * FLAGS_cprof_duration_sec * kNanosPerSecond;
+    int64_t wait_range_ns = interval_ns_ - duration_cpu_wall_ns -
+                            duration_alloc_ns_ - duration_contention_ns_ -
+                            duration_perf_ns;
     if (wait_range_ns < 0) {
       wait_range_ns = 0;
     }
@@ -142,11 +213,27 @@ bool TimedThrottler::WaitNext() {
     clock_->SleepUntil(profiling_start);
     next_interval_ = TimeAdd(next_interval_, NanosToTimeSpec(interval_ns_));
 
-    if (duration_cpu_ns_ > 0) {
-      cur_.push_back({kTypeCPU, duration_cpu_ns_});
+    if (cpu_wall) {
+      cur_.push_back({kTypeCPUWall, duration_cpu_wall_ns});
+    } else {
+      if (duration_cpu_ns_ > 0) {
+        cur_.push_back({kTypeCPU, duration_cpu_ns_});
+      }
+      if (duration_wall_ns_ > 0) {
+        cur_.push_back({kTypeWall, duration_wall_ns_});
+      }
+    }
+    if (duration_alloc_ns_ > 0) {
+      cur_.push_back({kTypeHeapAlloc, duration_alloc_ns_});
+    }
+    if (duration_contention_ns_ > 0) {
+      cur_.push_back({kTypeContention, duration_contention_ns_});
     }
-    if (duration_wall_ns_ > 0) {
-      cur_.push_back({kTypeWall, duration_wall_ns_});
+    if (heap_) {
+      cur_.push_back({kTypeHeap, 0});
+    }
+    for (const string& type : perf_types_) {
+      cur_.push_back({type, FLAGS_cprof_duration_sec * kNanosPerSecond});
     }
     // Randomize the profile type order.
     std::shuffle(cur_.begin(), cur_.end(), gen_);
@@ -164,10 +251,29 @@ int64_t TimedThrottler::DurationNanos() {
 }
 
 bool TimedThrottler::Upload(string profile) {
+  return DeferUpload(std::move(profile))();
+}
+
+std::function<bool()> TimedThrottler::DeferUpload(string profile) {
+  return DeferUploadAs(ProfileType(), std::move(profile));
+}
+
+std::function<bool()> TimedThrottler::DeferUploadBurst(
+    const string& profile_type, string profile) {
+  return DeferUploadAs("burst_" + profile_type, std::move(profile));
+}
+
+std::function<bool()> TimedThrottler::DeferUploadAs(const string& profile_type,
+                                                    string profile) {
   if (cur_.empty() || !uploader_) {
-    return false;
+    return []() { return false; };
   }
-  return uploader_->Upload(cur_.back().first, profile);
+  ProfileUploader *uploader = uploader_.get();
+  // Avoids copying the profile into the function.
+  std::shared_ptr<string> data(new string(std::move(profile)));
+  return [uploader, profile_type, data]() {
+    return uploader->Upload(profile_type, *data);
+  };
 }
 
 }  // namespace profiler
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "src/clock.h"
 #include "src/throttler.h"
@@ -43,16 +44,27 @@ class TimedThrottler : public Throttler {
   string ProfileType() override;
   int64_t DurationNanos() override;
   bool Upload(string profile) override;
+  std::function<bool()> DeferUpload(string profile) override;
+  std::function<bool()> DeferUploadAs(const string& profile_type,
+                                      string profile) override;
+  // Uploads the profile as type "burst_" followed by profile_type.
+  std::function<bool()> DeferUploadBurst(const string& profile_type,
+                                         string profile) override;
 
  private:
   Clock* clock_;
-  int64_t duration_cpu_ns_, duration_wall_ns_;
+  int64_t duration_cpu_ns_, duration_wall_ns_, duration_alloc_ns_,
+      duration_contention_ns_;
+  // Whether to collect heap profiles, which are snapshots with no duration.
+  bool heap_;
+  // Perf event profiles to collect, each over the profile duration.
+  std::vector<string> perf_types_;
   int64_t interval_ns_;
 
   std::default_random_engine gen_;
   std::uniform_int_distribution<int64_t> dist_;
   struct timespec next_interval_;
-  // Counts profile sets really (CPU + wall).
+  // Counts profile sets really (CPU + wall + heap + contention).
   int profile_count_;
 
   std::vector<std::pair<string, int64_t>> cur_;
@@ -0,0 +1,312 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "src/trace_record.h"
+
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Leads the records, with a version in the last character.
+const char kMagic[] = "CPTRACE1";
+const size_t kMagicSize = sizeof(kMagic) - 1;
+
+// The frames with one of these line numbers hold no Java method, their
+// method id is recorded as is.
+bool IsJavaFrame(const JVMPI_CallFrame &frame) {
+  return frame.lineno != kNativeFrameLineNum &&
+         frame.lineno != kCallTraceErrorLineNum &&
+         frame.lineno != kTruncatedFrameLineNum;
+}
+
+// Appends the values to a record, with the varint and zigzag encodings of
+// protocol buffers.
+class Writer {
+ public:
+  explicit Writer(string *out) : out_(out) {}
+
+  void Varint(uint64_t value) {
+    while (value >= 0x80) {
+      out_->push_back(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    out_->push_back(static_cast<char>(value));
+  }
+
+  void Signed(int64_t value) {
+    Varint((static_cast<uint64_t>(value) << 1) ^
+           static_cast<uint64_t>(value >> 63));
+  }
+
+  void String(const string &value) {
+    Varint(value.size());
+    out_->append(value);
+  }
+
+ private:
+  string *out_;
+};
+
+// Reads the values appended by Writer, failing for good on the first one
+// which does not fit in the data.
+class Reader {
+ public:
+  explicit Reader(const string &data) : data_(data), pos_(0), ok_(true) {}
+
+  bool ok() const { return ok_; }
+
+  bool Skip(const char *bytes, size_t size) {
+    ok_ = ok_ && data_.size() - pos_ >= size &&
+          memcmp(data_.data() + pos_, bytes, size) == 0;
+    pos_ += ok_ ? size : 0;
+    return ok_;
+  }
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; ok_ && shift < 64; shift += 7) {
+      if (pos_ >= data_.size()) {
+        break;
+      }
+      uint8_t byte = data_[pos_++];
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  int64_t Signed() {
+    uint64_t value = Varint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  string String() {
+    uint64_t size = Varint();
+    if (!ok_ || data_.size() - pos_ < size) {
+      ok_ = false;
+      return "";
+    }
+    string value = data_.substr(pos_, size);
+    pos_ += size;
+    return value;
+  }
+
+  // Reads a count of elements, each taking at least one byte, so that a
+  // corrupted count does not allocate more than the data.
+  size_t Count() {
+    uint64_t count = Varint();
+    if (count > data_.size() - pos_) {
+      ok_ = false;
+      return 0;
+    }
+    return count;
+  }
+
+ private:
+  const string &data_;
+  size_t pos_;
+  bool ok_;
+};
+
+// Returns the string answered by a JVMTI call, or an empty one on error.
+string JvmtiString(jvmtiEnv *jvmti, jvmtiError err, char *str) {
+  JvmtiScopedPtr<char> ptr(jvmti, err == JVMTI_ERROR_NONE ? str : nullptr);
+  return ptr.Get() == nullptr ? "" : ptr.Get();
+}
+
+void ResolveMethod(jvmtiEnv *jvmti, TraceRecord::Method *method) {
+  char *name = nullptr, *signature = nullptr;
+  jvmtiError err =
+      jvmti->GetMethodName(method->id, &name, &signature, nullptr);
+  method->name = JvmtiString(jvmti, err, name);
+  method->signature = JvmtiString(jvmti, err, signature);
+
+  jclass klass = nullptr;
+  if (jvmti->GetMethodDeclaringClass(method->id, &klass) ==
+      JVMTI_ERROR_NONE) {
+    char *class_signature = nullptr, *source_file = nullptr;
+    err = jvmti->GetClassSignature(klass, &class_signature, nullptr);
+    method->class_signature = JvmtiString(jvmti, err, class_signature);
+    err = jvmti->GetSourceFileName(klass, &source_file);
+    method->source_file = JvmtiString(jvmti, err, source_file);
+  }
+
+  jint entry_count = 0;
+  jvmtiLineNumberEntry *table = nullptr;
+  err = jvmti->GetLineNumberTable(method->id, &entry_count, &table);
+  JvmtiScopedPtr<jvmtiLineNumberEntry> table_ptr(
+      jvmti, err == JVMTI_ERROR_NONE ? table : nullptr);
+  for (jint i = 0; table_ptr.Get() != nullptr && i < entry_count; i++) {
+    method->lines.push_back(
+        std::make_pair(table[i].start_location, table[i].line_number));
+  }
+}
+
+}  // namespace
+
+string EncodeTraceRecord(jvmtiEnv *jvmti, const char *profile_type,
+                         int64_t duration_nanos, int64_t period_nanos,
+                         const google::javaprofiler::TraceMultiset &traces,
+                         int64_t unknown_count) {
+  // The methods are numbered from 1 in their order of appearance, and the
+  // frames refer to them by number.
+  std::vector<TraceRecord::Method> methods;
+  std::unordered_map<jmethodID, uint64_t> method_numbers;
+  std::map<int64_t, std::vector<TraceRecord::Label>> attributes;
+  for (const auto &trace : traces) {
+    traces.ForEachFrame(trace.first, [&](const JVMPI_CallFrame &frame) {
+      if (IsJavaFrame(frame) &&
+          method_numbers.emplace(frame.method_id, methods.size() + 1)
+              .second) {
+        methods.push_back(TraceRecord::Method());
+        methods.back().id = frame.method_id;
+      }
+    });
+    int64_t attr = trace.first.attr;
+    if (attributes.count(attr) != 0) {
+      continue;
+    }
+    std::vector<TraceRecord::Label> &labels = attributes[attr];
+    int values[google::javaprofiler::AttributeTable::kMaxKeys];
+    google::javaprofiler::AttributeTable::GetValues(attr, values);
+    for (int key = 0; key < google::javaprofiler::AttributeTable::kMaxKeys;
+         key++) {
+      const string *value =
+          google::javaprofiler::AttributeTable::GetString(values[key]);
+      if (values[key] == 0 || value == nullptr) {
+        continue;
+      }
+      const string *key_name = google::javaprofiler::AttributeTable::GetString(
+          google::javaprofiler::AttributeTable::KeyString(key));
+      labels.push_back(
+          {key, key == 0 || key_name == nullptr ? "" : *key_name, *value});
+    }
+  }
+  for (auto &method : methods) {
+    ResolveMethod(jvmti, &method);
+  }
+
+  string out(kMagic, kMagicSize);
+  Writer w(&out);
+  w.String(profile_type);
+  w.Signed(duration_nanos);
+  w.Signed(period_nanos);
+  w.Signed(unknown_count);
+
+  w.Varint(methods.size());
+  for (const auto &method : methods) {
+    w.Varint(reinterpret_cast<uint64_t>(method.id));
+    w.String(method.class_signature);
+    w.String(method.source_file);
+    w.String(method.name);
+    w.String(method.signature);
+    w.Varint(method.lines.size());
+    for (const auto &line : method.lines) {
+      w.Signed(line.first);
+      w.Signed(line.second);
+    }
+  }
+
+  w.Varint(attributes.size());
+  for (const auto &attr : attributes) {
+    w.Signed(attr.first);
+    w.Varint(attr.second.size());
+    for (const auto &label : attr.second) {
+      w.Varint(label.key);
+      w.String(label.key_name);
+      w.String(label.value);
+    }
+  }
+
+  w.Varint(std::distance(traces.begin(), traces.end()));
+  for (const auto &trace : traces) {
+    w.Signed(trace.first.attr);
+    w.Varint(trace.second);
+    w.Varint(trace.first.num_frames);
+    traces.ForEachFrame(trace.first, [&](const JVMPI_CallFrame &frame) {
+      w.Signed(frame.lineno);
+      w.Varint(IsJavaFrame(frame)
+                   ? method_numbers[frame.method_id]
+                   : reinterpret_cast<uint64_t>(frame.method_id));
+    });
+  }
+  return out;
+}
+
+bool DecodeTraceRecord(const string &data, TraceRecord *record) {
+  Reader r(data);
+  if (!r.Skip(kMagic, kMagicSize)) {
+    return false;
+  }
+  record->profile_type = r.String();
+  record->duration_nanos = r.Signed();
+  record->period_nanos = r.Signed();
+  record->unknown_count = r.Signed();
+
+  record->methods.resize(r.Count());
+  for (auto &method : record->methods) {
+    method.id = reinterpret_cast<jmethodID>(r.Varint());
+    method.class_signature = r.String();
+    method.source_file = r.String();
+    method.name = r.String();
+    method.signature = r.String();
+    method.lines.resize(r.Count());
+    for (auto &line : method.lines) {
+      line.first = r.Signed();
+      line.second = r.Signed();
+    }
+  }
+
+  record->attributes.clear();
+  for (size_t num_attrs = r.Count(); r.ok() && num_attrs > 0; num_attrs--) {
+    std::vector<TraceRecord::Label> &labels = record->attributes[r.Signed()];
+    labels.resize(r.Count());
+    for (auto &label : labels) {
+      label.key = r.Varint();
+      label.key_name = r.String();
+      label.value = r.String();
+    }
+  }
+
+  record->traces.resize(r.Count());
+  for (auto &trace : record->traces) {
+    trace.attr = r.Signed();
+    trace.count = r.Varint();
+    trace.frames.resize(r.Count());
+    for (auto &frame : trace.frames) {
+      frame.lineno = r.Signed();
+      uint64_t method = r.Varint();
+      if (!IsJavaFrame(frame)) {
+        frame.method_id = reinterpret_cast<jmethodID>(method);
+      } else if (method >= 1 && method <= record->methods.size()) {
+        frame.method_id = record->methods[method - 1].id;
+      } else {
+        return false;
+      }
+    }
+  }
+  return r.ok();
+}
+
+}  // namespace profiler
+}  // namespace cloud
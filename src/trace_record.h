@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_TRACE_RECORD_H_
+#define CLOUD_PROFILER_AGENT_JAVA_TRACE_RECORD_H_
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "src/globals.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+namespace cloud {
+namespace profiler {
+
+// TraceRecord holds the traces of a profile as they are serialized, along
+// with what the JVMTI answered about their methods and the strings of their
+// attributes, so that the serialization can be replayed offline by
+// trace_replay, with no JVM.
+struct TraceRecord {
+  struct Method {
+    jmethodID id;
+    // Empty when the JVMTI did not know, as for the methods of unloaded
+    // classes.
+    string class_signature;
+    string source_file;
+    string name;
+    string signature;
+    // Line number table, as (start bci, line number) pairs in the order
+    // returned by the JVMTI.
+    std::vector<std::pair<jlocation, jint>> lines;
+  };
+
+  // A label of an attribute, key 0 being the plain attribute.
+  struct Label {
+    int key;
+    string key_name;
+    string value;
+  };
+
+  struct Trace {
+    int64_t attr;
+    int64_t count;
+    std::vector<JVMPI_CallFrame> frames;
+  };
+
+  string profile_type;
+  int64_t duration_nanos = 0;
+  int64_t period_nanos = 0;
+  int64_t unknown_count = 0;
+  std::vector<Method> methods;
+  std::map<int64_t, std::vector<Label>> attributes;
+  std::vector<Trace> traces;
+};
+
+// Encodes the traces of a profile into a compact binary record, resolving
+// their Java methods through the JVMTI.
+string EncodeTraceRecord(jvmtiEnv *jvmti, const char *profile_type,
+                         int64_t duration_nanos, int64_t period_nanos,
+                         const google::javaprofiler::TraceMultiset &traces,
+                         int64_t unknown_count);
+
+// Decodes a record made by EncodeTraceRecord(). Returns false if it is not
+// valid.
+bool DecodeTraceRecord(const string &data, TraceRecord *record);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_TRACE_RECORD_H_
@@ -0,0 +1,257 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Replays the serialization of the profiles whose traces were recorded by
+// the agent with --cprof_record_traces, with a fake JVMTI answering from the
+// records, to profile or benchmark the serialization on production traces
+// with no JVM:
+//
+//   trace_replay [--iterations=10] [--output=profile.pb.gz] file.traces...
+//
+// The files are replayed in order as consecutive profiles of the same JVM,
+// sharing the caches kept across profiles, so they should come from one
+// run. Pass --logtostderr to get the log on the standard error.
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "src/agent_stats.h"
+#include "src/clock.h"
+#include "src/proto.h"
+#include "src/trace_record.h"
+
+DEFINE_string(output, "", "path of the last replayed profile, if any");
+DEFINE_int32(iterations, 1,
+             "# of times the serialization of each profile is replayed");
+
+namespace {
+
+using cloud::profiler::TraceRecord;
+
+// The record answered from, and its methods by id. The classes are the
+// methods, as in profile_test_lib.cc: the jclass of a method is its index in
+// the record plus one.
+const TraceRecord *replayed;
+std::unordered_map<jmethodID, size_t> method_index;
+
+const TraceRecord::Method *FindMethod(jmethodID method_id) {
+  auto it = method_index.find(method_id);
+  return it == method_index.end() ? nullptr : &replayed->methods[it->second];
+}
+
+const TraceRecord::Method *FindClass(jclass klass) {
+  size_t index = reinterpret_cast<size_t>(klass);
+  return index >= 1 && index <= replayed->methods.size()
+             ? &replayed->methods[index - 1]
+             : nullptr;
+}
+
+jvmtiError JNICALL Allocate(jvmtiEnv *jvmti, jlong size,
+                            unsigned char **mem_ptr) {
+  *mem_ptr = static_cast<unsigned char *>(malloc(size));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL Deallocate(jvmtiEnv *jvmti, unsigned char *mem) {
+  free(mem);
+  return JVMTI_ERROR_NONE;
+}
+
+// Returns a copy of str allocated as the JVMTI would, if the JVMTI knew it.
+jvmtiError JvmtiString(const string &str, char **str_ptr) {
+  if (str.empty()) {
+    return JVMTI_ERROR_ABSENT_INFORMATION;
+  }
+  if (str_ptr != nullptr) {
+    *str_ptr = strdup(str.c_str());
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetMethodName(jvmtiEnv *jvmti, jmethodID method_id,
+                                 char **name_ptr, char **signature_ptr,
+                                 char **generic_ptr) {
+  const TraceRecord::Method *method = FindMethod(method_id);
+  if (method == nullptr || method->name.empty()) {
+    return JVMTI_ERROR_INVALID_METHODID;
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  JvmtiString(method->signature, signature_ptr);
+  return JvmtiString(method->name, name_ptr);
+}
+
+jvmtiError JNICALL GetMethodDeclaringClass(jvmtiEnv *jvmti,
+                                           jmethodID method_id,
+                                           jclass *declaring_class) {
+  auto it = method_index.find(method_id);
+  if (it == method_index.end() ||
+      replayed->methods[it->second].class_signature.empty()) {
+    return JVMTI_ERROR_INVALID_METHODID;
+  }
+  *declaring_class = reinterpret_cast<jclass>(it->second + 1);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetClassSignature(jvmtiEnv *jvmti, jclass klass,
+                                     char **signature_ptr,
+                                     char **generic_ptr) {
+  const TraceRecord::Method *method = FindClass(klass);
+  if (method == nullptr) {
+    return JVMTI_ERROR_INVALID_CLASS;
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  return JvmtiString(method->class_signature, signature_ptr);
+}
+
+jvmtiError JNICALL GetSourceFileName(jvmtiEnv *jvmti, jclass klass,
+                                     char **source_name_ptr) {
+  const TraceRecord::Method *method = FindClass(klass);
+  if (method == nullptr) {
+    return JVMTI_ERROR_INVALID_CLASS;
+  }
+  return JvmtiString(method->source_file, source_name_ptr);
+}
+
+jvmtiError JNICALL GetLineNumberTable(jvmtiEnv *jvmti, jmethodID method_id,
+                                      jint *entry_count_ptr,
+                                      jvmtiLineNumberEntry **table_ptr) {
+  const TraceRecord::Method *method = FindMethod(method_id);
+  if (method == nullptr) {
+    return JVMTI_ERROR_INVALID_METHODID;
+  }
+  if (method->lines.empty()) {
+    return JVMTI_ERROR_ABSENT_INFORMATION;
+  }
+  *entry_count_ptr = method->lines.size();
+  *table_ptr = static_cast<jvmtiLineNumberEntry *>(
+      malloc(method->lines.size() * sizeof(jvmtiLineNumberEntry)));
+  for (size_t i = 0; i < method->lines.size(); i++) {
+    (*table_ptr)[i].start_location = method->lines[i].first;
+    (*table_ptr)[i].line_number = method->lines[i].second;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+bool ReadFile(const string &path, string *data) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  *data = contents.str();
+  return !in.bad();
+}
+
+// Registers the labels of the recorded attributes in the AttributeTable,
+// and returns the attributes they get.
+std::unordered_map<int64_t, int64_t> ReplayAttributes(
+    const TraceRecord &record) {
+  using google::javaprofiler::AttributeTable;
+  std::unordered_map<int64_t, int64_t> attrs;
+  for (const auto &attr : record.attributes) {
+    int value = 0;
+    for (const auto &label : attr.second) {
+      int key = label.key == 0 ? 0 : AttributeTable::RegisterKey(
+                                         label.key_name.c_str());
+      value = AttributeTable::SetValue(
+          value, key, AttributeTable::RegisterString(label.value.c_str()));
+    }
+    attrs[attr.first] = value;
+  }
+  return attrs;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (argc < 2) {
+    LOG(ERROR) << "No recorded traces to replay";
+    return 2;
+  }
+  google::javaprofiler::AttributeTable::Init();
+
+  struct jvmtiInterface_1_ functions;
+  memset(&functions, 0, sizeof(functions));
+  functions.Allocate = &Allocate;
+  functions.Deallocate = &Deallocate;
+  functions.GetMethodName = &GetMethodName;
+  functions.GetMethodDeclaringClass = &GetMethodDeclaringClass;
+  functions.GetClassSignature = &GetClassSignature;
+  functions.GetSourceFileName = &GetSourceFileName;
+  functions.GetLineNumberTable = &GetLineNumberTable;
+  jvmtiEnv jvmti;
+  jvmti.functions = &functions;
+  // The recorded native frames have no mappings, they are left as
+  // addresses.
+  google::javaprofiler::NativeProcessInfo native_info("/dev/null");
+  cloud::profiler::Clock *clock = cloud::profiler::DefaultClock();
+
+  string profile;
+  for (int i = 1; i < argc; i++) {
+    string data;
+    TraceRecord record;
+    if (!ReadFile(argv[i], &data) ||
+        !cloud::profiler::DecodeTraceRecord(data, &record)) {
+      LOG(ERROR) << "Failed to read the recorded traces " << argv[i];
+      return 1;
+    }
+    replayed = &record;
+    method_index.clear();
+    for (size_t m = 0; m < record.methods.size(); m++) {
+      method_index[record.methods[m].id] = m;
+    }
+    std::unordered_map<int64_t, int64_t> attrs = ReplayAttributes(record);
+
+    for (int iteration = 0; iteration < FLAGS_iterations; iteration++) {
+      google::javaprofiler::TraceMultiset traces;
+      for (const auto &trace : record.traces) {
+        traces.Add(attrs[trace.attr], trace.frames.size(),
+                   trace.frames.data(), trace.count);
+      }
+      int64_t start = cloud::profiler::TimeSpecToNanos(clock->Now());
+      profile = cloud::profiler::SerializeAndClearJavaCpuTraces(
+          &jvmti, native_info, record.profile_type.c_str(),
+          record.duration_nanos, record.period_nanos, &traces,
+          record.unknown_count);
+      int64_t nanos = cloud::profiler::TimeSpecToNanos(clock->Now()) - start;
+      LOG(INFO) << argv[i] << ": serialized " << record.traces.size()
+                << " traces of " << record.methods.size() << " methods into "
+                << profile.size() << " bytes in "
+                << nanos / cloud::profiler::kNanosPerMilli << "ms";
+    }
+  }
+  LOG(INFO) << "Agent stats: " << cloud::profiler::AgentStats::ToString();
+
+  if (!FLAGS_output.empty()) {
+    std::ofstream out(FLAGS_output, std::ios::binary);
+    out.write(profile.data(), profile.size());
+    out.close();
+    if (!out) {
+      LOG(ERROR) << "Failed to write " << FLAGS_output;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/unwinder.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Bounds of the stack of the current thread, both 0 while unknown.
+__thread uintptr_t stack_low;
+__thread uintptr_t stack_high;
+
+}  // namespace
+
+void RegisterThreadStack() {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return;
+  }
+  void *addr;
+  size_t size;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    stack_low = reinterpret_cast<uintptr_t>(addr);
+    stack_high = stack_low + size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+int UnwindNativeStack(const ucontext_t *context, int max_frames, void **pcs) {
+  return UnwindNativeStack(context, stack_low, stack_high, max_frames, pcs);
+}
+
+int UnwindNativeStack(const ucontext_t *context, uintptr_t stack_low,
+                      uintptr_t stack_high, int max_frames, void **pcs) {
+  uintptr_t sp = context->uc_mcontext.gregs[REG_RSP];
+  if (sp < stack_low || sp >= stack_high) {
+    // Unknown stack, or running on an alternate signal stack.
+    return -1;
+  }
+
+  // Frames of the x86-64 ABI: the saved frame pointer of the caller, then
+  // the return address.
+  const uintptr_t kFrameSize = 2 * sizeof(uintptr_t);
+  uintptr_t pc = context->uc_mcontext.gregs[REG_RIP];
+  uintptr_t fp = context->uc_mcontext.gregs[REG_RBP];
+  // Lowest address the next frame may start at. Starting from the stack
+  // pointer skips the guard page, and frames only grow towards high.
+  uintptr_t low = sp;
+  int num_frames = 0;
+  while (num_frames < max_frames) {
+    pcs[num_frames++] = reinterpret_cast<void *>(pc);
+    if (fp < low || fp > stack_high - kFrameSize ||
+        fp % sizeof(uintptr_t) != 0) {
+      break;
+    }
+    const uintptr_t *frame = reinterpret_cast<const uintptr_t *>(fp);
+    pc = frame[1];
+    if (pc == 0) {
+      break;
+    }
+    low = fp + kFrameSize;
+    fp = frame[0];
+  }
+  return num_frames;
+}
+
+}  // namespace profiler
+}  // namespace cloud
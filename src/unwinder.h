@@ -0,0 +1,50 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UNWINDER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UNWINDER_H_
+
+#include <stdint.h>
+#include <sys/ucontext.h>
+
+namespace cloud {
+namespace profiler {
+
+// Records the bounds of the stack of the current thread, which
+// UnwindNativeStack() needs to walk it. Not async-safe, meant to be called
+// when a thread starts.
+void RegisterThreadStack();
+
+// Walks the native stack of the current thread by following the chain of
+// frame pointers, starting from the interrupted context of a signal
+// handler. Writes up to max_frames program counters to pcs, starting from
+// the interrupted one, and returns their number. Returns -1 if the stack
+// bounds of the thread are unknown.
+//
+// Each frame is checked to lie within the stack, above the previous one,
+// so that a function not maintaining a frame pointer ends the walk rather
+// than causing a fault. Async-safe, and constant time per frame.
+int UnwindNativeStack(const ucontext_t *context, int max_frames, void **pcs);
+
+// Same as above, for a thread whose stack spans [stack_low, stack_high), as
+// found by another thread, rather than registered.
+int UnwindNativeStack(const ucontext_t *context, uintptr_t stack_low,
+                      uintptr_t stack_high, int max_frames, void **pcs);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UNWINDER_H_
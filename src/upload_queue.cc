@@ -0,0 +1,98 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/upload_queue.h"
+
+#include <chrono>  // NOLINT
+
+#include "src/clock.h"
+#include "src/threads.h"
+
+namespace cloud {
+namespace profiler {
+
+UploadQueue::UploadQueue(int max_pending, int max_attempts,
+                         int64_t backoff_nanos)
+    : max_pending_(max_pending > 0 ? max_pending : 1),
+      max_attempts_(max_attempts > 0 ? max_attempts : 1),
+      backoff_nanos_(backoff_nanos),
+      stopping_(false) {
+  thread_ = std::thread(&UploadQueue::Run, this);
+}
+
+UploadQueue::~UploadQueue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    if (!pending_.empty()) {
+      LOG(WARNING) << "Dropping " << pending_.size() << " pending uploads";
+      pending_.clear();
+    }
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void UploadQueue::Push(Upload upload) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.size() >= max_pending_) {
+      LOG(WARNING) << "Too many pending uploads, dropping the oldest profile";
+      pending_.pop_front();
+    }
+    pending_.push_back({std::move(upload), 0});
+  }
+  cond_.notify_all();
+}
+
+void UploadQueue::Run() {
+  ScopedAgentThread agent_thread;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    Pending p = std::move(pending_.front());
+    pending_.pop_front();
+
+    lock.unlock();
+    bool ok = p.upload();
+    lock.lock();
+
+    if (ok) {
+      continue;
+    }
+    p.failures++;
+    if (p.failures >= max_attempts_) {
+      LOG(ERROR) << "Error on profile upload after " << p.failures
+                 << " attempts, discarding the profile";
+      continue;
+    }
+    int64_t backoff_nanos = backoff_nanos_ << (p.failures - 1);
+    LOG(WARNING) << "Error on profile upload, retrying in "
+                 << backoff_nanos / kNanosPerMilli << "ms";
+    // Retry before the newer profiles, unless it gets dropped by them.
+    if (pending_.size() >= max_pending_) {
+      LOG(WARNING) << "Too many pending uploads, dropping the oldest profile";
+      continue;
+    }
+    pending_.push_front(std::move(p));
+    cond_.wait_for(lock, std::chrono::nanoseconds(backoff_nanos),
+                   [this] { return stopping_; });
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
+
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <functional>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// UploadQueue runs the profile uploads on a dedicated thread, so that slow
+// uploads do not delay the collection of the next profiles. It holds up to
+// max_pending uploads, dropping the oldest ones when full, and retries the
+// failed uploads up to max_attempts times, with an exponential backoff.
+class UploadQueue {
+ public:
+  // Returns false when the upload failed.
+  typedef std::function<bool()> Upload;
+
+  UploadQueue(int max_pending, int max_attempts, int64_t backoff_nanos);
+
+  // Waits for the upload in progress, if any, and drops the pending ones.
+  ~UploadQueue();
+
+  // Queues an upload.
+  void Push(Upload upload);
+
+ private:
+  struct Pending {
+    Upload upload;
+    // Number of failed attempts so far.
+    int failures;
+  };
+
+  // Body of the upload thread.
+  void Run();
+
+  const size_t max_pending_;
+  const int max_attempts_;
+  const int64_t backoff_nanos_;
+
+  std::mutex mutex_;
+  // Signaled on new uploads and when stopping.
+  std::condition_variable cond_;
+  std::deque<Pending> pending_;
+  bool stopping_;
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(UploadQueue);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
@@ -20,11 +20,16 @@ namespace cloud {
 namespace profiler {
 
 string ProfilePath(const string& prefix, const string& profile_type) {
+  return ProfilePath(prefix, profile_type, ".pb.gz");
+}
+
+string ProfilePath(const string& prefix, const string& profile_type,
+                   const string& extension) {
   using std::chrono::system_clock;
   int64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
                           system_clock::now().time_since_epoch())
                           .count();
-  return prefix + profile_type + "_" + std::to_string(timestamp) + ".pb.gz";
+  return prefix + profile_type + "_" + std::to_string(timestamp) + extension;
 }
 
 }  // namespace profiler
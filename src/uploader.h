@@ -25,6 +25,8 @@ namespace profiler {
 class ProfileUploader {
  public:
   virtual ~ProfileUploader() {}
+  // Uploads the compressed profile proto bytes. Implementations send them
+  // from the given buffer rather than from a copy, as profiles can be large.
   virtual bool Upload(const string &profile_type, const string &profile) = 0;
 };
 
@@ -32,6 +34,10 @@ class ProfileUploader {
 // timestamp which makes it fairly (but not necessarily globally) unique.
 string ProfilePath(const string& prefix, const string& profile_type);
 
+// Same as above, with the given extension rather than ".pb.gz".
+string ProfilePath(const string& prefix, const string& profile_type,
+                   const string& extension);
+
 }  // namespace profiler
 }  // namespace cloud
 
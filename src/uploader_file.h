@@ -17,7 +17,10 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOADER_FILE_H_
 #define CLOUD_PROFILER_AGENT_JAVA_UPLOADER_FILE_H_
 
-#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "src/uploader.h"
 
@@ -31,17 +34,30 @@ class FileUploader : public cloud::profiler::ProfileUploader {
   bool Upload(const string &profile_type, const string &profile) override {
     string filename = ProfilePath(prefix_, profile_type);
 
-    FILE *f = fopen(filename.c_str(), "w");
-    if (f == nullptr) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
       LOG(INFO) << "Failed to create file " << filename;
       return false;
     }
 
     LOG(INFO) << "Saving profile to " << filename;
 
-    int count = profile.size();
-    int wrote = fwrite(profile.c_str(), 1, count, f);
-    fclose(f);
+    // Written straight from the profile, without going through a stdio
+    // buffer.
+    size_t count = profile.size();
+    size_t wrote = 0;
+    while (wrote < count) {
+      ssize_t n = write(fd, profile.data() + wrote, count - wrote);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG(INFO) << "Failed to write " << filename << ": " << strerror(errno);
+        break;
+      }
+      wrote += n;
+    }
+    close(fd);
 
     if (wrote != count) {
       LOG(INFO) << "Failure! Wrote " << wrote << " bytes, wanted " << count;
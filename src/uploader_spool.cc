@@ -0,0 +1,277 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/uploader_spool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+DEFINE_int32(cprof_spool_size_mb, 64,
+             "size of the memory mapped ring file holding the profiles "
+             "saved to a spool, in megabytes");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char kSpoolMagic[8] = {'C', 'P', 'S', 'P', 'O', 'O', 'L', '1'};
+
+// Number of profiles indexed by the header, the older ones are forgotten.
+const int kMaxEntries = 256;
+
+const size_t kMaxTypeSize = 16;
+
+struct Entry {
+  // Sequence number of the profile, 0 for an unused entry. Written last.
+  std::atomic<uint64_t> seq;
+  // Location of the profile bytes in the ring.
+  uint64_t offset;
+  uint64_t size;
+  int64_t time_nanos;
+  // Profile type, zero-padded.
+  char type[kMaxTypeSize];
+};
+
+int64_t RealtimeNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+size_t PageAligned(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+// Holds an exclusive lock on a file while in scope, see flock(2).
+class FileLock {
+ public:
+  explicit FileLock(int fd) : fd_(fd) {
+    while (flock(fd_, LOCK_EX) != 0 && errno == EINTR) {
+    }
+  }
+  ~FileLock() { Release(); }
+
+  // Unlocks the file before it is closed.
+  void Release() {
+    if (fd_ >= 0) {
+      flock(fd_, LOCK_UN);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileLock);
+};
+
+}  // namespace
+
+struct SpoolUploader::Header {
+  char magic[sizeof(kSpoolMagic)];
+  // Size of the ring following the header.
+  uint64_t ring_size;
+  // Offset in the ring of the next profile, and its sequence number.
+  uint64_t head;
+  uint64_t next_seq;
+  // Profile of sequence number seq is at entries[seq % kMaxEntries].
+  Entry entries[kMaxEntries];
+
+  char *Ring() {
+    return reinterpret_cast<char *>(this) + PageAligned(sizeof(Header));
+  }
+};
+
+std::unique_ptr<SpoolUploader> SpoolUploader::Open(const string &path,
+                                                   int64_t size_bytes) {
+  size_t header_size = PageAligned(sizeof(Header));
+  size_t mapped_size = PageAligned(size_bytes);
+  if (mapped_size <= header_size) {
+    LOG(ERROR) << "The profile spool size must be over " << header_size
+               << " bytes";
+    return nullptr;
+  }
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    LOG(ERROR) << "Failed to open profile spool " << path << ": "
+               << strerror(errno);
+    return nullptr;
+  }
+  // Held while checking and initializing the spool, so that another
+  // process cannot write to it meanwhile.
+  FileLock file_lock(fd);
+  struct stat st;
+  bool existing = fstat(fd, &st) == 0 &&
+                  static_cast<size_t>(st.st_size) == mapped_size;
+  if (!existing && ftruncate(fd, mapped_size) != 0) {
+    LOG(ERROR) << "Failed to size profile spool " << path << ": "
+               << strerror(errno);
+    file_lock.Release();
+    close(fd);
+    return nullptr;
+  }
+  void *addr =
+      mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map profile spool " << path << ": "
+               << strerror(errno);
+    file_lock.Release();
+    close(fd);
+    return nullptr;
+  }
+
+  Header *header = static_cast<Header *>(addr);
+  uint64_t ring_size = mapped_size - header_size;
+  if (!existing || memcmp(header->magic, kSpoolMagic, sizeof(kSpoolMagic)) ||
+      header->ring_size != ring_size || header->head > ring_size) {
+    LOG(INFO) << "Initializing profile spool " << path;
+    // Value-initialized, which zeroes the index.
+    header = new (addr) Header();
+    header->ring_size = ring_size;
+    header->next_seq = 1;
+    memcpy(header->magic, kSpoolMagic, sizeof(kSpoolMagic));
+  }
+  LOG(INFO) << "Will save profiles to the spool " << path;
+  return std::unique_ptr<SpoolUploader>(
+      new SpoolUploader(fd, header, mapped_size));
+}
+
+std::unique_ptr<SpoolUploader> SpoolUploader::Open(const string &path) {
+  return Open(path, static_cast<int64_t>(FLAGS_cprof_spool_size_mb) << 20);
+}
+
+SpoolUploader::SpoolUploader(int fd, Header *header, size_t mapped_size)
+    : fd_(fd), header_(header), mapped_size_(mapped_size) {}
+
+SpoolUploader::~SpoolUploader() {
+  munmap(header_, mapped_size_);
+  close(fd_);
+}
+
+bool SpoolUploader::Upload(const string &profile_type, const string &profile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FileLock file_lock(fd_);
+  uint64_t size = profile.size();
+  if (size > header_->ring_size) {
+    LOG(ERROR) << "Profile of " << size << " bytes larger than the spool, "
+               << "discarding it";
+    return false;
+  }
+  uint64_t offset = header_->head;
+  if (offset + size > header_->ring_size) {
+    offset = 0;
+  }
+  uint64_t seq = header_->next_seq;
+
+  // Forget the profiles about to be overwritten, and the one whose entry
+  // is reused, before overwriting them.
+  for (Entry &entry : header_->entries) {
+    uint64_t entry_seq = entry.seq.load(std::memory_order_relaxed);
+    bool overlaps =
+        entry.offset < offset + size && offset < entry.offset + entry.size;
+    if (entry_seq != 0 &&
+        (entry_seq % kMaxEntries == seq % kMaxEntries || overlaps)) {
+      entry.seq.store(0, std::memory_order_release);
+    }
+  }
+  // Keeps the copy below from being seen before the entries are cleared,
+  // see Read().
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(header_->Ring() + offset, profile.data(), size);
+  Entry &entry = header_->entries[seq % kMaxEntries];
+  entry.offset = offset;
+  entry.size = size;
+  entry.time_nanos = RealtimeNanos();
+  memset(entry.type, 0, sizeof(entry.type));
+  memcpy(entry.type, profile_type.data(),
+         std::min(profile_type.size(), sizeof(entry.type)));
+  entry.seq.store(seq, std::memory_order_release);
+
+  header_->head = offset + size;
+  header_->next_seq = seq + 1;
+  return true;
+}
+
+bool SpoolUploader::Read(
+    const string &path,
+    const std::function<void(const string &profile_type, int64_t time_nanos,
+                             const string &profile)> &visit) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  size_t header_size = PageAligned(sizeof(Header));
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= header_size) {
+    close(fd);
+    return false;
+  }
+  size_t mapped_size = st.st_size;
+  void *addr = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  Header *header = static_cast<Header *>(addr);
+  if (memcmp(header->magic, kSpoolMagic, sizeof(kSpoolMagic)) != 0 ||
+      header->ring_size != mapped_size - header_size) {
+    munmap(addr, mapped_size);
+    return false;
+  }
+
+  std::vector<std::pair<uint64_t, const Entry *>> entries;
+  for (const Entry &entry : header->entries) {
+    uint64_t seq = entry.seq.load(std::memory_order_acquire);
+    if (seq != 0) {
+      entries.push_back({seq, &entry});
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  for (const auto &seq_entry : entries) {
+    const Entry *entry = seq_entry.second;
+    uint64_t offset = entry->offset;
+    uint64_t size = entry->size;
+    if (offset > header->ring_size || size > header->ring_size - offset) {
+      continue;
+    }
+    string type(entry->type, strnlen(entry->type, sizeof(entry->type)));
+    int64_t time_nanos = entry->time_nanos;
+    string profile(header->Ring() + offset, size);
+    // Skip the profiles overwritten while being copied. The fence keeps
+    // the copies above from being reordered after the check.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry->seq.load(std::memory_order_acquire) == seq_entry.first) {
+      visit(type, time_nanos, profile);
+    }
+  }
+  munmap(addr, mapped_size);
+  return true;
+}
+
+}  // namespace profiler
+}  // namespace cloud
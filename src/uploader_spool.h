@@ -0,0 +1,81 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SPOOL_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SPOOL_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
+
+#include "src/uploader.h"
+
+namespace cloud {
+namespace profiler {
+
+// SpoolUploader appends the profiles to a ring of fixed size in a memory
+// mapped file, overwriting the oldest ones once the ring is full. Saving a
+// profile is a copy into the page cache, and the saved profiles survive a
+// crash of the JVM.
+//
+// The file starts with a header indexing the profiles in the ring. A
+// profile is copied before its index entry is written, and the entries of
+// the profiles it overwrites are cleared before, so that the index only
+// ever points to complete profiles. An existing spool of the same size is
+// appended to. Several processes can write to the same spool, if they
+// give it the same size, as the writes are serialized by a lock on the
+// file.
+class SpoolUploader : public ProfileUploader {
+ public:
+  // Maps a spool of size_bytes, including the header, at path. Returns
+  // nullptr if it cannot be mapped.
+  static std::unique_ptr<SpoolUploader> Open(const string &path,
+                                             int64_t size_bytes);
+  // Same as above, with the size set by --cprof_spool_size_mb.
+  static std::unique_ptr<SpoolUploader> Open(const string &path);
+
+  ~SpoolUploader() override;
+
+  bool Upload(const string &profile_type, const string &profile) override;
+
+  // Calls visit for each profile of the spool at path, oldest first, with
+  // its type, the time it was saved in nanoseconds since the epoch and its
+  // bytes. For offline readers, which may run while an agent writes to
+  // the spool. Returns false if the file is not a valid spool.
+  static bool Read(
+      const string &path,
+      const std::function<void(const string &profile_type, int64_t time_nanos,
+                               const string &profile)> &visit);
+
+ private:
+  struct Header;
+
+  SpoolUploader(int fd, Header *header, size_t mapped_size);
+
+  // Serializes the writes of the threads of this process, the lock on fd_
+  // those of other processes.
+  std::mutex mutex_;
+  const int fd_;
+  Header *header_;
+  const size_t mapped_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpoolUploader);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SPOOL_H_
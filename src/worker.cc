@@ -14,10 +14,25 @@
 
 #include "src/worker.h"
 
+#include <algorithm>
+#include <condition_variable>  // NOLINT
+#include <functional>
+#include <map>
+#include <thread>  // NOLINT
+
+#include "src/agent_stats.h"
+#include "src/cgroup_cpu.h"
 #include "src/clock.h"
+#include "src/contention_monitor.h"
+#include "src/heap_monitor.h"
+#include "src/native_threads.h"
+#include "src/overhead_controller.h"
+#include "src/perf_events.h"
 #include "src/profiler.h"
+#include "src/symbolizer_pool.h"
 #include "src/throttler_api.h"
 #include "src/throttler_timed.h"
+#include "src/upload_queue.h"
 
 DEFINE_bool(cprof_enabled, true,
             "when unset, unconditionally disable the profiling");
@@ -28,6 +43,45 @@ DEFINE_int32(cprof_cpu_sampling_period_msec, 10,
              "sampling period for CPU time profiling, in milliseconds");
 DEFINE_int32(cprof_wall_sampling_period_msec, 100,
              "sampling period for wall time profiling, in milliseconds");
+DEFINE_int64(cprof_perf_sampling_period, 0,
+             "number of events between the samples of the perf event "
+             "profiles, e.g. cycles; 0 for a default suited to each event");
+DEFINE_int32(cprof_upload_queue_size, 2,
+             "max # of profiles waiting to be uploaded from a separate "
+             "thread, the oldest ones are dropped; 0 uploads synchronously");
+DEFINE_int32(cprof_upload_attempts, 3,
+             "max # of attempts to upload a profile from the upload queue");
+DEFINE_bool(cprof_continuous_cpu, false,
+            "when set, keep collecting CPU samples between profiles and cut "
+            "CPU profiles from the most recent collection windows");
+DEFINE_int32(cprof_continuous_window_msec, 1000,
+             "duration of the collection windows in continuous CPU mode, "
+             "in milliseconds");
+DEFINE_int32(cprof_continuous_windows, 10,
+             "number of collection windows kept in continuous CPU mode, "
+             "which bounds the CPU profile duration");
+DEFINE_double(cprof_overhead_budget_percent, 0,
+              "when positive, lengthen the CPU and wall sampling periods "
+              "from profile to profile to keep the measured collection cost "
+              "under this percentage of one CPU, e.g. 0.5; the flag periods "
+              "are the shortest used. Not applied to continuous CPU mode");
+DEFINE_bool(cprof_wall_runqueue, false,
+            "when set, also collect a runqueue profile of the time threads "
+            "spent waiting for a CPU along with each wall profile; only "
+            "with --cprof_profile_filename, as the API has no such type");
+DEFINE_int32(cprof_burst_min_interval_sec, 60,
+             "min # of seconds between the burst profiles requested by the "
+             "application, which are rejected meanwhile; negative to reject "
+             "all the requests");
+DEFINE_int32(cprof_burst_max_duration_msec, 10000,
+             "max duration of the burst profiles, in milliseconds");
+DEFINE_int32(cprof_burst_sampling_period_usec, 1000,
+             "sampling period for the CPU and wall burst profiles, in "
+             "microseconds; the perf event bursts are sampled ten times as "
+             "often as their profiles");
+DEFINE_bool(cprof_log_timings, false,
+            "when set, log the time spent collecting and serializing each "
+            "profile, and the size of the serialized profile");
 
 namespace cloud {
 namespace profiler {
@@ -43,6 +97,9 @@ void Worker::Start(JNIEnv *jni) {
     return;
   }
 
+  // Before the profiling starts, which then takes the native threads in.
+  NativeThreads::Start(jvmti_, jni, threads_);
+
   // Pass 'this' as the arg to access members from the worker thread.
   jvmtiError err = jvmti_->RunAgentThread(thread, ProfileThread, this,
                                           JVMTI_THREAD_MIN_PRIORITY);
@@ -50,31 +107,274 @@ void Worker::Start(JNIEnv *jni) {
     LOG(ERROR) << "Failed to start cloud profiler worker thread";
     return;
   }
+  SymbolizerPool::Start(jvmti_, jni);
+
+  if (FLAGS_cprof_burst_min_interval_sec >= 0) {
+    jobject burst_thread =
+        jni->NewGlobalRef(jni->NewObject(cls, constructor));
+    if (burst_thread == nullptr ||
+        jvmti_->RunAgentThread(burst_thread, BurstThread, this,
+                               JVMTI_THREAD_MIN_PRIORITY)) {
+      LOG(ERROR) << "Failed to start cloud profiler burst thread";
+    }
+  }
 
   enabled_ = FLAGS_cprof_enabled;
 }
 
-void Worker::Stop() {
-  // Signal the worker thread to exit and wait until it does.
-  stopping_.store(true, std::memory_order_release);
-  std::lock_guard<std::mutex> lock(mutex_);
+namespace {
+
+// Bursts requested by the application and collected, shared by
+// RequestBurst() and the burst and profiling threads.
+struct BurstState {
+  std::mutex mutex;
+  std::condition_variable requested;
+  // Type of the burst to collect next, empty when none is requested or
+  // being collected.
+  string request_type;
+  int64_t request_duration_nanos = 0;
+  // Time of the last accepted request, 0 if none.
+  int64_t last_request_nanos = 0;
+  // Collected bursts waiting for an iteration of their type, the newest
+  // one of each type.
+  std::map<string, string> profiles;
+  bool stopping = false;
+};
+
+BurstState *Bursts() {
+  static BurstState *bursts = new BurstState();
+  return bursts;
 }
 
-namespace {
+// Returns in profile the burst of the given type collected since the
+// previous iteration of that type, if any.
+bool TakeBurst(const string &profile_type, string *profile) {
+  BurstState *bursts = Bursts();
+  std::lock_guard<std::mutex> lock(bursts->mutex);
+  auto it = bursts->profiles.find(profile_type);
+  if (it == bursts->profiles.end()) {
+    return false;
+  }
+  *profile = std::move(it->second);
+  bursts->profiles.erase(it);
+  return true;
+}
+
+// Serializes a collected profile.
+string Serialize(Profiler *p,
+                 google::javaprofiler::NativeProcessInfo *native_info) {
+  native_info->Refresh();
+  int64_t start_nanos = TimeSpecToNanos(DefaultClock()->Now());
+  string profile = p->SerializeProfile(*native_info);
+  int64_t end_nanos = TimeSpecToNanos(DefaultClock()->Now());
+  AgentStats::Add(AgentStats::kProfiles, 1);
+  AgentStats::Add(AgentStats::kSerializeNanos, end_nanos - start_nanos);
+  AgentStats::Add(AgentStats::kSerializedBytes, profile.size());
+  if (FLAGS_cprof_log_timings) {
+    LOG(INFO) << "Serialized " << p->ProfileType() << " profile in "
+              << (end_nanos - start_nanos) / 1000 << " usec, "
+              << profile.size() << " bytes";
+  }
+  return profile;
+}
 
+// Collects and serializes a profile. Reports its cost to overhead unless
+// it is null.
 string Collect(Profiler *p,
-               google::javaprofiler::NativeProcessInfo *native_info) {
+               google::javaprofiler::NativeProcessInfo *native_info,
+               OverheadController *overhead) {
+  int64_t handler_nanos, num_signals;
+  // Discards the cost of the signals handled before this profile.
+  Profiler::TakeHandlerCost(&handler_nanos, &num_signals);
+  pid_t tid = GetTid();
+  int64_t start_cpu_nanos = ThreadCpuNanos(tid);
+  int64_t start_nanos = TimeSpecToNanos(DefaultClock()->Now());
+
   const char *profile_type = p->ProfileType();
   if (!p->Collect()) {
     LOG(ERROR) << "Failure: Could not collect " << profile_type << " profile";
     return "";
   }
-  native_info->Refresh();
-  return p->SerializeProfile(*native_info);
+  // Read before serializing, which clears the counts.
+  int64_t num_dropped = p->UnknownStackCount();
+  string profile = Serialize(p, native_info);
+  int64_t end_nanos = TimeSpecToNanos(DefaultClock()->Now());
+
+  if (overhead != nullptr) {
+    Profiler::TakeHandlerCost(&handler_nanos, &num_signals);
+    int64_t cost_nanos = handler_nanos + ThreadCpuNanos(tid) -
+                         start_cpu_nanos + p->HelperCpuNanos();
+    overhead->Update(end_nanos - start_nanos, cost_nanos, num_signals,
+                     num_dropped);
+  }
+  return profile;
+}
+
+// Runs an upload, counting it in the agent stats.
+bool CountedUpload(const std::function<bool()> &upload) {
+  int64_t start_nanos = TimeSpecToNanos(DefaultClock()->Now());
+  bool ok = upload();
+  AgentStats::Add(AgentStats::kUploads, 1);
+  AgentStats::Add(AgentStats::kUploadNanos,
+                  TimeSpecToNanos(DefaultClock()->Now()) - start_nanos);
+  if (!ok) {
+    AgentStats::Add(AgentStats::kUploadFailures, 1);
+  }
+  return ok;
+}
+
+// Runs an upload of the current iteration of the throttler, from the
+// upload queue if there is one.
+void RunUpload(UploadQueue *uploads, std::function<bool()> upload) {
+  if (uploads != nullptr) {
+    uploads->Push(std::bind(CountedUpload, std::move(upload)));
+  } else if (!CountedUpload(upload)) {
+    LOG(ERROR) << "Error on profile upload, discarding the profile";
+  }
+}
+
+// Uploads a profile of the current iteration of the throttler.
+void UploadProfile(Throttler *t, UploadQueue *uploads,
+                   const string &profile_type, string profile) {
+  if (profile.empty()) {
+    LOG(ERROR) << "No " << profile_type
+               << " profile bytes collected, skipping the upload";
+    return;
+  }
+  RunUpload(uploads, t->DeferUploadAs(profile_type, std::move(profile)));
+}
+
+// Collects and serializes a burst profile, on behalf of BurstThread().
+string CollectBurst(jvmtiEnv *jvmti, ThreadTable *threads,
+                    const string &profile_type, int64_t duration_nanos,
+                    google::javaprofiler::NativeProcessInfo *native_info) {
+  int64_t period_nanos =
+      static_cast<int64_t>(FLAGS_cprof_burst_sampling_period_usec) * 1000;
+  if (profile_type == kTypeCPU) {
+    CPUProfiler p(jvmti, threads, duration_nanos, period_nanos);
+    return Collect(&p, native_info, nullptr);
+  }
+  if (profile_type == kTypeWall) {
+    WallProfiler p(jvmti, threads, duration_nanos, period_nanos);
+    return Collect(&p, native_info, nullptr);
+  }
+  const PerfEvent &event = *FindPerfEvent(profile_type);
+  int64_t period = FLAGS_cprof_perf_sampling_period > 0
+                       ? FLAGS_cprof_perf_sampling_period
+                       : event.default_period;
+  PerfEventProfiler p(jvmti, threads, event, duration_nanos,
+                      std::max<int64_t>(period / 10, 1));
+  return Collect(&p, native_info, nullptr);
 }
 
 }  // namespace
 
+void Worker::Stop() {
+  {
+    BurstState *bursts = Bursts();
+    std::lock_guard<std::mutex> lock(bursts->mutex);
+    bursts->stopping = true;
+    bursts->requested.notify_all();
+  }
+  // Signal the worker thread to exit and wait until it does.
+  stopping_.store(true, std::memory_order_release);
+  {
+    // The worker thread does not hold mutex_ while the continuous
+    // collection runs, stop the timer and the collector thread first.
+    std::lock_guard<std::mutex> lock(continuous_cpu_mutex_);
+    if (continuous_cpu_) {
+      continuous_cpu_->StopCollection();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  SymbolizerPool::Stop();
+  NativeThreads::Stop();
+}
+
+bool Worker::RequestBurst(const string &profile_type,
+                          int64_t duration_nanos) {
+  if (FLAGS_cprof_burst_min_interval_sec < 0 || !enabled_) {
+    return false;
+  }
+  if (profile_type != kTypeCPU && profile_type != kTypeWall &&
+      FindPerfEvent(profile_type) == nullptr) {
+    LOG(WARNING) << "Unsupported burst profile type '" << profile_type
+                 << "', rejecting the request";
+    return false;
+  }
+  if (profile_type == kTypeCPU && FLAGS_cprof_continuous_cpu) {
+    // The continuous collection holds the CPU timer.
+    LOG(WARNING) << "No CPU burst profiles in continuous CPU mode, "
+                 << "rejecting the request";
+    return false;
+  }
+  int64_t max_duration_nanos =
+      static_cast<int64_t>(FLAGS_cprof_burst_max_duration_msec) *
+      kNanosPerMilli;
+  duration_nanos = std::min(duration_nanos, max_duration_nanos);
+  if (duration_nanos <= 0) {
+    return false;
+  }
+
+  BurstState *bursts = Bursts();
+  std::lock_guard<std::mutex> lock(bursts->mutex);
+  int64_t now_nanos = TimeSpecToNanos(DefaultClock()->Now());
+  if (bursts->stopping || !bursts->request_type.empty() ||
+      (bursts->last_request_nanos != 0 &&
+       now_nanos - bursts->last_request_nanos <
+           FLAGS_cprof_burst_min_interval_sec * kNanosPerSecond)) {
+    return false;
+  }
+  bursts->last_request_nanos = now_nanos;
+  bursts->request_type = profile_type;
+  bursts->request_duration_nanos = duration_nanos;
+  bursts->requested.notify_all();
+  LOG(INFO) << "Collecting a " << profile_type << " burst profile over "
+            << duration_nanos / kNanosPerMilli << " ms";
+  return true;
+}
+
+void Worker::BurstThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
+  Worker *w = static_cast<Worker *>(arg);
+  BurstState *bursts = Bursts();
+  google::javaprofiler::NativeProcessInfo n("/proc/self/maps");
+
+  while (true) {
+    string profile_type;
+    int64_t duration_nanos;
+    {
+      std::unique_lock<std::mutex> lock(bursts->mutex);
+      bursts->requested.wait(lock, [bursts] {
+        return bursts->stopping || !bursts->request_type.empty();
+      });
+      if (bursts->stopping) {
+        break;
+      }
+      profile_type = bursts->request_type;
+      duration_nanos = bursts->request_duration_nanos;
+    }
+
+    string profile;
+    {
+      // Waits for the profile in progress, if any, as the profilers share
+      // the signal handler, the timers and the serialization caches.
+      std::lock_guard<std::mutex> lock(w->mutex_);
+      if (w->stopping_) {
+        break;
+      }
+      profile = CollectBurst(w->jvmti_, w->threads_, profile_type,
+                             duration_nanos, &n);
+    }
+
+    std::lock_guard<std::mutex> lock(bursts->mutex);
+    bursts->request_type.clear();
+    if (!profile.empty()) {
+      bursts->profiles[profile_type] = std::move(profile);
+    }
+  }
+  LOG(INFO) << "Exiting the burst profiling loop";
+}
+
 void Worker::EnableProfiling() {
   enabled_ = true;
 }
@@ -93,39 +393,165 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
           : std::unique_ptr<Throttler>(
                 new TimedThrottler(FLAGS_cprof_profile_filename));
 
+  // Destroyed before the throttler, which the uploads refer to.
+  std::unique_ptr<UploadQueue> uploads;
+  if (FLAGS_cprof_upload_queue_size > 0) {
+    uploads.reset(new UploadQueue(FLAGS_cprof_upload_queue_size,
+                                  FLAGS_cprof_upload_attempts,
+                                  kNanosPerSecond));
+  }
+
+  CgroupCpu::Init();
+  double budget = FLAGS_cprof_overhead_budget_percent / 100;
+  OverheadController cpu_overhead(
+      kTypeCPU, FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli, budget);
+  OverheadController wall_overhead(
+      kTypeWall, FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli,
+      budget);
+
+  bool runqueue = FLAGS_cprof_wall_runqueue;
+  if (runqueue && FLAGS_cprof_profile_filename.empty()) {
+    LOG(WARNING) << "Runqueue profiles are only collected into local files";
+    runqueue = false;
+  }
+
+  ContinuousCPUProfiler *continuous_cpu = nullptr;
+  if (FLAGS_cprof_continuous_cpu) {
+    std::lock_guard<std::mutex> lock(w->continuous_cpu_mutex_);
+    if (!w->stopping_) {
+      w->continuous_cpu_.reset(new ContinuousCPUProfiler(
+          w->jvmti_, w->threads_,
+          FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli,
+          FLAGS_cprof_continuous_window_msec * kNanosPerMilli,
+          FLAGS_cprof_continuous_windows));
+      if (w->continuous_cpu_->StartCollection()) {
+        continuous_cpu = w->continuous_cpu_.get();
+      } else {
+        LOG(ERROR) << "Failed to start continuous CPU profiling, "
+                   << "falling back to per-profile collection";
+        w->continuous_cpu_.reset();
+      }
+    }
+  }
+
   while (t->WaitNext()) {
     std::lock_guard<std::mutex> lock(w->mutex_);
     if (w->stopping_) {
       // The worker is exiting.
       break;
     }
+    if (HeapMonitor::Enabled()) {
+      // The allocations are sampled regardless of the profiles taken.
+      HeapMonitor::RemoveCollected(jni_env);
+    }
     if (!enabled_) {
       // Skip the collection and upload steps when profiling is disabled.
+      if (continuous_cpu) {
+        continuous_cpu->Pause();
+      }
       continue;
     }
+    CgroupCpu::Update();
+    cpu_overhead.SetAllowance(CgroupCpu::Allowance());
+    wall_overhead.SetAllowance(CgroupCpu::Allowance());
     string profile;
     string pt = t->ProfileType();
-    if (pt == kTypeCPU) {
+    if (TakeBurst(pt, &profile)) {
+      // The burst stands in for this profile, as the API only takes the
+      // profiles it asks for.
+      LOG(INFO) << "Uploading a " << pt << " burst profile";
+      RunUpload(uploads.get(), t->DeferUploadBurst(pt, std::move(profile)));
+      continue;
+    }
+    if (pt == kTypeCPUWall) {
+      // Only the timed throttler asks for these, and takes the bursts along
+      // with the profiles of the iteration.
+      for (const char *type : {kTypeCPU, kTypeWall}) {
+        if (TakeBurst(type, &profile)) {
+          RunUpload(uploads.get(),
+                    t->DeferUploadBurst(type, std::move(profile)));
+        }
+      }
+      profile.clear();
+    }
+    if (pt == kTypeCPU && continuous_cpu) {
+      continuous_cpu->Resume();
+      continuous_cpu->SetProfileDuration(t->DurationNanos());
+      profile = Collect(continuous_cpu, &n, nullptr);
+    } else if (pt == kTypeCPU) {
       CPUProfiler p(w->jvmti_, w->threads_, t->DurationNanos(),
-                    FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, &n);
+                    cpu_overhead.PeriodNanos());
+      profile = Collect(&p, &n, &cpu_overhead);
     } else if (pt == kTypeWall) {
       // Note that the requested sampling period for the wall profiling may be
-      // increased if the number of live threads is too large.
+      // increased if the number of live threads is too large. The continuous
+      // CPU collection, if any, keeps going meanwhile.
       WallProfiler p(w->jvmti_, w->threads_, t->DurationNanos(),
-                     FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, &n);
+                     wall_overhead.PeriodNanos(), runqueue);
+      profile = Collect(&p, &n, &wall_overhead);
+      if (runqueue && !profile.empty()) {
+        UploadProfile(t.get(), uploads.get(), kTypeRunqueue,
+                      p.SerializeRunqueueProfile(n));
+      }
+    } else if (pt == kTypeCPUWall) {
+      // The wall samples are taken on a helper thread over the same
+      // window, and serialized on this one, which is attached to the JVM.
+      // Their cost is measured along with the CPU profile one, the wall
+      // sampling period does not adapt meanwhile.
+      WallProfiler wall(w->jvmti_, w->threads_, t->DurationNanos(),
+                        wall_overhead.PeriodNanos(), runqueue);
+      // Skips this thread, which the helper one collects for.
+      pid_t worker_tid = GetTid();
+      bool wall_collected = false;
+      std::thread wall_thread([&] {
+        ScopedAgentThread agent_thread;
+        wall_collected = wall.Collect(worker_tid);
+      });
+      if (continuous_cpu) {
+        continuous_cpu->Resume();
+        continuous_cpu->SetProfileDuration(t->DurationNanos());
+        profile = Collect(continuous_cpu, &n, nullptr);
+      } else {
+        CPUProfiler p(w->jvmti_, w->threads_, t->DurationNanos(),
+                      cpu_overhead.PeriodNanos());
+        profile = Collect(&p, &n, &cpu_overhead);
+      }
+      wall_thread.join();
+      if (wall_collected) {
+        UploadProfile(t.get(), uploads.get(), kTypeWall, Serialize(&wall, &n));
+        if (runqueue) {
+          UploadProfile(t.get(), uploads.get(), kTypeRunqueue,
+                        wall.SerializeRunqueueProfile(n));
+        }
+      } else {
+        LOG(ERROR) << "Failure: Could not collect wall profile";
+      }
+      pt = kTypeCPU;
+    } else if (pt == kTypeHeap && HeapMonitor::Enabled()) {
+      profile = HeapMonitor::SerializeLiveHeap(w->jvmti_, jni_env);
+    } else if (pt == kTypeHeapAlloc && HeapMonitor::Enabled()) {
+      profile = HeapMonitor::CollectAllocations(w->jvmti_, t->DurationNanos());
+    } else if (pt == kTypeContention && ContentionMonitor::Enabled()) {
+      profile = ContentionMonitor::Collect(w->jvmti_, t->DurationNanos());
+    } else if (FindPerfEvent(pt) != nullptr) {
+      // When perf_event_open is restricted, the collection fails and the
+      // upload is skipped.
+      const PerfEvent &event = *FindPerfEvent(pt);
+      int64_t period = FLAGS_cprof_perf_sampling_period > 0
+                           ? FLAGS_cprof_perf_sampling_period
+                           : event.default_period;
+      PerfEventProfiler p(w->jvmti_, w->threads_, event, t->DurationNanos(),
+                          period);
+      profile = Collect(&p, &n, nullptr);
     } else {
       LOG(ERROR) << "Unknown profile type '" << pt << "', skipping the upload";
       continue;
     }
-    if (profile.empty()) {
-      LOG(ERROR) << "No profile bytes collected, skipping the upload";
-      continue;
-    }
-    if (!t->Upload(profile)) {
-      LOG(ERROR) << "Error on profile upload, discarding the profile";
-    }
+    UploadProfile(t.get(), uploads.get(), pt, std::move(profile));
+  }
+  {
+    std::lock_guard<std::mutex> lock(w->continuous_cpu_mutex_);
+    w->continuous_cpu_.reset();
   }
   LOG(INFO) << "Exiting the profiling loop";
 }
@@ -18,9 +18,11 @@
 #define CLOUD_PROFILER_AGENT_JAVA_WORKER_H_
 
 #include <atomic>
+#include <memory>
 #include <mutex>  // NOLINT
 
 #include "src/globals.h"
+#include "src/profiler.h"
 #include "src/threads.h"
 #include "src/throttler.h"
 
@@ -38,13 +40,26 @@ class Worker {
   static void EnableProfiling();
   static void DisableProfiling();
 
+  // Asks for a burst profile of the given type, collected right away over
+  // duration_nanos at a higher sampling rate. The burst stands in for the
+  // next profile of its type the throttler asks for, and is uploaded as a
+  // burst. Returns false if the request is rejected, as when the type is
+  // not supported or the rate limit is reached.
+  static bool RequestBurst(const string &profile_type, int64_t duration_nanos);
+
  private:
   static void ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg);
+  // Collects the requested bursts, one at a time.
+  static void BurstThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg);
 
   jvmtiEnv *jvmti_;
   ThreadTable *threads_;
   std::mutex mutex_;  // Held by the worker thread while it's running.
   std::atomic<bool> stopping_;
+  // The continuous CPU collection, if any, which runs while the worker
+  // thread waits for the next profile and is stopped by Stop().
+  std::mutex continuous_cpu_mutex_;
+  std::unique_ptr<ContinuousCPUProfiler> continuous_cpu_;
   static std::atomic<bool> enabled_;
   DISALLOW_COPY_AND_ASSIGN(Worker);
 };
@@ -12,74 +12,160 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Force definition of SNCx64 macro used below for all variations of
-// inttypes.h.
-#ifndef __STDC_FORMAT_MACROS
-#define __STDC_FORMAT_MACROS
-#endif
-
 #include "third_party/javaprofiler/native.h"
 
-#include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#include <cinttypes>
-#include <cstdio>
+#include <algorithm>
 #include <cstring>
-#include <memory>
 
 namespace google {
 namespace javaprofiler {
 
+namespace {
+
+// Minimum room left in the buffer for each read of the maps file.
+const size_t kMinReadSize = 16 * 1024;
+
+const char *SkipSpaces(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+const char *SkipField(const char *p, const char *end) {
+  while (p < end && *p != ' ' && *p != '\t') {
+    p++;
+  }
+  return p;
+}
+
+// Parses the hexadecimal number at *p, advancing *p past it. Returns false
+// if there is no digit.
+bool ParseHex(const char **p, const char *end, uint64_t *value) {
+  const char *start = *p;
+  uint64_t v = 0;
+  for (; *p < end; (*p)++) {
+    char c = **p;
+    if (c >= '0' && c <= '9') {
+      v = (v << 4) | (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      v = (v << 4) | (c - 'a' + 10);
+    } else {
+      break;
+    }
+  }
+  *value = v;
+  return *p != start;
+}
+
+// Parses a line of the maps file, in the "start-limit perms offset dev inode
+// name" format. Returns false if it is not an executable mapping of a named
+// region.
+bool ParseMapping(const char *p, const char *end, uint64_t *start,
+                  uint64_t *limit, uint64_t *offset, const char **name,
+                  size_t *name_len) {
+  if (!ParseHex(&p, end, start) || p == end || *p++ != '-' ||
+      !ParseHex(&p, end, limit)) {
+    return false;
+  }
+  p = SkipSpaces(p, end);
+  const char *permissions = p;
+  p = SkipField(p, end);
+  if (p - permissions != 4 || permissions[2] != 'x') {
+    // Only examine executable mappings.
+    return false;
+  }
+  p = SkipSpaces(p, end);
+  if (!ParseHex(&p, end, offset)) {
+    return false;
+  }
+  p = SkipField(SkipSpaces(p, end), end);  // Device.
+  p = SkipField(SkipSpaces(p, end), end);  // Inode.
+  p = SkipSpaces(p, end);
+  // Skip mappings with an empty name. Likely generated code that cannot be
+  // symbolized anyway.
+  *name = p;
+  *name_len = SkipField(p, end) - p;
+  return *name_len != 0;
+}
+
+}  // namespace
+
 NativeProcessInfo::NativeProcessInfo(const string &procmaps_filename)
     : procmaps_filename_(procmaps_filename) {
   Refresh();
 }
 
 void NativeProcessInfo::Refresh() {
-  FILE *f = fopen(procmaps_filename_.c_str(), "r");
-
-  if (f == nullptr) {
+  int fd = open(procmaps_filename_.c_str(), O_RDONLY);
+  if (fd == -1) {
     LOG(ERROR) << "Could not open maps file: " << procmaps_filename_;
     return;
   }
 
-  mappings_.clear();
-
-  const size_t kBufferLineSize = 2048;
-  std::unique_ptr<char[]> line(new char[kBufferLineSize]);
-  while (fgets(&line[0], kBufferLineSize, f)) {
-    uint64_t start = 0, limit = 0, offset = 0;
-    char permissions[5];
-    int filename_index = 0;
-
-    if (sscanf(&line[0], "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n",
-               &start, &limit, &permissions[0], &offset,
-               &filename_index) != 4) {
-      // Partial match, ignore.
-      continue;
+  // The size of the file is not known in advance, read it all in as few
+  // calls as possible.
+  size_t size = 0;
+  while (true) {
+    if (buffer_.size() - size < kMinReadSize) {
+      buffer_.resize(std::max(2 * buffer_.size(), 4 * kMinReadSize));
     }
-    if (strlen(permissions) != 4 || permissions[2] != 'x') {
-      // Only examine executable mappings.
+    ssize_t n = read(fd, &buffer_[size], buffer_.size() - size);
+    if (n < 0 && errno == EINTR) {
       continue;
     }
-
-    if (filename_index == 0 || filename_index > strlen(&line[0])) {
-      // No valid filename found.
-      continue;
+    if (n <= 0) {
+      break;
     }
+    size += n;
+  }
+  close(fd);
 
-    if (!line[filename_index]) {
-      // Skip mappings with an empty name. Likely generated code that
-      // cannot be symbolized anyway.
-      continue;
+  size_t num_mappings = 0;
+  const char *p = buffer_.data();
+  const char *end = p + size;
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
     }
+    uint64_t start, limit, offset;
+    const char *name;
+    size_t name_len;
+    if (ParseMapping(p, eol, &start, &limit, &offset, &name, &name_len)) {
+      if (num_mappings < mappings_.size()) {
+        Mapping &mapping = mappings_[num_mappings];
+        mapping.start = start;
+        mapping.limit = limit;
+        mapping.offset = offset;
+        if (mapping.name.compare(0, string::npos, name, name_len) != 0) {
+          mapping.name.assign(name, name_len);
+        }
+      } else {
+        mappings_.push_back(
+            Mapping{start, limit, offset, string(name, name_len)});
+      }
+      num_mappings++;
+    }
+    p = eol + 1;
+  }
+  mappings_.resize(num_mappings);
+}
 
-    const char *filename = &line[filename_index];
-    size_t filename_len = strcspn(filename, " \t\n");
-    mappings_.emplace_back(
-        Mapping{start, limit, string(filename, filename_len)});
+const NativeProcessInfo::Mapping *NativeProcessInfo::Find(
+    uint64_t address) const {
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), address,
+      [](uint64_t address, const Mapping &m) { return address < m.start; });
+  if (it == mappings_.begin()) {
+    return nullptr;
   }
-  fclose(f);
+  --it;
+  return address < it->limit ? &*it : nullptr;
 }
 
 }  // namespace javaprofiler
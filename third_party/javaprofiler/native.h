@@ -35,15 +35,26 @@ class NativeProcessInfo {
 
   struct Mapping {
     uint64_t start, limit;
+    // Offset in the file of the start of the mapping.
+    uint64_t offset;
     string name;
   };
 
+  // Reads the executable mappings again. The mappings which did not change
+  // reuse their storage.
   void Refresh();
+
+  // The executable mappings, sorted by start address.
   const std::vector<Mapping> &Mappings() const { return mappings_; }
 
+  // Returns the mapping holding address, or nullptr if there is none.
+  const Mapping *Find(uint64_t address) const;
+
  private:
   const string procmaps_filename_;
   std::vector<Mapping> mappings_;
+  // Contents of the maps file, kept to reuse the memory.
+  string buffer_;
   DISALLOW_COPY_AND_ASSIGN(NativeProcessInfo);
 };
 
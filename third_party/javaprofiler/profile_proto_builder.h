@@ -17,13 +17,15 @@
 #ifndef THIRD_PARTY_JAVAPROFILER_PROFILE_PROTO_BUILDER_H__
 #define THIRD_PARTY_JAVAPROFILER_PROFILE_PROTO_BUILDER_H__
 
+#include <jvmti.h>
 #include <link.h>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "perftools/profiles/proto/builder.h"
-#include "third_party/java/jdk/include/jvmti.h"
+#include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
 
 namespace google {
@@ -31,7 +33,7 @@ namespace javaprofiler {
 
 struct ProfileStackTrace {
   JVMPI_CallTrace *trace;
-  jint metric_value;
+  int64_t metric_value;
 };
 
 // Store proto sample objects for specific stack traces.
@@ -50,8 +52,8 @@ class TraceSamples {
                     const JVMPI_CallTrace &trace2) const;
   };
 
-  __gnu_cxx::hash_map<JVMPI_CallTrace, perftools::profiles::Sample *, TraceHash,
-                      TraceEquals>
+  std::unordered_map<JVMPI_CallTrace, perftools::profiles::Sample *, TraceHash,
+                     TraceEquals>
       traces_;
 };
 
@@ -88,8 +90,8 @@ class LocationBuilder {
 
   perftools::profiles::Builder *builder_;
 
-  __gnu_cxx::hash_map<LocationInfo, perftools::profiles::Location *,
-                      LocationInfoHash, LocationInfoEquals>
+  std::unordered_map<LocationInfo, perftools::profiles::Location *,
+                     LocationInfoHash, LocationInfoEquals>
       locations_;
 };
 
@@ -108,6 +110,24 @@ class ProfileFrameCache {
   virtual ~ProfileFrameCache() {}
 };
 
+// Frame cache for traces with Java frames only, such as the ones returned by
+// the JVMTI GetStackTrace(), which have no native frames to resolve.
+class JavaFrameCache : public ProfileFrameCache {
+ public:
+  void ProcessTraces(const ProfileStackTrace *traces,
+                     int num_traces) override {}
+
+  perftools::profiles::Location *GetLocation(
+      const JVMPI_CallFrame &jvm_frame,
+      LocationBuilder *location_builder) override {
+    return location_builder->LocationFor("", "[Unknown native]", "", 0);
+  }
+
+  string GetFunctionName(const JVMPI_CallFrame &jvm_frame) override {
+    return "";
+  }
+};
+
 // Create profile protobufs from traces obtained from JVM profiling.
 class ProfileProtoBuilder {
  public:
@@ -119,7 +139,7 @@ class ProfileProtoBuilder {
   // Add traces to the proto, where each trace has a defined count
   // of occurrences.
   void AddTraces(const ProfileStackTrace *traces,
-                 const int32 *counts,
+                 const int64_t *counts,
                  int num_traces);
 
   // Add a "fake" trace with a single frame. Used to represent JVM
@@ -131,13 +151,16 @@ class ProfileProtoBuilder {
   virtual std::unique_ptr<perftools::profiles::Profile> CreateProto() = 0;
 
   static std::unique_ptr<ProfileProtoBuilder> ForHeap(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
+
+  static std::unique_ptr<ProfileProtoBuilder> ForAllocations(
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
   static std::unique_ptr<ProfileProtoBuilder> ForCpu(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
   static std::unique_ptr<ProfileProtoBuilder> ForContention(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
  protected:
   struct SampleType {
@@ -150,7 +173,7 @@ class ProfileProtoBuilder {
 
   ProfileProtoBuilder(jvmtiEnv *jvmti_env,
                       ProfileFrameCache *native_cache,
-                      int64 sampling_rate,
+                      int64_t sampling_rate,
                       const SampleType &count_type,
                       const SampleType &metric_type);
 
@@ -207,12 +230,12 @@ class ProfileProtoBuilder {
 
   void AddSampleType(const SampleType &sample_type);
   void SetPeriodType(const SampleType &metric_type);
-  void InitSampleValues(perftools::profiles::Sample *sample, jint metric);
-  void InitSampleValues(perftools::profiles::Sample *sample, jint count,
-                        jint metric);
-  void UpdateSampleValues(perftools::profiles::Sample *sample, jint count,
-                          jint size);
-  void AddTrace(const ProfileStackTrace &trace, int32 count);
+  void InitSampleValues(perftools::profiles::Sample *sample, int64_t metric);
+  void InitSampleValues(perftools::profiles::Sample *sample, int64_t count,
+                        int64_t metric);
+  void UpdateSampleValues(perftools::profiles::Sample *sample, int64_t count,
+                          int64_t size);
+  void AddTrace(const ProfileStackTrace &trace, int64_t count);
   void AddJavaInfo(const google::javaprofiler::JVMPI_CallFrame &jvm_frame,
                    perftools::profiles::Profile *profile,
                    perftools::profiles::Sample *sample,
@@ -228,7 +251,7 @@ class ProfileProtoBuilder {
   ProfileFrameCache *native_cache_;
   TraceSamples trace_samples_;
   LocationBuilder location_builder_;
-  int64 sampling_rate_ = 0;
+  int64_t sampling_rate_ = 0;
 };
 
 // Computes the ratio to use to scale heap data to unsample it.
@@ -237,12 +260,13 @@ class ProfileProtoBuilder {
 // on a poisson process to determine which samples to collect, based
 // on the desired average collection rate R. The probability of a
 // sample of size S to appear in that profile is 1-exp(-S/R).
-double CalculateSamplingRatio(int64 rate, int64 count, int64 metric_value);
+double CalculateSamplingRatio(int64_t rate, int64_t count,
+                              int64_t metric_value);
 
 class CpuProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   CpuProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                         int64 sampling_rate,
+                         int64_t sampling_rate,
                          ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("samples", "count"),
@@ -262,7 +286,7 @@ class CpuProfileProtoBuilder : public ProfileProtoBuilder {
 class HeapProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   HeapProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                          int64 sampling_rate,
+                          int64_t sampling_rate,
                           ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("inuse_objects",
@@ -276,6 +300,15 @@ class HeapProfileProtoBuilder : public ProfileProtoBuilder {
   }
 
  protected:
+  HeapProfileProtoBuilder(jvmtiEnv *jvmti_env,
+                          int64_t sampling_rate,
+                          ProfileFrameCache *cache,
+                          const SampleType &count_type,
+                          const SampleType &metric_type)
+      : ProfileProtoBuilder(jvmti_env, cache, sampling_rate, count_type,
+                            metric_type) {
+  }
+
   int SkipTopNativeFrames(const JVMPI_CallTrace &trace) override {
     for (int i = 0; i < trace.num_frames; ++i) {
       if (trace.frames[i].lineno !=
@@ -288,10 +321,25 @@ class HeapProfileProtoBuilder : public ProfileProtoBuilder {
   }
 };
 
+// Same as HeapProfileProtoBuilder, for all the objects allocated over a
+// period of time instead of the ones still in use.
+class AllocationProfileProtoBuilder : public HeapProfileProtoBuilder {
+ public:
+  AllocationProfileProtoBuilder(jvmtiEnv *jvmti_env,
+                                int64_t sampling_rate,
+                                ProfileFrameCache *cache)
+      : HeapProfileProtoBuilder(jvmti_env, sampling_rate, cache,
+                                ProfileProtoBuilder::SampleType("alloc_objects",
+                                                                "count"),
+                                ProfileProtoBuilder::SampleType("alloc_space",
+                                                                "bytes")) {
+  }
+};
+
 class ContentionProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   ContentionProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                                int64 sampling_rate,
+                                int64_t sampling_rate,
                                 ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("contentions",
@@ -70,6 +70,11 @@ const jint kNativeFrameLineNum = -99;
 // field contains a value from the CallTraceErrors enumeration defined below.
 const jint kCallTraceErrorLineNum = -100;
 
+// Placeholder (fake) line number for the frame added as the root of the
+// traces which had more frames than captured, so that truncated traces are
+// aggregated apart from complete ones. The method_id field is null.
+const jint kTruncatedFrameLineNum = -101;
+
 enum CallTraceErrors {
   // 0 is reserved for native stack traces.  This includes JIT and GC threads.
   kNativeStackTrace = 0,
@@ -14,6 +14,16 @@
 
 #include "third_party/javaprofiler/stacktraces.h"
 
+#include <sched.h>
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
 namespace google {
 namespace javaprofiler {
 
@@ -21,37 +31,506 @@ __thread JNIEnv *Accessors::env_;
 __thread int64_t Accessors::attr_;
 ASGCTType Asgct::asgct_;
 
-std::mutex *AttributeTable::mutex_;
-std::unordered_map<string, int> *AttributeTable::string_map_;
-std::vector<string> *AttributeTable::strings_;
+LockFreeStringTable *AttributeTable::strings_;
+LockFreeStringTable *AttributeTable::value_sets_;
+std::atomic<int> AttributeTable::keys_[AttributeTable::kMaxKeys];
+
+namespace {
+
+// Odd constants of the multiply-mix, with bits set in both halves so that
+// a value xor-ed with them is never 0.
+const uint64_t kHashSeed0 = 0xa0761d6478bd642fULL;
+const uint64_t kHashSeed1 = 0xe7037ed1a0b428dbULL;
+
+// Folds the 128-bit product of a and b into 64 bits. Every bit of the
+// inputs affects most bits of the result, in a single multiplication.
+inline uint64_t MulMix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(product) ^
+         static_cast<uint64_t>(product >> 64);
+#else
+  uint64_t product = a * b;
+  return product ^ (product >> 32);
+#endif
+}
+
+inline uint64_t HashFinish(uint64_t h) {
+  h += h << 3;
+  h ^= h >> 11;
+  return h;
+}
+
+// Mixes a frame into the hash of its callers. Traces are hashed from the
+// root, so the hash of a trace extends the one of its caller's trace.
+inline uint64_t HashFrame(uint64_t h, const JVMPI_CallFrame &frame) {
+  return MulMix(h ^ reinterpret_cast<uintptr_t>(frame.method_id) ^ kHashSeed0,
+                static_cast<uint32_t>(frame.lineno) ^ kHashSeed1);
+}
+
+// Completes the hash of a trace from the hash of its frames.
+inline uint64_t HashTrace(int64_t attr, uint64_t frames_hash) {
+  return MulMix(frames_hash ^ kHashSeed1,
+                static_cast<uint64_t>(attr) ^ kHashSeed0);
+}
+
+}  // namespace
+
+LockFreeStringTable::LockFreeStringTable(int max_strings)
+    : max_strings_(max_strings > 1 ? max_strings : 1),
+      index_size_(IndexSize(max_strings_)),
+      next_(1) {
+  strings_ = new std::atomic<const string *>[max_strings_];
+  for (int i = 0; i < max_strings_; i++) {
+    strings_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  strings_[0].store(new string(), std::memory_order_release);
+  index_ = new std::atomic<int>[index_size_];
+  for (int i = 0; i < index_size_; i++) {
+    index_[i].store(0, std::memory_order_relaxed);
+  }
+}
 
-bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
-  uint64_t hash_val = CalculateHash(attr, trace->num_frames, &trace->frames[0]);
+int LockFreeStringTable::IndexSize(int max_strings) {
+  int size = 1;
+  while (size < 2 * max_strings) {
+    size <<= 1;
+  }
+  return size;
+}
+
+int LockFreeStringTable::Intern(const char *data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  // FNV-1a.
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+  }
 
-  active_insertions_.fetch_add(1, std::memory_order_acquire);
-  for (int64_t i = 0; i < MaxEntries(); i++) {
-    int64_t idx = (i + hash_val) % MaxEntries();
-    auto &entry = traces_[idx];
+  // Id allocated to the string, once an empty slot has been found.
+  int id = 0;
+  for (int i = 0; i < index_size_; i++) {
+    auto &slot = index_[(h + i) & (index_size_ - 1)];
+    int existing = slot.load(std::memory_order_acquire);
+    if (existing == 0) {
+      if (id == 0) {
+        if (next_.load(std::memory_order_relaxed) >= max_strings_) {
+          return 0;
+        }
+        id = next_.fetch_add(1, std::memory_order_acq_rel);
+        if (id >= max_strings_) {
+          return 0;
+        }
+        // Published before the id, so that whoever finds the id finds the
+        // string.
+        strings_[id].store(new string(data, size), std::memory_order_release);
+      }
+      if (slot.compare_exchange_strong(existing, id,
+                                       std::memory_order_acq_rel)) {
+        return id;
+      }
+      // Lost the slot to existing, which may be the same string.
+    }
+    const string *str = strings_[existing].load(std::memory_order_acquire);
+    if (str->size() == size && memcmp(str->data(), data, size) == 0) {
+      return existing;
+    }
+  }
+  return 0;
+}
+
+void AttributeTable::Init() {
+  strings_ = new LockFreeStringTable(kMaxStrings);
+  value_sets_ = new LockFreeStringTable(kMaxValueSets);
+}
+
+int AttributeTable::RegisterString(const char *value) {
+  if (strings_ == nullptr || value == nullptr) {
+    // Not initialized.
+    return 0;
+  }
+  return strings_->Intern(value, strlen(value));
+}
+
+const string *AttributeTable::GetString(int id) {
+  return strings_ == nullptr ? nullptr : strings_->Get(id);
+}
+
+int AttributeTable::NumStrings() {
+  return strings_ == nullptr ? 0 : strings_->Size();
+}
+
+int AttributeTable::RegisterKey(const char *name) {
+  int name_id = RegisterString(name);
+  if (name_id == 0) {
+    return 0;
+  }
+  for (int key = 1; key < kMaxKeys; key++) {
+    int existing = 0;
+    if (keys_[key].compare_exchange_strong(existing, name_id,
+                                           std::memory_order_acq_rel) ||
+        existing == name_id) {
+      return key;
+    }
+  }
+  return 0;
+}
+
+int AttributeTable::KeyString(int key) {
+  if (key <= 0 || key >= kMaxKeys) {
+    return 0;
+  }
+  return keys_[key].load(std::memory_order_acquire);
+}
+
+int AttributeTable::SetValue(int attr, int key, int value) {
+  if (key < 0 || key >= kMaxKeys) {
+    return attr;
+  }
+  int values[kMaxKeys];
+  GetValues(attr, values);
+  values[key] = value;
+  bool other_keys = false;
+  for (int i = 1; i < kMaxKeys; i++) {
+    other_keys = other_keys || values[i] != 0;
+  }
+  if (!other_keys || value_sets_ == nullptr) {
+    // Plain string id, as set by the callers not using the keys.
+    return values[0];
+  }
+  int value_set =
+      value_sets_->Intern(reinterpret_cast<const char *>(values),
+                          sizeof(values));
+  // Only keeps the default key when out of room.
+  return value_set != 0 ? -value_set : values[0];
+}
+
+void AttributeTable::GetValues(int attr, int values[kMaxKeys]) {
+  memset(values, 0, kMaxKeys * sizeof(values[0]));
+  if (attr >= 0) {
+    values[0] = attr;
+    return;
+  }
+  const string *value_set =
+      value_sets_ == nullptr ? nullptr : value_sets_->Get(-attr);
+  if (value_set != nullptr &&
+      value_set->size() == kMaxKeys * sizeof(values[0])) {
+    memcpy(values, value_set->data(), value_set->size());
+  }
+}
+
+AsyncSafeFrameTrie::AsyncSafeFrameTrie(int64_t max_nodes)
+    : max_nodes_(max_nodes > 0 ? max_nodes : 1),
+      // Keep the load factor of the index under 50%.
+      index_size_(2 * max_nodes_) {
+  // The nodes are left uninitialized so that they only become resident
+  // when used.
+  nodes_ = new Node[max_nodes_];
+  index_ = new std::atomic<uint32_t>[index_size_];
+  Reset();
+}
+
+AsyncSafeFrameTrie::~AsyncSafeFrameTrie() {
+  delete[] nodes_;
+  delete[] index_;
+}
+
+void AsyncSafeFrameTrie::Reset() {
+  for (int64_t i = 0; i < index_size_; i++) {
+    index_[i].store(kNoNode, std::memory_order_relaxed);
+  }
+  num_nodes_ = 0;
+}
+
+uint32_t AsyncSafeFrameTrie::Add(int num_frames,
+                                 const JVMPI_CallFrame *frames) {
+  uint32_t node = kNoNode;
+  for (int i = num_frames - 1; i >= 0; i--) {
+    node = Intern(node, frames[i]);
+    if (node == kNoNode) {
+      return kNoNode;
+    }
+  }
+  return node;
+}
+
+uint32_t AsyncSafeFrameTrie::Intern(uint32_t parent,
+                                    const JVMPI_CallFrame &frame) {
+  // The hash of the path to the node identifies (parent, frame) as well.
+  uint64_t frames_hash = HashFrame(FramesHash(parent), frame);
+  uint64_t h = HashFinish(frames_hash);
+
+  uint32_t allocated = kNoNode;
+  for (int64_t i = 0; i < kMaxProbeLength; i++) {
+    auto &slot = index_[(h + i) % index_size_];
+    uint32_t node = slot.load(std::memory_order_acquire);
+    if (node == kNoNode) {
+      if (allocated == kNoNode) {
+        int64_t pos = num_nodes_.fetch_add(1, std::memory_order_relaxed);
+        if (pos >= max_nodes_) {
+          return kNoNode;
+        }
+        allocated = pos + 1;
+        // memcpy is not async safe
+        Node &n = nodes_[pos];
+        n.frame.lineno = frame.lineno;
+        n.frame.method_id = frame.method_id;
+        n.parent = parent;
+        n.depth = parent == kNoNode ? 1 : NodeAt(parent).depth + 1;
+        n.frames_hash = frames_hash;
+      }
+      // Publish the node, which has been fully written before.
+      if (slot.compare_exchange_strong(node, allocated,
+                                       std::memory_order_release,
+                                       std::memory_order_acquire)) {
+        return allocated;
+      }
+      // Another thread took the slot, node now holds its id. Check if it
+      // added the same frame before moving on.
+    }
+    const Node &n = NodeAt(node);
+    if (n.parent == parent && n.frame.method_id == frame.method_id &&
+        n.frame.lineno == frame.lineno) {
+      // Any node allocated above is leaked until the next Reset().
+      return node;
+    }
+  }
+  return kNoNode;
+}
+
+int AsyncSafeFrameTrie::Depth(uint32_t node) const {
+  return node == kNoNode ? 0 : NodeAt(node).depth;
+}
+
+int64_t AsyncSafeFrameTrie::NumNodes() const {
+  int64_t num_nodes = num_nodes_.load(std::memory_order_relaxed);
+  return num_nodes < max_nodes_ ? num_nodes : max_nodes_;
+}
+
+uint64_t AsyncSafeFrameTrie::FramesHash(uint32_t node) const {
+  return node == kNoNode ? 0 : NodeAt(node).frames_hash;
+}
+
+int AsyncSafeFrameTrie::Frames(uint32_t node, int max_frames,
+                               JVMPI_CallFrame *frames) const {
+  int num_frames = 0;
+  while (node != kNoNode && num_frames < max_frames) {
+    const Node &n = NodeAt(node);
+    frames[num_frames].lineno = n.frame.lineno;
+    frames[num_frames].method_id = n.frame.method_id;
+    num_frames++;
+    node = n.parent;
+  }
+  return num_frames;
+}
+
+AsyncSafeTraceMultiset::AsyncSafeTraceMultiset(int64_t max_entries,
+                                               int num_shards,
+                                               int64_t max_frames)
+    : num_shards_(num_shards > 0 ? num_shards : 1),
+      shard_entries_(std::max<int64_t>(
+          num_shards_ > 1 ? kMinShardEntries : 1,
+          (max_entries + num_shards_ - 1) / num_shards_)),
+      shard_words_((shard_entries_ + 63) / 64),
+      generation_(0) {
+  if (max_frames > kMaxFramesLimit) {
+    max_frames = kMaxFramesLimit;
+  }
+  frames_[0].reset(new AsyncSafeFrameTrie(max_frames));
+  frames_[1].reset(new AsyncSafeFrameTrie(max_frames));
+  // new does not honor the alignment of Shard before C++17.
+  void *shards = nullptr;
+  if (posix_memalign(&shards, alignof(Shard), num_shards_ * sizeof(Shard)) !=
+      0) {
+    LOG(FATAL) << "Could not allocate the shards of the trace multiset";
+  }
+  shards_ = static_cast<Shard *>(shards);
+  for (int i = 0; i < num_shards_; i++) {
+    new (&shards_[i]) Shard();
+    shards_[i].traces = new TraceData[shard_entries_];
+    shards_[i].occupied = new std::atomic<uint64_t>[shard_words_];
+    shards_[i].additions = 0;
+    shards_[i].probes = 0;
+    shards_[i].active_frames[0] = 0;
+    shards_[i].active_frames[1] = 0;
+  }
+  Reset();
+}
+
+AsyncSafeTraceMultiset::~AsyncSafeTraceMultiset() {
+  for (int i = 0; i < num_shards_; i++) {
+    delete[] shards_[i].traces;
+    delete[] shards_[i].occupied;
+    shards_[i].~Shard();
+  }
+  free(shards_);
+}
+
+void AsyncSafeTraceMultiset::Reset() {
+  for (int i = 0; i < num_shards_; i++) {
+    Shard &shard = shards_[i];
+    for (int64_t j = 0; j < shard_entries_; j++) {
+      shard.traces[j].attr = 0;
+      shard.traces[j].node = AsyncSafeFrameTrie::kNoNode;
+      shard.traces[j].count.store(0, std::memory_order_relaxed);
+    }
+    for (int64_t w = 0; w < shard_words_; w++) {
+      shard.occupied[w].store(0, std::memory_order_relaxed);
+    }
+    shard.active_insertions = 0;
+  }
+  frames_[0]->Reset();
+  frames_[1]->Reset();
+}
+
+void AsyncSafeTraceMultiset::TakeProbeStats(int64_t *additions,
+                                            int64_t *probes) {
+  *additions = 0;
+  *probes = 0;
+  for (int i = 0; i < num_shards_; i++) {
+    *additions += shards_[i].additions.exchange(0, std::memory_order_relaxed);
+    *probes += shards_[i].probes.exchange(0, std::memory_order_relaxed);
+  }
+}
+
+int AsyncSafeTraceMultiset::CpuShard() const {
+  if (num_shards_ == 1) {
+    return 0;
+  }
+  // sched_getcpu() reads the CPU number from the vDSO or rseq area and
+  // does not take any locks.
+  int cpu = sched_getcpu();
+  return cpu < 0 ? -1 : cpu % num_shards_;
+}
+
+uint64_t AsyncSafeTraceMultiset::EnterGeneration(int shard) {
+  std::atomic<int> *active_frames = shards_[shard].active_frames;
+  while (true) {
+    uint64_t generation = generation_.load(std::memory_order_seq_cst);
+    active_frames[generation % 2].fetch_add(1, std::memory_order_seq_cst);
+    // Either SwapFrames() sees the addition counted, or it is seen here
+    // to have moved on to the next generation.
+    if (generation_.load(std::memory_order_seq_cst) == generation) {
+      return generation;
+    }
+    active_frames[generation % 2].fetch_sub(1, std::memory_order_release);
+  }
+}
+
+void AsyncSafeTraceMultiset::LeaveGeneration(int shard, uint64_t generation) {
+  shards_[shard].active_frames[generation % 2].fetch_sub(
+      1, std::memory_order_release);
+}
+
+bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace,
+                                 uint32_t *node) {
+  int cpu_shard = CpuShard();
+  int shard = cpu_shard < 0 ? 0 : cpu_shard;
+  uint64_t generation = EnterGeneration(shard);
+  uint32_t frames_node = TagNode(
+      generation,
+      frames_[generation % 2]->Add(trace->num_frames, trace->frames));
+  if (node != nullptr) {
+    *node = frames_node;
+  }
+  bool added = AddToShards(cpu_shard, attr, frames_node, 1);
+  LeaveGeneration(shard, generation);
+  return added;
+}
+
+bool AsyncSafeTraceMultiset::AddNode(int attr, uint32_t node,
+                                     int64_t count) {
+  int cpu_shard = CpuShard();
+  int shard = cpu_shard < 0 ? 0 : cpu_shard;
+  uint64_t generation = EnterGeneration(shard);
+  // The trie of any other generation may be cleared before the trace is
+  // harvested.
+  bool added = SameGeneration(generation, node) &&
+               AddToShards(cpu_shard, attr, node, count);
+  LeaveGeneration(shard, generation);
+  return added;
+}
+
+bool AsyncSafeTraceMultiset::HasNode(uint32_t node) const {
+  return node != AsyncSafeFrameTrie::kNoNode &&
+         SameGeneration(generation_.load(std::memory_order_acquire), node);
+}
+
+int AsyncSafeTraceMultiset::NodeFrames(uint32_t node, int max_frames,
+                                       JVMPI_CallFrame *frames) const {
+  if (!HasNode(node)) {
+    return 0;
+  }
+  return TrieOf(node).Frames(UntagNode(node), max_frames, frames);
+}
+
+int64_t AsyncSafeTraceMultiset::NumFrames() const {
+  return frames_[generation_.load(std::memory_order_relaxed) % 2]
+      ->NumNodes();
+}
+
+const AsyncSafeFrameTrie &AsyncSafeTraceMultiset::TrieOf(
+    uint32_t node) const {
+  // Only the tries of the current and previous generations hold nodes,
+  // which the lowest bit of the tag tells apart.
+  return *frames_[(node >> kNodeBits) % 2];
+}
+
+bool AsyncSafeTraceMultiset::AddToShards(int cpu_shard, int attr,
+                                         uint32_t node, int64_t count) {
+  if (node == AsyncSafeFrameTrie::kNoNode || count <= 0) {
+    return false;
+  }
+  // Identical traces share the same leaf node, so the entries only need
+  // to be keyed on it.
+  uint64_t hash_val =
+      HashTrace(attr, TrieOf(node).FramesHash(UntagNode(node)));
+
+  // Fall back to the trace hash if the CPU is unknown.
+  int home = cpu_shard < 0 ? hash_val % num_shards_ : cpu_shard;
+  if (AddToShard(&shards_[home], hash_val, attr, node, count)) {
+    return true;
+  }
+  if (num_shards_ == 1) {
+    return false;
+  }
+  // The probe sequence on the home shard is full, spill over to another
+  // shard picked by the trace hash, so that a busy CPU can use the space
+  // left in all the other shards. This may leave the same trace in multiple
+  // shards, which is fine as they get merged when harvested.
+  int spill = (home + 1 + (hash_val >> 32) % (num_shards_ - 1)) % num_shards_;
+  return AddToShard(&shards_[spill], hash_val, attr, node, count);
+}
+
+bool AsyncSafeTraceMultiset::AddToShard(Shard *shard, uint64_t hash_val,
+                                        int attr, uint32_t node,
+                                        int64_t count) {
+  int64_t max_probe =
+      shard_entries_ < kMaxProbeLength ? shard_entries_ : kMaxProbeLength;
+
+  shard->active_insertions.fetch_add(1, std::memory_order_acquire);
+  shard->additions.fetch_add(1, std::memory_order_relaxed);
+  for (int64_t i = 0; i < max_probe; i++) {
+    int64_t idx = (i + hash_val) % shard_entries_;
+    auto &entry = shard->traces[idx];
     int64_t count_zero = 0;
-    int64_t count = entry.count.load(std::memory_order_acquire);
-    switch (count) {
+    int64_t entry_count = entry.count.load(std::memory_order_acquire);
+    switch (entry_count) {
       case 0:
         if (entry.count.compare_exchange_weak(count_zero, kTraceCountLocked,
                                               std::memory_order_relaxed)) {
           // This entry is reserved, there is no danger of interacting
           // with Extract, so decrement active_insertions early.
-          active_insertions_.fetch_add(-1, std::memory_order_release);
-          // memcpy is not async safe
-          JVMPI_CallFrame *fb = frame_buffer_[idx];
-          int num_frames = trace->num_frames;
-          for (int frame_num = 0; frame_num < num_frames; ++frame_num) {
-            fb[frame_num].lineno = trace->frames[frame_num].lineno;
-            fb[frame_num].method_id = trace->frames[frame_num].method_id;
-          }
-          entry.trace.frames = fb;
-          entry.trace.num_frames = num_frames;
+          shard->active_insertions.fetch_add(-1, std::memory_order_release);
+          entry.node = node;
           entry.attr = attr;
-          entry.count.store(int64_t(1), std::memory_order_release);
+          entry.count.store(count, std::memory_order_release);
+          // Published after the count, so that the harvest sees it.
+          shard->occupied[idx / 64].fetch_or(uint64_t{1} << (idx % 64),
+                                             std::memory_order_release);
+          shard->probes.fetch_add(i + 1, std::memory_order_relaxed);
           return true;
         }
         break;
@@ -60,17 +539,18 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
         // Worst case we may end with multiple entries with the same trace.
         break;
       default:
-        if (attr == entry.attr && trace->num_frames == entry.trace.num_frames &&
-            Equal(trace->num_frames, entry.trace.frames, trace->frames)) {
+        if (attr == entry.attr && node == entry.node) {
           // Bump using a compare-swap instead of fetch_add to ensure
           // it hasn't been locked by a thread doing Extract().
           // Reload count in case it was updated while we were
           // examining the trace.
-          count = entry.count.load(std::memory_order_relaxed);
-          if (count != kTraceCountLocked &&
-              entry.count.compare_exchange_weak(count, count + 1,
+          entry_count = entry.count.load(std::memory_order_relaxed);
+          if (entry_count != kTraceCountLocked &&
+              entry.count.compare_exchange_weak(entry_count,
+                                                entry_count + count,
                                                 std::memory_order_relaxed)) {
-            active_insertions_.fetch_add(-1, std::memory_order_release);
+            shard->active_insertions.fetch_add(-1, std::memory_order_release);
+            shard->probes.fetch_add(i + 1, std::memory_order_relaxed);
             return true;
           }
         }
@@ -78,111 +558,299 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
   }
   // Did nothing, but we still need storage ordering between this
   // store and preceding loads.
-  active_insertions_.fetch_add(-1, std::memory_order_release);
+  shard->active_insertions.fetch_add(-1, std::memory_order_release);
+  shard->probes.fetch_add(max_probe, std::memory_order_relaxed);
   return false;
 }
 
 int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
-                                    JVMPI_CallFrame *frames, int64_t *count) {
-  if (location < 0 || location >= MaxEntries()) {
+                                    JVMPI_CallFrame *frames, int64_t *count,
+                                    uint64_t *hash) {
+  uint32_t node;
+  if (!ExtractNode(location, attr, &node, count)) {
     return 0;
   }
-  auto &entry = traces_[location];
+  // The trie nodes are immutable once added, and the trie of the node is
+  // only cleared by the harvest, which is the caller.
+  const AsyncSafeFrameTrie &trie = TrieOf(node);
+  node = UntagNode(node);
+  int num_frames = trie.Frames(node, max_frames, frames);
+  if (hash != nullptr) {
+    if (num_frames == trie.Depth(node)) {
+      *hash = HashTrace(*attr, trie.FramesHash(node));
+    } else {
+      // Truncated, the hash of the node covers frames not returned.
+      *hash = CalculateHash(*attr, num_frames, frames);
+    }
+  }
+  return num_frames;
+}
+
+bool AsyncSafeTraceMultiset::ExtractNode(int location, int64_t *attr,
+                                         uint32_t *node, int64_t *count) {
+  if (location < 0 || location >= MaxEntries()) {
+    return false;
+  }
+  Shard &shard = shards_[location / shard_entries_];
+  int64_t idx = location % shard_entries_;
+  auto &entry = shard.traces[idx];
   int64_t c = entry.count.load(std::memory_order_acquire);
   if (c <= 0) {
     // Unused or in process of being updated, skip for now.
-    return 0;
-  }
-  int num_frames = entry.trace.num_frames;
-  if (num_frames > max_frames) {
-    num_frames = max_frames;
+    return false;
   }
 
   c = entry.count.exchange(kTraceCountLocked, std::memory_order_acquire);
 
   *attr = entry.attr;
-  bool all_quiet = false;
-  for (int i = 0; i < num_frames; ++i) {
-    frames[i].lineno = entry.trace.frames[i].lineno;
-    frames[i].method_id = entry.trace.frames[i].method_id;
-    if (all_quiet == false &&
-        active_insertions_.load(std::memory_order_acquire) == 0) {
-      all_quiet = true;
+  *node = entry.node;
+
+  while (shard.active_insertions.load(std::memory_order_acquire) != 0) {
+    // spin
+    // TODO: Introduce a limit to detect and break
+    // deadlock
+  }
+
+  // Cleared before the entry can be claimed again, as the next Add() to
+  // fill it sets the bit back.
+  shard.occupied[idx / 64].fetch_and(~(uint64_t{1} << (idx % 64)),
+                                     std::memory_order_relaxed);
+  entry.count.store(0, std::memory_order_release);
+  *count = c;
+  return true;
+}
+
+bool AsyncSafeTraceMultiset::SwapFrames() {
+  uint64_t generation = generation_.load(std::memory_order_relaxed);
+  const AsyncSafeFrameTrie &frames = *frames_[generation % 2];
+  if (frames.NumNodes() < frames.MaxNodes() / 2) {
+    // Leave the nodes in use as long as possible, as the nodes cached by
+    // the callers of Add() are lost along with them.
+    return false;
+  }
+  // The other trie has been cleared by ClearPreviousFrames().
+  generation_.store(generation + 1, std::memory_order_seq_cst);
+  for (int i = 0; i < num_shards_; i++) {
+    while (shards_[i].active_frames[generation % 2].load(
+               std::memory_order_seq_cst) != 0) {
+      // spin, the additions do not block.
     }
   }
+  return true;
+}
 
-  if (!all_quiet) {
-    while (active_insertions_.load(std::memory_order_acquire) != 0) {
-      // spin
-      // TODO: Introduce a limit to detect and break
-      // deadlock
+void AsyncSafeTraceMultiset::ClearPreviousFrames() {
+  // No trace of the previous generation is left, and none can be added.
+  frames_[(generation_.load(std::memory_order_relaxed) + 1) % 2]->Reset();
+}
+
+int64_t AsyncSafeTraceMultiset::NextOccupied(int64_t location) const {
+  if (location < 0) {
+    location = 0;
+  }
+  for (int64_t s = location / shard_entries_; s < num_shards_; s++) {
+    const Shard &shard = shards_[s];
+    int64_t idx = s == location / shard_entries_ ? location % shard_entries_
+                                                 : 0;
+    for (int64_t w = idx / 64; w < shard_words_; w++) {
+      uint64_t bits = shard.occupied[w].load(std::memory_order_acquire);
+      if (w == idx / 64) {
+        // Drop the entries before idx.
+        bits &= ~uint64_t{0} << (idx % 64);
+      }
+      if (bits != 0) {
+        return s * shard_entries_ + w * 64 + __builtin_ctzll(bits);
+      }
     }
   }
+  return MaxEntries();
+}
 
-  entry.count.store(0, std::memory_order_release);
-  *count = c;
-  return num_frames;
+TraceMultiset::~TraceMultiset() { Clear(); }
+
+void TraceMultiset::Add(int64_t attr, int num_frames,
+                        const JVMPI_CallFrame *frames, int64_t count) {
+  Add(attr, num_frames, frames, count,
+      CalculateHash(attr, num_frames, frames));
 }
 
-void TraceMultiset::Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
-                        int64_t count) {
+void TraceMultiset::Add(int64_t attr, int num_frames,
+                        const JVMPI_CallFrame *frames, int64_t count,
+                        uint64_t hash) {
   CallTrace t;
+  t.node = kNoNode;
+  for (int i = num_frames - 1; i >= 0; i--) {
+    t.node = Intern(t.node, frames[i]);
+  }
+  t.num_frames = num_frames;
   t.attr = attr;
-  t.frames = std::vector<JVMPI_CallFrame>(frames, frames + num_frames);
+  t.hash = hash;
+  traces_[t] += count;
+}
 
-  auto entry = traces_.find(t);
-  if (entry != traces_.end()) {
-    entry->second += count;
-    return;
+void TraceMultiset::Add(int64_t attr, const AsyncSafeFrameTrie &trie,
+                        uint32_t node, int64_t count, uint64_t hash,
+                        NodeMap *nodes) {
+  CallTrace t;
+  t.node = kNoNode;
+  // Walk up to the first node interned by a previous call, and intern the
+  // ones below it from there.
+  path_.clear();
+  for (uint32_t n = node; n != AsyncSafeFrameTrie::kNoNode;
+       n = trie.Parent(n)) {
+    auto it = nodes->find(n);
+    if (it != nodes->end()) {
+      t.node = it->second;
+      break;
+    }
+    path_.push_back(n);
+  }
+  for (auto it = path_.rbegin(); it != path_.rend(); ++it) {
+    t.node = Intern(t.node, trie.Frame(*it));
+    (*nodes)[*it] = t.node;
+  }
+  t.num_frames = trie.Depth(node);
+  t.attr = attr;
+  t.hash = hash;
+  traces_[t] += count;
+}
+
+void TraceMultiset::Frames(const CallTrace &trace,
+                           JVMPI_CallFrame *frames) const {
+  int i = 0;
+  ForEachFrame(trace, [&](const JVMPI_CallFrame &frame) {
+    frames[i++] = frame;
+  });
+}
+
+void TraceMultiset::Clear() {
+  traces_.clear();
+  // Releases the storage, swap() as shrink_to_fit() is only a request.
+  std::vector<Node>().swap(nodes_);
+  std::vector<uint32_t>().swap(index_);
+}
+
+uint32_t TraceMultiset::Intern(uint32_t parent,
+                               const JVMPI_CallFrame &frame) {
+  if (2 * (nodes_.size() + 1) > index_.size()) {
+    GrowIndex();
+  }
+  size_t mask = index_.size() - 1;
+  uint64_t h = HashFinish(HashFrame(parent, frame));
+  for (size_t i = h & mask;; i = (i + 1) & mask) {
+    uint32_t node = index_[i];
+    if (node == kNoNode) {
+      nodes_.push_back(Node{frame, parent});
+      index_[i] = nodes_.size();
+      return index_[i];
+    }
+    const Node &n = nodes_[node - 1];
+    if (n.parent == parent && n.frame.method_id == frame.method_id &&
+        n.frame.lineno == frame.lineno) {
+      return node;
+    }
   }
-  traces_.emplace(std::move(t), count);
 }
 
-int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+void TraceMultiset::GrowIndex() {
+  size_t size = index_.empty() ? kMinIndexSize : 2 * index_.size();
+  index_.assign(size, static_cast<uint32_t>(kNoNode));
+  size_t mask = size - 1;
+  for (size_t pos = 0; pos < nodes_.size(); pos++) {
+    const Node &n = nodes_[pos];
+    uint64_t h = HashFinish(HashFrame(n.parent, n.frame));
+    size_t i = h & mask;
+    while (index_[i] != kNoNode) {
+      i = (i + 1) & mask;
+    }
+    index_[i] = pos + 1;
+  }
+}
+
+int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to,
+                   int max_frames) {
+  // Once swapped, no trace can be added to the previous trie, and all the
+  // ones using it are extracted below.
+  bool swapped = from->SwapFrames();
   int trace_count = 0;
   int64_t num_traces = from->MaxEntries();
-  for (int64_t i = 0; i < num_traces; i++) {
-    JVMPI_CallFrame frame[kMaxFramesToCapture];
+  // The nodes of each trie already interned into to.
+  TraceMultiset::NodeMap nodes[2];
+  std::vector<JVMPI_CallFrame> frames;
+  for (int64_t i = from->NextOccupied(0); i < num_traces;
+       i = from->NextOccupied(i + 1)) {
     int64_t attr, count;
-
-    int num_frames =
-        from->Extract(i, &attr, kMaxFramesToCapture, &frame[0], &count);
-    if (num_frames > 0 && count > 0) {
-      ++trace_count;
-      to->Add(attr, num_frames, &frame[0], count);
+    uint32_t node;
+    if (!from->ExtractNode(i, &attr, &node, &count) || count <= 0) {
+      continue;
+    }
+    ++trace_count;
+    const AsyncSafeFrameTrie &trie = from->TrieOf(node);
+    TraceMultiset::NodeMap *trie_nodes =
+        &nodes[(node >> AsyncSafeTraceMultiset::kNodeBits) % 2];
+    node = AsyncSafeTraceMultiset::UntagNode(node);
+    if (trie.Depth(node) <= max_frames) {
+      to->Add(attr, trie, node, count, HashTrace(attr, trie.FramesHash(node)),
+              trie_nodes);
+    } else {
+      // Keep the leaf frames, the nodes are those of the full trace.
+      frames.resize(max_frames);
+      int num_frames = trie.Frames(node, max_frames, frames.data());
+      to->Add(attr, num_frames, frames.data(), count);
     }
   }
+  if (swapped) {
+    from->ClearPreviousFrames();
+  }
   return trace_count;
 }
 
 uint64_t CalculateHash(int64_t attr, int num_frames,
                        const JVMPI_CallFrame *frame) {
-  // Make hash-value
-  uint64_t h = attr;
-  h += h << 10;
-  h ^= h >> 6;
-  for (int i = 0; i < num_frames; i++) {
-    h += reinterpret_cast<uintptr_t>(frame[i].method_id);
-    h += h << 10;
-    h ^= h >> 6;
-    h += static_cast<uintptr_t>(frame[i].lineno);
-    h += h << 10;
-    h ^= h >> 6;
+  // Hash the frames starting from the root, to match the hashes kept by
+  // AsyncSafeFrameTrie.
+  uint64_t h = 0;
+  for (int i = num_frames - 1; i >= 0; i--) {
+    h = HashFrame(h, frame[i]);
   }
-  h += h << 3;
-  h ^= h >> 11;
-  return h;
+  return HashTrace(attr, h);
 }
 
 bool Equal(int num_frames, const JVMPI_CallFrame *f1,
            const JVMPI_CallFrame *f2) {
-  // Compare individual members to avoid differences in padding.
+  // Frames are compared as two 64-bit words, ignoring the padding after
+  // lineno, whose content is undefined.
+  static_assert(sizeof(JVMPI_CallFrame) == 16 &&
+                    offsetof(JVMPI_CallFrame, lineno) == 0 &&
+                    offsetof(JVMPI_CallFrame, method_id) == 8,
+                "unexpected JVMPI_CallFrame layout");
+#ifdef __SSE2__
+  const __m128i mask = _mm_set_epi32(-1, -1, 0, -1);
   for (int i = 0; i < num_frames; i++) {
-    if (f1[i].method_id != f2[i].method_id || f1[i].lineno != f2[i].lineno) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f1 + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f2 + i));
+    __m128i diff = _mm_and_si128(_mm_xor_si128(a, b), mask);
+    // All the bytes of diff are 0 when the frames are equal.
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) !=
+        0xffff) {
+      return false;
+    }
+  }
+  return true;
+#else
+  const uint64_t mask = 0xffffffffULL;
+  const char *p1 = reinterpret_cast<const char *>(f1);
+  const char *p2 = reinterpret_cast<const char *>(f2);
+  for (int i = 0; i < num_frames; i++, p1 += 16, p2 += 16) {
+    uint64_t a[2], b[2];
+    memcpy(a, p1, sizeof(a));
+    memcpy(b, p2, sizeof(b));
+    if ((((a[0] ^ b[0]) & mask) | (a[1] ^ b[1])) != 0) {
       return false;
     }
   }
   return true;
+#endif
 }
 
 }  // namespace javaprofiler
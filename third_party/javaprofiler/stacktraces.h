@@ -20,7 +20,7 @@
 #define THIRD_PARTY_JAVAPROFILER_STACKTRACES_H_
 
 #include <atomic>
-#include <mutex>  // NOLINT
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -30,9 +30,14 @@
 namespace google {
 namespace javaprofiler {
 
-// Maximum number of frames to store from the stack traces sampled.
+// Default maximum number of frames to store from the stack traces sampled,
+// which fits on the stack of the signal handlers.
 const int kMaxFramesToCapture = 128;
 
+// Upper bound of the configurable maximum number of frames.
+const int kMaxStackDepthLimit = 4096;
+
+// Returns the hash of a trace, where frame[num_frames - 1] is its root.
 uint64_t CalculateHash(int64_t attr, int num_frames,
                        const JVMPI_CallFrame *frame);
 bool Equal(int num_frames, const JVMPI_CallFrame *f1,
@@ -55,48 +60,188 @@ class Asgct {
   DISALLOW_IMPLICIT_CONSTRUCTORS(Asgct);
 };
 
-class AttributeTable {
+// Append-only table of strings, which get consecutive ids from 1, with 0
+// standing for the empty string. Lookups and insertions are lock free, and
+// getting a string from its id is wait free. The strings are never freed,
+// so pointers to them remain valid.
+//
+// Insertions are not async-safe, as they allocate. Two threads racing to
+// add the same string both allocate an id, only one of them is returned
+// to both, the other one just holds an unused copy.
+class LockFreeStringTable {
  public:
-  static void Init() {
-    mutex_ = new (std::mutex);
-    string_map_ = new (std::unordered_map<string, int>);
-    strings_ = new (std::vector<string>);
-    strings_->push_back("");
-  }
+  explicit LockFreeStringTable(int max_strings);
 
-  static int RegisterString(const char *value) {
-    if (mutex_ == nullptr || value == nullptr || !*value) {
-      // Not initialized or empty string.
-      return 0;
-    }
-    std::lock_guard<std::mutex> lock(*mutex_);
-    int ret = strings_->size();
-    const auto inserted = string_map_->emplace(value, ret);
-    if (!inserted.second) {
-      // Insertion failed, use existing value.
-      return inserted.first->second;
+  // Returns the id of the string of size bytes at data, adding it if
+  // needed, or 0 if the table is full.
+  int Intern(const char *data, size_t size);
+
+  // Returns the string of an id returned by Intern(), nullptr if there is
+  // none.
+  const string *Get(int id) const {
+    if (id < 0 || id >= max_strings_) {
+      return nullptr;
     }
-    strings_->push_back(value);
-    (*string_map_)[value] = ret;
-    return ret;
+    return strings_[id].load(std::memory_order_acquire);
   }
 
-  static std::vector<string> GetStrings() {
-    if (mutex_ == nullptr) {
-      return std::vector<string>();
-    }
-    std::lock_guard<std::mutex> lock(*mutex_);
-    return *strings_;
+  // All the ids returned by Intern() are below Size().
+  int Size() const {
+    int size = next_.load(std::memory_order_acquire);
+    return size < max_strings_ ? size : max_strings_;
   }
 
  private:
-  static std::mutex *mutex_;
-  static std::unordered_map<string, int> *string_map_;
-  static std::vector<string> *strings_;
+  static int IndexSize(int max_strings);
+
+  const int max_strings_;
+  // Power of two, at least twice the number of strings.
+  const int index_size_;
+  std::atomic<const string *> *strings_;
+  // Open-addressed index of the ids by the hash of their strings, 0 for an
+  // empty slot.
+  std::atomic<int> *index_;
+  std::atomic<int> next_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockFreeStringTable);
+};
+
+// Registry of the attributes with which threads tag their samples.
+//
+// An attribute is the id of a registered string, which is the value of the
+// default "attr" key. A thread can also set values for up to kMaxKeys - 1
+// other keys, registered with RegisterKey(). Each combination of values is
+// then itself registered, and the attribute is minus its id. Either way a
+// sample is tagged with a single int, so the keys cost nothing while
+// sampling.
+//
+// The strings and the combinations of values are never removed, and each
+// table holds up to 16384 of them. Past that, the new strings are not
+// registered, and a combination only keeps the value of the default key.
+class AttributeTable {
+ public:
+  static const int kMaxKeys = 4;
+  static const int kMaxStrings = 1 << 14;
+  static const int kMaxValueSets = 1 << 14;
+
+  static void Init();
+
+  // Returns the id of value, 0 for the empty string or if the table is
+  // full or not initialized.
+  static int RegisterString(const char *value);
+
+  // Returns the string registered as id, nullptr if there is none. Wait
+  // free.
+  static const string *GetString(int id);
+
+  // All the string ids are below NumStrings().
+  static int NumStrings();
+
+  // Returns the index of the key with this name, adding it if needed, or
+  // 0 if there is no room for it or name is empty. Key 0 is the default
+  // "attr" one.
+  static int RegisterKey(const char *name);
+
+  // Returns the string id of the name of a key, 0 for the default one.
+  static int KeyString(int key);
+
+  // Returns the attribute with the value of key set to the string id
+  // value, and the values of the other keys the same as in attr.
+  static int SetValue(int attr, int key, int value);
+
+  // Sets values[key] to the string id of the value of each key in attr.
+  static void GetValues(int attr, int values[kMaxKeys]);
+
+ private:
+  static LockFreeStringTable *strings_;
+  // Combinations of values, as the bytes of an int[kMaxKeys].
+  static LockFreeStringTable *value_sets_;
+  // String ids of the names of the keys, 0 for the free ones.
+  static std::atomic<int> keys_[kMaxKeys];
 
   DISALLOW_IMPLICIT_CONSTRUCTORS(AttributeTable);
 };
 
+// Prefix tree of call frames, where each trace is represented by the
+// node of its leaf (top) frame and traces sharing callers share the
+// nodes for them. Nodes are allocated from a preallocated arena, so
+// memory only becomes resident as distinct frames are added, and are
+// found through an open-addressed index keyed on (parent, frame).
+//
+// The Add() operation is async-safe and lock free. Nodes are never
+// removed other than by Reset(), which must not run concurrently with
+// Add() or with readers of the nodes.
+class AsyncSafeFrameTrie {
+ public:
+  // Creates a trie holding up to max_nodes distinct frames. All the
+  // storage is allocated here, so the trie must be created outside of a
+  // signal handler.
+  explicit AsyncSafeFrameTrie(int64_t max_nodes);
+  ~AsyncSafeFrameTrie();
+
+  void Reset();
+
+  // Adds the trace frames, starting from its root at
+  // frames[num_frames - 1]. Returns the node for frames[0], or kNoNode if
+  // there is no room for the trace or it has no frames.
+  uint32_t Add(int num_frames, const JVMPI_CallFrame *frames);
+
+  // Returns the number of frames of the trace ending at node.
+  int Depth(uint32_t node) const;
+
+  // Returns the frame of node, and the node of its caller, kNoNode for a
+  // root frame.
+  const JVMPI_CallFrame &Frame(uint32_t node) const {
+    return NodeAt(node).frame;
+  }
+  uint32_t Parent(uint32_t node) const { return NodeAt(node).parent; }
+
+  // Copies up to max_frames frames of the trace ending at node, starting
+  // from the leaf. Returns the number of frames written.
+  int Frames(uint32_t node, int max_frames, JVMPI_CallFrame *frames) const;
+
+  // Returns the hash of the frames of the trace ending at node, computed
+  // incrementally as the nodes are added. It is the value CalculateHash()
+  // mixes the attribute into.
+  uint64_t FramesHash(uint32_t node) const;
+
+  int64_t MaxNodes() const { return max_nodes_; }
+
+  // Returns the number of nodes added since the last Reset().
+  int64_t NumNodes() const;
+
+  // Id of the (virtual) parent of root frames.
+  static const uint32_t kNoNode = 0;
+
+ private:
+  struct Node {
+    JVMPI_CallFrame frame;
+    uint32_t parent;
+    int depth;
+    uint64_t frames_hash;
+  };
+
+  // Returns the child of parent for frame, adding it if missing.
+  uint32_t Intern(uint32_t parent, const JVMPI_CallFrame &frame);
+
+  const Node &NodeAt(uint32_t node) const { return nodes_[node - 1]; }
+
+  // Maximum number of index slots examined when looking up a node.
+  static const int64_t kMaxProbeLength = 64;
+
+  const int64_t max_nodes_;
+  const int64_t index_size_;
+  // Node storage, node ids are one-based positions in this array.
+  Node *nodes_;
+  // Open-addressed hash index of node ids, kNoNode for empty slots.
+  std::atomic<uint32_t> *index_;
+  // Number of nodes allocated from nodes_, may exceed max_nodes_.
+  std::atomic<int64_t> num_nodes_;
+  DISALLOW_COPY_AND_ASSIGN(AsyncSafeFrameTrie);
+};
+
+class TraceMultiset;
+
 // Multiset of stack traces. There is a maximum number of distinct
 // traces that can be held, return by MaxEntries();
 //
@@ -115,58 +260,204 @@ class AttributeTable {
 // by a subsequent call to Add(). It is important for Extract() to
 // wait until no additions are in progress to avoid releasing the
 // entry while another thread is inspecting it.
+//
+// The frames of the traces are held in an AsyncSafeFrameTrie shared by
+// all entries. There are two of them, used in turn: once the one in use is
+// half full, HarvestSamples() switches the additions to the other one,
+// waits for those in progress, extracts all the traces and clears the
+// trie they used. So max_frames bounds the number of distinct frames added
+// between two harvests rather than over a profile. The nodes returned by
+// Add() are tagged with the generation of their trie, and the nodes of a
+// cleared trie are rejected by AddNode() and NodeFrames().
+//
+// The entries are split into a number of independent shards, each one
+// an open-addressed table with its own count of in-progress additions.
+// Add() picks the shard of the CPU it is running on, so concurrent
+// signal handlers on different CPUs do not contend on the same cache
+// lines, and probes at most kMaxProbeLength entries of that shard (and
+// of one other shard, if full) before giving up. Extract() only waits for
+// the additions in progress on the shard of the entry being extracted.
+//
+// Each shard also keeps a bitmap of its entries holding a trace, set by
+// Add() once it has filled an entry and cleared by Extract(), so that
+// NextOccupied() lets the harvest skip the empty entries.
 class AsyncSafeTraceMultiset {
  public:
-  AsyncSafeTraceMultiset() { Reset(); }
-
-  void Reset() {
-    memset(traces_, 0, sizeof(traces_));
-    memset(frame_buffer_, 0, sizeof(frame_buffer_));
-    active_insertions_ = 0;
-  }
+  // Creates a multiset holding up to max_entries distinct traces, split
+  // evenly across num_shards tables, with up to max_frames distinct
+  // frames. Each of multiple tables holds at least kMinShardEntries
+  // traces, so that a trace seen on many CPUs does not use up the small
+  // ones, which makes for more than max_entries traces with many shards.
+  // All the storage is allocated here, so the multiset must be created
+  // outside of a signal handler.
+  explicit AsyncSafeTraceMultiset(int64_t max_entries = kDefaultMaxEntries,
+                                  int num_shards = 1,
+                                  int64_t max_frames = kDefaultMaxFrames);
+  ~AsyncSafeTraceMultiset();
+
+  void Reset();
 
   // Add a trace to the set. If it is already present, increment its
-  // count. This operation is thread safe and async safe.
-  bool Add(int attr, JVMPI_CallTrace *trace);
+  // count. This operation is thread safe and async safe. If node is not
+  // null, it is set to the node of the trace frames, which can be passed
+  // to AddNode() until its trie is cleared.
+  bool Add(int attr, JVMPI_CallTrace *trace, uint32_t *node = nullptr);
+
+  // Add count occurrences of a trace previously added with the given
+  // frames node. Same guarantees as Add(). Returns false if the trie of
+  // the node has been cleared since.
+  bool AddNode(int attr, uint32_t node, int64_t count);
+
+  // Whether the frames of a node set by Add() are still held. A harvest
+  // running concurrently may clear them right after.
+  bool HasNode(uint32_t node) const;
 
   // Extract a trace from the array. frames must point to at least
   // max_frames contiguous frames. It will return the number of frames
   // written starting at frames[0], up to max_frames. returns 0 if
   // there is no valid trace at this location.  This operation is
   // thread safe with respect to Add() but only a single call to
-  // Extract can be done at a time.
+  // Extract can be done at a time. If hash is not null, it is set to
+  // CalculateHash() of the extracted trace, which is mostly precomputed.
   int Extract(int location, int64_t *attr, int max_frames,
-              JVMPI_CallFrame *frames, int64_t *count);
+              JVMPI_CallFrame *frames, int64_t *count,
+              uint64_t *hash = nullptr);
+
+  // Copies up to max_frames frames of the trace of a node set by Add(),
+  // starting from the leaf. Returns the number of frames written, 0 if the
+  // trie of the node has been cleared since. Must not run concurrently
+  // with HarvestSamples().
+  int NodeFrames(uint32_t node, int max_frames,
+                 JVMPI_CallFrame *frames) const;
+
+  // Returns the first location at or after location which holds a trace,
+  // or MaxEntries() if there is none. The entries filled concurrently may
+  // or may not be seen. Only for the thread calling Extract().
+  int64_t NextOccupied(int64_t location) const;
+
+  int64_t MaxEntries() const { return num_shards_ * shard_entries_; }
+
+  int NumShards() const { return num_shards_; }
 
-  int64_t MaxEntries() const { return kMaxStackTraces; }
+  // Maximum number of distinct frames of each trie.
+  int64_t MaxFrames() const { return frames_[0]->MaxNodes(); }
+
+  // Number of distinct frames in the trie in use. Once it reaches
+  // MaxFrames(), traces with new frames can no longer be added until the
+  // next harvest.
+  int64_t NumFrames() const;
+
+  // Sets additions to the number of attempts to add a trace to a shard
+  // since the previous call, and probes to the number of entries they
+  // examined, and resets them. Thread safe.
+  void TakeProbeStats(int64_t *additions, int64_t *probes);
+
+  // Default number of distinct traces held by a multiset.
+  static const int64_t kDefaultMaxEntries = 2048;
+
+  // Default number of distinct frames held by each trie of a multiset.
+  static const int64_t kDefaultMaxFrames = 65536;
+
+  // Minimum number of distinct traces held by each shard of a multiset
+  // with multiple shards.
+  static const int64_t kMinShardEntries = 256;
 
  private:
+  friend int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to,
+                            int max_frames);
+
   struct TraceData {
     // attr is an integer attribute for the stack trace. On encode
     // this will represent a sample label.
     int attr;
-    // trace is a triple containing the JNIEnv and the individual call frames.
-    // The frames are stored in AsyncSafeTraceMultiset::frame_buffer_
-    JVMPI_CallTrace trace;
+    // Leaf node of the trace in AsyncSafeTraceMultiset::frames_.
+    uint32_t node;
     // Number of times a trace has been encountered.
     // 0 indicates that the trace is unused
     // <0 values are reserved, used for concurrency control.
     std::atomic<int64_t> count;
   };
 
-  // TODO: Re-evaluate MaxStackTraces, to minimize storage
-  // consumption while maintaining good performance and avoiding
-  // overflow.
-  static const int kMaxStackTraces = 2048;
+  // Aligned on a cache line, so that the counters of different shards do not
+  // share one.
+  struct alignas(64) Shard {
+    // Number of calls to Add() currently in progress on this shard.
+    std::atomic<int> active_insertions;
+    TraceData *traces;
+    // Bit i % 64 of occupied[i / 64] is set while traces[i] holds a trace.
+    std::atomic<uint64_t> *occupied;
+    // Attempts to add a trace to this shard, and entries they examined.
+    std::atomic<int64_t> additions;
+    std::atomic<int64_t> probes;
+    // Number of additions in progress from the CPUs of this shard on each
+    // trie, by the parity of its generation.
+    std::atomic<int> active_frames[2];
+  };
+  static_assert(sizeof(Shard) % 64 == 0, "Shard must fill its cache lines");
+
+  // Maximum number of entries examined on a shard by a single Add().
+  static const int64_t kMaxProbeLength = 64;
 
   // Sentinel to use as trace count while the frames are being updated.
   static const int64_t kTraceCountLocked = -1;
 
-  // Number of calls to Add() currently in progress.
-  std::atomic<int> active_insertions_;
+  // The nodes handed out are the trie nodes, in the low kNodeBits bits,
+  // tagged with the low bits of the generation of their trie.
+  static const int kNodeBits = 24;
+  static const int64_t kMaxFramesLimit = (int64_t{1} << kNodeBits) - 1;
 
-  TraceData traces_[kMaxStackTraces];
-  JVMPI_CallFrame frame_buffer_[kMaxStackTraces][kMaxFramesToCapture];
+  static uint32_t TagNode(uint64_t generation, uint32_t node) {
+    return node == AsyncSafeFrameTrie::kNoNode
+               ? node
+               : static_cast<uint32_t>(generation << kNodeBits) | node;
+  }
+  static uint32_t UntagNode(uint32_t node) {
+    return node & ((uint32_t{1} << kNodeBits) - 1);
+  }
+  static bool SameGeneration(uint64_t generation, uint32_t node) {
+    return (node >> kNodeBits) ==
+           (static_cast<uint32_t>(generation << kNodeBits) >> kNodeBits);
+  }
+
+  // Returns the shard of the current CPU, -1 if unknown.
+  int CpuShard() const;
+
+  // Returns the current generation, after counting an addition in progress
+  // on its trie in the given shard, and LeaveGeneration() uncounts it.
+  uint64_t EnterGeneration(int shard);
+  void LeaveGeneration(int shard, uint64_t generation);
+
+  // Adds count occurrences of the trace of a tagged node to the shard of
+  // the current CPU, or to another one if full.
+  bool AddToShards(int cpu_shard, int attr, uint32_t node, int64_t count);
+
+  // Attempts to add the trace to the given shard.
+  bool AddToShard(Shard *shard, uint64_t hash_val, int attr, uint32_t node,
+                  int64_t count);
+
+  // Same as Extract(), but sets node to the tagged node of the trace instead
+  // of copying its frames. Returns false if there is no valid trace at
+  // this location.
+  bool ExtractNode(int location, int64_t *attr, uint32_t *node,
+                   int64_t *count);
+
+  const AsyncSafeFrameTrie &TrieOf(uint32_t node) const;
+
+  // If the trie in use is at least half full, switches the additions to
+  // the other one, and waits for the ones in progress on it. Returns
+  // whether it did, in which case ClearPreviousFrames() must be called once
+  // all its traces have been extracted.
+  bool SwapFrames();
+  void ClearPreviousFrames();
+
+  const int num_shards_;
+  const int64_t shard_entries_;
+  // Number of words of the occupancy bitmap of a shard.
+  const int64_t shard_words_;
+  Shard *shards_;
+  // The trie of generation g is frames_[g % 2].
+  std::unique_ptr<AsyncSafeFrameTrie> frames_[2];
+  std::atomic<uint64_t> generation_;
   DISALLOW_COPY_AND_ASSIGN(AsyncSafeTraceMultiset);
 };
 
@@ -175,29 +466,31 @@ class AsyncSafeTraceMultiset {
 // collected atomically from AsyncSafeTraceMultiset, which implements
 // async and thread safe add/extract methods, but has fixed maximum
 // size.
+//
+// The frames of the traces are held in a trie shared by all of them, so
+// that the memory it takes grows with the number of distinct frames rather
+// than with the total number of frames. They are read back with Frames().
 class TraceMultiset {
- private:
-  typedef struct {
-    std::vector<JVMPI_CallFrame> frames;
+ public:
+  // Key of the multiset. The node remains valid until Clear() is called.
+  struct CallTrace {
+    // Trie node of the leaf frame, frames[0] of the trace added.
+    uint32_t node;
+    int num_frames;
     int64_t attr;
-  } CallTrace;
+    // CalculateHash(attr, num_frames, frames)
+    uint64_t hash;
+  };
 
+ private:
   struct CallTraceHash {
-    std::size_t operator()(const CallTrace &trace) const {
-      return CalculateHash(trace.attr, trace.frames.size(),
-                           trace.frames.data());
-    }
+    std::size_t operator()(const CallTrace &trace) const { return trace.hash; }
   };
 
+  // Identical traces share the same leaf node.
   struct CallTraceEqual {
     bool operator()(const CallTrace &t1, const CallTrace &t2) const {
-      if (t1.attr != t2.attr) {
-        return false;
-      }
-      if (t1.frames.size() != t2.frames.size()) {
-        return false;
-      }
-      return Equal(t1.frames.size(), t1.frames.data(), t2.frames.data());
+      return t1.node == t2.node && t1.attr == t2.attr;
     }
   };
 
@@ -205,13 +498,29 @@ class TraceMultiset {
       CountMap;
 
  public:
+  // Map of the nodes of an AsyncSafeFrameTrie to the nodes of this
+  // multiset holding the same frames.
+  typedef std::unordered_map<uint32_t, uint32_t> NodeMap;
+
   TraceMultiset() {}
+  ~TraceMultiset();
 
   // Add a trace to the array. If it is already in the array,
-  // increment its count.
-  void Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+  // increment its count. Only the frames not already in the trie are
+  // copied.
+  void Add(int64_t attr, int num_frames, const JVMPI_CallFrame *frames,
            int64_t count);
 
+  // Same as above, with hash being CalculateHash(attr, num_frames, frames).
+  void Add(int64_t attr, int num_frames, const JVMPI_CallFrame *frames,
+           int64_t count, uint64_t hash);
+
+  // Same as above, for the trace ending at node of trie. Only the frames
+  // of the nodes missing from nodes are interned, which are then added to
+  // it. nodes must be dropped when this multiset or trie is cleared.
+  void Add(int64_t attr, const AsyncSafeFrameTrie &trie, uint32_t node,
+           int64_t count, uint64_t hash, NodeMap *nodes);
+
   typedef CountMap::iterator iterator;
   typedef CountMap::const_iterator const_iterator;
 
@@ -221,20 +530,62 @@ class TraceMultiset {
   const_iterator begin() const { return const_iterator(traces_.begin()); }
   const_iterator end() const { return const_iterator(traces_.end()); }
 
+  // The frames of erased traces are only released by Clear().
   iterator erase(iterator it) { return traces_.erase(it); }
 
-  void Clear() { traces_.clear(); }
+  // Copies the trace.num_frames frames of the trace, starting from the
+  // leaf, into frames.
+  void Frames(const CallTrace &trace, JVMPI_CallFrame *frames) const;
+
+  // Calls visit(frame) on each frame of the trace, starting from the leaf.
+  template <typename Visitor>
+  void ForEachFrame(const CallTrace &trace, Visitor visit) const {
+    for (uint32_t node = trace.node; node != kNoNode;
+         node = nodes_[node - 1].parent) {
+      visit(nodes_[node - 1].frame);
+    }
+  }
+
+  // Returns the number of distinct frames in the trie.
+  int64_t NumFrameNodes() const { return nodes_.size(); }
+
+  void Clear();
 
  private:
+  struct Node {
+    JVMPI_CallFrame frame;
+    uint32_t parent;
+  };
+
+  // Id of the (virtual) parent of root frames.
+  static const uint32_t kNoNode = 0;
+  // Initial number of slots of the index, a power of 2.
+  static const size_t kMinIndexSize = 1024;
+
+  // Returns the child of parent for frame, adding it if missing.
+  uint32_t Intern(uint32_t parent, const JVMPI_CallFrame &frame);
+  // Doubles the size of the index.
+  void GrowIndex();
+
   CountMap traces_;
+  // Nodes of a trie being interned by Add(), from the leaf.
+  std::vector<uint32_t> path_;
+  // Nodes of the trie, node ids are their index plus one.
+  std::vector<Node> nodes_;
+  // Open-addressed index of the nodes by (parent, frame), at most half
+  // full. Empty slots are kNoNode.
+  std::vector<uint32_t> index_;
   DISALLOW_COPY_AND_ASSIGN(TraceMultiset);
 };
 
 // HarvestSamples extracts traces from an asyncsafe trace multiset
-// and copies them into a trace multiset. It returns the number of samples
-// that were copied. This is thread-safe with respect to other threads adding
-// samples into the asyncsafe set.
-int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to);
+// and copies them into a trace multiset, keeping up to max_frames frames of
+// each. It returns the number of samples that were copied. This is
+// thread-safe with respect to other threads adding samples into the
+// asyncsafe set. The frames no longer used by the asyncsafe set are
+// reclaimed here, see AsyncSafeTraceMultiset.
+int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to,
+                   int max_frames = kMaxFramesToCapture + 1);
 
 }  // namespace javaprofiler
 }  // namespace google